@@ -19,6 +19,7 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "bunyan.h"
 #include "debug.h"
@@ -36,10 +37,12 @@ static const char *bunyan_name = NULL;
  * removed those annotations here (and the mutexes) but left the remainder of
  * the code as-is.
  *
- * As a result this version of bunyan.c is completely unsafe to use in the
- * face of multi-threading. This is fine within the pivy repo where all we have
- * is a couple of single-threaded commandline tools, but if you re-use this
- * code elsewhere, beware!
+ * As a result this version of bunyan.c is unsafe to use in the face of
+ * multi-threading by default. This is fine for the single-threaded commandline
+ * tools in the pivy repo. Programs which do log from more than one thread
+ * (like pivy-agent) must supply their own lock and per-thread frame stacks
+ * with bunyan_set_thread_ops() before starting any threads, or call
+ * bunyan_enable_threads() to use the simple pthreads-based ones below.
  */
 
 /*
@@ -85,6 +88,87 @@ struct bunyan_stack {
 
 static struct bunyan_stack *thstack;
 static struct bunyan_stack *bunyan_stacks;
+static const struct bunyan_thread_ops *bunyan_thops = NULL;
+
+void
+bunyan_set_thread_ops(const struct bunyan_thread_ops *ops)
+{
+	bunyan_thops = ops;
+}
+
+static struct bunyan_stack **
+bunyan_stack(void)
+{
+	if (bunyan_thops != NULL)
+		return (bunyan_thops->bto_stack());
+	return (&thstack);
+}
+
+static pthread_mutex_t bunyan_dflt_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t bunyan_dflt_key;
+static pthread_t bunyan_dflt_main;
+
+static void
+bunyan_dflt_lock(void)
+{
+	VERIFY0(pthread_mutex_lock(&bunyan_dflt_mtx));
+}
+
+static void
+bunyan_dflt_unlock(void)
+{
+	VERIFY0(pthread_mutex_unlock(&bunyan_dflt_mtx));
+}
+
+/*
+ * The thread that turned threading on keeps using the stack it had before,
+ * so that any frames it already has pushed stay put.
+ */
+static struct bunyan_stack **
+bunyan_dflt_stack(void)
+{
+	struct bunyan_stack **stk;
+
+	if (pthread_equal(pthread_self(), bunyan_dflt_main))
+		return (&thstack);
+	stk = pthread_getspecific(bunyan_dflt_key);
+	if (stk == NULL) {
+		stk = calloc(1, sizeof (struct bunyan_stack *));
+		VERIFY(stk != NULL);
+		VERIFY0(pthread_setspecific(bunyan_dflt_key, stk));
+	}
+	return (stk);
+}
+
+static const struct bunyan_thread_ops bunyan_dflt_thops = {
+	.bto_lock = bunyan_dflt_lock,
+	.bto_unlock = bunyan_dflt_unlock,
+	.bto_stack = bunyan_dflt_stack
+};
+
+void
+bunyan_enable_threads(void)
+{
+	if (bunyan_thops != NULL)
+		return;
+	VERIFY0(pthread_key_create(&bunyan_dflt_key, free));
+	bunyan_dflt_main = pthread_self();
+	bunyan_thops = &bunyan_dflt_thops;
+}
+
+static void
+bunyan_lock(void)
+{
+	if (bunyan_thops != NULL)
+		bunyan_thops->bto_lock();
+}
+
+static void
+bunyan_unlock(void)
+{
+	if (bunyan_thops != NULL)
+		bunyan_thops->bto_unlock();
+}
 
 void
 bunyan_set_level(enum bunyan_log_level level)
@@ -211,11 +295,11 @@ void
 bunyan_timestamp(char *buffer, size_t len)
 {
 	struct timespec ts;
-	struct tm *info;
+	struct tm tm, *info;
 	int w;
 
 	VERIFY0(clock_gettime(CLOCK_REALTIME, &ts));
-	info = gmtime(&ts.tv_sec);
+	info = gmtime_r(&ts.tv_sec, &tm);
 	VERIFY(info != NULL);
 
 	w = snprintf(buffer, len, "%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ",
@@ -296,6 +380,7 @@ _bunyan_push(const char *func, ...)
 {
 	va_list ap;
 	struct bunyan_frame *frame;
+	struct bunyan_stack **stk = bunyan_stack();
 
 	frame = calloc(1, sizeof (struct bunyan_frame));
 	VERIFY(frame != NULL);
@@ -305,15 +390,17 @@ _bunyan_push(const char *func, ...)
 	bunyan_add_vars_p(frame, ap);
 	va_end(ap);
 
-	if (thstack == NULL) {
-		thstack = calloc(1, sizeof (struct bunyan_stack));
-		VERIFY(thstack != NULL);
-		thstack->bs_next = bunyan_stacks;
-		bunyan_stacks = thstack;
+	if (*stk == NULL) {
+		*stk = calloc(1, sizeof (struct bunyan_stack));
+		VERIFY(*stk != NULL);
+		bunyan_lock();
+		(*stk)->bs_next = bunyan_stacks;
+		bunyan_stacks = *stk;
+		bunyan_unlock();
 	}
 
-	frame->bf_next = thstack->bs_top;
-	thstack->bs_top = frame;
+	frame->bf_next = (*stk)->bs_top;
+	(*stk)->bs_top = frame;
 
 	return (frame);
 }
@@ -322,10 +409,11 @@ void
 bunyan_pop(struct bunyan_frame *frame)
 {
 	struct bunyan_var *var, *nvar;
+	struct bunyan_stack **stk = bunyan_stack();
 	VERIFY(frame != NULL);
-	VERIFY(thstack != NULL);
-	VERIFY(thstack->bs_top == frame);
-	thstack->bs_top = frame->bf_next;
+	VERIFY(*stk != NULL);
+	VERIFY((*stk)->bs_top == frame);
+	(*stk)->bs_top = frame->bf_next;
 
 	for (var = frame->bf_vars; var != NULL; var = nvar) {
 		nvar = var->bv_next;
@@ -404,7 +492,9 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 	uint n = 0;
 	struct bunyan_frame *frame;
 	struct bunyan_var *evars = NULL, *evar, *nevar;
+	struct bunyan_stack *stk = *bunyan_stack();
 
+	bunyan_lock();
 	reset_buf();
 
 	if (!bunyan_omit_timestamp) {
@@ -437,8 +527,8 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 
 	printf_buf("%s", msg);
 
-	if (thstack != NULL) {
-		frame = thstack->bs_top;
+	if (stk != NULL) {
+		frame = stk->bs_top;
 		for (; frame != NULL; frame = frame->bf_next) {
 			print_frame(frame, &n, &evars);
 		}
@@ -528,8 +618,7 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 		free(evar);
 	}
 
-	if (level < bunyan_min_level) {
-		return;
-	}
-	fprintf(stderr, "%s", bunyan_buf);
+	if (level >= bunyan_min_level)
+		fprintf(stderr, "%s", bunyan_buf);
+	bunyan_unlock();
 }
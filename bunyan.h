@@ -44,4 +44,25 @@ void bunyan_pop(struct bunyan_frame *frame);
 
 #define	bunyan_push(...)	_bunyan_push(__func__, __VA_ARGS__)
 
+/*
+ * For programs which log from more than one thread. bto_lock/bto_unlock are
+ * held around formatting and writing out each log line, and bto_stack must
+ * return a pointer to storage for the calling thread's own frame stack
+ * (initially NULL).
+ */
+struct bunyan_stack;
+struct bunyan_thread_ops {
+	void (*bto_lock)(void);
+	void (*bto_unlock)(void);
+	struct bunyan_stack **(*bto_stack)(void);
+};
+void bunyan_set_thread_ops(const struct bunyan_thread_ops *ops);
+/*
+ * Makes logging safe from multiple threads using a plain pthread mutex and
+ * thread-specific frame stacks, unless thread ops have already been set. Must
+ * be called from the thread that's been doing the logging so far, before
+ * any others start.
+ */
+void bunyan_enable_threads(void);
+
 #endif
@@ -397,7 +397,7 @@ release_context(void)
 		piv_release(ebox_enum_tokens);
 	ebox_enum_tokens = NULL;
 	if (ebox_ctx_init)
-		SCardReleaseContext(ebox_ctx);
+		piv_release_context(ebox_ctx);
 	ebox_ctx_init = B_FALSE;
 }
 
@@ -426,8 +426,7 @@ local_unlock(struct piv_ecdh_box *box, struct sshkey *cak, const char *name)
 	}
 
 	if (!ebox_ctx_init) {
-		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
-		    &ebox_ctx);
+		rc = piv_establish_context(&ebox_ctx);
 		if (rc != SCARD_S_SUCCESS) {
 			errfx(EXIT_ERROR, pcscerrf("SCardEstablishContext", rc),
 			    "failed to initialise libpcsc");
@@ -447,7 +446,7 @@ local_unlock(struct piv_ecdh_box *box, struct sshkey *cak, const char *name)
 		err = piv_find(ebox_ctx, piv_box_guid(box), GUID_LEN, &tokens);
 		if (errf_caused_by(err, "NotFoundError")) {
 			errf_free(err);
-			err = piv_enumerate(ebox_ctx, &tokens);
+			err = piv_enumerate_lazy(ebox_ctx, &tokens);
 			if (err && agerr) {
 				err = errf("AgentError", agerr, "ssh-agent "
 				"unlock failed, and no PIV tokens were "
@@ -1414,8 +1413,7 @@ interactive_select_local_token(struct ebox_tpl_part **ppart)
 	unsigned long parsed;
 
 	if (!ebox_ctx_init) {
-		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
-		    &ebox_ctx);
+		rc = piv_establish_context(&ebox_ctx);
 		if (rc != SCARD_S_SUCCESS) {
 			errfx(EXIT_ERROR, pcscerrf("SCardEstablishContext", rc),
 			    "failed to initialise libpcsc");
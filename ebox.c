@@ -37,13 +37,6 @@
 
 #include "piv-internal.h"
 
-#if defined(__sun) || defined(__APPLE__)
-#include <netinet/in.h>
-#define	htobe32(v)	(htonl(v))
-#else
-#include <endian.h>
-#endif
-
 struct buf {
 	size_t b_len;
 	uint8_t *b_data;
@@ -182,6 +175,29 @@ struct ebox_stream_chunk {
 	uint8_t *esc_plain;
 };
 
+/*
+ * Cipher and HMAC contexts kept between chunks by one thread. esx_cipher is
+ * indexed by the do_encrypt argument to cipher_init().
+ */
+struct ebox_stream_ctx {
+	const struct ebox_stream *esx_stream;
+	struct sshcipher_ctx *esx_cipher[2];
+	struct ssh_hmac_ctx *esx_hmac;
+};
+
+struct ebox_stream_index_ent {
+	uint64_t esie_encoff;
+	uint64_t esie_plainoff;
+};
+
+struct ebox_stream_index {
+	uint64_t esi_enclen;
+	uint64_t esi_plainlen;
+	size_t esi_count;
+	size_t esi_alloc;
+	struct ebox_stream_index_ent *esi_ents;
+};
+
 enum ebox_part_tag {
 	EBOX_PART_END = 0,
 	EBOX_PART_PUBKEY = 1,
@@ -194,6 +210,14 @@ enum ebox_part_tag {
 };
 
 #define	EBOX_STREAM_DEFAULT_CHUNK	(128 * 1024)
+/*
+ * We never write chunks bigger than the default, but allow some headroom for
+ * other writers. Readers size buffers from the chunk size in the header, so
+ * it has to be bounded.
+ */
+#define	EBOX_STREAM_MAX_CHUNK		(16 * 1024 * 1024)
+/* "EBOXINDX", the last 8 bytes of a stream which has a chunk index. */
+#define	EBOX_STREAM_INDEX_MAGIC		0x45424f58494e4458ULL
 
 enum ebox_version {
 	EBOX_V1 = 0x01,
@@ -1202,23 +1226,74 @@ ebox_part_free_private(struct ebox_part *part)
 	part->ep_priv = NULL;
 }
 
+/*
+ * Ciphers we will create new streams with, in order of preference. The first
+ * one which libssh supports is the default. The AEAD ciphers only make one
+ * pass over each chunk; aes256-ctr needs a separate HMAC-SHA256 pass, but is
+ * what streams written by older versions use.
+ *
+ * Decryption will accept any cipher libssh knows about.
+ */
+static const char *ebox_stream_ciphers[] = {
+	"aes256-gcm",
+	"chacha20-poly1305",
+	"aes256-ctr",
+	NULL
+};
+
+const char **
+ebox_stream_cipher_list(void)
+{
+	return (ebox_stream_ciphers);
+}
+
 errf_t *
 ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str)
+{
+	const char **name;
+
+	for (name = ebox_stream_ciphers; *name != NULL; ++name) {
+		if (cipher_by_name(*name) != NULL)
+			break;
+	}
+	VERIFY(*name != NULL);
+
+	return (ebox_stream_new_cipher(tpl, *name, str));
+}
+
+errf_t *
+ebox_stream_new_cipher(const struct ebox_tpl *tpl, const char *ciphername,
+    struct ebox_stream **str)
 {
 	struct ebox_stream *es;
 	uint8_t *key;
 	size_t keylen;
 	errf_t *err;
 	const struct sshcipher *cipher;
+	const char **name;
+
+	for (name = ebox_stream_ciphers; *name != NULL; ++name) {
+		if (strcmp(*name, ciphername) == 0)
+			break;
+	}
+	cipher = cipher_by_name(ciphername);
+	if (*name == NULL || cipher == NULL) {
+		return (errf("NotSupportedError", NULL, "cipher '%s' is not "
+		    "supported for ebox streams", ciphername));
+	}
 
 	es = calloc(1, sizeof (struct ebox_stream));
 	VERIFY(es != NULL);
 	es->es_chunklen = EBOX_STREAM_DEFAULT_CHUNK;
 
-	es->es_cipher = strdup("aes256-ctr");
+	es->es_cipher = strdup(ciphername);
+	/*
+	 * AEAD ciphers have their own tag and ignore the MAC, but we still
+	 * record sha256 so that older readers (which insist on a digest
+	 * they know) can open the stream.
+	 */
 	es->es_mac = strdup("sha256");
-	cipher = cipher_by_name(es->es_cipher);
-	VERIFY(cipher != NULL);
+	VERIFY(es->es_cipher != NULL && es->es_mac != NULL);
 	keylen = cipher_keylen(cipher);
 
 	key = malloc_conceal(keylen);
@@ -1296,6 +1371,18 @@ sshbuf_get_ebox_stream_chunk(struct sshbuf *buf, const struct ebox_stream *es,
 	}
 	esc->esc_stream = (struct ebox_stream *)es;
 
+	/*
+	 * A seqnr of 0 is never used for a real chunk: it marks the start of
+	 * the chunk index trailer. Leave it in the buffer for
+	 * sshbuf_get_ebox_stream_index().
+	 */
+	if (sshbuf_len(buf) >= sizeof (uint32_t) &&
+	    PEEK_U32(sshbuf_ptr(buf)) == 0) {
+		err = errf("EndOfStreamError", NULL, "reached chunk index at "
+		    "end of ebox stream");
+		goto out;
+	}
+
 	if ((rc = sshbuf_get_u32(buf, &esc->esc_seqnr))) {
 		err = boxderrf(ssherrf("sshbuf_get_u32", rc));
 		goto out;
@@ -1360,9 +1447,10 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 		err = boxderrf(ssherrf("sshbuf_get_u64", rc));
 		goto out;
 	}
-	if (chunklen > SIZE_MAX) {
-		err = boxderrf(errf("OverflowError", NULL,
-		    "stream chunk size (%" PRIu64 ") too large", chunklen));
+	if (chunklen == 0 || chunklen > EBOX_STREAM_MAX_CHUNK) {
+		err = boxderrf(errf("RangeError", NULL,
+		    "stream chunk size (%" PRIu64 ") is out of range (must be "
+		    "1-%u bytes)", chunklen, EBOX_STREAM_MAX_CHUNK));
 		goto out;
 	}
 	es->es_chunklen = chunklen;
@@ -1380,7 +1468,8 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 		goto out;
 	}
 	dgalg = ssh_digest_alg_by_name(es->es_mac);
-	if (dgalg == -1) {
+	if (dgalg == -1 && !(cipher_authlen(cipher) > 0 &&
+	    strcmp(es->es_mac, "none") == 0)) {
 		err = boxverrf(errf("BadAlgorithmError", NULL,
 		    "unsupported MAC algorithm '%s'", es->es_mac));
 		goto out;
@@ -1396,47 +1485,175 @@ out:
 	return (err);
 }
 
+/*
+ * Everything we need to know about a stream's cipher and MAC to process a
+ * chunk.
+ */
+struct ebox_stream_params {
+	const struct sshcipher	*esp_cipher;
+	size_t			 esp_ivlen;
+	size_t			 esp_authlen;
+	size_t			 esp_blocksz;
+	size_t			 esp_keylen;
+	int			 esp_dgalg;
+	size_t			 esp_maclen;
+};
+
+static void
+ebox_stream_params(const struct ebox_stream *es, struct ebox_stream_params *p)
+{
+	p->esp_cipher = cipher_by_name(es->es_cipher);
+	VERIFY(p->esp_cipher != NULL);
+	p->esp_ivlen = cipher_ivlen(p->esp_cipher);
+	p->esp_authlen = cipher_authlen(p->esp_cipher);
+	p->esp_blocksz = cipher_blocksize(p->esp_cipher);
+	p->esp_keylen = cipher_keylen(p->esp_cipher);
+
+	if (p->esp_authlen == 0) {
+		p->esp_dgalg = ssh_digest_alg_by_name(es->es_mac);
+		VERIFY(p->esp_dgalg != -1);
+		p->esp_maclen = ssh_digest_bytes(p->esp_dgalg);
+	} else {
+		p->esp_dgalg = -1;
+		p->esp_maclen = 0;
+	}
+
+	VERIFY3U(es->es_ebox->e_keylen, >=, p->esp_keylen);
+	VERIFY(es->es_ebox->e_key != NULL);
+}
+
+/*
+ * Length of the padded ciphertext plus auth tag or MAC. Callers bound plainlen
+ * by the chunk size (or by an allocation they've already made), so this can't
+ * overflow in practice, but check anyway.
+ */
+static size_t
+ebox_stream_enclen(const struct ebox_stream_params *p, size_t plainlen)
+{
+	VERIFY3U(plainlen, <=, SIZE_MAX - p->esp_blocksz - p->esp_authlen -
+	    p->esp_maclen);
+	return (plainlen + p->esp_blocksz - (plainlen % p->esp_blocksz) +
+	    p->esp_authlen + p->esp_maclen);
+}
+
 errf_t *
-ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
+ebox_stream_ctx_new(const struct ebox_stream *es, struct ebox_stream_ctx **ctx)
 {
-	struct ebox_stream *es;
-	const struct sshcipher *cipher;
-	int dgalg = -1;
-	size_t blocksz, ivlen, authlen, keylen, plainlen, enclen, maclen;
-	size_t padding, i;
-	uint8_t *key, *plain, *enc, *iv;
-	struct sshcipher_ctx *cctx = NULL;
-	struct ssh_hmac_ctx *hctx = NULL;
+	struct ebox_stream_ctx *esx;
 
-	es = esc->esc_stream;
-	plainlen = esc->esc_plainlen;
+	esx = calloc(1, sizeof (struct ebox_stream_ctx));
+	if (esx == NULL)
+		return (ERRF_NOMEM);
+	esx->esx_stream = es;
+	*ctx = esx;
+	return (ERRF_OK);
+}
 
-	cipher = cipher_by_name(es->es_cipher);
-	VERIFY(cipher != NULL);
-	ivlen = cipher_ivlen(cipher);
-	authlen = cipher_authlen(cipher);
-	blocksz = cipher_blocksize(cipher);
-	keylen = cipher_keylen(cipher);
+void
+ebox_stream_ctx_free(struct ebox_stream_ctx *esx)
+{
+	if (esx == NULL)
+		return;
+	cipher_free(esx->esx_cipher[0]);
+	cipher_free(esx->esx_cipher[1]);
+	ssh_hmac_free(esx->esx_hmac);
+	free(esx);
+}
 
-	if (ivlen > 0) {
-		iv = calloc(1, ivlen);
-		VERIFY3U(ivlen, >=, sizeof (uint32_t));
-		*(uint32_t *)iv = htobe32(esc->esc_seqnr);
-	} else {
-		iv = NULL;
+/*
+ * Returns a cipher context set up for the chunk with the given IV, re-using
+ * the one in "esx" if we can. Pass the result to ebox_stream_cipher_put()
+ * when done.
+ *
+ * For the AEAD ciphers, cipher_set_keyiv() resets the IV the same way that
+ * cipher_init() sets it (and chacha20-poly1305 takes its nonce from the seqnr
+ * given to cipher_crypt(), so has no IV at all). For the others, whether it
+ * really resets the counter depends on the crypto library, so we don't trust
+ * it and start again for every chunk.
+ */
+static struct sshcipher_ctx *
+ebox_stream_cipher_get(struct ebox_stream_ctx *esx,
+    const struct ebox_stream *es, const struct ebox_stream_params *p,
+    const uint8_t *iv, int do_encrypt)
+{
+	struct sshcipher_ctx *cctx = NULL;
+
+	if (esx != NULL && p->esp_authlen > 0 &&
+	    (cctx = esx->esx_cipher[do_encrypt]) != NULL) {
+		if (p->esp_ivlen == 0 || cipher_set_keyiv(cctx, iv) == 0)
+			return (cctx);
+		cipher_free(cctx);
+		esx->esx_cipher[do_encrypt] = NULL;
+		cctx = NULL;
 	}
+	VERIFY0(cipher_init(&cctx, p->esp_cipher, es->es_ebox->e_key,
+	    p->esp_keylen, (p->esp_ivlen > 0) ? iv : NULL, p->esp_ivlen,
+	    do_encrypt));
+	if (esx != NULL && p->esp_authlen > 0)
+		esx->esx_cipher[do_encrypt] = cctx;
+	return (cctx);
+}
 
-	if (authlen == 0) {
-		dgalg = ssh_digest_alg_by_name(es->es_mac);
-		VERIFY(dgalg != -1);
-		maclen = ssh_digest_bytes(dgalg);
-	} else {
-		maclen = 0;
+static void
+ebox_stream_cipher_put(struct ebox_stream_ctx *esx, struct sshcipher_ctx *cctx)
+{
+	if (esx == NULL || (cctx != esx->esx_cipher[0] &&
+	    cctx != esx->esx_cipher[1]))
+		cipher_free(cctx);
+}
+
+/*
+ * Returns an HMAC context keyed for this stream and ready for
+ * ssh_hmac_update(). One kept in "esx" just needs resetting, which
+ * ssh_hmac_init() does when given no key.
+ */
+static struct ssh_hmac_ctx *
+ebox_stream_hmac_get(struct ebox_stream_ctx *esx, const struct ebox_stream *es,
+    const struct ebox_stream_params *p)
+{
+	struct ssh_hmac_ctx *hctx;
+
+	if (esx != NULL && esx->esx_hmac != NULL) {
+		VERIFY0(ssh_hmac_init(esx->esx_hmac, NULL, 0));
+		return (esx->esx_hmac);
 	}
+	hctx = ssh_hmac_start(p->esp_dgalg);
+	VERIFY(hctx != NULL);
+	VERIFY0(ssh_hmac_init(hctx, es->es_ebox->e_key, p->esp_keylen));
+	if (esx != NULL)
+		esx->esx_hmac = hctx;
+	return (hctx);
+}
 
-	VERIFY3U(es->es_ebox->e_keylen, >=, keylen);
-	key = es->es_ebox->e_key;
-	VERIFY(key != NULL);
+static void
+ebox_stream_hmac_put(struct ebox_stream_ctx *esx, struct ssh_hmac_ctx *hctx)
+{
+	if (esx == NULL)
+		ssh_hmac_free(hctx);
+}
+
+/*
+ * Encrypts "plainlen" bytes at the start of "buf" in place. The buffer must
+ * have room for ebox_stream_enclen() bytes. "esx" may be NULL.
+ */
+static void
+ebox_stream_seal(const struct ebox_stream *es, struct ebox_stream_ctx *esx,
+    const struct ebox_stream_params *p, uint32_t seqnr, uint8_t *buf,
+    size_t plainlen, size_t *enclen)
+{
+	uint8_t iv[32];
+	size_t padding, padlen, i;
+	struct sshcipher_ctx *cctx;
+	struct ssh_hmac_ctx *hctx;
+
+	VERIFY(esx == NULL || esx->esx_stream == es);
+
+	if (p->esp_ivlen > 0) {
+		VERIFY3U(p->esp_ivlen, <=, sizeof (iv));
+		VERIFY3U(p->esp_ivlen, >=, sizeof (uint32_t));
+		bzero(iv, p->esp_ivlen);
+		POKE_U32(iv, seqnr);
+	}
 
 	/*
 	 * We add PKCS#7 style padding, consisting of up to a block of bytes,
@@ -1444,148 +1661,251 @@ ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
 	 * off after decryption and avoids the need to include and validate the
 	 * real length of the payload separately.
 	 */
-	padding = blocksz - (plainlen % blocksz);
-	VERIFY3U(padding, <=, blocksz);
+	padding = p->esp_blocksz - (plainlen % p->esp_blocksz);
+	VERIFY3U(padding, <=, p->esp_blocksz);
 	VERIFY3U(padding, >, 0);
-	plainlen += padding;
-	plain = malloc(plainlen);
-	VERIFY3P(plain, !=, NULL);
-	bcopy(esc->esc_plain, plain, esc->esc_plainlen);
-	for (i = esc->esc_plainlen; i < plainlen; ++i)
-		plain[i] = padding;
+	padlen = plainlen + padding;
+	for (i = plainlen; i < padlen; ++i)
+		buf[i] = padding;
 
-	enclen = plainlen + authlen + maclen;
-	esc->esc_enc = (enc = malloc(enclen));
-	VERIFY(enc != NULL);
-	esc->esc_enclen = enclen;
+	cctx = ebox_stream_cipher_get(esx, es, p, iv, 1);
+	VERIFY0(cipher_crypt(cctx, seqnr, buf, buf, padlen, 0,
+	    p->esp_authlen));
+	ebox_stream_cipher_put(esx, cctx);
 
-	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 1));
-	VERIFY0(cipher_crypt(cctx, esc->esc_seqnr, enc, plain, plainlen, 0,
-	    authlen));
-	cipher_free(cctx);
-
-	if (dgalg != -1) {
-		hctx = ssh_hmac_start(dgalg);
-		VERIFY(hctx != NULL);
-		VERIFY0(ssh_hmac_init(hctx, key, keylen));
-		VERIFY0(ssh_hmac_update(hctx, enc, enclen - maclen));
-		VERIFY0(ssh_hmac_final(hctx, &enc[enclen - maclen], maclen));
-		ssh_hmac_free(hctx);
+	if (p->esp_dgalg != -1) {
+		hctx = ebox_stream_hmac_get(esx, es, p);
+		VERIFY0(ssh_hmac_update(hctx, buf, padlen));
+		VERIFY0(ssh_hmac_final(hctx, &buf[padlen], p->esp_maclen));
+		ebox_stream_hmac_put(esx, hctx);
 	}
 
-	return (ERRF_OK);
+	*enclen = padlen + p->esp_authlen + p->esp_maclen;
 }
 
-errf_t *
-ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
+/*
+ * Authenticates and decrypts "enclen" bytes at the start of "buf" in place,
+ * leaving *plainlen bytes of plaintext at the start of it. On failure the
+ * contents of buf are undefined. "esx" may be NULL.
+ */
+static errf_t *
+ebox_stream_open(const struct ebox_stream *es, struct ebox_stream_ctx *esx,
+    const struct ebox_stream_params *p, uint32_t seqnr, uint8_t *buf,
+    size_t enclen, size_t *plainlen)
 {
-	struct ebox_stream *es;
-	const struct sshcipher *cipher;
-	int dgalg = -1;
-	size_t blocksz, ivlen, authlen, keylen, plainlen, enclen, maclen;
-	size_t padding, i, reallen;
-	uint8_t *key, *plain, *enc, *mac, *iv;
-	struct sshcipher_ctx *cctx = NULL;
-	struct ssh_hmac_ctx *hctx = NULL;
+	uint8_t iv[32];
+	uint8_t mac[SSH_DIGEST_MAX_LENGTH];
+	size_t padding, padlen, reallen, i;
+	struct sshcipher_ctx *cctx;
+	struct ssh_hmac_ctx *hctx;
 	int rc;
-	errf_t *err;
 
-	es = esc->esc_stream;
+	VERIFY(esx == NULL || esx->esx_stream == es);
 
-	cipher = cipher_by_name(es->es_cipher);
-	VERIFY(cipher != NULL);
-	ivlen = cipher_ivlen(cipher);
-	authlen = cipher_authlen(cipher);
-	blocksz = cipher_blocksize(cipher);
-	keylen = cipher_keylen(cipher);
-
-	if (ivlen > 0) {
-		iv = calloc(1, ivlen);
-		VERIFY3U(ivlen, >=, sizeof (uint32_t));
-		*(uint32_t *)iv = htobe32(esc->esc_seqnr);
-	} else {
-		iv = NULL;
+	if (enclen < p->esp_authlen + p->esp_maclen + p->esp_blocksz) {
+		return (errf("LengthError", NULL, "Ciphertext length (%zu) "
+		    "is smaller than minimum length (auth tag + 1 block = %zu)",
+		    enclen, p->esp_authlen + p->esp_maclen + p->esp_blocksz));
 	}
+	padlen = enclen - p->esp_authlen - p->esp_maclen;
 
-	if (authlen == 0) {
-		dgalg = ssh_digest_alg_by_name(es->es_mac);
-		VERIFY(dgalg != -1);
-		maclen = ssh_digest_bytes(dgalg);
-	} else {
-		maclen = 0;
+	if (p->esp_ivlen > 0) {
+		VERIFY3U(p->esp_ivlen, <=, sizeof (iv));
+		VERIFY3U(p->esp_ivlen, >=, sizeof (uint32_t));
+		bzero(iv, p->esp_ivlen);
+		POKE_U32(iv, seqnr);
 	}
 
-	VERIFY3U(es->es_ebox->e_keylen, >=, keylen);
-	key = es->es_ebox->e_key;
-	VERIFY(key != NULL);
-
-	enc = esc->esc_enc;
-	enclen = esc->esc_enclen;
-	if (enclen < authlen + blocksz) {
-		err = errf("LengthError", NULL, "Ciphertext length (%d) "
-		    "is smaller than minimum length (auth tag + 1 block = %d)",
-		    enclen, authlen + blocksz);
-		free(iv);
-		return (err);
-	}
-
-	if (dgalg != -1) {
-		mac = malloc(maclen);
-		VERIFY(mac != NULL);
-		hctx = ssh_hmac_start(dgalg);
-		VERIFY(hctx != NULL);
-		VERIFY0(ssh_hmac_init(hctx, key, keylen));
-		VERIFY0(ssh_hmac_update(hctx, enc, enclen - maclen));
-		VERIFY0(ssh_hmac_final(hctx, mac, maclen));
-		ssh_hmac_free(hctx);
-		if (timingsafe_bcmp(mac, &enc[enclen - maclen], maclen) != 0) {
-			explicit_bzero(mac, maclen);
-			free(mac);
-			free(iv);
+	if (p->esp_dgalg != -1) {
+		VERIFY3U(p->esp_maclen, <=, sizeof (mac));
+		hctx = ebox_stream_hmac_get(esx, es, p);
+		VERIFY0(ssh_hmac_update(hctx, buf, enclen - p->esp_maclen));
+		VERIFY0(ssh_hmac_final(hctx, mac, p->esp_maclen));
+		ebox_stream_hmac_put(esx, hctx);
+		rc = timingsafe_bcmp(mac, &buf[enclen - p->esp_maclen],
+		    p->esp_maclen);
+		explicit_bzero(mac, p->esp_maclen);
+		if (rc != 0) {
 			return (errf("MACError", NULL, "Ciphertext MAC failed "
 			    "validation"));
 		}
-		explicit_bzero(mac, maclen);
-		free(mac);
 	}
 
-	plainlen = enclen - authlen - maclen;
-	plain = malloc(plainlen);
-	VERIFY(plain != NULL);
-
-	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 0));
-	rc = cipher_crypt(cctx, esc->esc_seqnr, plain, enc,
-	    enclen - authlen - maclen, 0, authlen);
-	cipher_free(cctx);
-
+	cctx = ebox_stream_cipher_get(esx, es, p, iv, 0);
+	rc = cipher_crypt(cctx, seqnr, buf, buf, padlen, 0, p->esp_authlen);
+	ebox_stream_cipher_put(esx, cctx);
 	if (rc != 0) {
-		err = ssherrf("cipher_crypt", rc);
-		explicit_bzero(plain, plainlen);
-		free(plain);
-		return (err);
+		explicit_bzero(buf, padlen);
+		return (ssherrf("cipher_crypt", rc));
 	}
 
 	/* Strip off the pkcs#7 padding and verify it. */
-	padding = plain[plainlen - 1];
-	if (padding < 1 || padding > blocksz)
+	padding = buf[padlen - 1];
+	if (padding < 1 || padding > p->esp_blocksz)
 		goto paderr;
-	reallen = plainlen - padding;
-	for (i = reallen; i < plainlen; ++i) {
-		if (plain[i] != padding) {
+	reallen = padlen - padding;
+	for (i = reallen; i < padlen; ++i) {
+		if (buf[i] != padding)
 			goto paderr;
-		}
 	}
 
+	*plainlen = reallen;
+	return (ERRF_OK);
+
+paderr:
+	explicit_bzero(buf, padlen);
+	return (errf("PaddingError", NULL, "Padding failed validation"));
+}
+
+errf_t *
+ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
+{
+	struct ebox_stream_params p;
+	uint8_t *enc;
+	size_t enclen;
+
+	ebox_stream_params(esc->esc_stream, &p);
+
+	enclen = ebox_stream_enclen(&p, esc->esc_plainlen);
+	enc = malloc(enclen);
+	VERIFY(enc != NULL);
+	bcopy(esc->esc_plain, enc, esc->esc_plainlen);
+
+	ebox_stream_seal(esc->esc_stream, NULL, &p, esc->esc_seqnr, enc,
+	    esc->esc_plainlen, &enclen);
+
+	free(esc->esc_enc);
+	esc->esc_enc = enc;
+	esc->esc_enclen = enclen;
+
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
+{
+	struct ebox_stream_params p;
+	uint8_t *plain;
+	size_t plainlen;
+	errf_t *err;
+
+	ebox_stream_params(esc->esc_stream, &p);
+
+	plain = malloc(esc->esc_enclen);
+	VERIFY(plain != NULL);
+	bcopy(esc->esc_enc, plain, esc->esc_enclen);
+
+	err = ebox_stream_open(esc->esc_stream, NULL, &p, esc->esc_seqnr, plain,
+	    esc->esc_enclen, &plainlen);
+	if (err) {
+		free(plain);
+		return (err);
+	}
+
+	if (esc->esc_plainlen > 0)
+		explicit_bzero(esc->esc_plain, esc->esc_plainlen);
+	free(esc->esc_plain);
 	esc->esc_plain = plain;
-	esc->esc_plainlen = reallen;
+	esc->esc_plainlen = plainlen;
 
 	return (ERRF_OK);
+}
 
-paderr:
-	err = errf("PaddingError", NULL, "Padding failed validation");
-	explicit_bzero(plain, plainlen);
-	free(plain);
-	return (err);
+size_t
+ebox_stream_frame_size(const struct ebox_stream *es, size_t plainlen)
+{
+	struct ebox_stream_params p;
+
+	ebox_stream_params(es, &p);
+	return (EBOX_STREAM_FRAME_HDRLEN + ebox_stream_enclen(&p, plainlen));
+}
+
+errf_t *
+ebox_stream_frame_header(const struct ebox_stream *es, const uint8_t *hdr,
+    size_t *seqnr, size_t *framelen)
+{
+	size_t len;
+
+	if (PEEK_U32(hdr) == 0) {
+		return (errf("EndOfStreamError", NULL, "reached chunk index at "
+		    "end of ebox stream"));
+	}
+	len = EBOX_STREAM_FRAME_HDRLEN + PEEK_U32(&hdr[sizeof (uint32_t)]);
+	if (len > ebox_stream_frame_size(es, es->es_chunklen)) {
+		return (boxderrf(errf("LengthError", NULL, "chunk length "
+		    "(%zu) is larger than the stream's chunk size allows",
+		    len)));
+	}
+
+	*seqnr = PEEK_U32(hdr);
+	*framelen = len;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_encrypt_frame(const struct ebox_stream *es,
+    struct ebox_stream_ctx *esx, size_t seqnr, uint8_t *frame, size_t framesz,
+    size_t plainlen, size_t *framelen)
+{
+	struct ebox_stream_params p;
+	size_t enclen;
+
+	if (seqnr == 0 || seqnr > UINT32_MAX) {
+		return (argerrf("seqnr", "a number between 1 and 2^32-1",
+		    "%zu", seqnr));
+	}
+	if (plainlen > es->es_chunklen) {
+		return (argerrf("plainlen", "at most the stream chunk size",
+		    "%zu", plainlen));
+	}
+
+	ebox_stream_params(es, &p);
+	if (framesz < EBOX_STREAM_FRAME_HDRLEN + ebox_stream_enclen(&p,
+	    plainlen)) {
+		return (argerrf("framesz", "at least ebox_stream_frame_size()",
+		    "%zu", framesz));
+	}
+
+	ebox_stream_seal(es, esx, &p, seqnr, &frame[EBOX_STREAM_FRAME_HDRLEN],
+	    plainlen, &enclen);
+	POKE_U32(frame, seqnr);
+	POKE_U32(&frame[sizeof (uint32_t)], enclen);
+
+	*framelen = EBOX_STREAM_FRAME_HDRLEN + enclen;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_decrypt_frame(const struct ebox_stream *es,
+    struct ebox_stream_ctx *esx, uint8_t *frame, size_t framelen,
+    size_t *seqnr, uint8_t **plain, size_t *plainlen)
+{
+	struct ebox_stream_params p;
+	size_t len, sn;
+	errf_t *err;
+
+	if (framelen < EBOX_STREAM_FRAME_HDRLEN) {
+		return (errf("IncompleteMessageError", NULL, "chunk frame is "
+		    "too short for its header"));
+	}
+	if ((err = ebox_stream_frame_header(es, frame, &sn, &len)))
+		return (err);
+	if (len != framelen) {
+		return (boxderrf(errf("LengthError", NULL, "chunk frame "
+		    "length (%zu) does not match its header (%zu)", framelen,
+		    len)));
+	}
+
+	ebox_stream_params(es, &p);
+	err = ebox_stream_open(es, esx, &p, sn,
+	    &frame[EBOX_STREAM_FRAME_HDRLEN],
+	    framelen - EBOX_STREAM_FRAME_HDRLEN, plainlen);
+	if (err)
+		return (err);
+
+	*seqnr = sn;
+	*plain = &frame[EBOX_STREAM_FRAME_HDRLEN];
+	return (ERRF_OK);
 }
 
 const uint8_t *
@@ -1595,6 +1915,12 @@ ebox_stream_chunk_data(const struct ebox_stream_chunk *esc, size_t *size)
 	return (esc->esc_plain);
 }
 
+size_t
+ebox_stream_chunk_seqnr(const struct ebox_stream_chunk *esc)
+{
+	return (esc->esc_seqnr);
+}
+
 errf_t *
 ebox_stream_chunk_new(const struct ebox_stream *es, const void *data,
     size_t len, size_t seqnr, struct ebox_stream_chunk **chunk)
@@ -1654,6 +1980,249 @@ ebox_stream_chunk_size(const struct ebox_stream *es)
 	return (es->es_chunklen);
 }
 
+size_t
+ebox_stream_seek_offset(const struct ebox_stream *es, size_t offset)
+{
+	return ((offset / es->es_chunklen) *
+	    ebox_stream_frame_size(es, es->es_chunklen));
+}
+
+struct ebox_stream_index *
+ebox_stream_index_new(void)
+{
+	struct ebox_stream_index *esi;
+
+	esi = calloc(1, sizeof (struct ebox_stream_index));
+	VERIFY(esi != NULL);
+	return (esi);
+}
+
+void
+ebox_stream_index_free(struct ebox_stream_index *esi)
+{
+	if (esi == NULL)
+		return;
+	free(esi->esi_ents);
+	free(esi);
+}
+
+void
+ebox_stream_index_add(struct ebox_stream_index *esi, size_t framelen,
+    size_t plainlen)
+{
+	struct ebox_stream_index_ent *ent;
+
+	if (esi->esi_count >= esi->esi_alloc) {
+		esi->esi_alloc = (esi->esi_alloc == 0) ? 64 :
+		    esi->esi_alloc * 2;
+		esi->esi_ents = recallocarray(esi->esi_ents, esi->esi_count,
+		    esi->esi_alloc, sizeof (struct ebox_stream_index_ent));
+		VERIFY(esi->esi_ents != NULL);
+	}
+	ent = &esi->esi_ents[esi->esi_count++];
+	ent->esie_encoff = esi->esi_enclen;
+	ent->esie_plainoff = esi->esi_plainlen;
+	esi->esi_enclen += framelen;
+	esi->esi_plainlen += plainlen;
+}
+
+size_t
+ebox_stream_index_plain_size(const struct ebox_stream_index *esi)
+{
+	return (esi->esi_plainlen);
+}
+
+errf_t *
+ebox_stream_index_lookup(const struct ebox_stream_index *esi, size_t offset,
+    size_t *encoff, size_t *plainoff, size_t *seqnr)
+{
+	size_t lo, hi, mid;
+
+	if (offset >= esi->esi_plainlen) {
+		return (errf("RangeError", NULL, "offset %zu is past the end "
+		    "of the stream (%" PRIu64 " bytes)", offset,
+		    esi->esi_plainlen));
+	}
+
+	/* Find the last entry starting at or before offset. */
+	lo = 0;
+	hi = esi->esi_count;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (esi->esi_ents[mid].esie_plainoff <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	*encoff = esi->esi_ents[lo].esie_encoff;
+	*plainoff = esi->esi_ents[lo].esie_plainoff;
+	*seqnr = lo + 1;
+	return (ERRF_OK);
+}
+
+/*
+ * The index trailer looks like a chunk with seqnr 0, followed by a u64 with
+ * the total length of the trailer and a u64 magic number, so that it can be
+ * found by reading the last 16 bytes of a file.
+ */
+errf_t *
+sshbuf_put_ebox_stream_index(struct sshbuf *buf,
+    const struct ebox_stream_index *esi)
+{
+	struct sshbuf *body;
+	size_t start, i;
+	int rc;
+	errf_t *err = NULL;
+
+	body = sshbuf_new();
+	if (body == NULL)
+		return (ERRF_NOMEM);
+
+	if ((rc = sshbuf_put_u64(body, esi->esi_plainlen)) ||
+	    (rc = sshbuf_put_u32(body, esi->esi_count))) {
+		err = ssherrf("sshbuf_put", rc);
+		goto out;
+	}
+	for (i = 0; i < esi->esi_count; ++i) {
+		if ((rc = sshbuf_put_u64(body, esi->esi_ents[i].esie_encoff)) ||
+		    (rc = sshbuf_put_u64(body,
+		    esi->esi_ents[i].esie_plainoff))) {
+			err = ssherrf("sshbuf_put_u64", rc);
+			goto out;
+		}
+	}
+
+	start = sshbuf_len(buf);
+	if ((rc = sshbuf_put_u32(buf, 0)) ||
+	    (rc = sshbuf_put_stringb(buf, body))) {
+		err = ssherrf("sshbuf_put_stringb", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_put_u64(buf, sshbuf_len(buf) - start +
+	    2 * sizeof (uint64_t))) ||
+	    (rc = sshbuf_put_u64(buf, EBOX_STREAM_INDEX_MAGIC))) {
+		err = ssherrf("sshbuf_put_u64", rc);
+		goto out;
+	}
+
+out:
+	sshbuf_free(body);
+	return (err);
+}
+
+errf_t *
+sshbuf_get_ebox_stream_index(struct sshbuf *buf,
+    struct ebox_stream_index **pesi)
+{
+	struct ebox_stream_index *esi = NULL;
+	struct sshbuf *body = NULL;
+	uint32_t seqnr, count, i;
+	uint64_t trailerlen, magic, encoff, plainoff;
+	size_t start;
+	int rc;
+	errf_t *err;
+
+	start = sshbuf_len(buf);
+
+	if ((rc = sshbuf_get_u32(buf, &seqnr)) ||
+	    (rc = sshbuf_froms(buf, &body)) ||
+	    (rc = sshbuf_get_u64(buf, &trailerlen)) ||
+	    (rc = sshbuf_get_u64(buf, &magic))) {
+		err = boxderrf(ssherrf("sshbuf_get", rc));
+		goto out;
+	}
+	if (seqnr != 0 || magic != EBOX_STREAM_INDEX_MAGIC ||
+	    trailerlen != start - sshbuf_len(buf)) {
+		err = boxderrf(errf("IndexError", NULL, "ebox stream chunk "
+		    "index trailer is malformed"));
+		goto out;
+	}
+
+	esi = ebox_stream_index_new();
+	if ((rc = sshbuf_get_u64(body, &esi->esi_plainlen)) ||
+	    (rc = sshbuf_get_u32(body, &count))) {
+		err = boxderrf(ssherrf("sshbuf_get", rc));
+		goto out;
+	}
+	if (sshbuf_len(body) != count * 2 * sizeof (uint64_t)) {
+		err = boxderrf(errf("IndexError", NULL, "ebox stream chunk "
+		    "index has wrong number of entries"));
+		goto out;
+	}
+	if (count == 0) {
+		if (esi->esi_plainlen != 0) {
+			err = boxderrf(errf("IndexError", NULL, "ebox stream "
+			    "chunk index is empty"));
+			goto out;
+		}
+		*pesi = esi;
+		esi = NULL;
+		err = ERRF_OK;
+		goto out;
+	}
+	esi->esi_alloc = count;
+	esi->esi_ents = calloc(count, sizeof (struct ebox_stream_index_ent));
+	if (esi->esi_ents == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	for (i = 0; i < count; ++i) {
+		if ((rc = sshbuf_get_u64(body, &encoff)) ||
+		    (rc = sshbuf_get_u64(body, &plainoff))) {
+			err = boxderrf(ssherrf("sshbuf_get_u64", rc));
+			goto out;
+		}
+		if (i > 0 && (encoff <= esi->esi_ents[i - 1].esie_encoff ||
+		    plainoff < esi->esi_ents[i - 1].esie_plainoff)) {
+			err = boxderrf(errf("IndexError", NULL, "ebox stream "
+			    "chunk index entries are out of order"));
+			goto out;
+		}
+		esi->esi_ents[i].esie_encoff = encoff;
+		esi->esi_ents[i].esie_plainoff = plainoff;
+	}
+	esi->esi_count = count;
+	if (esi->esi_ents[0].esie_encoff != 0 ||
+	    esi->esi_ents[0].esie_plainoff != 0 ||
+	    esi->esi_ents[count - 1].esie_plainoff > esi->esi_plainlen) {
+		err = boxderrf(errf("IndexError", NULL, "ebox stream chunk "
+		    "index entries are out of range"));
+		goto out;
+	}
+
+	*pesi = esi;
+	esi = NULL;
+	err = ERRF_OK;
+
+out:
+	sshbuf_free(body);
+	ebox_stream_index_free(esi);
+	return (err);
+}
+
+errf_t *
+ebox_stream_index_trailer_size(const uint8_t *tail, size_t len,
+    size_t *trailerlen)
+{
+	uint64_t v;
+
+	if (len < 2 * sizeof (uint64_t) ||
+	    PEEK_U64(tail + len - sizeof (uint64_t)) !=
+	    EBOX_STREAM_INDEX_MAGIC) {
+		return (errf("NotFoundError", NULL, "ebox stream has no "
+		    "chunk index"));
+	}
+	v = PEEK_U64(tail + len - 2 * sizeof (uint64_t));
+	if (v < 2 * sizeof (uint32_t) + 2 * sizeof (uint64_t) ||
+	    v > SIZE_MAX) {
+		return (boxderrf(errf("IndexError", NULL, "ebox stream chunk "
+		    "index trailer has invalid length")));
+	}
+	*trailerlen = v;
+	return (ERRF_OK);
+}
+
 static errf_t *
 sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
     struct ebox_part **ppart)
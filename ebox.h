@@ -70,6 +70,8 @@ struct ebox_part;
 struct ebox_challenge;
 struct ebox_stream;
 struct ebox_stream_chunk;
+struct ebox_stream_index;
+struct ebox_stream_ctx;
 
 /*
  * Ebox templates (ebox_tpl_*) store the metadata about possible configurations
@@ -320,10 +322,23 @@ MUST_CHECK
 errf_t *ebox_challenge_response(struct ebox_config *config,
     struct piv_ecdh_box *respbox, struct ebox_part **ppart);
 
+/*
+ * Reads a stream header.
+ *
+ * Errors:
+ *  - InvalidDataError: the header was corrupt or truncated, or its chunk size
+ *                      was zero or larger than we are willing to buffer
+ */
 MUST_CHECK
 errf_t *sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **str);
 MUST_CHECK
 errf_t *sshbuf_put_ebox_stream(struct sshbuf *buf, struct ebox_stream *str);
+/*
+ * Errors:
+ *  - EndOfStreamError: the next thing in buf is a chunk index trailer rather
+ *                      than a chunk. It is left in buf, to be read with
+ *                      sshbuf_get_ebox_stream_index().
+ */
 MUST_CHECK
 errf_t *sshbuf_get_ebox_stream_chunk(struct sshbuf *buf,
     const struct ebox_stream *stream, struct ebox_stream_chunk **chunk);
@@ -335,10 +350,86 @@ struct ebox *ebox_stream_ebox(const struct ebox_stream *str);
 const char *ebox_stream_cipher(const struct ebox_stream *str);
 const char *ebox_stream_mac(const struct ebox_stream *str);
 size_t ebox_stream_chunk_size(const struct ebox_stream *str);
+/*
+ * Returns the offset (relative to the end of the stream header) of the chunk
+ * containing plaintext byte "offset". This assumes that every chunk before it
+ * is full-size, which is always true for streams written by pivy-box. That
+ * chunk's seqnr is (offset / ebox_stream_chunk_size(str)) + 1.
+ */
 size_t ebox_stream_seek_offset(const struct ebox_stream *str, size_t offset);
 
+/*
+ * An optional index of chunk offsets, written at the end of a stream after
+ * the last chunk. The index is not authenticated: the caller must check that
+ * the chunk it finds at an offset has the seqnr it expected.
+ */
+struct ebox_stream_index *ebox_stream_index_new(void);
+void ebox_stream_index_free(struct ebox_stream_index *idx);
+
+/*
+ * Appends the next chunk to the index, given its length as written by
+ * sshbuf_put_ebox_stream_chunk() and its plaintext length.
+ */
+void ebox_stream_index_add(struct ebox_stream_index *idx, size_t framelen,
+    size_t plainlen);
+
+size_t ebox_stream_index_plain_size(const struct ebox_stream_index *idx);
+
+/*
+ * Finds the chunk containing plaintext byte "offset". Sets *encoff to its
+ * offset relative to the end of the stream header, *plainoff to the plaintext
+ * offset of its first byte and *seqnr to its seqnr.
+ *
+ * Errors:
+ *  - RangeError: offset is past the end of the stream
+ */
+MUST_CHECK
+errf_t *ebox_stream_index_lookup(const struct ebox_stream_index *idx,
+    size_t offset, size_t *encoff, size_t *plainoff, size_t *seqnr);
+
+MUST_CHECK
+errf_t *sshbuf_put_ebox_stream_index(struct sshbuf *buf,
+    const struct ebox_stream_index *idx);
+MUST_CHECK
+errf_t *sshbuf_get_ebox_stream_index(struct sshbuf *buf,
+    struct ebox_stream_index **idx);
+
+/*
+ * Given the last "len" bytes of a stream, works out how long its chunk index
+ * trailer is (so that the caller can read that many bytes from the end and
+ * give them to sshbuf_get_ebox_stream_index()).
+ *
+ * Errors:
+ *  - NotFoundError: the stream does not end with a chunk index
+ *  - InvalidDataError: the trailer is corrupt
+ */
+MUST_CHECK
+errf_t *ebox_stream_index_trailer_size(const uint8_t *tail, size_t len,
+    size_t *trailerlen);
+
+/*
+ * Creates a new stream encrypted to the given template, using the default
+ * cipher (the first one in ebox_stream_cipher_list() which is available).
+ */
 MUST_CHECK
 errf_t *ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str);
+
+/*
+ * As ebox_stream_new(), but using a particular cipher.
+ *
+ * Errors:
+ *  - NotSupportedError: cipher is not in ebox_stream_cipher_list() or is not
+ *                       available in this build
+ */
+MUST_CHECK
+errf_t *ebox_stream_new_cipher(const struct ebox_tpl *tpl, const char *cipher,
+    struct ebox_stream **str);
+
+/*
+ * Returns the NULL-terminated list of ciphers which ebox_stream_new_cipher()
+ * accepts, in order of preference. Some may not be available in this build.
+ */
+const char **ebox_stream_cipher_list(void);
 MUST_CHECK
 errf_t *ebox_stream_chunk_new(const struct ebox_stream *str, const void *data,
     size_t size, size_t seqnr, struct ebox_stream_chunk **chunk);
@@ -349,6 +440,82 @@ MUST_CHECK
 errf_t *ebox_stream_encrypt_chunk(struct ebox_stream_chunk *chunk);
 const uint8_t *ebox_stream_chunk_data(const struct ebox_stream_chunk *chunk,
     size_t *size);
+size_t ebox_stream_chunk_seqnr(const struct ebox_stream_chunk *chunk);
+
+/*
+ * In-place chunk API. A "frame" is a chunk exactly as it appears in the
+ * stream (as written by sshbuf_put_ebox_stream_chunk()): a u32 seqnr and u32
+ * length, then the ciphertext and auth tag or MAC. These functions encrypt
+ * and decrypt frames inside a caller-provided buffer, so a chunk can go from
+ * the read buffer to the write buffer without any allocation or copying.
+ */
+#define	EBOX_STREAM_FRAME_HDRLEN	(2 * sizeof (uint32_t))
+
+/*
+ * Holds the cipher and MAC state used to encrypt or decrypt frames, so that
+ * it can be set up once and re-used for every chunk rather than allocated
+ * each time. A context is not thread-safe: give each thread its own. The
+ * frame functions below also accept a NULL context, in which case they set
+ * up and tear down their own for each call.
+ */
+MUST_CHECK
+errf_t *ebox_stream_ctx_new(const struct ebox_stream *str,
+    struct ebox_stream_ctx **ctx);
+void ebox_stream_ctx_free(struct ebox_stream_ctx *ctx);
+
+/*
+ * Buffer size needed to hold the frame for a chunk of "plainlen" bytes of
+ * plaintext (including the header). ebox_stream_frame_size(str,
+ * ebox_stream_chunk_size(str)) is enough for any chunk in the stream, and
+ * plainlen should never be more than that.
+ */
+size_t ebox_stream_frame_size(const struct ebox_stream *str, size_t plainlen);
+
+/*
+ * Parses the EBOX_STREAM_FRAME_HDRLEN-byte header at "hdr", giving the
+ * chunk's seqnr and total frame length (including the header).
+ *
+ * Errors:
+ *  - EndOfStreamError: this is the start of the chunk index trailer, not a
+ *                      chunk
+ *  - InvalidDataError: the length is longer than any chunk in this stream
+ *                      can be
+ */
+MUST_CHECK
+errf_t *ebox_stream_frame_header(const struct ebox_stream *str,
+    const uint8_t *hdr, size_t *seqnr, size_t *framelen);
+
+/*
+ * Encrypts "plainlen" bytes of plaintext found at
+ * frame + EBOX_STREAM_FRAME_HDRLEN in place, and fills in the frame header.
+ * "framesz" is the size of the buffer at "frame", which must be at least
+ * ebox_stream_frame_size(str, plainlen). On return, the first *framelen
+ * bytes of frame are ready to be written out.
+ *
+ * Errors:
+ *  - ArgumentError: seqnr is 0 or too large, plainlen is larger than the
+ *                   stream's chunk size, or framesz is too small
+ */
+MUST_CHECK
+errf_t *ebox_stream_encrypt_frame(const struct ebox_stream *str,
+    struct ebox_stream_ctx *ctx, size_t seqnr, uint8_t *frame, size_t framesz,
+    size_t plainlen, size_t *framelen);
+
+/*
+ * Authenticates and decrypts the complete frame of "framelen" bytes at
+ * "frame" in place. On success, *plain points inside frame at *plainlen bytes
+ * of plaintext. On failure the buffer contents are undefined and must not be
+ * used.
+ *
+ * Errors:
+ *  - InvalidDataError: the frame header is inconsistent
+ *  - MACError, PaddingError, LengthError, LibSSHError: the chunk failed
+ *                                                      validation
+ */
+MUST_CHECK
+errf_t *ebox_stream_decrypt_frame(const struct ebox_stream *str,
+    struct ebox_stream_ctx *ctx, uint8_t *frame, size_t framelen,
+    size_t *seqnr, uint8_t **plain, size_t *plainlen);
 
 void ebox_stream_free(struct ebox_stream *str);
 void ebox_stream_chunk_free(struct ebox_stream_chunk *chunk);
@@ -171,7 +171,7 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	if (pwent == NULL)
 		return (PAM_AUTHINFO_UNAVAIL);
 
-	res = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
+	res = piv_establish_context(&ctx);
 	if (res != SCARD_S_SUCCESS)
 		return (PAM_AUTHINFO_UNAVAIL);
 
@@ -289,7 +289,7 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 		d = NULL;
 	}
 
-	err = piv_enumerate(ctx, &tokens);
+	err = piv_enumerate_lazy(ctx, &tokens);
 	if (err) {
 		errf_free(err);
 		res = PAM_AUTHINFO_UNAVAIL;
@@ -505,7 +505,7 @@ out:
 		pin = NULL;
 	}
 	piv_release(tokens);
-	SCardReleaseContext(ctx);
+	piv_release_context(ctx);
 
 	return (res);
 }
@@ -85,4 +85,61 @@ enum piv_certinfo_flags {
 	PIV_CI_COMPTYPE = 0x03,
 };
 
+/* The PIV applet AID (the last 4 bytes are the version). */
+extern const uint8_t AID_PIV[11];
+
+/* Tags used in the GENERAL AUTHENTICATE command. */
+enum gen_auth_tag {
+	GA_TAG_WITNESS = 0x80,
+	GA_TAG_CHALLENGE = 0x81,
+	GA_TAG_RESPONSE = 0x82,
+	GA_TAG_EXP = 0x85,
+};
+
+/* Tags used in the response to select on the PIV applet. */
+enum piv_sel_tag {
+	PIV_TAG_APT = 0x61,
+	PIV_TAG_AID = 0x4F,
+	PIV_TAG_AUTHORITY = 0x79,
+	PIV_TAG_APP_LABEL = 0x50,
+	PIV_TAG_URI = 0x5F50,
+	PIV_TAG_ALGS = 0xAC,
+};
+
+/*
+ * PC/SC transport used by piv.c, which can record or replay APDU traces
+ * (see the comment at the top of piv-trace.c). These take the same arguments
+ * as the SCard* functions they wrap, minus the ones piv.c never varies.
+ */
+LONG piv_trace_establish(SCARDCONTEXT *ctx);
+LONG piv_trace_release(SCARDCONTEXT ctx);
+LONG piv_trace_list_readers(SCARDCONTEXT ctx, char *readers,
+    DWORD *readerslen);
+LONG piv_trace_get_status_change(SCARDCONTEXT ctx, DWORD timeout,
+    SCARD_READERSTATE *states, DWORD nstates);
+LONG piv_trace_connect(SCARDCONTEXT ctx, const char *rdr, SCARDHANDLE *card,
+    DWORD *proto);
+LONG piv_trace_reconnect(SCARDHANDLE card, DWORD init, DWORD *proto);
+LONG piv_trace_disconnect(SCARDHANDLE card, DWORD disp);
+LONG piv_trace_begin(SCARDHANDLE card);
+LONG piv_trace_end(SCARDHANDLE card, DWORD disp);
+LONG piv_trace_status(SCARDHANDLE card, DWORD *proto, uint8_t *atr,
+    DWORD *atrlen);
+LONG piv_trace_transmit(SCARDHANDLE card, const char *rdr,
+    const SCARD_IO_REQUEST *pci, const uint8_t *cmd, DWORD cmdlen,
+    uint8_t *reply, DWORD *replylen);
+
+/*
+ * Software PIV card (see the comment at the top of piv-soft.c), which
+ * piv-trace.c puts in place of PC/SC when PIVY_SOFT_CARD is set.
+ */
+#define	PIV_SOFT_READER	"Pivy Soft PIV Card"
+
+errf_t *piv_soft_init(const char *path, uint64_t latency);
+void piv_soft_begin(void);
+void piv_soft_reset(void);
+LONG piv_soft_status(uint8_t *atr, DWORD *atrlen);
+LONG piv_soft_transmit(const uint8_t *cmd, DWORD cmdlen, uint8_t *reply,
+    DWORD *replylen);
+
 #endif
@@ -0,0 +1,1680 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2019, Joyent Inc
+ * Author: Alex Wilson <alex.wilson@joyent.com>
+ */
+
+/*
+ * Software PIV card.
+ *
+ * With PIVY_SOFT_CARD=<file> in the environment, piv-trace.c doesn't talk to
+ * PC/SC at all: it presents a single reader (PIV_SOFT_READER) with this card
+ * in it, and hands every APDU to piv_soft_transmit(). The card keeps its
+ * objects, keys, PINs and admin key in <file>, which is created with the
+ * usual YubiKey defaults (PIN 123456, PUK 12345678, default 3DES admin key)
+ * the first time it's used.
+ *
+ * PIVY_SOFT_CARD_LATENCY=<usec> makes every APDU take (at least) that long,
+ * which is handy for seeing what the host side does with a slow card.
+ *
+ * We implement enough of the PIV and YubicoPIV command set for everything in
+ * piv.c except key import:
+ *
+ *  - SELECT, GET DATA, PUT DATA
+ *  - VERIFY, CHANGE REFERENCE DATA, RESET RETRY COUNTER
+ *  - GENERAL AUTHENTICATE: 3DES admin challenge-response, signing (RSA and
+ *    ECDSA) and ECDH
+ *  - GENERATE ASYMMETRIC KEY PAIR (RSA1024, RSA2048, ECCP256, ECCP384)
+ *  - YubicoPIV GET VERSION, GET SERIAL, GET METADATA, ATTEST,
+ *    SET MANAGEMENT KEY, SET PIN RETRIES and RESET
+ *
+ * PIN policies are enforced, touch policies are only stored and reported.
+ * Keys are plain sshkeys in the state file, so this is for tests and
+ * benchmarks only: it offers none of the protection of a real card.
+ *
+ * The state file is re-read at the start of each transaction if another
+ * process has replaced it, but there's no locking between processes beyond
+ * that.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/ecdsa.h>
+#include <openssl/ecdh.h>
+
+#include "libssh/ssherr.h"
+#include "libssh/sshkey.h"
+#include "libssh/sshbuf.h"
+#include "libssh/cipher.h"
+
+#include "utils.h"
+#include "debug.h"
+#include "tlv.h"
+#include "bunyan.h"
+#include "piv.h"
+#include "piv-internal.h"
+
+#define	MINIMUM(a,b) (((a) < (b)) ? (a) : (b))
+
+#define	SOFT_MAGIC		"pivy-soft-card"
+#define	SOFT_VERSION		1
+
+/* What we claim to be in response to YK_INS_GET_VER. */
+#define	SOFT_YKVER_MAJOR	5
+#define	SOFT_YKVER_MINOR	4
+#define	SOFT_YKVER_PATCH	3
+
+/* ISO 7816 "memory failure": we couldn't write out our state file. */
+#define	SOFT_SW_MEMORY_FAILURE	0x6581
+
+/*
+ * T=1, with a compact-TLV card capabilities object saying we accept extended
+ * Lc/Le (see piv_check_ext_apdu()).
+ */
+static const uint8_t soft_atr[] = {
+	0x3B, 0x85, 0x81, 0x01, 0x80, 0x73, 0xC0, 0x21, 0xC0, 0xD7
+};
+
+static const uint8_t soft_default_pin[8] = {
+	'1', '2', '3', '4', '5', '6', 0xFF, 0xFF
+};
+static const uint8_t soft_default_puk[8] = {
+	'1', '2', '3', '4', '5', '6', '7', '8'
+};
+static const uint8_t soft_default_admin[24] = {
+	1, 2, 3, 4, 5, 6, 7, 8,
+	1, 2, 3, 4, 5, 6, 7, 8,
+	1, 2, 3, 4, 5, 6, 7, 8
+};
+
+struct soft_obj {
+	struct soft_obj		*so_next;
+	uint32_t		 so_tag;
+	uint8_t			*so_data;
+	size_t			 so_len;
+};
+
+struct soft_key {
+	struct soft_key		*sk_next;
+	enum piv_slotid		 sk_slot;
+	enum piv_alg		 sk_alg;
+	enum ykpiv_pin_policy	 sk_pinpol;
+	enum ykpiv_touch_policy	 sk_touchpol;
+	uint8_t			 sk_origin;
+	struct sshkey		*sk_key;
+};
+
+struct soft_card {
+	/* Persistent state, kept in the state file. */
+	uint8_t			 sc_pin[8];
+	uint8_t			 sc_puk[8];
+	uint8_t			 sc_pin_tries;
+	uint8_t			 sc_pin_max;
+	uint8_t			 sc_puk_tries;
+	uint8_t			 sc_puk_max;
+	uint8_t			 sc_admin[24];
+	uint32_t		 sc_serial;
+	struct soft_obj		*sc_objs;
+	struct soft_key		*sc_keys;
+
+	/* Identity of the state file we last loaded or wrote. */
+	dev_t			 sc_dev;
+	ino_t			 sc_ino;
+
+	/* Volatile state, lost on card reset. */
+	boolean_t		 sc_pin_ok;
+	boolean_t		 sc_pin_fresh;
+	boolean_t		 sc_admin_ok;
+	boolean_t		 sc_chal_valid;
+	uint8_t			 sc_chal[8];
+	uint8_t			 sc_chain_ins;
+	struct sshbuf		*sc_chain;
+	struct sshbuf		*sc_resp;
+};
+
+static pthread_mutex_t soft_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct soft_card soft;
+static char *soft_path = NULL;
+static uint64_t soft_latency = 0;
+
+static void
+soft_free_state(struct soft_card *sc)
+{
+	struct soft_obj *so, *nso;
+	struct soft_key *sk, *nsk;
+
+	for (so = sc->sc_objs; so != NULL; so = nso) {
+		nso = so->so_next;
+		free(so->so_data);
+		free(so);
+	}
+	sc->sc_objs = NULL;
+	for (sk = sc->sc_keys; sk != NULL; sk = nsk) {
+		nsk = sk->sk_next;
+		sshkey_free(sk->sk_key);
+		free(sk);
+	}
+	sc->sc_keys = NULL;
+}
+
+static struct soft_obj *
+soft_find_obj(struct soft_card *sc, uint32_t tag)
+{
+	struct soft_obj *so;
+
+	for (so = sc->sc_objs; so != NULL; so = so->so_next) {
+		if (so->so_tag == tag)
+			return (so);
+	}
+	return (NULL);
+}
+
+static struct soft_key *
+soft_find_key(struct soft_card *sc, enum piv_slotid slotid)
+{
+	struct soft_key *sk;
+
+	for (sk = sc->sc_keys; sk != NULL; sk = sk->sk_next) {
+		if (sk->sk_slot == slotid)
+			return (sk);
+	}
+	return (NULL);
+}
+
+/*
+ * Replaces (or adds) the key in sk->sk_slot. Takes ownership of sk.
+ */
+static void
+soft_put_key(struct soft_card *sc, struct soft_key *sk)
+{
+	struct soft_key **psk, *osk;
+
+	for (psk = &sc->sc_keys; *psk != NULL; psk = &(*psk)->sk_next) {
+		if ((*psk)->sk_slot == sk->sk_slot) {
+			osk = *psk;
+			sk->sk_next = osk->sk_next;
+			*psk = sk;
+			sshkey_free(osk->sk_key);
+			free(osk);
+			return;
+		}
+	}
+	sk->sk_next = sc->sc_keys;
+	sc->sc_keys = sk;
+}
+
+static boolean_t
+soft_key_slot(uint slotid)
+{
+	switch (slotid) {
+	case PIV_SLOT_9A:
+	case PIV_SLOT_9C:
+	case PIV_SLOT_9D:
+	case PIV_SLOT_9E:
+	case PIV_SLOT_F9:
+		return (B_TRUE);
+	default:
+		return (slotid >= PIV_SLOT_RETIRED_1 &&
+		    slotid <= PIV_SLOT_RETIRED_20);
+	}
+}
+
+static enum ykpiv_pin_policy
+soft_default_pinpol(enum piv_slotid slotid)
+{
+	switch (slotid) {
+	case PIV_SLOT_CARD_AUTH:
+	case PIV_SLOT_YK_ATTESTATION:
+		return (YKPIV_PIN_NEVER);
+	case PIV_SLOT_SIGNATURE:
+		return (YKPIV_PIN_ALWAYS);
+	default:
+		return (YKPIV_PIN_ONCE);
+	}
+}
+
+static int
+soft_generate_key(enum piv_alg alg, struct sshkey **pkey)
+{
+	switch (alg) {
+	case PIV_ALG_RSA1024:
+		return (sshkey_generate(KEY_RSA, 1024, pkey));
+	case PIV_ALG_RSA2048:
+		return (sshkey_generate(KEY_RSA, 2048, pkey));
+	case PIV_ALG_ECCP256:
+		return (sshkey_generate(KEY_ECDSA, 256, pkey));
+	case PIV_ALG_ECCP384:
+		return (sshkey_generate(KEY_ECDSA, 384, pkey));
+	default:
+		return (SSH_ERR_KEY_TYPE_UNKNOWN);
+	}
+}
+
+static void
+soft_defaults(struct soft_card *sc)
+{
+	bcopy(soft_default_pin, sc->sc_pin, sizeof (sc->sc_pin));
+	bcopy(soft_default_puk, sc->sc_puk, sizeof (sc->sc_puk));
+	sc->sc_pin_tries = sc->sc_pin_max = 3;
+	sc->sc_puk_tries = sc->sc_puk_max = 3;
+	bcopy(soft_default_admin, sc->sc_admin, sizeof (sc->sc_admin));
+}
+
+static errf_t *
+soft_load(struct soft_card *sc, const char *path)
+{
+	errf_t *err = NULL;
+	struct sshbuf *b = NULL, *kb = NULL;
+	struct soft_obj *so;
+	struct soft_key *sk;
+	char *magic = NULL;
+	uint8_t buf[4096];
+	const uint8_t *pin, *puk, *admin;
+	size_t n, pinlen, puklen, adminlen;
+	uint8_t ver, slotid, alg, pinpol, touchpol, origin;
+	uint32_t nobjs, nkeys, i;
+	struct stat st;
+	FILE *f = NULL;
+	int rc, saverr;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		saverr = errno;
+		err = errfno("fopen", saverr, "%s", path);
+		if (saverr == ENOENT)
+			err = errf("NotFoundError", err, "No soft card state");
+		goto out;
+	}
+	if (fstat(fileno(f), &st) != 0) {
+		err = errfno("fstat", errno, "%s", path);
+		goto out;
+	}
+	b = sshbuf_new();
+	VERIFY(b != NULL);
+	while ((n = fread(buf, 1, sizeof (buf), f)) > 0) {
+		if ((rc = sshbuf_put(b, buf, n))) {
+			err = ssherrf("sshbuf_put", rc);
+			goto out;
+		}
+	}
+	if (ferror(f)) {
+		err = errfno("fread", errno, "%s", path);
+		goto out;
+	}
+
+	if ((rc = sshbuf_get_cstring(b, &magic, NULL)) ||
+	    (rc = sshbuf_get_u8(b, &ver))) {
+		err = ssherrf("sshbuf_get", rc);
+		goto out;
+	}
+	if (strcmp(magic, SOFT_MAGIC) != 0 || ver != SOFT_VERSION) {
+		err = errf("VersionError", NULL, "Soft card state in %s is "
+		    "not a version %d state file", path, SOFT_VERSION);
+		goto out;
+	}
+
+	soft_free_state(sc);
+
+	if ((rc = sshbuf_get_string_direct(b, &pin, &pinlen)) ||
+	    (rc = sshbuf_get_string_direct(b, &puk, &puklen)) ||
+	    (rc = sshbuf_get_u8(b, &sc->sc_pin_tries)) ||
+	    (rc = sshbuf_get_u8(b, &sc->sc_pin_max)) ||
+	    (rc = sshbuf_get_u8(b, &sc->sc_puk_tries)) ||
+	    (rc = sshbuf_get_u8(b, &sc->sc_puk_max)) ||
+	    (rc = sshbuf_get_string_direct(b, &admin, &adminlen)) ||
+	    (rc = sshbuf_get_u32(b, &sc->sc_serial)) ||
+	    (rc = sshbuf_get_u32(b, &nobjs))) {
+		err = ssherrf("sshbuf_get", rc);
+		goto out;
+	}
+	if (pinlen != sizeof (sc->sc_pin) || puklen != sizeof (sc->sc_puk) ||
+	    adminlen != sizeof (sc->sc_admin)) {
+		err = errf("LengthError", NULL, "Soft card PIN, PUK or admin "
+		    "key has the wrong length");
+		goto out;
+	}
+	bcopy(pin, sc->sc_pin, pinlen);
+	bcopy(puk, sc->sc_puk, puklen);
+	bcopy(admin, sc->sc_admin, adminlen);
+
+	for (i = 0; i < nobjs; ++i) {
+		so = calloc(1, sizeof (struct soft_obj));
+		VERIFY(so != NULL);
+		if ((rc = sshbuf_get_u32(b, &so->so_tag)) ||
+		    (rc = sshbuf_get_string(b, &so->so_data, &so->so_len))) {
+			free(so);
+			err = ssherrf("sshbuf_get", rc);
+			goto out;
+		}
+		so->so_next = sc->sc_objs;
+		sc->sc_objs = so;
+	}
+
+	if ((rc = sshbuf_get_u32(b, &nkeys))) {
+		err = ssherrf("sshbuf_get_u32", rc);
+		goto out;
+	}
+	for (i = 0; i < nkeys; ++i) {
+		if ((rc = sshbuf_get_u8(b, &slotid)) ||
+		    (rc = sshbuf_get_u8(b, &alg)) ||
+		    (rc = sshbuf_get_u8(b, &pinpol)) ||
+		    (rc = sshbuf_get_u8(b, &touchpol)) ||
+		    (rc = sshbuf_get_u8(b, &origin)) ||
+		    (rc = sshbuf_froms(b, &kb))) {
+			err = ssherrf("sshbuf_get", rc);
+			goto out;
+		}
+		sk = calloc(1, sizeof (struct soft_key));
+		VERIFY(sk != NULL);
+		sk->sk_slot = slotid;
+		sk->sk_alg = alg;
+		sk->sk_pinpol = pinpol;
+		sk->sk_touchpol = touchpol;
+		sk->sk_origin = origin;
+		rc = sshkey_private_deserialize(kb, &sk->sk_key);
+		sshbuf_free(kb);
+		kb = NULL;
+		if (rc) {
+			free(sk);
+			err = ssherrf("sshkey_private_deserialize", rc);
+			goto out;
+		}
+		soft_put_key(sc, sk);
+	}
+
+	sc->sc_dev = st.st_dev;
+	sc->sc_ino = st.st_ino;
+
+out:
+	if (f != NULL)
+		fclose(f);
+	sshbuf_free(kb);
+	sshbuf_free(b);
+	free(magic);
+	return (err);
+}
+
+static errf_t *
+soft_save(struct soft_card *sc)
+{
+	errf_t *err = NULL;
+	struct sshbuf *b, *kb;
+	struct soft_obj *so;
+	struct soft_key *sk;
+	char *tpath = NULL;
+	uint32_t n;
+	ssize_t done;
+	size_t off;
+	struct stat st;
+	int fd = -1;
+
+	b = sshbuf_new();
+	VERIFY(b != NULL);
+	VERIFY0(sshbuf_put_cstring(b, SOFT_MAGIC));
+	VERIFY0(sshbuf_put_u8(b, SOFT_VERSION));
+	VERIFY0(sshbuf_put_string(b, sc->sc_pin, sizeof (sc->sc_pin)));
+	VERIFY0(sshbuf_put_string(b, sc->sc_puk, sizeof (sc->sc_puk)));
+	VERIFY0(sshbuf_put_u8(b, sc->sc_pin_tries));
+	VERIFY0(sshbuf_put_u8(b, sc->sc_pin_max));
+	VERIFY0(sshbuf_put_u8(b, sc->sc_puk_tries));
+	VERIFY0(sshbuf_put_u8(b, sc->sc_puk_max));
+	VERIFY0(sshbuf_put_string(b, sc->sc_admin, sizeof (sc->sc_admin)));
+	VERIFY0(sshbuf_put_u32(b, sc->sc_serial));
+
+	for (n = 0, so = sc->sc_objs; so != NULL; so = so->so_next)
+		++n;
+	VERIFY0(sshbuf_put_u32(b, n));
+	for (so = sc->sc_objs; so != NULL; so = so->so_next) {
+		VERIFY0(sshbuf_put_u32(b, so->so_tag));
+		VERIFY0(sshbuf_put_string(b, so->so_data, so->so_len));
+	}
+
+	for (n = 0, sk = sc->sc_keys; sk != NULL; sk = sk->sk_next)
+		++n;
+	VERIFY0(sshbuf_put_u32(b, n));
+	kb = sshbuf_new();
+	VERIFY(kb != NULL);
+	for (sk = sc->sc_keys; sk != NULL; sk = sk->sk_next) {
+		VERIFY0(sshbuf_put_u8(b, sk->sk_slot));
+		VERIFY0(sshbuf_put_u8(b, sk->sk_alg));
+		VERIFY0(sshbuf_put_u8(b, sk->sk_pinpol));
+		VERIFY0(sshbuf_put_u8(b, sk->sk_touchpol));
+		VERIFY0(sshbuf_put_u8(b, sk->sk_origin));
+		sshbuf_reset(kb);
+		VERIFY0(sshkey_private_serialize(sk->sk_key, kb));
+		VERIFY0(sshbuf_put_stringb(b, kb));
+	}
+	sshbuf_free(kb);
+
+	tpath = calloc(1, PATH_MAX);
+	VERIFY(tpath != NULL);
+	snprintf(tpath, PATH_MAX, "%s.%d", soft_path, (int)getpid());
+
+	fd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		err = errfno("open", errno, "%s", tpath);
+		goto out;
+	}
+	for (off = 0; off < sshbuf_len(b); off += done) {
+		done = write(fd, sshbuf_ptr(b) + off, sshbuf_len(b) - off);
+		if (done < 0 && errno == EINTR) {
+			done = 0;
+			continue;
+		}
+		if (done < 0) {
+			err = errfno("write", errno, "%s", tpath);
+			goto out;
+		}
+	}
+	if (fstat(fd, &st) != 0) {
+		err = errfno("fstat", errno, "%s", tpath);
+		goto out;
+	}
+	if (close(fd) != 0) {
+		fd = -1;
+		err = errfno("close", errno, "%s", tpath);
+		goto out;
+	}
+	fd = -1;
+	if (rename(tpath, soft_path) != 0) {
+		err = errfno("rename", errno, "%s", soft_path);
+		goto out;
+	}
+	sc->sc_dev = st.st_dev;
+	sc->sc_ino = st.st_ino;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	if (err != NULL && tpath != NULL)
+		(void) unlink(tpath);
+	sshbuf_free(b);
+	free(tpath);
+	return (err);
+}
+
+/*
+ * Saves state after a command which changed it. Returns the SW the command
+ * should reply with.
+ */
+static uint16_t
+soft_commit(struct soft_card *sc, uint16_t sw)
+{
+	errf_t *err;
+
+	if ((err = soft_save(sc)) != ERRF_OK) {
+		bunyan_log(BNY_ERROR, "failed to save soft card state",
+		    "path", BNY_STRING, soft_path,
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		return (SOFT_SW_MEMORY_FAILURE);
+	}
+	return (sw);
+}
+
+static void
+soft_reset_volatile(struct soft_card *sc)
+{
+	sc->sc_pin_ok = B_FALSE;
+	sc->sc_pin_fresh = B_FALSE;
+	sc->sc_admin_ok = B_FALSE;
+	sc->sc_chal_valid = B_FALSE;
+	explicit_bzero(sc->sc_chal, sizeof (sc->sc_chal));
+}
+
+errf_t *
+piv_soft_init(const char *path, uint64_t latency)
+{
+	struct soft_card *sc = &soft;
+	struct soft_key *sk;
+	errf_t *err;
+	int rc;
+
+	VERIFY0(pthread_mutex_lock(&soft_lock));
+	VERIFY(soft_path == NULL);
+	soft_path = strdup(path);
+	VERIFY(soft_path != NULL);
+	soft_latency = latency;
+
+	sc->sc_chain = sshbuf_new();
+	sc->sc_resp = sshbuf_new();
+	VERIFY(sc->sc_chain != NULL && sc->sc_resp != NULL);
+
+	err = soft_load(sc, path);
+	if (err && errf_caused_by(err, "NotFoundError")) {
+		errf_free(err);
+		soft_defaults(sc);
+		arc4random_buf(&sc->sc_serial, sizeof (sc->sc_serial));
+		sc->sc_serial &= 0x7FFFFFFF;
+
+		/* Like a YubiKey, we come with an attestation key. */
+		sk = calloc(1, sizeof (struct soft_key));
+		VERIFY(sk != NULL);
+		sk->sk_slot = PIV_SLOT_YK_ATTESTATION;
+		sk->sk_alg = PIV_ALG_ECCP256;
+		sk->sk_pinpol = YKPIV_PIN_NEVER;
+		sk->sk_touchpol = YKPIV_TOUCH_NEVER;
+		sk->sk_origin = 0x01;
+		rc = soft_generate_key(sk->sk_alg, &sk->sk_key);
+		if (rc) {
+			free(sk);
+			err = ssherrf("sshkey_generate", rc);
+			goto out;
+		}
+		soft_put_key(sc, sk);
+
+		err = soft_save(sc);
+		if (err == ERRF_OK) {
+			bunyan_log(BNY_INFO, "created new soft card state",
+			    "path", BNY_STRING, path,
+			    "serial", BNY_UINT, (uint)sc->sc_serial, NULL);
+		}
+	}
+
+out:
+	VERIFY0(pthread_mutex_unlock(&soft_lock));
+	return (err);
+}
+
+/*
+ * Called at the start of every transaction: if someone else has replaced our
+ * state file since we last looked at it, pick up their changes.
+ */
+void
+piv_soft_begin(void)
+{
+	struct soft_card *sc = &soft;
+	struct stat st;
+	errf_t *err;
+
+	VERIFY0(pthread_mutex_lock(&soft_lock));
+	if (stat(soft_path, &st) == 0 &&
+	    (st.st_dev != sc->sc_dev || st.st_ino != sc->sc_ino)) {
+		if ((err = soft_load(sc, soft_path)) != ERRF_OK) {
+			bunyan_log(BNY_WARN, "failed to reload soft card "
+			    "state", "path", BNY_STRING, soft_path,
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+		}
+	}
+	VERIFY0(pthread_mutex_unlock(&soft_lock));
+}
+
+void
+piv_soft_reset(void)
+{
+	VERIFY0(pthread_mutex_lock(&soft_lock));
+	soft_reset_volatile(&soft);
+	sshbuf_reset(soft.sc_chain);
+	sshbuf_reset(soft.sc_resp);
+	VERIFY0(pthread_mutex_unlock(&soft_lock));
+}
+
+LONG
+piv_soft_status(uint8_t *atr, DWORD *atrlen)
+{
+	if (*atrlen < sizeof (soft_atr))
+		return (SCARD_E_INSUFFICIENT_BUFFER);
+	bcopy(soft_atr, atr, sizeof (soft_atr));
+	*atrlen = sizeof (soft_atr);
+	return (SCARD_S_SUCCESS);
+}
+
+static void
+soft_write_pubkey(struct tlv_state *tlv, const struct sshkey *k)
+{
+	const EC_GROUP *g;
+	const EC_POINT *pt;
+	const BIGNUM *bns[2];
+	uint8_t buf[512];
+	size_t len;
+	uint i;
+
+	if (k->type == KEY_RSA) {
+		bns[0] = k->rsa->n;
+		bns[1] = k->rsa->e;
+		for (i = 0; i < 2; ++i) {
+			len = BN_num_bytes(bns[i]);
+			VERIFY3U(len, <=, sizeof (buf));
+			VERIFY3U(BN_bn2bin(bns[i], buf), ==, len);
+			tlv_pushl(tlv, 0x81 + i, len);
+			tlv_write(tlv, buf, len);
+			tlv_pop(tlv);
+		}
+		return;
+	}
+
+	VERIFY3S(k->type, ==, KEY_ECDSA);
+	g = EC_KEY_get0_group(k->ecdsa);
+	pt = EC_KEY_get0_public_key(k->ecdsa);
+	len = EC_POINT_point2oct(g, pt, POINT_CONVERSION_UNCOMPRESSED, buf,
+	    sizeof (buf), NULL);
+	VERIFY(len > 0);
+	tlv_pushl(tlv, 0x86, len);
+	tlv_write(tlv, buf, len);
+	tlv_pop(tlv);
+}
+
+static void
+soft_put_tlv(struct sshbuf *out, struct tlv_state *tlv)
+{
+	VERIFY0(sshbuf_put(out, tlv_buf(tlv), tlv_len(tlv)));
+	tlv_free(tlv);
+}
+
+static uint16_t
+soft_select(struct soft_card *sc, uint8_t p1, const uint8_t *data,
+    size_t len, struct sshbuf *out)
+{
+	struct tlv_state *tlv;
+	static const char label[] = "Pivy soft PIV card";
+	static const uint8_t algs[] = {
+		PIV_ALG_RSA1024, PIV_ALG_RSA2048, PIV_ALG_ECCP256,
+		PIV_ALG_ECCP384
+	};
+	uint i;
+
+	if (p1 != 0x04)
+		return (SW_INCORRECT_P1P2);
+	/* Partial AID match is fine (the PIX has a version in it). */
+	if (len < 5 || len > sizeof (AID_PIV) || bcmp(data, AID_PIV, len) != 0)
+		return (SW_FILE_NOT_FOUND);
+
+	tlv = tlv_init_write();
+	tlv_push(tlv, PIV_TAG_APT);
+	tlv_push(tlv, PIV_TAG_AID);
+	tlv_write(tlv, &AID_PIV[5], sizeof (AID_PIV) - 5);
+	tlv_pop(tlv);
+	tlv_push(tlv, PIV_TAG_AUTHORITY);
+	tlv_push(tlv, PIV_TAG_AID);
+	tlv_write(tlv, AID_PIV, 5);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	tlv_push(tlv, PIV_TAG_APP_LABEL);
+	tlv_write(tlv, (const uint8_t *)label, strlen(label));
+	tlv_pop(tlv);
+	tlv_push(tlv, PIV_TAG_ALGS);
+	for (i = 0; i < sizeof (algs); ++i) {
+		tlv_push(tlv, 0x80);
+		tlv_write_byte(tlv, algs[i]);
+		tlv_pop(tlv);
+	}
+	tlv_push(tlv, 0x06);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	soft_put_tlv(out, tlv);
+
+	return (SW_NO_ERROR);
+}
+
+/*
+ * Reads the 0x5C tag list at the start of GET DATA and PUT DATA commands.
+ * Leaves the tlv positioned after it.
+ */
+static boolean_t
+soft_read_objtag(struct tlv_state *tlv, uint32_t *objtag)
+{
+	errf_t *err;
+	uint tag;
+
+	if ((err = tlv_read_tag(tlv, &tag)))
+		goto bad;
+	if (tag != 0x5C || tlv_rem(tlv) < 1 || tlv_rem(tlv) > 3) {
+		tlv_abort(tlv);
+		return (B_FALSE);
+	}
+	if ((err = tlv_read_u8to32(tlv, objtag)) || (err = tlv_end(tlv)))
+		goto bad;
+	return (B_TRUE);
+
+bad:
+	errf_free(err);
+	tlv_abort(tlv);
+	return (B_FALSE);
+}
+
+static uint16_t
+soft_get_data(struct soft_card *sc, uint8_t p1, uint8_t p2,
+    const uint8_t *data, size_t len, struct sshbuf *out)
+{
+	struct tlv_state *tlv;
+	struct soft_obj *so;
+	uint32_t objtag;
+	boolean_t ok;
+
+	if (p1 != 0x3F || p2 != 0xFF)
+		return (SW_INCORRECT_P1P2);
+
+	tlv = tlv_init(data, 0, len);
+	ok = soft_read_objtag(tlv, &objtag);
+	tlv_free(tlv);
+	if (!ok)
+		return (SW_WRONG_DATA);
+
+	if ((so = soft_find_obj(sc, objtag)) == NULL)
+		return (SW_FILE_NOT_FOUND);
+
+	tlv = tlv_init_write();
+	tlv_pushl(tlv, 0x53, so->so_len);
+	tlv_write(tlv, so->so_data, so->so_len);
+	tlv_pop(tlv);
+	soft_put_tlv(out, tlv);
+
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+soft_put_data(struct soft_card *sc, uint8_t p1, uint8_t p2,
+    const uint8_t *data, size_t len)
+{
+	struct tlv_state *tlv;
+	struct soft_obj *so, **pso;
+	uint32_t objtag;
+	uint tag;
+	errf_t *err;
+
+	if (p1 != 0x3F || p2 != 0xFF)
+		return (SW_INCORRECT_P1P2);
+	if (!sc->sc_admin_ok)
+		return (SW_SECURITY_STATUS_NOT_SATISFIED);
+
+	tlv = tlv_init(data, 0, len);
+	if (!soft_read_objtag(tlv, &objtag)) {
+		tlv_free(tlv);
+		return (SW_WRONG_DATA);
+	}
+	if ((err = tlv_read_tag(tlv, &tag)) || tag != 0x53) {
+		errf_free(err);
+		tlv_abort(tlv);
+		tlv_free(tlv);
+		return (SW_WRONG_DATA);
+	}
+
+	if ((so = soft_find_obj(sc, objtag)) == NULL) {
+		so = calloc(1, sizeof (struct soft_obj));
+		VERIFY(so != NULL);
+		so->so_tag = objtag;
+		so->so_next = sc->sc_objs;
+		sc->sc_objs = so;
+	}
+	free(so->so_data);
+	so->so_len = tlv_rem(tlv);
+	so->so_data = malloc(so->so_len + 1);
+	VERIFY(so->so_data != NULL);
+	bcopy(tlv_ptr(tlv), so->so_data, so->so_len);
+	tlv_skip(tlv);
+	tlv_free(tlv);
+
+	/* Writing an empty object deletes it. */
+	if (so->so_len == 0) {
+		for (pso = &sc->sc_objs; *pso != so; pso = &(*pso)->so_next)
+			;
+		*pso = so->so_next;
+		free(so->so_data);
+		free(so);
+	}
+
+	return (soft_commit(sc, SW_NO_ERROR));
+}
+
+/*
+ * Checks a PIN or PUK guess against its reference value, counting down the
+ * retries on failure.
+ */
+static uint16_t
+soft_check_ref(struct soft_card *sc, const uint8_t *ref, uint8_t *tries,
+    uint8_t max, const uint8_t *guess)
+{
+	if (*tries == 0)
+		return (SW_FILE_INVALID);
+	if (timingsafe_bcmp(ref, guess, 8) != 0) {
+		--(*tries);
+		return (soft_commit(sc, (*tries == 0) ? SW_FILE_INVALID :
+		    (SW_INCORRECT_PIN | *tries)));
+	}
+	if (*tries != max) {
+		*tries = max;
+		return (soft_commit(sc, SW_NO_ERROR));
+	}
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+soft_verify(struct soft_card *sc, uint8_t p1, uint8_t p2,
+    const uint8_t *data, size_t len)
+{
+	uint16_t sw;
+
+	if (p2 != PIV_PIN)
+		return (SW_INCORRECT_P1P2);
+
+	if (len == 0) {
+		if (p1 == 0xFF) {
+			sc->sc_pin_ok = B_FALSE;
+			sc->sc_pin_fresh = B_FALSE;
+			return (SW_NO_ERROR);
+		}
+		if (sc->sc_pin_ok)
+			return (SW_NO_ERROR);
+		if (sc->sc_pin_tries == 0)
+			return (SW_FILE_INVALID);
+		return (SW_INCORRECT_PIN | sc->sc_pin_tries);
+	}
+	if (p1 != 0x00)
+		return (SW_INCORRECT_P1P2);
+	if (len != 8)
+		return (SW_WRONG_DATA);
+
+	sw = soft_check_ref(sc, sc->sc_pin, &sc->sc_pin_tries,
+	    sc->sc_pin_max, data);
+	sc->sc_pin_ok = (sw == SW_NO_ERROR);
+	sc->sc_pin_fresh = sc->sc_pin_ok;
+	return (sw);
+}
+
+static uint16_t
+soft_change_ref(struct soft_card *sc, uint8_t p2, const uint8_t *data,
+    size_t len)
+{
+	uint8_t *ref, *tries, max;
+	uint16_t sw;
+
+	if (p2 == PIV_PIN) {
+		ref = sc->sc_pin;
+		tries = &sc->sc_pin_tries;
+		max = sc->sc_pin_max;
+	} else if (p2 == PIV_PUK) {
+		ref = sc->sc_puk;
+		tries = &sc->sc_puk_tries;
+		max = sc->sc_puk_max;
+	} else {
+		return (SW_INCORRECT_P1P2);
+	}
+	if (len != 16)
+		return (SW_WRONG_DATA);
+
+	sw = soft_check_ref(sc, ref, tries, max, data);
+	if (sw != SW_NO_ERROR)
+		return (sw);
+	bcopy(&data[8], ref, 8);
+	return (soft_commit(sc, SW_NO_ERROR));
+}
+
+static uint16_t
+soft_reset_pin(struct soft_card *sc, uint8_t p2, const uint8_t *data,
+    size_t len)
+{
+	uint16_t sw;
+
+	if (p2 != PIV_PIN)
+		return (SW_INCORRECT_P1P2);
+	if (len != 16)
+		return (SW_WRONG_DATA);
+
+	sw = soft_check_ref(sc, sc->sc_puk, &sc->sc_puk_tries,
+	    sc->sc_puk_max, data);
+	if (sw != SW_NO_ERROR)
+		return (sw);
+	bcopy(&data[8], sc->sc_pin, 8);
+	sc->sc_pin_tries = sc->sc_pin_max;
+	return (soft_commit(sc, SW_NO_ERROR));
+}
+
+static uint16_t
+soft_auth_admin(struct soft_card *sc, uint8_t alg, const uint8_t *chal,
+    size_t challen, const uint8_t *resp, size_t resplen, struct sshbuf *out)
+{
+	const struct sshcipher *cipher;
+	struct sshcipher_ctx *cctx;
+	struct tlv_state *tlv;
+	uint8_t iv[8], expect[8];
+	boolean_t ok;
+
+	if (alg != PIV_ALG_3DES)
+		return (SW_INCORRECT_P1P2);
+
+	if (chal != NULL && challen == 0) {
+		arc4random_buf(sc->sc_chal, sizeof (sc->sc_chal));
+		sc->sc_chal_valid = B_TRUE;
+		sc->sc_admin_ok = B_FALSE;
+
+		tlv = tlv_init_write();
+		tlv_push(tlv, 0x7C);
+		tlv_push(tlv, GA_TAG_CHALLENGE);
+		tlv_write(tlv, sc->sc_chal, sizeof (sc->sc_chal));
+		tlv_pop(tlv);
+		tlv_pop(tlv);
+		soft_put_tlv(out, tlv);
+		return (SW_NO_ERROR);
+	}
+
+	/* We don't do the witness-based mutual auth variant. */
+	if (resp == NULL || !sc->sc_chal_valid)
+		return (SW_WRONG_DATA);
+	sc->sc_chal_valid = B_FALSE;
+	if (resplen != sizeof (expect))
+		return (SW_WRONG_DATA);
+
+	cipher = cipher_by_name("3des-cbc");
+	VERIFY(cipher != NULL);
+	bzero(iv, sizeof (iv));
+	VERIFY0(cipher_init(&cctx, cipher, sc->sc_admin, sizeof (sc->sc_admin),
+	    iv, sizeof (iv), 1));
+	VERIFY0(cipher_crypt(cctx, 0, expect, sc->sc_chal,
+	    sizeof (sc->sc_chal), 0, 0));
+	cipher_free(cctx);
+
+	ok = (timingsafe_bcmp(expect, resp, sizeof (expect)) == 0);
+	explicit_bzero(expect, sizeof (expect));
+	explicit_bzero(sc->sc_chal, sizeof (sc->sc_chal));
+	if (!ok)
+		return (SW_SECURITY_STATUS_NOT_SATISFIED);
+
+	sc->sc_admin_ok = B_TRUE;
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+soft_check_pinpol(struct soft_card *sc, const struct soft_key *sk)
+{
+	switch (sk->sk_pinpol) {
+	case YKPIV_PIN_NEVER:
+		return (SW_NO_ERROR);
+	case YKPIV_PIN_ALWAYS:
+		if (!sc->sc_pin_ok || !sc->sc_pin_fresh)
+			return (SW_SECURITY_STATUS_NOT_SATISFIED);
+		sc->sc_pin_fresh = B_FALSE;
+		return (SW_NO_ERROR);
+	default:
+		if (!sc->sc_pin_ok)
+			return (SW_SECURITY_STATUS_NOT_SATISFIED);
+		return (SW_NO_ERROR);
+	}
+}
+
+static uint16_t
+soft_sign(struct soft_key *sk, const uint8_t *data, size_t len,
+    struct sshbuf *out)
+{
+	struct tlv_state *tlv;
+	ECDSA_SIG *esig;
+	uint8_t *sig = NULL;
+	int siglen;
+
+	if (sk->sk_key->type == KEY_RSA) {
+		if (len != (size_t)RSA_size(sk->sk_key->rsa))
+			return (SW_WRONG_DATA);
+		sig = malloc(len);
+		VERIFY(sig != NULL);
+		siglen = RSA_private_encrypt(len, data, sig, sk->sk_key->rsa,
+		    RSA_NO_PADDING);
+		if (siglen < 0) {
+			free(sig);
+			return (SW_WRONG_DATA);
+		}
+	} else {
+		esig = ECDSA_do_sign(data, len, sk->sk_key->ecdsa);
+		VERIFY(esig != NULL);
+		siglen = i2d_ECDSA_SIG(esig, &sig);
+		ECDSA_SIG_free(esig);
+		VERIFY(siglen > 0);
+	}
+
+	tlv = tlv_init_write();
+	tlv_pushl(tlv, 0x7C, siglen + 4);
+	tlv_pushl(tlv, GA_TAG_RESPONSE, siglen);
+	tlv_write(tlv, sig, siglen);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	soft_put_tlv(out, tlv);
+
+	if (sk->sk_key->type == KEY_RSA)
+		free(sig);
+	else
+		OPENSSL_free(sig);
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+soft_ecdh(struct soft_key *sk, const uint8_t *data, size_t len,
+    struct sshbuf *out)
+{
+	struct tlv_state *tlv;
+	const EC_GROUP *g;
+	EC_POINT *pt;
+	uint8_t secret[66];
+	int seclen;
+
+	if (sk->sk_key->type != KEY_ECDSA)
+		return (SW_WRONG_DATA);
+
+	g = EC_KEY_get0_group(sk->sk_key->ecdsa);
+	pt = EC_POINT_new(g);
+	VERIFY(pt != NULL);
+	if (EC_POINT_oct2point(g, pt, data, len, NULL) != 1 ||
+	    sshkey_ec_validate_public(g, pt) != 0) {
+		EC_POINT_free(pt);
+		return (SW_WRONG_DATA);
+	}
+	seclen = (EC_GROUP_get_degree(g) + 7) / 8;
+	VERIFY3S(seclen, <=, sizeof (secret));
+	seclen = ECDH_compute_key(secret, seclen, pt, sk->sk_key->ecdsa, NULL);
+	EC_POINT_free(pt);
+	if (seclen <= 0)
+		return (SW_WRONG_DATA);
+
+	tlv = tlv_init_write();
+	tlv_push(tlv, 0x7C);
+	tlv_pushl(tlv, GA_TAG_RESPONSE, seclen);
+	tlv_write(tlv, secret, seclen);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	soft_put_tlv(out, tlv);
+	explicit_bzero(secret, sizeof (secret));
+
+	return (SW_NO_ERROR);
+}
+
+/*
+ * GENERAL AUTHENTICATE. We look at which tags are present (and which are
+ * empty) to work out what we're being asked to do, like a real card does.
+ */
+static uint16_t
+soft_gen_auth(struct soft_card *sc, uint8_t alg, uint8_t slotid,
+    const uint8_t *data, size_t len, struct sshbuf *out)
+{
+	struct tlv_state *tlv;
+	struct soft_key *sk;
+	const uint8_t *chal = NULL, *resp = NULL, *exp = NULL;
+	size_t challen = 0, resplen = 0, explen = 0;
+	boolean_t witness = B_FALSE;
+	errf_t *err;
+	uint tag;
+	uint16_t sw;
+
+	tlv = tlv_init(data, 0, len);
+	if ((err = tlv_read_tag(tlv, &tag)))
+		goto invdata;
+	if (tag != 0x7C)
+		goto invtag;
+	while (!tlv_at_end(tlv)) {
+		if ((err = tlv_read_tag(tlv, &tag)))
+			goto invdata;
+		switch (tag) {
+		case GA_TAG_WITNESS:
+			witness = B_TRUE;
+			break;
+		case GA_TAG_CHALLENGE:
+			chal = tlv_ptr(tlv);
+			challen = tlv_rem(tlv);
+			break;
+		case GA_TAG_RESPONSE:
+			resp = tlv_ptr(tlv);
+			resplen = tlv_rem(tlv);
+			break;
+		case GA_TAG_EXP:
+			exp = tlv_ptr(tlv);
+			explen = tlv_rem(tlv);
+			break;
+		default:
+			tlv_skip(tlv);
+			goto invtag;
+		}
+		tlv_skip(tlv);
+	}
+	if ((err = tlv_end(tlv)))
+		goto invdata;
+	tlv_free(tlv);
+
+	if (witness)
+		return (SW_WRONG_DATA);
+
+	if (slotid == PIV_SLOT_ADMIN) {
+		return (soft_auth_admin(sc, alg, chal, challen, resp, resplen,
+		    out));
+	}
+
+	if ((sk = soft_find_key(sc, slotid)) == NULL)
+		return (SW_INCORRECT_P1P2);
+	if (sk->sk_alg != alg)
+		return (SW_INCORRECT_P1P2);
+	/* Everything else wants an empty response tag to fill in. */
+	if (resp == NULL || resplen != 0)
+		return (SW_WRONG_DATA);
+
+	if ((sw = soft_check_pinpol(sc, sk)) != SW_NO_ERROR)
+		return (sw);
+
+	if (exp != NULL)
+		return (soft_ecdh(sk, exp, explen, out));
+	if (chal != NULL)
+		return (soft_sign(sk, chal, challen, out));
+	return (SW_WRONG_DATA);
+
+invdata:
+	errf_free(err);
+invtag:
+	tlv_abort(tlv);
+	tlv_free(tlv);
+	return (SW_WRONG_DATA);
+}
+
+static uint16_t
+soft_gen_asym(struct soft_card *sc, uint8_t p1, uint8_t slotid,
+    const uint8_t *data, size_t len, struct sshbuf *out)
+{
+	struct tlv_state *tlv;
+	struct soft_key *sk;
+	errf_t *err;
+	uint tag;
+	uint8_t alg = 0;
+	uint8_t pinpol = YKPIV_PIN_DEFAULT, touchpol = YKPIV_TOUCH_DEFAULT;
+	int rc;
+
+	if (p1 != 0x00 || !soft_key_slot(slotid) ||
+	    slotid == PIV_SLOT_YK_ATTESTATION) {
+		return (SW_INCORRECT_P1P2);
+	}
+	if (!sc->sc_admin_ok)
+		return (SW_SECURITY_STATUS_NOT_SATISFIED);
+
+	tlv = tlv_init(data, 0, len);
+	if ((err = tlv_read_tag(tlv, &tag)))
+		goto invdata;
+	if (tag != 0xAC)
+		goto invtag;
+	while (!tlv_at_end(tlv)) {
+		if ((err = tlv_read_tag(tlv, &tag)))
+			goto invdata;
+		switch (tag) {
+		case 0x80:
+			err = tlv_read_u8(tlv, &alg);
+			break;
+		case 0xAA:
+			err = tlv_read_u8(tlv, &pinpol);
+			break;
+		case 0xAB:
+			err = tlv_read_u8(tlv, &touchpol);
+			break;
+		default:
+			tlv_skip(tlv);
+			goto invtag;
+		}
+		if (err || (err = tlv_end(tlv)))
+			goto invdata;
+	}
+	if ((err = tlv_end(tlv)))
+		goto invdata;
+	tlv_free(tlv);
+
+	if (pinpol > YKPIV_PIN_ALWAYS || touchpol > YKPIV_TOUCH_CACHED)
+		return (SW_WRONG_DATA);
+
+	sk = calloc(1, sizeof (struct soft_key));
+	VERIFY(sk != NULL);
+	sk->sk_slot = slotid;
+	sk->sk_alg = alg;
+	sk->sk_pinpol = pinpol;
+	if (pinpol == YKPIV_PIN_DEFAULT)
+		sk->sk_pinpol = soft_default_pinpol(slotid);
+	sk->sk_touchpol = touchpol;
+	if (touchpol == YKPIV_TOUCH_DEFAULT)
+		sk->sk_touchpol = YKPIV_TOUCH_NEVER;
+	sk->sk_origin = 0x01;		/* generated on card */
+	if ((rc = soft_generate_key(alg, &sk->sk_key)) != 0) {
+		free(sk);
+		return (SW_WRONG_DATA);
+	}
+	soft_put_key(sc, sk);
+
+	tlv = tlv_init_write();
+	tlv_push64k(tlv, 0x7F49);
+	soft_write_pubkey(tlv, sk->sk_key);
+	tlv_pop(tlv);
+	soft_put_tlv(out, tlv);
+
+	return (soft_commit(sc, SW_NO_ERROR));
+
+invdata:
+	errf_free(err);
+invtag:
+	tlv_abort(tlv);
+	tlv_free(tlv);
+	return (SW_WRONG_DATA);
+}
+
+static uint16_t
+soft_get_metadata(struct soft_card *sc, uint8_t slotid, struct sshbuf *out)
+{
+	struct tlv_state *tlv;
+	struct soft_key *sk = NULL;
+
+	tlv = tlv_init_write();
+	if (slotid == PIV_PIN || slotid == PIV_PUK) {
+		tlv_push(tlv, 0x01);
+		tlv_write_byte(tlv, 0xFF);
+		tlv_pop(tlv);
+		tlv_push(tlv, 0x05);
+		if (slotid == PIV_PIN) {
+			tlv_write_byte(tlv, bcmp(sc->sc_pin, soft_default_pin,
+			    sizeof (sc->sc_pin)) == 0);
+		} else {
+			tlv_write_byte(tlv, bcmp(sc->sc_puk, soft_default_puk,
+			    sizeof (sc->sc_puk)) == 0);
+		}
+		tlv_pop(tlv);
+		tlv_push(tlv, 0x06);
+		if (slotid == PIV_PIN) {
+			tlv_write_byte(tlv, sc->sc_pin_max);
+			tlv_write_byte(tlv, sc->sc_pin_tries);
+		} else {
+			tlv_write_byte(tlv, sc->sc_puk_max);
+			tlv_write_byte(tlv, sc->sc_puk_tries);
+		}
+		tlv_pop(tlv);
+
+	} else if (slotid == PIV_SLOT_ADMIN) {
+		tlv_push(tlv, 0x01);
+		tlv_write_byte(tlv, PIV_ALG_3DES);
+		tlv_pop(tlv);
+		tlv_push(tlv, 0x02);
+		tlv_write_byte(tlv, YKPIV_PIN_NEVER);
+		tlv_write_byte(tlv, YKPIV_TOUCH_NEVER);
+		tlv_pop(tlv);
+		tlv_push(tlv, 0x05);
+		tlv_write_byte(tlv, bcmp(sc->sc_admin, soft_default_admin,
+		    sizeof (sc->sc_admin)) == 0);
+		tlv_pop(tlv);
+
+	} else if (!soft_key_slot(slotid)) {
+		tlv_free(tlv);
+		return (SW_INCORRECT_P1P2);
+
+	} else if ((sk = soft_find_key(sc, slotid)) == NULL) {
+		tlv_free(tlv);
+		return (SW_FILE_NOT_FOUND);
+
+	} else {
+		tlv_push(tlv, 0x01);
+		tlv_write_byte(tlv, sk->sk_alg);
+		tlv_pop(tlv);
+		tlv_push(tlv, 0x02);
+		tlv_write_byte(tlv, sk->sk_pinpol);
+		tlv_write_byte(tlv, sk->sk_touchpol);
+		tlv_pop(tlv);
+		tlv_push(tlv, 0x03);
+		tlv_write_byte(tlv, sk->sk_origin);
+		tlv_pop(tlv);
+		tlv_push64k(tlv, 0x04);
+		soft_write_pubkey(tlv, sk->sk_key);
+		tlv_pop(tlv);
+	}
+	soft_put_tlv(out, tlv);
+
+	return (SW_NO_ERROR);
+}
+
+static EVP_PKEY *
+soft_key_to_evp(const struct sshkey *k)
+{
+	EVP_PKEY *pkey;
+
+	pkey = EVP_PKEY_new();
+	VERIFY(pkey != NULL);
+	if (k->type == KEY_RSA)
+		VERIFY(EVP_PKEY_set1_RSA(pkey, k->rsa) == 1);
+	else
+		VERIFY(EVP_PKEY_set1_EC_KEY(pkey, k->ecdsa) == 1);
+	return (pkey);
+}
+
+static void
+soft_add_ext(X509 *cert, const char *oid, const uint8_t *data, size_t len)
+{
+	ASN1_OBJECT *obj;
+	ASN1_OCTET_STRING *octstr;
+	X509_EXTENSION *ext;
+
+	obj = OBJ_txt2obj(oid, 1);
+	VERIFY(obj != NULL);
+	octstr = ASN1_OCTET_STRING_new();
+	VERIFY(octstr != NULL);
+	VERIFY(ASN1_OCTET_STRING_set(octstr, data, len) == 1);
+	ext = X509_EXTENSION_create_by_OBJ(NULL, obj, 0, octstr);
+	VERIFY(ext != NULL);
+	VERIFY(X509_add_ext(cert, ext, -1) == 1);
+	X509_EXTENSION_free(ext);
+	ASN1_OCTET_STRING_free(octstr);
+	ASN1_OBJECT_free(obj);
+}
+
+/*
+ * YubicoPIV attestation: a certificate for the key in the slot, signed by the
+ * key in slot F9, with the firmware version and the key's policies in Yubico
+ * extensions.
+ */
+static uint16_t
+soft_attest(struct soft_card *sc, uint8_t slotid, struct sshbuf *out)
+{
+	struct soft_key *sk, *ak;
+	X509 *cert;
+	X509_NAME *name;
+	EVP_PKEY *pkey, *akey;
+	uint8_t *der = NULL;
+	uint8_t ver[3], pol[2];
+	char cn[64];
+	int derlen;
+
+	if (!soft_key_slot(slotid) || slotid == PIV_SLOT_YK_ATTESTATION)
+		return (SW_INCORRECT_P1P2);
+	if ((sk = soft_find_key(sc, slotid)) == NULL)
+		return (SW_FILE_NOT_FOUND);
+	if ((ak = soft_find_key(sc, PIV_SLOT_YK_ATTESTATION)) == NULL)
+		return (SW_CONDITIONS_NOT_SATISFIED);
+
+	cert = X509_new();
+	VERIFY(cert != NULL);
+	VERIFY(X509_set_version(cert, 2) == 1);
+	VERIFY(ASN1_INTEGER_set(X509_get_serialNumber(cert),
+	    arc4random() & 0x7FFFFFFF) == 1);
+	VERIFY(X509_gmtime_adj(X509_get_notBefore(cert), 0) != NULL);
+	VERIFY(X509_gmtime_adj(X509_get_notAfter(cert),
+	    20L * 365 * 24 * 3600) != NULL);
+
+	name = X509_NAME_new();
+	VERIFY(name != NULL);
+	VERIFY(X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (const uint8_t *)"Pivy soft card attestation", -1, -1, 0) == 1);
+	VERIFY(X509_set_issuer_name(cert, name) == 1);
+	X509_NAME_free(name);
+
+	snprintf(cn, sizeof (cn), "YubiKey PIV Attestation %02x", slotid);
+	name = X509_NAME_new();
+	VERIFY(name != NULL);
+	VERIFY(X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (const uint8_t *)cn, -1, -1, 0) == 1);
+	VERIFY(X509_set_subject_name(cert, name) == 1);
+	X509_NAME_free(name);
+
+	pkey = soft_key_to_evp(sk->sk_key);
+	VERIFY(X509_set_pubkey(cert, pkey) == 1);
+	EVP_PKEY_free(pkey);
+
+	ver[0] = SOFT_YKVER_MAJOR;
+	ver[1] = SOFT_YKVER_MINOR;
+	ver[2] = SOFT_YKVER_PATCH;
+	soft_add_ext(cert, "1.3.6.1.4.1.41482.3.3", ver, sizeof (ver));
+	pol[0] = sk->sk_pinpol;
+	pol[1] = sk->sk_touchpol;
+	soft_add_ext(cert, "1.3.6.1.4.1.41482.3.8", pol, sizeof (pol));
+
+	akey = soft_key_to_evp(ak->sk_key);
+	VERIFY(X509_sign(cert, akey, EVP_sha256()) > 0);
+	EVP_PKEY_free(akey);
+
+	derlen = i2d_X509(cert, &der);
+	X509_free(cert);
+	VERIFY(derlen > 0);
+	VERIFY0(sshbuf_put(out, der, derlen));
+	OPENSSL_free(der);
+
+	return (SW_NO_ERROR);
+}
+
+static uint16_t
+soft_set_mgmt(struct soft_card *sc, uint8_t p1, uint8_t p2,
+    const uint8_t *data, size_t len)
+{
+	if (p1 != 0xFF || (p2 != 0xFF && p2 != 0xFE))
+		return (SW_INCORRECT_P1P2);
+	if (!sc->sc_admin_ok)
+		return (SW_SECURITY_STATUS_NOT_SATISFIED);
+	if (len != 3 + sizeof (sc->sc_admin) || data[0] != PIV_ALG_3DES ||
+	    data[1] != PIV_SLOT_ADMIN || data[2] != sizeof (sc->sc_admin)) {
+		return (SW_WRONG_DATA);
+	}
+	bcopy(&data[3], sc->sc_admin, sizeof (sc->sc_admin));
+	return (soft_commit(sc, SW_NO_ERROR));
+}
+
+static uint16_t
+soft_set_pin_retries(struct soft_card *sc, uint8_t p1, uint8_t p2)
+{
+	if (p1 == 0 || p2 == 0)
+		return (SW_INCORRECT_P1P2);
+	if (!sc->sc_admin_ok || !sc->sc_pin_ok)
+		return (SW_SECURITY_STATUS_NOT_SATISFIED);
+	bcopy(soft_default_pin, sc->sc_pin, sizeof (sc->sc_pin));
+	bcopy(soft_default_puk, sc->sc_puk, sizeof (sc->sc_puk));
+	sc->sc_pin_tries = sc->sc_pin_max = p1;
+	sc->sc_puk_tries = sc->sc_puk_max = p2;
+	return (soft_commit(sc, SW_NO_ERROR));
+}
+
+/*
+ * YubicoPIV RESET: only allowed once both the PIN and PUK are blocked. Like a
+ * YubiKey, we keep our serial and attestation key.
+ */
+static uint16_t
+soft_ykreset(struct soft_card *sc)
+{
+	struct soft_key *ak, **psk;
+
+	if (sc->sc_pin_tries != 0 || sc->sc_puk_tries != 0)
+		return (SW_CONDITIONS_NOT_SATISFIED);
+
+	for (psk = &sc->sc_keys; *psk != NULL; psk = &(*psk)->sk_next) {
+		if ((*psk)->sk_slot == PIV_SLOT_YK_ATTESTATION)
+			break;
+	}
+	if ((ak = *psk) != NULL) {
+		*psk = ak->sk_next;
+		ak->sk_next = NULL;
+	}
+	soft_free_state(sc);
+	sc->sc_keys = ak;
+
+	soft_defaults(sc);
+	soft_reset_volatile(sc);
+	return (soft_commit(sc, SW_NO_ERROR));
+}
+
+static uint16_t
+soft_command(struct soft_card *sc, uint8_t ins, uint8_t p1, uint8_t p2,
+    const uint8_t *data, size_t len, struct sshbuf *out)
+{
+	switch (ins) {
+	case INS_SELECT:
+		return (soft_select(sc, p1, data, len, out));
+	case INS_GET_DATA:
+		return (soft_get_data(sc, p1, p2, data, len, out));
+	case INS_PUT_DATA:
+		return (soft_put_data(sc, p1, p2, data, len));
+	case INS_VERIFY:
+		return (soft_verify(sc, p1, p2, data, len));
+	case INS_CHANGE_PIN:
+		return (soft_change_ref(sc, p2, data, len));
+	case INS_RESET_PIN:
+		return (soft_reset_pin(sc, p2, data, len));
+	case INS_GEN_AUTH:
+		return (soft_gen_auth(sc, p1, p2, data, len, out));
+	case INS_GEN_ASYM:
+		return (soft_gen_asym(sc, p1, p2, data, len, out));
+	case INS_GET_VER:
+		VERIFY0(sshbuf_put_u8(out, SOFT_YKVER_MAJOR));
+		VERIFY0(sshbuf_put_u8(out, SOFT_YKVER_MINOR));
+		VERIFY0(sshbuf_put_u8(out, SOFT_YKVER_PATCH));
+		return (SW_NO_ERROR);
+	case INS_GET_SERIAL:
+		VERIFY0(sshbuf_put_u32(out, sc->sc_serial));
+		return (SW_NO_ERROR);
+	case INS_GET_METADATA:
+		return (soft_get_metadata(sc, p2, out));
+	case INS_ATTEST:
+		return (soft_attest(sc, p1, out));
+	case INS_SET_MGMT:
+		return (soft_set_mgmt(sc, p1, p2, data, len));
+	case INS_SET_PIN_RETRIES:
+		return (soft_set_pin_retries(sc, p1, p2));
+	case INS_RESET:
+		return (soft_ykreset(sc));
+	default:
+		return (SW_INS_NOT_SUP);
+	}
+}
+
+/*
+ * Moves up to "le" bytes of pending response data into the reply, and works
+ * out the status word to go with it (61xx if there's more left).
+ */
+static uint16_t
+soft_take_resp(struct soft_card *sc, size_t le, struct sshbuf *out)
+{
+	size_t n, rem;
+
+	n = MINIMUM(sshbuf_len(sc->sc_resp), le);
+	VERIFY0(sshbuf_put(out, sshbuf_ptr(sc->sc_resp), n));
+	VERIFY0(sshbuf_consume(sc->sc_resp, n));
+	rem = sshbuf_len(sc->sc_resp);
+	if (rem == 0)
+		return (SW_NO_ERROR);
+	return (SW_BYTES_REMAINING_00 | (rem > 0xFF ? 0x00 : rem));
+}
+
+LONG
+piv_soft_transmit(const uint8_t *cmd, DWORD cmdlen, uint8_t *reply,
+    DWORD *replylen)
+{
+	struct soft_card *sc = &soft;
+	struct sshbuf *out;
+	const uint8_t *data = NULL;
+	uint8_t cla, ins, p1, p2;
+	size_t lc = 0, le = 65536, rest;
+	uint16_t sw;
+	LONG rv = SCARD_S_SUCCESS;
+
+	if (soft_latency > 0) {
+		struct timespec ts;
+		ts.tv_sec = soft_latency / 1000000;
+		ts.tv_nsec = (soft_latency % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+
+	out = sshbuf_new();
+	VERIFY(out != NULL);
+	VERIFY0(pthread_mutex_lock(&soft_lock));
+
+	if (cmdlen < 4) {
+		sw = SW_WRONG_LENGTH;
+		goto reply;
+	}
+	cla = cmd[0];
+	ins = cmd[1];
+	p1 = cmd[2];
+	p2 = cmd[3];
+
+	/* Work out which of the ISO 7816-4 cases (short or extended) this is */
+	if (cmdlen == 5) {
+		le = (cmd[4] == 0) ? 256 : cmd[4];
+	} else if (cmdlen == 7 && cmd[4] == 0) {
+		le = (cmd[5] << 8) | cmd[6];
+		if (le == 0)
+			le = 65536;
+	} else if (cmdlen > 7 && cmd[4] == 0) {
+		lc = (cmd[5] << 8) | cmd[6];
+		data = &cmd[7];
+		if (lc == 0 || 7 + lc > cmdlen) {
+			sw = SW_WRONG_LENGTH;
+			goto reply;
+		}
+		rest = cmdlen - 7 - lc;
+		if (rest == 2) {
+			le = (cmd[7 + lc] << 8) | cmd[8 + lc];
+			if (le == 0)
+				le = 65536;
+		} else if (rest != 0) {
+			sw = SW_WRONG_LENGTH;
+			goto reply;
+		}
+	} else if (cmdlen > 5) {
+		lc = cmd[4];
+		data = &cmd[5];
+		if (5 + lc > cmdlen) {
+			sw = SW_WRONG_LENGTH;
+			goto reply;
+		}
+		rest = cmdlen - 5 - lc;
+		if (rest == 1) {
+			le = (cmd[5 + lc] == 0) ? 256 : cmd[5 + lc];
+		} else if (rest != 0) {
+			sw = SW_WRONG_LENGTH;
+			goto reply;
+		}
+	}
+
+	if (ins == INS_CONTINUE) {
+		sw = soft_take_resp(sc, le, out);
+		goto reply;
+	}
+	sshbuf_reset(sc->sc_resp);
+
+	/*
+	 * Command chaining: stash the data until the last command in the
+	 * chain (which doesn't have CLA_CHAIN set) arrives.
+	 */
+	if (sshbuf_len(sc->sc_chain) > 0 && sc->sc_chain_ins != ins)
+		sshbuf_reset(sc->sc_chain);
+	if (cla & CLA_CHAIN) {
+		sc->sc_chain_ins = ins;
+		if (lc > 0)
+			VERIFY0(sshbuf_put(sc->sc_chain, data, lc));
+		sw = SW_NO_ERROR;
+		goto reply;
+	}
+	if (sshbuf_len(sc->sc_chain) > 0) {
+		if (lc > 0)
+			VERIFY0(sshbuf_put(sc->sc_chain, data, lc));
+		data = sshbuf_ptr(sc->sc_chain);
+		lc = sshbuf_len(sc->sc_chain);
+	}
+
+	sw = soft_command(sc, ins, p1, p2, data, lc, sc->sc_resp);
+	sshbuf_reset(sc->sc_chain);
+	if (sw == SW_NO_ERROR)
+		sw = soft_take_resp(sc, le, out);
+	else
+		sshbuf_reset(sc->sc_resp);
+
+reply:
+	VERIFY0(pthread_mutex_unlock(&soft_lock));
+	if (*replylen < sshbuf_len(out) + 2) {
+		rv = SCARD_E_INSUFFICIENT_BUFFER;
+	} else {
+		bcopy(sshbuf_ptr(out), reply, sshbuf_len(out));
+		reply[sshbuf_len(out)] = sw >> 8;
+		reply[sshbuf_len(out) + 1] = sw & 0xFF;
+		*replylen = sshbuf_len(out) + 2;
+	}
+	sshbuf_free(out);
+	return (rv);
+}
@@ -0,0 +1,741 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2019, Joyent Inc
+ * Author: Alex Wilson <alex.wilson@joyent.com>
+ */
+
+/*
+ * APDU trace transport.
+ *
+ * All of piv.c's PC/SC calls go through the functions in here. Normally they
+ * are just the plain SCard* calls, but:
+ *
+ *  - with PIVY_APDU_RECORD=<file> in the environment, we also write out the
+ *    readers we were told about, the cards we connected to, and every APDU
+ *    exchanged with them (along with how long the card took to answer);
+ *
+ *  - with PIVY_APDU_REPLAY=<file>, we don't talk to PC/SC at all, and serve
+ *    the recorded exchanges back instead. Replies come back immediately
+ *    unless PIVY_APDU_REPLAY_LATENCY=1 is set, in which case we sleep for as
+ *    long as the card took originally.
+ *
+ *  - with PIVY_SOFT_CARD=<file>, we also don't talk to PC/SC, and instead
+ *    present a single reader containing the software card in piv-soft.c.
+ *
+ * This lets us measure and regression-test the host side of things (e.g.
+ * piv_enumerate() or the agent's request paths) without a card attached.
+ *
+ * Exchanges are replayed in order per reader (probes of different readers
+ * may run in parallel, so there's no global order). Only the APDU header
+ * (CLA, INS, P1, P2) has to match what was recorded: command data often
+ * includes random challenges or ephemeral keys which change from run to
+ * run.
+ *
+ * The trace file is text, one record per line, fields separated by tabs:
+ *
+ *   pivy-apdu-trace	1
+ *   R	<reader>
+ *   C	<reader>	<rv>	<proto>	<atr hex>
+ *   X	<reader>	<usec>	<rv>	<command hex>	<reply hex>
+ *
+ * We blank out the data in commands which carry PINs or key material before
+ * writing them, but card replies are written as-is. Don't record traces with
+ * keys you care about.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "utils.h"
+#include "debug.h"
+#include "bunyan.h"
+#include "piv.h"
+#include "piv-internal.h"
+
+#define	MINIMUM(a,b) (((a) < (b)) ? (a) : (b))
+
+#define	TRACE_MAGIC	"pivy-apdu-trace"
+#define	TRACE_VERSION	1
+
+enum trace_mode {
+	TRACE_OFF = 0,
+	TRACE_RECORD,
+	TRACE_REPLAY,
+	TRACE_SOFT
+};
+
+struct trace_xchg {
+	struct trace_xchg	*tx_next;
+	LONG			 tx_rv;
+	uint64_t		 tx_usec;
+	uint8_t			*tx_cmd;
+	size_t			 tx_cmdlen;
+	uint8_t			*tx_reply;
+	size_t			 tx_replylen;
+};
+
+struct trace_reader {
+	struct trace_reader	*tr_next;
+	char			*tr_name;
+	uint			 tr_id;
+	boolean_t		 tr_listed;
+	boolean_t		 tr_connected;
+	LONG			 tr_connrv;
+	DWORD			 tr_proto;
+	uint8_t			*tr_atr;
+	size_t			 tr_atrlen;
+	struct trace_xchg	*tr_xchgs;
+	struct trace_xchg	*tr_lastx;
+	struct trace_xchg	*tr_cursor;
+};
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum trace_mode trace_mode = TRACE_OFF;
+static boolean_t trace_latency = B_FALSE;
+static boolean_t trace_soft_ok = B_FALSE;
+static FILE *trace_file = NULL;
+static struct trace_reader *trace_readers = NULL;
+static struct trace_reader *trace_last_reader = NULL;
+static uint trace_nreaders = 0;
+
+static struct trace_reader *
+trace_find_reader(const char *name, boolean_t create)
+{
+	struct trace_reader *tr;
+
+	for (tr = trace_readers; tr != NULL; tr = tr->tr_next) {
+		if (strcmp(tr->tr_name, name) == 0)
+			return (tr);
+	}
+	if (!create)
+		return (NULL);
+
+	tr = calloc(1, sizeof (struct trace_reader));
+	VERIFY(tr != NULL);
+	tr->tr_name = strdup(name);
+	VERIFY(tr->tr_name != NULL);
+	tr->tr_id = ++trace_nreaders;
+	if (trace_last_reader == NULL)
+		trace_readers = tr;
+	else
+		trace_last_reader->tr_next = tr;
+	trace_last_reader = tr;
+	return (tr);
+}
+
+static struct trace_reader *
+trace_reader_by_id(SCARDHANDLE id)
+{
+	struct trace_reader *tr;
+
+	for (tr = trace_readers; tr != NULL; tr = tr->tr_next) {
+		if (tr->tr_id == id)
+			return (tr);
+	}
+	return (NULL);
+}
+
+static int
+trace_parse_hex(const char *str, uint8_t **pbuf, size_t *plen)
+{
+	size_t len = strlen(str), i;
+	uint8_t *buf;
+	uint v;
+
+	if (len % 2 != 0)
+		return (-1);
+	buf = malloc(len / 2 + 1);
+	VERIFY(buf != NULL);
+	for (i = 0; i < len / 2; ++i) {
+		if (sscanf(&str[i * 2], "%2x", &v) != 1) {
+			free(buf);
+			return (-1);
+		}
+		buf[i] = v;
+	}
+	*pbuf = buf;
+	*plen = len / 2;
+	return (0);
+}
+
+static errf_t *
+trace_load(FILE *f)
+{
+	char *line = NULL, *p, *fields[6];
+	size_t linesz = 0;
+	ssize_t len;
+	uint lineno = 0, nf;
+	struct trace_reader *tr;
+	struct trace_xchg *tx;
+	errf_t *err = ERRF_OK;
+
+	while ((len = getline(&line, &linesz, f)) != -1) {
+		++lineno;
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+
+		p = line;
+		for (nf = 0; nf < 6 && p != NULL; ++nf)
+			fields[nf] = strsep(&p, "\t");
+
+		if (lineno == 1) {
+			if (nf != 2 || strcmp(fields[0], TRACE_MAGIC) != 0 ||
+			    atoi(fields[1]) != TRACE_VERSION) {
+				err = errf("TraceVersionError", NULL,
+				    "Not a version %d APDU trace file",
+				    TRACE_VERSION);
+				goto out;
+			}
+			continue;
+		}
+
+		if (strcmp(fields[0], "R") == 0 && nf == 2) {
+			tr = trace_find_reader(fields[1], B_TRUE);
+			tr->tr_listed = B_TRUE;
+
+		} else if (strcmp(fields[0], "C") == 0 && nf == 5) {
+			tr = trace_find_reader(fields[1], B_TRUE);
+			if (tr->tr_connected)
+				continue;
+			tr->tr_connected = B_TRUE;
+			tr->tr_connrv = strtoul(fields[2], NULL, 16);
+			tr->tr_proto = strtoul(fields[3], NULL, 10);
+			if (trace_parse_hex(fields[4], &tr->tr_atr,
+			    &tr->tr_atrlen) != 0)
+				goto invdata;
+
+		} else if (strcmp(fields[0], "X") == 0 && nf == 6) {
+			tr = trace_find_reader(fields[1], B_TRUE);
+			tx = calloc(1, sizeof (struct trace_xchg));
+			VERIFY(tx != NULL);
+			tx->tx_usec = strtoull(fields[2], NULL, 10);
+			tx->tx_rv = strtoul(fields[3], NULL, 16);
+			if (trace_parse_hex(fields[4], &tx->tx_cmd,
+			    &tx->tx_cmdlen) != 0 ||
+			    trace_parse_hex(fields[5], &tx->tx_reply,
+			    &tx->tx_replylen) != 0) {
+				free(tx->tx_cmd);
+				free(tx);
+				goto invdata;
+			}
+			if (tr->tr_lastx == NULL)
+				tr->tr_xchgs = tx;
+			else
+				tr->tr_lastx->tx_next = tx;
+			tr->tr_lastx = tx;
+			if (tr->tr_cursor == NULL)
+				tr->tr_cursor = tx;
+
+		} else {
+			goto invdata;
+		}
+	}
+
+out:
+	free(line);
+	return (err);
+
+invdata:
+	err = errf("InvalidDataError", NULL, "APDU trace file has invalid "
+	    "record on line %u", lineno);
+	goto out;
+}
+
+static void
+trace_init(void)
+{
+	const char *path, *lat;
+	FILE *f;
+	int fd;
+	errf_t *err;
+
+	if ((path = getenv("PIVY_APDU_REPLAY")) != NULL && *path != '\0') {
+		trace_mode = TRACE_REPLAY;
+		lat = getenv("PIVY_APDU_REPLAY_LATENCY");
+		trace_latency = (lat != NULL && atoi(lat) != 0);
+
+		/*
+		 * Even if we can't load the trace we stay in replay mode, so
+		 * a broken test setup can't end up using real cards.
+		 */
+		if ((f = fopen(path, "r")) == NULL) {
+			err = errfno("fopen", errno, "%s", path);
+		} else {
+			err = trace_load(f);
+			fclose(f);
+		}
+		if (err) {
+			bunyan_log(BNY_ERROR, "failed to load APDU trace",
+			    "path", BNY_STRING, path,
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+		}
+		return;
+	}
+
+	if ((path = getenv("PIVY_SOFT_CARD")) != NULL && *path != '\0') {
+		trace_mode = TRACE_SOFT;
+		lat = getenv("PIVY_SOFT_CARD_LATENCY");
+		err = piv_soft_init(path, (lat == NULL) ? 0 :
+		    strtoull(lat, NULL, 10));
+		if (err) {
+			bunyan_log(BNY_ERROR, "failed to load soft card state",
+			    "path", BNY_STRING, path,
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+			return;
+		}
+		trace_soft_ok = B_TRUE;
+		return;
+	}
+
+	if ((path = getenv("PIVY_APDU_RECORD")) != NULL && *path != '\0') {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || (f = fdopen(fd, "w")) == NULL) {
+			bunyan_log(BNY_ERROR, "failed to open APDU trace "
+			    "file for recording",
+			    "path", BNY_STRING, path,
+			    "error", BNY_STRING, strerror(errno), NULL);
+			if (fd >= 0)
+				close(fd);
+			return;
+		}
+		trace_mode = TRACE_RECORD;
+		trace_file = f;
+		fprintf(f, "%s\t%d\n", TRACE_MAGIC, TRACE_VERSION);
+		fflush(f);
+	}
+}
+
+static enum trace_mode
+trace_get_mode(void)
+{
+	VERIFY0(pthread_once(&trace_once, trace_init));
+	return (trace_mode);
+}
+
+static void
+trace_write_hex(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		fprintf(trace_file, "%02x", buf[i]);
+}
+
+/*
+ * Commands whose data we blank out when recording, since they carry PINs or
+ * keys (VERIFY, CHANGE REFERENCE DATA, RESET RETRY COUNTER, and the YubicoPIV
+ * key import and set management key).
+ */
+static boolean_t
+trace_sensitive_ins(uint8_t ins)
+{
+	switch (ins) {
+	case 0x20:
+	case 0x24:
+	case 0x2C:
+	case 0xFE:
+	case 0xFF:
+		return (B_TRUE);
+	default:
+		return (B_FALSE);
+	}
+}
+
+LONG
+piv_trace_establish(SCARDCONTEXT *ctx)
+{
+	enum trace_mode mode = trace_get_mode();
+
+	if (mode == TRACE_REPLAY || mode == TRACE_SOFT) {
+		*ctx = 1;
+		return (SCARD_S_SUCCESS);
+	}
+	return (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, ctx));
+}
+
+LONG
+piv_trace_release(SCARDCONTEXT ctx)
+{
+	enum trace_mode mode = trace_get_mode();
+
+	if (mode == TRACE_REPLAY || mode == TRACE_SOFT)
+		return (SCARD_S_SUCCESS);
+	return (SCardReleaseContext(ctx));
+}
+
+LONG
+piv_trace_list_readers(SCARDCONTEXT ctx, char *readers, DWORD *readerslen)
+{
+	struct trace_reader *tr;
+	const char *p;
+	size_t len = 1;
+	LONG rv;
+
+	switch (trace_get_mode()) {
+	case TRACE_REPLAY:
+		for (tr = trace_readers; tr != NULL; tr = tr->tr_next) {
+			if (tr->tr_listed)
+				len += strlen(tr->tr_name) + 1;
+		}
+		if (len == 1)
+			return (SCARD_E_NO_READERS_AVAILABLE);
+		if (readers == NULL) {
+			*readerslen = len;
+			return (SCARD_S_SUCCESS);
+		}
+		if (*readerslen < len)
+			return (SCARD_E_INSUFFICIENT_BUFFER);
+		for (tr = trace_readers; tr != NULL; tr = tr->tr_next) {
+			if (!tr->tr_listed)
+				continue;
+			strcpy(readers, tr->tr_name);
+			readers += strlen(tr->tr_name) + 1;
+		}
+		*readers = '\0';
+		*readerslen = len;
+		return (SCARD_S_SUCCESS);
+
+	case TRACE_SOFT:
+		if (!trace_soft_ok)
+			return (SCARD_E_NO_READERS_AVAILABLE);
+		len = strlen(PIV_SOFT_READER) + 2;
+		if (readers == NULL) {
+			*readerslen = len;
+			return (SCARD_S_SUCCESS);
+		}
+		if (*readerslen < len)
+			return (SCARD_E_INSUFFICIENT_BUFFER);
+		strcpy(readers, PIV_SOFT_READER);
+		readers[len - 1] = '\0';
+		*readerslen = len;
+		return (SCARD_S_SUCCESS);
+
+	case TRACE_RECORD:
+		rv = SCardListReaders(ctx, NULL, readers, readerslen);
+		if (rv != SCARD_S_SUCCESS || readers == NULL)
+			return (rv);
+		VERIFY0(pthread_mutex_lock(&trace_lock));
+		for (p = readers; *p != '\0'; p += strlen(p) + 1) {
+			tr = trace_find_reader(p, B_TRUE);
+			if (tr->tr_listed)
+				continue;
+			tr->tr_listed = B_TRUE;
+			fprintf(trace_file, "R\t%s\n", p);
+		}
+		fflush(trace_file);
+		VERIFY0(pthread_mutex_unlock(&trace_lock));
+		return (rv);
+
+	default:
+		return (SCardListReaders(ctx, NULL, readers, readerslen));
+	}
+}
+
+#define	TRACE_PNP_READER	"\\\\?PnP?\\Notification"
+
+/*
+ * In replay and soft modes the set of readers (and cards in them) never
+ * changes, so we report them all as present, and if the caller already knows
+ * that, just wait out the timeout.
+ */
+LONG
+piv_trace_get_status_change(SCARDCONTEXT ctx, DWORD timeout,
+    SCARD_READERSTATE *states, DWORD nstates)
+{
+	enum trace_mode mode = trace_get_mode();
+	struct trace_reader *tr;
+	boolean_t changed = B_FALSE, present;
+	DWORD i, cur, st;
+
+	if (mode != TRACE_REPLAY && mode != TRACE_SOFT)
+		return (SCardGetStatusChange(ctx, timeout, states, nstates));
+
+	for (i = 0; i < nstates; ++i) {
+		cur = states[i].dwCurrentState & ~SCARD_STATE_CHANGED;
+		if (strcmp(states[i].szReader, TRACE_PNP_READER) == 0) {
+			states[i].dwEventState = cur;
+			continue;
+		}
+		present = B_FALSE;
+		if (mode == TRACE_SOFT) {
+			present = trace_soft_ok &&
+			    strcmp(states[i].szReader, PIV_SOFT_READER) == 0;
+		} else {
+			for (tr = trace_readers; tr != NULL; tr = tr->tr_next) {
+				if (tr->tr_listed && strcmp(tr->tr_name,
+				    states[i].szReader) == 0) {
+					present = B_TRUE;
+					break;
+				}
+			}
+		}
+		st = present ? SCARD_STATE_PRESENT :
+		    (SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE);
+		if (st != cur) {
+			st |= SCARD_STATE_CHANGED;
+			changed = B_TRUE;
+		}
+		states[i].dwEventState = st;
+	}
+	if (changed)
+		return (SCARD_S_SUCCESS);
+
+	(void) poll(NULL, 0, (timeout == SCARD_INFINITE) ? -1 : (int)timeout);
+	return (SCARD_E_TIMEOUT);
+}
+
+LONG
+piv_trace_connect(SCARDCONTEXT ctx, const char *rdr, SCARDHANDLE *card,
+    DWORD *proto)
+{
+	struct trace_reader *tr;
+	uint8_t atr[MAX_ATR_SIZE];
+	DWORD atrlen = sizeof (atr), rdrlen = 0, state, sproto;
+	LONG rv;
+
+	if (trace_get_mode() == TRACE_SOFT) {
+		if (!trace_soft_ok || strcmp(rdr, PIV_SOFT_READER) != 0)
+			return (SCARD_E_UNKNOWN_READER);
+		*card = 1;
+		*proto = SCARD_PROTOCOL_T1;
+		return (SCARD_S_SUCCESS);
+	}
+	if (trace_mode == TRACE_REPLAY) {
+		tr = trace_find_reader(rdr, B_FALSE);
+		if (tr == NULL || !tr->tr_connected)
+			return (SCARD_E_UNKNOWN_READER);
+		if (tr->tr_connrv != SCARD_S_SUCCESS)
+			return (tr->tr_connrv);
+		*card = tr->tr_id;
+		*proto = tr->tr_proto;
+		return (SCARD_S_SUCCESS);
+	}
+
+	rv = SCardConnect(ctx, rdr, SCARD_SHARE_SHARED,
+	    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, card, proto);
+	if (trace_mode != TRACE_RECORD)
+		return (rv);
+
+	if (rv != SCARD_S_SUCCESS ||
+	    SCardStatus(*card, NULL, &rdrlen, &state, &sproto, atr,
+	    &atrlen) != SCARD_S_SUCCESS) {
+		atrlen = 0;
+	}
+	VERIFY0(pthread_mutex_lock(&trace_lock));
+	fprintf(trace_file, "C\t%s\t%lx\t%lu\t", rdr, (unsigned long)rv,
+	    (rv == SCARD_S_SUCCESS) ? (unsigned long)*proto : 0ul);
+	trace_write_hex(atr, atrlen);
+	fprintf(trace_file, "\n");
+	fflush(trace_file);
+	VERIFY0(pthread_mutex_unlock(&trace_lock));
+	return (rv);
+}
+
+LONG
+piv_trace_reconnect(SCARDHANDLE card, DWORD init, DWORD *proto)
+{
+	struct trace_reader *tr;
+
+	if (trace_get_mode() == TRACE_SOFT) {
+		if (init == SCARD_RESET_CARD)
+			piv_soft_reset();
+		*proto = SCARD_PROTOCOL_T1;
+		return (SCARD_S_SUCCESS);
+	}
+	if (trace_mode == TRACE_REPLAY) {
+		if ((tr = trace_reader_by_id(card)) == NULL)
+			return (SCARD_E_INVALID_HANDLE);
+		*proto = tr->tr_proto;
+		return (SCARD_S_SUCCESS);
+	}
+	return (SCardReconnect(card, SCARD_SHARE_SHARED,
+	    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, init, proto));
+}
+
+LONG
+piv_trace_disconnect(SCARDHANDLE card, DWORD disp)
+{
+	if (trace_get_mode() == TRACE_SOFT) {
+		if (disp == SCARD_RESET_CARD)
+			piv_soft_reset();
+		return (SCARD_S_SUCCESS);
+	}
+	if (trace_mode == TRACE_REPLAY)
+		return (SCARD_S_SUCCESS);
+	return (SCardDisconnect(card, disp));
+}
+
+LONG
+piv_trace_begin(SCARDHANDLE card)
+{
+	if (trace_get_mode() == TRACE_SOFT) {
+		piv_soft_begin();
+		return (SCARD_S_SUCCESS);
+	}
+	if (trace_mode == TRACE_REPLAY)
+		return (SCARD_S_SUCCESS);
+	return (SCardBeginTransaction(card));
+}
+
+LONG
+piv_trace_end(SCARDHANDLE card, DWORD disp)
+{
+	if (trace_get_mode() == TRACE_SOFT) {
+		if (disp == SCARD_RESET_CARD)
+			piv_soft_reset();
+		return (SCARD_S_SUCCESS);
+	}
+	if (trace_mode == TRACE_REPLAY)
+		return (SCARD_S_SUCCESS);
+	return (SCardEndTransaction(card, disp));
+}
+
+LONG
+piv_trace_status(SCARDHANDLE card, DWORD *proto, uint8_t *atr,
+    DWORD *atrlen)
+{
+	struct trace_reader *tr;
+	DWORD rdrlen = 0, state;
+
+	if (trace_get_mode() == TRACE_SOFT) {
+		*proto = SCARD_PROTOCOL_T1;
+		return (piv_soft_status(atr, atrlen));
+	}
+	if (trace_mode == TRACE_REPLAY) {
+		if ((tr = trace_reader_by_id(card)) == NULL)
+			return (SCARD_E_INVALID_HANDLE);
+		if (*atrlen < tr->tr_atrlen)
+			return (SCARD_E_INSUFFICIENT_BUFFER);
+		bcopy(tr->tr_atr, atr, tr->tr_atrlen);
+		*atrlen = tr->tr_atrlen;
+		*proto = tr->tr_proto;
+		return (SCARD_S_SUCCESS);
+	}
+	return (SCardStatus(card, NULL, &rdrlen, &state, proto, atr, atrlen));
+}
+
+static LONG
+trace_replay_transmit(SCARDHANDLE card, const char *rdr, const uint8_t *cmd,
+    DWORD cmdlen, uint8_t *reply, DWORD *replylen)
+{
+	struct trace_reader *tr;
+	struct trace_xchg *tx;
+	LONG rv;
+	uint64_t usec;
+
+	VERIFY0(pthread_mutex_lock(&trace_lock));
+	if ((tr = trace_reader_by_id(card)) == NULL) {
+		VERIFY0(pthread_mutex_unlock(&trace_lock));
+		return (SCARD_E_INVALID_HANDLE);
+	}
+	if ((tx = tr->tr_cursor) == NULL) {
+		VERIFY0(pthread_mutex_unlock(&trace_lock));
+		bunyan_log(BNY_WARN, "APDU trace has no more exchanges "
+		    "for reader", "reader", BNY_STRING, rdr, NULL);
+		return (SCARD_W_REMOVED_CARD);
+	}
+	if (tx->tx_cmdlen < 4 || cmdlen < 4 ||
+	    bcmp(tx->tx_cmd, cmd, 4) != 0) {
+		VERIFY0(pthread_mutex_unlock(&trace_lock));
+		bunyan_log(BNY_WARN, "APDU does not match trace",
+		    "reader", BNY_STRING, rdr,
+		    "apdu", BNY_BIN_HEX, cmd, (size_t)MINIMUM(cmdlen, 4),
+		    "expected", BNY_BIN_HEX, tx->tx_cmd,
+		    MINIMUM(tx->tx_cmdlen, 4), NULL);
+		return (SCARD_F_COMM_ERROR);
+	}
+	tr->tr_cursor = tx->tx_next;
+	VERIFY0(pthread_mutex_unlock(&trace_lock));
+
+	rv = tx->tx_rv;
+	usec = tx->tx_usec;
+	if (rv == SCARD_S_SUCCESS) {
+		if (*replylen < tx->tx_replylen) {
+			rv = SCARD_E_INSUFFICIENT_BUFFER;
+		} else {
+			bcopy(tx->tx_reply, reply, tx->tx_replylen);
+			*replylen = tx->tx_replylen;
+		}
+	}
+
+	if (trace_latency && usec > 0) {
+		struct timespec ts;
+		ts.tv_sec = usec / 1000000;
+		ts.tv_nsec = (usec % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+
+	return (rv);
+}
+
+LONG
+piv_trace_transmit(SCARDHANDLE card, const char *rdr,
+    const SCARD_IO_REQUEST *pci, const uint8_t *cmd, DWORD cmdlen,
+    uint8_t *reply, DWORD *replylen)
+{
+	struct timespec t0, t1;
+	uint64_t usec;
+	LONG rv;
+	static const uint8_t zero[16];
+	size_t i, n;
+
+	switch (trace_get_mode()) {
+	case TRACE_REPLAY:
+		return (trace_replay_transmit(card, rdr, cmd, cmdlen, reply,
+		    replylen));
+
+	case TRACE_SOFT:
+		return (piv_soft_transmit(cmd, cmdlen, reply, replylen));
+
+	case TRACE_RECORD:
+		VERIFY0(clock_gettime(CLOCK_MONOTONIC, &t0));
+		rv = SCardTransmit(card, pci, cmd, cmdlen, NULL, reply,
+		    replylen);
+		VERIFY0(clock_gettime(CLOCK_MONOTONIC, &t1));
+		usec = (t1.tv_sec - t0.tv_sec) * 1000000ull;
+		usec += t1.tv_nsec / 1000;
+		usec -= t0.tv_nsec / 1000;
+
+		VERIFY0(pthread_mutex_lock(&trace_lock));
+		fprintf(trace_file, "X\t%s\t%llu\t%lx\t", rdr,
+		    (unsigned long long)usec, (unsigned long)rv);
+		if (cmdlen > 4 && trace_sensitive_ins(cmd[1])) {
+			trace_write_hex(cmd, 4);
+			for (i = 4; i < cmdlen; i += n) {
+				n = MINIMUM(cmdlen - i, sizeof (zero));
+				trace_write_hex(zero, n);
+			}
+		} else {
+			trace_write_hex(cmd, cmdlen);
+		}
+		fprintf(trace_file, "\t");
+		if (rv == SCARD_S_SUCCESS)
+			trace_write_hex(reply, *replylen);
+		fprintf(trace_file, "\n");
+		fflush(trace_file);
+		VERIFY0(pthread_mutex_unlock(&trace_lock));
+		return (rv);
+
+	default:
+		return (SCardTransmit(card, pci, cmd, cmdlen, NULL, reply,
+		    replylen));
+	}
+}
@@ -25,6 +25,7 @@
 #include <stddef.h>
 #include <errno.h>
 #include <strings.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -37,6 +38,9 @@
 #include <sys/mman.h>
 #include <sys/errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
@@ -133,30 +137,19 @@ struct apdu {
 	uint8_t a_p1;
 	uint8_t a_p2;
 	uint8_t a_le;
+	/*
+	 * Send this one as an extended-length APDU (Lc and Le are 2 bytes,
+	 * and Le is sized to fit the reply buffer instead of a_le).
+	 */
+	boolean_t a_ext;
+	/* Token whose arena a_reply is borrowed from, if any */
+	struct piv_token *a_pool;
 
 	struct apdubuf a_cmd;
 	uint16_t a_sw;
 	struct apdubuf a_reply;
 };
 
-/* Tags used in the GENERAL AUTHENTICATE command. */
-enum gen_auth_tag {
-	GA_TAG_WITNESS = 0x80,
-	GA_TAG_CHALLENGE = 0x81,
-	GA_TAG_RESPONSE = 0x82,
-	GA_TAG_EXP = 0x85,
-};
-
-/* Tags used in the response to select on the PIV applet. */
-enum piv_sel_tag {
-	PIV_TAG_APT = 0x61,
-	PIV_TAG_AID = 0x4F,
-	PIV_TAG_AUTHORITY = 0x79,
-	PIV_TAG_APP_LABEL = 0x50,
-	PIV_TAG_URI = 0x5F50,
-	PIV_TAG_ALGS = 0xAC,
-};
-
 struct piv_slot {
 	/*
 	 * Links to the next member of the slot list hanging off a token at
@@ -172,6 +165,14 @@ struct piv_slot {
 	enum piv_slot_auth ps_auth;
 
 	boolean_t ps_got_metadata;
+
+	/*
+	 * Set when we learnt the public key from YubicoPIV metadata (see
+	 * piv_read_all_keys()) and haven't read the certificate yet. The
+	 * cert accessors will read it from ps_token on demand.
+	 */
+	boolean_t ps_certpending;
+	struct piv_token *ps_token;
 };
 
 struct piv_token {
@@ -187,6 +188,32 @@ struct piv_token {
 	SCARDHANDLE pt_cardhdl;
 	DWORD pt_proto;
 	SCARD_IO_REQUEST pt_sendpci;
+	/*
+	 * Does the card take extended-length APDUs? We find this out from the
+	 * card capabilities in the ATR, and turn it off again if the card
+	 * turns out to be lying.
+	 */
+	boolean_t pt_ext_apdu;
+	/*
+	 * If we were probed on a thread of our own, this is the PCSC context
+	 * we made for it, which we have to release along with the card.
+	 */
+	SCARDCONTEXT pt_ctx;
+	boolean_t pt_ownctx;
+
+	/*
+	 * Buffers for encoding commands and receiving replies, allocated the
+	 * first time we transceive and reused after that, so that we aren't
+	 * allocating and freeing 16k or so of memory per APDU. It's locked
+	 * into memory (replies include things like decrypted keys) and wiped
+	 * at the end of each transaction.
+	 *
+	 * Only one struct apdu can be using the reply buffer at a time
+	 * (pt_arena_user); any others get a buffer of their own.
+	 */
+	uint8_t *pt_arena;
+	size_t pt_arena_size;
+	struct apdu *pt_arena_user;
 
 	/* Are we in a transaction right now? */
 	boolean_t pt_intxn;
@@ -255,8 +282,36 @@ struct piv_token {
 
 	boolean_t pt_ykserial_valid;	/* YubiKey serial # only on YK5 */
 	uint32_t pt_ykserial;
+
+	/*
+	 * Things we haven't read off the card yet (PIV_LAZY_* bits), if this
+	 * token came from piv_enumerate_lazy(). See piv_fill_lazy().
+	 */
+	uint pt_lazy;
+
+	/*
+	 * Slots we've looked at and found to be empty (no cert object, or no
+	 * key according to YubicoPIV metadata), as PIV_SLOT_BIT()s, so that
+	 * piv_read_all_certs() and piv_read_all_keys() don't keep asking.
+	 * Cleared when we write to the card, or it's been reset under us.
+	 */
+	uint64_t pt_absent;
+};
+
+/* All the key slots we read have distinct values in their low 6 bits. */
+#define	PIV_SLOT_BIT(slotid)	(1ull << ((uint)(slotid) & 0x3f))
+
+enum piv_lazy {
+	PIV_LAZY_DISCOV		= (1 << 0),
+	PIV_LAZY_KEYHIST	= (1 << 1),
+	PIV_LAZY_YKPIV		= (1 << 2),	/* version and serial */
+	PIV_LAZY_ALL		= 0x7
 };
 
+static void piv_fill_lazy(struct piv_token *, uint);
+static void piv_slot_fill_cert(struct piv_slot *);
+static void arena_free(struct piv_token *);
+
 /* Helper to dump out APDU data */
 static inline void
 debug_dump(errf_t *err, struct apdu *apdu)
@@ -403,12 +458,14 @@ piv_token_has_signed_chuid(const struct piv_token *token)
 enum piv_pin
 piv_token_default_auth(const struct piv_token *token)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_DISCOV);
 	return (token->pt_auth);
 }
 
 boolean_t
 piv_token_has_auth(const struct piv_token *token, enum piv_pin auth)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_DISCOV);
 	switch (auth) {
 	case PIV_PIN:
 		return (token->pt_pin_app);
@@ -426,24 +483,28 @@ piv_token_has_auth(const struct piv_token *token, enum piv_pin auth)
 boolean_t
 piv_token_has_vci(const struct piv_token *token)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_DISCOV);
 	return (token->pt_vci);
 }
 
 uint
 piv_token_keyhistory_oncard(const struct piv_token *token)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_KEYHIST);
 	return (token->pt_hist_oncard);
 }
 
 uint
 piv_token_keyhistory_offcard(const struct piv_token *token)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_KEYHIST);
 	return (token->pt_hist_offcard);
 }
 
 const char *
 piv_token_offcard_url(const struct piv_token *token)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_KEYHIST);
 	return (token->pt_hist_url);
 }
 
@@ -462,12 +523,14 @@ piv_token_app_uri(const struct piv_token *token)
 boolean_t
 piv_token_is_ykpiv(const struct piv_token *token)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_YKPIV);
 	return (token->pt_ykpiv);
 }
 
 const uint8_t *
 ykpiv_token_version(const struct piv_token *token)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_YKPIV);
 	VERIFY(token->pt_ykpiv);
 	return (token->pt_ykver);
 }
@@ -476,6 +539,7 @@ int
 ykpiv_version_compare(const struct piv_token *token, uint8_t major,
     uint8_t minor, uint8_t patch)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_YKPIV);
 	VERIFY(token->pt_ykpiv);
 	if (token->pt_ykver[0] < major)
 		return (-1);
@@ -495,6 +559,7 @@ ykpiv_version_compare(const struct piv_token *token, uint8_t major,
 boolean_t
 ykpiv_token_has_serial(const struct piv_token *token)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_YKPIV);
 	VERIFY(token->pt_ykpiv);
 	return (token->pt_ykserial_valid);
 }
@@ -502,6 +567,7 @@ ykpiv_token_has_serial(const struct piv_token *token)
 uint32_t
 ykpiv_token_serial(const struct piv_token *token)
 {
+	piv_fill_lazy((struct piv_token *)token, PIV_LAZY_YKPIV);
 	VERIFY(token->pt_ykpiv);
 	VERIFY(token->pt_ykserial_valid);
 	return (token->pt_ykserial);
@@ -932,6 +998,98 @@ invdata:
 	goto out;
 }
 
+/*
+ * Reads whichever of the discovery object, key history object and YubicoPIV
+ * version/serial are in "what" and still outstanding on the token, filling in
+ * defaults for the ones the card doesn't have. Must be in a transaction with
+ * the applet selected.
+ */
+static errf_t *
+piv_read_lazy(struct piv_token *pk, uint what)
+{
+	errf_t *err;
+
+	what &= pk->pt_lazy;
+
+	if (what & PIV_LAZY_DISCOV) {
+		err = piv_read_discov(pk);
+		if (errf_caused_by(err, "NotFoundError") ||
+		    errf_caused_by(err, "NotSupportedError")) {
+			errf_free(err);
+			err = ERRF_OK;
+			/*
+			 * Default to preferring the application PIN if
+			 * we have no discovery object.
+			 */
+			pk->pt_pin_app = B_TRUE;
+			pk->pt_auth = PIV_PIN;
+		}
+		if (err)
+			return (err);
+		pk->pt_lazy &= ~PIV_LAZY_DISCOV;
+	}
+	if (what & PIV_LAZY_KEYHIST) {
+		err = piv_read_keyhist(pk);
+		if (errf_caused_by(err, "NotFoundError") ||
+		    errf_caused_by(err, "NotSupportedError")) {
+			errf_free(err);
+			err = ERRF_OK;
+		}
+		if (err)
+			return (err);
+		pk->pt_lazy &= ~PIV_LAZY_KEYHIST;
+	}
+	if (what & PIV_LAZY_YKPIV) {
+		err = ykpiv_get_version(pk);
+		if (err == ERRF_OK) {
+			err = ykpiv_read_serial(pk);
+		}
+		if (errf_caused_by(err, "NotSupportedError")) {
+			errf_free(err);
+			err = ERRF_OK;
+		}
+		if (err)
+			return (err);
+		pk->pt_lazy &= ~PIV_LAZY_YKPIV;
+	}
+	return (ERRF_OK);
+}
+
+/*
+ * Called by the accessors for things which piv_enumerate_lazy() didn't read
+ * up front. If we're not already in a transaction we open one for the
+ * purpose. The accessors have no way to return an error, so if the read
+ * fails we leave the defaults in place (and will try again next time).
+ */
+static void
+piv_fill_lazy(struct piv_token *pk, uint what)
+{
+	boolean_t ourtxn = B_FALSE;
+	errf_t *err;
+
+	if ((pk->pt_lazy & what) == 0)
+		return;
+
+	if (!pk->pt_intxn) {
+		if ((err = piv_txn_begin(pk)))
+			goto out;
+		ourtxn = B_TRUE;
+		if ((err = piv_select(pk)))
+			goto out;
+	}
+	err = piv_read_lazy(pk, what);
+
+out:
+	if (ourtxn)
+		piv_txn_end(pk);
+	if (err) {
+		bunyan_log(BNY_DEBUG, "failed to read token info on demand",
+		    "reader", BNY_STRING, pk->pt_rdrname,
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+}
+
 /*
  * Reads and parses the PIV Card Holder Unique Identifier Object.
  * [piv] 800-73-4 part 1 section 3.1.2
@@ -1091,143 +1249,296 @@ invdata:
 	goto out;
 }
 
-errf_t *
-piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens)
+/*
+ * Looks at the card capabilities in the historical bytes of the ATR to see if
+ * the card says it takes extended-length APDUs (ISO7816-4 section 8.1.1.2.7,
+ * third software function table, b7). We only use them over T=1, since T=0
+ * would need ENVELOPE to carry them.
+ */
+static void
+piv_check_ext_apdu(struct piv_token *pt)
 {
-	DWORD rv, readersLen = 0;
-	LPTSTR readers, thisrdr;
-	struct piv_token *ks = NULL;
-	errf_t *err;
+	uint8_t atr[MAX_ATR_SIZE];
+	DWORD atrlen = sizeof (atr);
+	DWORD proto;
+	uint i, k, y, tag, len;
+	LONG rv;
 
-	rv = SCardListReaders(ctx, NULL, NULL, &readersLen);
-	switch (rv) {
-	case SCARD_S_SUCCESS:
-		break;
-	case SCARD_E_NO_SERVICE:
-	case SCARD_E_INVALID_HANDLE:
-	case SCARD_E_SERVICE_STOPPED:
-		return (errf("PCSCContextError",
-		    pcscerrf("SCardListReaders", rv),
-		    "PCSC context is not functional"));
-	default:
-		return (pcscerrf("SCardListReaders", rv));
+	pt->pt_ext_apdu = B_FALSE;
+	if (pt->pt_proto != SCARD_PROTOCOL_T1)
+		return;
+
+	rv = piv_trace_status(pt->pt_cardhdl, &proto, atr, &atrlen);
+	if (rv != SCARD_S_SUCCESS || atrlen < 2)
+		return;
+
+	/* Skip over TS, T0 and the interface bytes. */
+	k = atr[1] & 0x0F;
+	y = atr[1] & 0xF0;
+	i = 2;
+	while (y != 0) {
+		if (y & 0x10)
+			++i;
+		if (y & 0x20)
+			++i;
+		if (y & 0x40)
+			++i;
+		if (y & 0x80) {
+			if (i >= atrlen)
+				return;
+			y = atr[i++] & 0xF0;
+		} else {
+			y = 0;
+		}
 	}
-	readers = calloc(1, readersLen);
-	rv = SCardListReaders(ctx, NULL, readers, &readersLen);
+	if (i + k > atrlen || k < 1)
+		return;
+
+	/*
+	 * Category indicator 00 has a 3 byte status indicator at the end,
+	 * 80 has only COMPACT-TLV objects. Others we don't understand.
+	 */
+	if (atr[i] == 0x00) {
+		if (k < 4)
+			return;
+		k -= 3;
+	} else if (atr[i] != 0x80) {
+		return;
+	}
+	k += i;
+	++i;
+
+	while (i < k) {
+		tag = atr[i] >> 4;
+		len = atr[i] & 0x0F;
+		++i;
+		if (i + len > k)
+			return;
+		if (tag == 0x7 && len >= 3) {
+			pt->pt_ext_apdu = ((atr[i + 2] & 0x40) != 0);
+			return;
+		}
+		i += len;
+	}
+}
+
+LONG
+piv_establish_context(SCARDCONTEXT *ctx)
+{
+	return (piv_trace_establish(ctx));
+}
+
+LONG
+piv_release_context(SCARDCONTEXT ctx)
+{
+	return (piv_trace_release(ctx));
+}
+
+LONG
+piv_list_readers(SCARDCONTEXT ctx, char *readers, DWORD *readerslen)
+{
+	return (piv_trace_list_readers(ctx, readers, readerslen));
+}
+
+LONG
+piv_get_status_change(SCARDCONTEXT ctx, DWORD timeout,
+    SCARD_READERSTATE *states, DWORD nstates)
+{
+	return (piv_trace_get_status_change(ctx, timeout, states, nstates));
+}
+
+/*
+ * Probing a reader (connecting, SELECTing the applet and reading the CHUID,
+ * discovery and key history objects, plus the YubiKey version and serial)
+ * takes a few hundred ms, which adds up on machines with lots of tokens
+ * attached. So when there's more than one reader, piv_enumerate() and
+ * piv_find() probe them in parallel on a bounded pool of threads. Each
+ * reader is probed using its own SCARDCONTEXT as PCSC requires (the token
+ * then keeps that context until piv_release()).
+ *
+ * The pool has piv_probe_threads threads, so that at most that many readers
+ * are probed at once and we don't swamp weak USB hubs. This defaults to
+ * PIV_PROBE_THREADS_DEFAULT (8), and can be set with piv_set_probe_threads()
+ * or PIVY_PROBE_THREADS in the environment.
+ */
+enum {
+	PIV_PROBE_THREADS_DEFAULT = 8
+};
+static uint piv_probe_threads = 0;
+
+void
+piv_set_probe_threads(uint n)
+{
+	piv_probe_threads = n;
+}
+
+static uint
+probe_threads(void)
+{
+	const char *env;
+	unsigned long parsed;
+	char *p;
+
+	if (piv_probe_threads != 0)
+		return (piv_probe_threads);
+	env = getenv("PIVY_PROBE_THREADS");
+	if (env != NULL && *env != '\0') {
+		errno = 0;
+		parsed = strtoul(env, &p, 10);
+		if (errno == 0 && *p == '\0' && parsed > 0 && parsed < 1024)
+			return (parsed);
+	}
+	return (PIV_PROBE_THREADS_DEFAULT);
+}
+
+struct reader_probe {
+	const char *rp_rdrname;
+	struct piv_token *rp_token;
+	errf_t *rp_err;
+};
+
+struct probe_set {
+	boolean_t ps_find;
+	boolean_t ps_lazy;
+	const uint8_t *ps_guid;
+	size_t ps_guidlen;
+
+	struct reader_probe *ps_probes;
+	size_t ps_nprobes;
+
+	pthread_mutex_t ps_mtx;
+	size_t ps_next;			/* protected by ps_mtx */
+};
+
+/*
+ * Connects to a reader and reads the basic token info. If we're looking for a
+ * particular GUID (ps_find) then we stop early on tokens which don't match,
+ * returning NotFoundError.
+ */
+static errf_t *
+piv_probe_reader(struct probe_set *set, SCARDCONTEXT ctx, const char *rdrname,
+    struct piv_token **out)
+{
+	SCARDHANDLE card;
+	struct piv_token *key;
+	DWORD activeProtocol;
+	DWORD rv;
+	errf_t *err;
+
+	rv = piv_trace_connect(ctx, rdrname, &card, &activeProtocol);
 	if (rv != SCARD_S_SUCCESS) {
-		free(readers);
-		return (pcscerrf("SCardListReaders", rv));
+		err = pcscrerrf("SCardConnect", rdrname, rv);
+		bunyan_log(BNY_DEBUG, "SCardConnect failed",
+		    "error", BNY_ERF, err, NULL);
+		return (err);
 	}
 
-	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1) {
-		SCARDHANDLE card;
-		struct piv_token *key;
-		DWORD activeProtocol;
+	key = calloc(1, sizeof (struct piv_token));
+	VERIFY(key != NULL);
+	key->pt_cardhdl = card;
+	key->pt_rdrname = strdup(rdrname);
+	VERIFY(key->pt_rdrname != NULL);
+	key->pt_proto = activeProtocol;
+
+	switch (activeProtocol) {
+	case SCARD_PROTOCOL_T0:
+		key->pt_sendpci = *SCARD_PCI_T0;
+		break;
+	case SCARD_PROTOCOL_T1:
+		key->pt_sendpci = *SCARD_PCI_T1;
+		break;
+	default:
+		VERIFY(0);
+	}
+	piv_check_ext_apdu(key);
 
-		rv = SCardConnect(ctx, thisrdr, SCARD_SHARE_SHARED,
-		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card,
-		    &activeProtocol);
-		if (rv != SCARD_S_SUCCESS) {
-			err = pcscrerrf("SCardConnect", thisrdr, rv);
-			bunyan_log(BNY_DEBUG, "SCardConnect failed",
-			    "error", BNY_ERF, err, NULL);
+	if ((err = piv_txn_begin(key))) {
+		bunyan_log(BNY_DEBUG, "piv_txn_begin failed",
+		    "error", BNY_ERF, err, NULL);
+		(void) piv_trace_disconnect(card, SCARD_RESET_CARD);
+		free((char *)key->pt_rdrname);
+		free(key);
+		return (err);
+	}
+	err = piv_select(key);
+	if (err == ERRF_OK) {
+		err = piv_read_chuid(key);
+		if (errf_caused_by(err, "NotFoundError") &&
+		    (!set->ps_find || set->ps_guidlen == 0)) {
 			errf_free(err);
-			continue;
+			err = ERRF_OK;
+			key->pt_nochuid = B_TRUE;
+		} else if (err == ERRF_OK && set->ps_find &&
+		    (set->ps_guidlen == 0 ||
+		    bcmp(set->ps_guid, key->pt_guid, set->ps_guidlen) != 0)) {
+			err = errf("NotFoundError", NULL, "PIV token in "
+			    "reader '%s' does not match GUID", rdrname);
 		}
+	}
+	key->pt_lazy = PIV_LAZY_ALL;
+	if (err == ERRF_OK && !set->ps_lazy)
+		err = piv_read_lazy(key, PIV_LAZY_ALL);
+	piv_txn_end(key);
+
+	if (err) {
+		(void) piv_trace_disconnect(card, SCARD_RESET_CARD);
+		arena_free(key);
+		free((char *)key->pt_rdrname);
+		free(key);
+		return (err);
+	}
 
-		key = calloc(1, sizeof (struct piv_token));
-		key->pt_cardhdl = card;
-		key->pt_rdrname = strdup(thisrdr);
-		key->pt_proto = activeProtocol;
+	*out = key;
+	return (ERRF_OK);
+}
 
-		switch (activeProtocol) {
-		case SCARD_PROTOCOL_T0:
-			key->pt_sendpci = *SCARD_PCI_T0;
-			break;
-		case SCARD_PROTOCOL_T1:
-			key->pt_sendpci = *SCARD_PCI_T1;
+static void *
+probe_thread(void *arg)
+{
+	struct probe_set *set = arg;
+	struct reader_probe *rp;
+	SCARDCONTEXT ctx;
+	DWORD rv;
+
+	for (;;) {
+		VERIFY0(pthread_mutex_lock(&set->ps_mtx));
+		if (set->ps_next >= set->ps_nprobes) {
+			VERIFY0(pthread_mutex_unlock(&set->ps_mtx));
 			break;
-		default:
-			VERIFY(0);
 		}
+		rp = &set->ps_probes[set->ps_next++];
+		VERIFY0(pthread_mutex_unlock(&set->ps_mtx));
 
-		if ((err = piv_txn_begin(key))) {
-			bunyan_log(BNY_DEBUG, "piv_txn_begin failed",
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
+		rv = piv_trace_establish(&ctx);
+		if (rv != SCARD_S_SUCCESS) {
+			rp->rp_err = pcscerrf("SCardEstablishContext", rv);
 			continue;
 		}
-		err = piv_select(key);
-		if (err == ERRF_OK) {
-			err = piv_read_chuid(key);
-			if (errf_caused_by(err, "NotFoundError")) {
-				errf_free(err);
-				err = ERRF_OK;
-				key->pt_nochuid = B_TRUE;
-			}
-		}
-		if (err == ERRF_OK) {
-			err = piv_read_discov(key);
-			if (errf_caused_by(err, "NotFoundError") ||
-			    errf_caused_by(err, "NotSupportedError")) {
-				errf_free(err);
-				err = ERRF_OK;
-				/*
-				 * Default to preferring the application PIN if
-				 * we have no discovery object.
-				 */
-				key->pt_pin_app = B_TRUE;
-				key->pt_auth = PIV_PIN;
-			}
-		}
-		if (err == ERRF_OK) {
-			err = piv_read_keyhist(key);
-			if (errf_caused_by(err, "NotFoundError") ||
-			    errf_caused_by(err, "NotSupportedError")) {
-				errf_free(err);
-				err = ERRF_OK;
-			}
-		}
-		if (err == ERRF_OK) {
-			err = ykpiv_get_version(key);
-			if (err == ERRF_OK) {
-				err = ykpiv_read_serial(key);
-			}
-			if (errf_caused_by(err, "NotSupportedError")) {
-				errf_free(err);
-				err = ERRF_OK;
-			}
-		}
-		piv_txn_end(key);
-
-		if (err == ERRF_OK) {
-			key->pt_next = ks;
-			ks = key;
-		} else {
-			bunyan_log(BNY_DEBUG, "piv_enumerate() eliminated reader "
-			    "due to error", "reader", BNY_STRING, thisrdr,
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			(void) SCardDisconnect(card, SCARD_RESET_CARD);
+		rp->rp_err = piv_probe_reader(set, ctx, rp->rp_rdrname,
+		    &rp->rp_token);
+		if (rp->rp_err != ERRF_OK) {
+			(void) piv_trace_release(ctx);
+			continue;
 		}
+		rp->rp_token->pt_ctx = ctx;
+		rp->rp_token->pt_ownctx = B_TRUE;
 	}
-
-	*tokens = ks;
-
-	free(readers);
-	return (ERRF_OK);
+	return (NULL);
 }
 
-errf_t *
-piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
-    struct piv_token **token)
+/*
+ * Lists the readers on ctx and probes all of them, filling out set->ps_probes
+ * (in the order PCSC gave us the readers).
+ */
+static errf_t *
+probe_readers(SCARDCONTEXT ctx, struct probe_set *set, char **readersp)
 {
 	DWORD rv, readersLen = 0;
 	LPTSTR readers, thisrdr;
-	struct piv_token *found = NULL, *key;
-	errf_t *err;
+	pthread_t *threads;
+	size_t i, nthreads;
 
-	rv = SCardListReaders(ctx, NULL, NULL, &readersLen);
+	rv = piv_trace_list_readers(ctx, NULL, &readersLen);
 	switch (rv) {
 	case SCARD_S_SUCCESS:
 		break;
@@ -1241,171 +1552,234 @@ piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
 		return (pcscerrf("SCardListReaders", rv));
 	}
 	readers = calloc(1, readersLen);
-	rv = SCardListReaders(ctx, NULL, readers, &readersLen);
+	VERIFY(readers != NULL);
+	rv = piv_trace_list_readers(ctx, readers, &readersLen);
 	if (rv != SCARD_S_SUCCESS) {
 		free(readers);
 		return (pcscerrf("SCardListReaders", rv));
 	}
-
-	key = calloc(1, sizeof (struct piv_token));
-	VERIFY(key != NULL);
-
-	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1) {
-		SCARDHANDLE card;
-		DWORD activeProtocol;
-
-		rv = SCardConnect(ctx, thisrdr, SCARD_SHARE_SHARED,
-		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card,
-		    &activeProtocol);
-		if (rv != SCARD_S_SUCCESS) {
-			err = pcscrerrf("SCardConnect", thisrdr, rv);
-			bunyan_log(BNY_DEBUG, "SCardConnect failed",
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			continue;
+	*readersp = readers;
+
+	set->ps_nprobes = 0;
+	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1)
+		++set->ps_nprobes;
+	set->ps_probes = calloc(set->ps_nprobes + 1,
+	    sizeof (struct reader_probe));
+	VERIFY(set->ps_probes != NULL);
+	i = 0;
+	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1)
+		set->ps_probes[i++].rp_rdrname = thisrdr;
+
+	nthreads = probe_threads();
+	if (nthreads > set->ps_nprobes)
+		nthreads = set->ps_nprobes;
+
+	if (nthreads <= 1) {
+		for (i = 0; i < set->ps_nprobes; ++i) {
+			struct reader_probe *rp = &set->ps_probes[i];
+			rp->rp_err = piv_probe_reader(set, ctx,
+			    rp->rp_rdrname, &rp->rp_token);
 		}
+		return (ERRF_OK);
+	}
 
-		key->pt_cardhdl = card;
-		key->pt_rdrname = strdup(thisrdr);
-		VERIFY(key->pt_rdrname != NULL);
-		key->pt_proto = activeProtocol;
+	set->ps_next = 0;
+	VERIFY0(pthread_mutex_init(&set->ps_mtx, NULL));
+	bunyan_enable_threads();
+	threads = calloc(nthreads, sizeof (pthread_t));
+	VERIFY(threads != NULL);
+	for (i = 0; i < nthreads; ++i)
+		VERIFY0(pthread_create(&threads[i], NULL, probe_thread, set));
+	for (i = 0; i < nthreads; ++i)
+		VERIFY0(pthread_join(threads[i], NULL));
+	free(threads);
+	VERIFY0(pthread_mutex_destroy(&set->ps_mtx));
 
-		switch (activeProtocol) {
-		case SCARD_PROTOCOL_T0:
-			key->pt_sendpci = *SCARD_PCI_T0;
-			break;
-		case SCARD_PROTOCOL_T1:
-			key->pt_sendpci = *SCARD_PCI_T1;
-			break;
-		default:
-			VERIFY(0);
-		}
+	return (ERRF_OK);
+}
 
-		if ((err = piv_txn_begin(key))) {
-			errf_free(err);
-			goto nopenotxn;
-		}
-		err = piv_select(key);
-		if (err) {
-			errf_free(err);
-			goto nope;
+static errf_t *
+piv_enumerate_common(SCARDCONTEXT ctx, boolean_t lazy,
+    struct piv_token **tokens)
+{
+	struct probe_set set;
+	struct reader_probe *rp;
+	struct piv_token *ks = NULL;
+	char *readers = NULL;
+	errf_t *err;
+	size_t i;
+
+	bzero(&set, sizeof (set));
+	set.ps_lazy = lazy;
+	if ((err = probe_readers(ctx, &set, &readers)))
+		return (err);
+
+	/*
+	 * Build the list back to front, the same order we've always returned
+	 * tokens in, no matter which order the probes finished in.
+	 */
+	for (i = 0; i < set.ps_nprobes; ++i) {
+		rp = &set.ps_probes[i];
+		if (rp->rp_err != ERRF_OK) {
+			bunyan_log(BNY_DEBUG, "piv_enumerate() eliminated "
+			    "reader due to error",
+			    "reader", BNY_STRING, rp->rp_rdrname,
+			    "error", BNY_ERF, rp->rp_err, NULL);
+			errf_free(rp->rp_err);
+			continue;
 		}
-		err = piv_read_chuid(key);
-		if (errf_caused_by(err, "NotFoundError") && guidlen == 0) {
-			errf_free(err);
-			err = ERRF_OK;
-			key->pt_nochuid = B_TRUE;
-			if (found != NULL) {
-				piv_txn_end(key);
-				(void) SCardDisconnect(card, SCARD_RESET_CARD);
-				free((char *)key->pt_rdrname);
-				free(key);
-				piv_txn_end(found);
-				(void) SCardDisconnect(found->pt_cardhdl,
-				    SCARD_RESET_CARD);
-				free((char *)found->pt_rdrname);
-				free(found);
-				free(readers);
-				return (errf("DuplicateError", NULL,
-				    "More than one PIV token matched GUID"));
+		rp->rp_token->pt_next = ks;
+		ks = rp->rp_token;
+	}
+
+	*tokens = ks;
+
+	free(set.ps_probes);
+	free(readers);
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens)
+{
+	return (piv_enumerate_common(ctx, B_FALSE, tokens));
+}
+
+errf_t *
+piv_enumerate_lazy(SCARDCONTEXT ctx, struct piv_token **tokens)
+{
+	return (piv_enumerate_common(ctx, B_TRUE, tokens));
+}
+
+errf_t *
+piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
+    struct piv_token **token)
+{
+	struct probe_set set;
+	struct reader_probe *rp;
+	struct piv_token *found = NULL;
+	char *readers = NULL;
+	errf_t *err = ERRF_OK;
+	size_t i;
+
+	bzero(&set, sizeof (set));
+	set.ps_find = B_TRUE;
+	set.ps_guid = guid;
+	set.ps_guidlen = guidlen;
+	if ((err = probe_readers(ctx, &set, &readers)))
+		return (err);
+
+	for (i = 0; i < set.ps_nprobes; ++i) {
+		rp = &set.ps_probes[i];
+		if (rp->rp_err != ERRF_OK) {
+			if (!errf_caused_by(rp->rp_err, "NotFoundError")) {
+				bunyan_log(BNY_DEBUG, "piv_find() eliminated "
+				    "reader due to error",
+				    "reader", BNY_STRING, rp->rp_rdrname,
+				    "error", BNY_ERF, rp->rp_err, NULL);
 			}
-			found = key;
-			key = calloc(1, sizeof (struct piv_token));
+			errf_free(rp->rp_err);
 			continue;
-		} else if (err) {
-			bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
-			    "due to error", "reader", BNY_STRING, thisrdr,
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			goto nope;
 		}
-		if (guidlen == 0 || bcmp(guid, key->pt_guid, guidlen) != 0)
-			goto nope;
-
-		if (found != NULL) {
-			piv_txn_end(key);
-			(void) SCardDisconnect(card, SCARD_RESET_CARD);
-			free((char *)key->pt_rdrname);
-			free(key);
-			piv_txn_end(found);
-			(void) SCardDisconnect(found->pt_cardhdl,
-			    SCARD_RESET_CARD);
-			free((char *)found->pt_rdrname);
-			free(found);
-			free(readers);
-			return (errf("DuplicateError", NULL,
-			    "More than one PIV token matched GUID"));
+		if (found != NULL && err == ERRF_OK) {
+			err = errf("DuplicateError", NULL,
+			    "More than one PIV token matched GUID");
+		}
+		if (found == NULL) {
+			found = rp->rp_token;
+		} else {
+			piv_release(rp->rp_token);
 		}
-		found = key;
-		key = calloc(1, sizeof (struct piv_token));
-		continue;
-
-nope:
-		piv_txn_end(key);
-nopenotxn:
-		(void) SCardDisconnect(card, SCARD_RESET_CARD);
-		free((char *)key->pt_rdrname);
-		bzero(key, sizeof (struct piv_token));
 	}
 
-	free(key);
+	free(set.ps_probes);
+	free(readers);
 
+	if (err != ERRF_OK) {
+		piv_release(found);
+		return (err);
+	}
 	if (found == NULL) {
-		free(readers);
 		return (errf("NotFoundError", NULL,
 		    "No PIV token found matching GUID"));
 	}
+	*token = found;
+	return (ERRF_OK);
+}
 
-	key = found;
-	err = ERRF_OK;
+/*
+ * Each half of the arena is big enough for a full MAX_APDU_SIZE of data plus
+ * the APDU header and trailer.
+ */
+#define	ARENA_HALF	(MAX_APDU_SIZE + 16)
 
-	if (err == ERRF_OK) {
-		err = piv_read_discov(key);
-		if (errf_caused_by(err, "NotFoundError") ||
-		    errf_caused_by(err, "NotSupportedError")) {
-			errf_free(err);
-			err = ERRF_OK;
-			/*
-			 * Default to preferring the application PIN if
-			 * we have no discovery object.
-			 */
-			key->pt_pin_app = B_TRUE;
-			key->pt_auth = PIV_PIN;
-		}
-	}
-	if (err == ERRF_OK) {
-		err = piv_read_keyhist(key);
-		if (errf_caused_by(err, "NotFoundError") ||
-		    errf_caused_by(err, "NotSupportedError")) {
-			errf_free(err);
-			err = ERRF_OK;
-		}
-	}
-	if (err == ERRF_OK) {
-		err = ykpiv_get_version(key);
-		if (err == ERRF_OK) {
-			err = ykpiv_read_serial(key);
-		}
-		if (errf_caused_by(err, "NotSupportedError")) {
-			errf_free(err);
-			err = ERRF_OK;
-		}
-	}
-	piv_txn_end(key);
+static void
+arena_alloc(struct piv_token *pt)
+{
+	long pgsz = sysconf(_SC_PAGESIZE);
+	size_t size;
+	void *p;
+
+	size = 2 * ARENA_HALF;
+	size = ((size + pgsz - 1) / pgsz) * pgsz;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+	    -1, 0);
+	if (p == MAP_FAILED)
+		return;
+	/* Not fatal: pivy-agent calls mlockall() anyway. */
+	(void) mlock(p, size);
+#if defined(MADV_DONTDUMP)
+	(void) madvise(p, size, MADV_DONTDUMP);
+#endif
+	pt->pt_arena = p;
+	pt->pt_arena_size = size;
+}
 
-	if (err) {
-		bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
-		    "due to error", "reader", BNY_STRING, thisrdr,
-		    "error", BNY_ERF, err, NULL);
-		errf_free(err);
-		(void) SCardDisconnect(key->pt_cardhdl, SCARD_RESET_CARD);
-		free((char *)key->pt_rdrname);
-		free(key);
-	}
+static inline uint8_t *
+arena_cmd(struct piv_token *pt)
+{
+	return (pt->pt_arena);
+}
 
-	*token = key;
-	free(readers);
-	return (ERRF_OK);
+static inline uint8_t *
+arena_reply(struct piv_token *pt)
+{
+	return (pt->pt_arena + ARENA_HALF);
+}
+
+static void
+arena_free(struct piv_token *pt)
+{
+	if (pt->pt_arena == NULL)
+		return;
+	explicit_bzero(pt->pt_arena, pt->pt_arena_size);
+	(void) munlock(pt->pt_arena, pt->pt_arena_size);
+	(void) munmap(pt->pt_arena, pt->pt_arena_size);
+	pt->pt_arena = NULL;
+	pt->pt_arena_size = 0;
+}
+
+/* Gives up the reply buffer, whether it's the token's or our own. */
+static void
+apdu_release_reply(struct apdu *a)
+{
+	struct apdubuf *r = &a->a_reply;
+	size_t used;
+
+	if (r->b_data == NULL)
+		return;
+	if (a->a_pool != NULL) {
+		used = r->b_offset + r->b_len + 2;
+		if (used > r->b_size)
+			used = r->b_size;
+		explicit_bzero(r->b_data, used);
+		VERIFY(a->a_pool->pt_arena_user == a);
+		a->a_pool->pt_arena_user = NULL;
+		a->a_pool = NULL;
+	} else {
+		freezero(r->b_data, r->b_size);
+	}
+	bzero(r, sizeof (struct apdubuf));
 }
 
 void
@@ -1416,7 +1790,9 @@ piv_release(struct piv_token *pk)
 
 	for (; pk != NULL; pk = next) {
 		VERIFY(pk->pt_intxn == B_FALSE);
-		(void) SCardDisconnect(pk->pt_cardhdl, SCARD_LEAVE_CARD);
+		(void) piv_trace_disconnect(pk->pt_cardhdl, SCARD_LEAVE_CARD);
+		if (pk->pt_ownctx)
+			(void) piv_trace_release(pk->pt_ctx);
 
 		for (ps = pk->pt_slots; ps != NULL; ps = psnext) {
 			OPENSSL_free((void *)ps->ps_subj);
@@ -1425,6 +1801,20 @@ piv_release(struct piv_token *pk)
 			psnext = ps->ps_next;
 			free(ps);
 		}
+		/*
+		 * Anyone still holding our reply buffer gets their own copy
+		 * of it, since it's about to go away.
+		 */
+		if (pk->pt_arena_user != NULL) {
+			struct apdu *a = pk->pt_arena_user;
+			uint8_t *copy = malloc(a->a_reply.b_size);
+			VERIFY(copy != NULL);
+			bcopy(a->a_reply.b_data, copy, a->a_reply.b_size);
+			a->a_reply.b_data = copy;
+			a->a_pool = NULL;
+			pk->pt_arena_user = NULL;
+		}
+		arena_free(pk);
 		free(pk->pt_hist_url);
 		free(pk->pt_app_label);
 		free(pk->pt_app_uri);
@@ -1493,15 +1883,23 @@ piv_slot_alg(const struct piv_slot *slot)
 X509 *
 piv_slot_cert(const struct piv_slot *slot)
 {
+	piv_slot_fill_cert((struct piv_slot *)slot);
 	return (slot->ps_x509);
 }
 
 const char *
 piv_slot_subject(const struct piv_slot *slot)
 {
+	piv_slot_fill_cert((struct piv_slot *)slot);
 	return (slot->ps_subj);
 }
 
+boolean_t
+piv_slot_cert_loaded(const struct piv_slot *slot)
+{
+	return (!slot->ps_certpending);
+}
+
 struct sshkey *
 piv_slot_pubkey(const struct piv_slot *slot)
 {
@@ -1522,9 +1920,7 @@ piv_apdu_make(enum iso_class cls, enum iso_ins ins, uint8_t p1, uint8_t p2)
 void
 piv_apdu_free(struct apdu *a)
 {
-	if (a->a_reply.b_data != NULL) {
-		freezero(a->a_reply.b_data, a->a_reply.b_size);
-	}
+	apdu_release_reply(a);
 	free(a);
 }
 
@@ -1550,21 +1946,52 @@ piv_apdu_get_reply(const struct apdu *apdu, size_t *len)
 	return (apdu->a_reply.b_data + apdu->a_reply.b_offset);
 }
 
+/*
+ * Encodes the command APDU into buf, which must have room for at least
+ * APDU_OVERHEAD bytes more than the command data.
+ */
+#define	APDU_OVERHEAD	9
+
 static uint8_t *
-apdu_to_buffer(struct apdu *apdu, uint *outlen)
+apdu_to_buffer(struct apdu *apdu, size_t replymax, uint8_t *buf, uint *outlen)
 {
 	struct apdubuf *d = &(apdu->a_cmd);
-	uint8_t *buf = calloc(1, 6 + d->b_len);
+	size_t le;
+	uint i;
 	buf[0] = apdu->a_cls;
 	buf[1] = apdu->a_ins;
 	buf[2] = apdu->a_p1;
 	buf[3] = apdu->a_p2;
+	if (apdu->a_ext) {
+		/*
+		 * Ask for as much as will fit in the reply buffer (less the
+		 * status word). An Le of 0000 means 65536.
+		 */
+		VERIFY(replymax > 2);
+		le = replymax - 2;
+		if (le > 0xFFFF)
+			le = 0;
+		buf[4] = 0;
+		i = 5;
+		if (d->b_data != NULL) {
+			VERIFY(d->b_len <= 0xFFFF && d->b_len > 0);
+			buf[i++] = (d->b_len >> 8) & 0xFF;
+			buf[i++] = d->b_len & 0xFF;
+			bcopy(d->b_data + d->b_offset, buf + i, d->b_len);
+			i += d->b_len;
+		}
+		if (!(apdu->a_cls & CLA_CHAIN)) {
+			buf[i++] = (le >> 8) & 0xFF;
+			buf[i++] = le & 0xFF;
+		}
+		*outlen = i;
+		return (buf);
+	}
 	if (d->b_data == NULL) {
 		buf[4] = apdu->a_le;
 		*outlen = 5;
 		return (buf);
 	} else {
-		/* TODO: maybe look at handling ext APDUs? */
 		VERIFY(d->b_len < 256 && d->b_len > 0);
 		buf[4] = d->b_len;
 		bcopy(d->b_data + d->b_offset, buf + 5, d->b_len);
@@ -1634,34 +2061,59 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 
 	boolean_t freedata = B_FALSE;
 	DWORD recvLength;
-	uint8_t *cmd;
+	uint8_t *cmd, *cmdbuf = NULL;
+	size_t cmdmax = APDU_OVERHEAD;
 	struct apdubuf *r = &(apdu->a_reply);
 
 	VERIFY(key->pt_intxn == B_TRUE);
 
-	cmd = apdu_to_buffer(apdu, &cmdLen);
-	VERIFY(cmd != NULL);
-	if (cmd == NULL || cmdLen < 5)
-		return (ERRF_NOMEM);
+	if (key->pt_arena == NULL)
+		arena_alloc(key);
 
 	if (r->b_data == NULL) {
-		r->b_data = calloc(1, MAX_APDU_SIZE);
-		r->b_size = MAX_APDU_SIZE;
+		if (key->pt_arena != NULL && key->pt_arena_user == NULL) {
+			r->b_data = arena_reply(key);
+			r->b_size = MAX_APDU_SIZE;
+			key->pt_arena_user = apdu;
+			apdu->a_pool = key;
+		} else {
+			r->b_data = calloc(1, MAX_APDU_SIZE);
+			r->b_size = MAX_APDU_SIZE;
+		}
 		r->b_offset = 0;
 		freedata = B_TRUE;
 	}
 	recvLength = r->b_size - r->b_offset;
 	VERIFY(r->b_data != NULL);
 
+	if (apdu->a_cmd.b_data != NULL)
+		cmdmax += apdu->a_cmd.b_len;
+	if (key->pt_arena != NULL && cmdmax <= ARENA_HALF) {
+		cmd = arena_cmd(key);
+	} else {
+		cmd = cmdbuf = calloc(1, cmdmax);
+		if (cmd == NULL) {
+			if (freedata)
+				apdu_release_reply(apdu);
+			return (ERRF_NOMEM);
+		}
+	}
+	(void) apdu_to_buffer(apdu, recvLength, cmd, &cmdLen);
+	VERIFY(cmdLen >= 5 && cmdLen <= cmdmax);
+
 	if (piv_full_apdu_debug) {
 		bunyan_log(BNY_TRACE, "sending APDU",
 		    "apdu", BNY_BIN_HEX, cmd, cmdLen,
 		    NULL);
 	}
 
-	rv = SCardTransmit(key->pt_cardhdl, &key->pt_sendpci, cmd,
-	    cmdLen, NULL, r->b_data + r->b_offset, &recvLength);
-	freezero(cmd, cmdLen);
+	rv = piv_trace_transmit(key->pt_cardhdl, key->pt_rdrname,
+	    &key->pt_sendpci, cmd, cmdLen, r->b_data + r->b_offset,
+	    &recvLength);
+	if (cmdbuf != NULL)
+		freezero(cmdbuf, cmdmax);
+	else
+		explicit_bzero(cmd, cmdLen);
 
 	if (piv_full_apdu_debug) {
 		bunyan_log(BNY_TRACE, "received APDU",
@@ -1673,10 +2125,8 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 		err = pcscrerrf("SCardTransmit", key->pt_rdrname, rv);
 		bunyan_log(BNY_DEBUG, "SCardTransmit failed",
 		    "error", BNY_ERF, err, NULL);
-		if (freedata) {
-			free(r->b_data);
-			bzero(r, sizeof (struct apdubuf));
-		}
+		if (freedata)
+			apdu_release_reply(apdu);
 		return (err);
 	}
 	recvLength -= 2;
@@ -1691,8 +2141,10 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	    "ins_name", BNY_STRING, ins_to_name(apdu->a_ins),
 	    "p1", BNY_UINT, (uint)apdu->a_p1,
 	    "p2", BNY_UINT, (uint)apdu->a_p2,
-	    "lc", BNY_UINT, (uint)(cmdLen - 5),
+	    "lc", BNY_UINT, (uint)((apdu->a_cmd.b_data == NULL) ? 0 :
+	    apdu->a_cmd.b_len),
 	    "le", BNY_UINT, (uint)apdu->a_le,
+	    "ext", BNY_UINT, (uint)apdu->a_ext,
 	    "sw", BNY_UINT, (uint)apdu->a_sw,
 	    "sw_name", BNY_STRING, sw_to_name(apdu->a_sw),
 	    "lr", BNY_UINT, (uint)r->b_len,
@@ -1705,23 +2157,49 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
  * This function sends and receives chains of commands so that the data length
  * can be arbitrarily long on either side.
  */
+static boolean_t
+ins_can_ext(enum iso_ins ins)
+{
+	switch (ins) {
+	case INS_GET_DATA:
+	case INS_PUT_DATA:
+	case INS_GEN_AUTH:
+	case INS_IMPORT_ASYM:
+		return (B_TRUE);
+	default:
+		return (B_FALSE);
+	}
+}
+
 errf_t *
 piv_apdu_transceive_chain(struct piv_token *pk, struct apdu *apdu)
 {
 	errf_t *rv;
 	size_t offset;
-	size_t rem;
+	size_t rem, seglen;
 	boolean_t gotok = B_FALSE;
+	boolean_t ext;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
+	/*
+	 * If the card can take extended-length APDUs, the commands which
+	 * carry big objects go in one APDU each way instead of a chain of
+	 * 255-byte segments and a string of GET RESPONSEs.
+	 */
+	ext = (pk->pt_ext_apdu && ins_can_ext(apdu->a_ins) &&
+	    apdu->a_cmd.b_len <= 0xFFFF);
+
 	/* First, send the command. */
 	rem = apdu->a_cmd.b_len;
+restart:
+	apdu->a_ext = ext;
+	seglen = ext ? 0xFFFF : 0xFF;
 	do {
 		/* Is there another block needed in the chain? */
-		if (rem > 0xFF) {
+		if (rem > seglen) {
 			apdu->a_cls |= CLA_CHAIN;
-			apdu->a_cmd.b_len = 0xFF;
+			apdu->a_cmd.b_len = seglen;
 		} else {
 			apdu->a_cls &= ~CLA_CHAIN;
 			apdu->a_cmd.b_len = rem;
@@ -1730,6 +2208,21 @@ again:
 		rv = piv_apdu_transceive(pk, apdu);
 		if (rv)
 			return (rv);
+		if (ext && (apdu->a_sw == SW_WRONG_LENGTH ||
+		    (apdu->a_sw & 0xFF00) == SW_CORRECT_LE_00)) {
+			/*
+			 * The card said it could do extended lengths in the
+			 * ATR, but it didn't like this one. Go back to short
+			 * APDUs and chaining for the rest of this session.
+			 */
+			bunyan_log(BNY_DEBUG, "card rejected extended APDU, "
+			    "falling back to chaining",
+			    "reader", BNY_STRING, pk->pt_rdrname,
+			    "sw", BNY_UINT, (uint)apdu->a_sw, NULL);
+			pk->pt_ext_apdu = B_FALSE;
+			ext = B_FALSE;
+			goto restart;
+		}
 		if ((apdu->a_sw & 0xFF00) == SW_CORRECT_LE_00) {
 			apdu->a_le = apdu->a_sw & 0x00FF;
 			/*
@@ -1768,9 +2261,11 @@ again:
 	 * and don't always give us SW_BYTES_REMAINING.
 	 */
 	while ((apdu->a_sw & 0xFF00) == SW_BYTES_REMAINING_00 ||
-	    (apdu->a_sw == SW_NO_ERROR && apdu->a_reply.b_len >= 0xFF)) {
+	    (!ext && apdu->a_sw == SW_NO_ERROR &&
+	    apdu->a_reply.b_len >= 0xFF)) {
 		if (apdu->a_sw == SW_NO_ERROR)
 			gotok = B_TRUE;
+		apdu->a_ext = B_FALSE;
 		apdu->a_cls = CLA_ISO;
 		apdu->a_ins = INS_CONTINUE;
 		apdu->a_p1 = 0;
@@ -1806,12 +2301,13 @@ piv_txn_begin(struct piv_token *key)
 	errf_t *err;
 	DWORD activeProtocol = 0;
 retry:
-	rv = SCardBeginTransaction(key->pt_cardhdl);
+	rv = piv_trace_begin(key->pt_cardhdl);
 	if (rv == SCARD_W_RESET_CARD) {
-		rv = SCardReconnect(key->pt_cardhdl, SCARD_SHARE_SHARED,
-		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD,
+		rv = piv_trace_reconnect(key->pt_cardhdl, SCARD_RESET_CARD,
 		    &activeProtocol);
 		if (rv == SCARD_S_SUCCESS) {
+			/* Someone else may have changed what's on it. */
+			key->pt_absent = 0;
 			goto retry;
 		} else {
 			err = ioerrf(pcscerrf("SCardReconnect", rv),
@@ -1833,7 +2329,7 @@ piv_txn_end(struct piv_token *key)
 {
 	VERIFY(key->pt_intxn == B_TRUE);
 	LONG rv;
-	rv = SCardEndTransaction(key->pt_cardhdl,
+	rv = piv_trace_end(key->pt_cardhdl,
 	    key->pt_reset ? SCARD_RESET_CARD : SCARD_LEAVE_CARD);
 	if (rv != SCARD_S_SUCCESS) {
 		bunyan_log(BNY_ERROR, "SCardEndTransaction failed",
@@ -1843,6 +2339,12 @@ piv_txn_end(struct piv_token *key)
 	}
 	key->pt_intxn = B_FALSE;
 	key->pt_reset = B_FALSE;
+
+	if (key->pt_arena != NULL) {
+		explicit_bzero(arena_cmd(key), ARENA_HALF);
+		if (key->pt_arena_user == NULL)
+			explicit_bzero(arena_reply(key), ARENA_HALF);
+	}
 }
 
 errf_t *
@@ -1895,6 +2397,8 @@ piv_select(struct piv_token *tk)
 				tlv_skip(tlv);
 				break;
 			case PIV_TAG_APP_LABEL:
+				free(tk->pt_app_label);
+				tk->pt_app_label = NULL;
 				rv = tlv_read_string(tlv, &tk->pt_app_label);
 				if (rv != NULL)
 					goto invdata;
@@ -1902,6 +2406,8 @@ piv_select(struct piv_token *tk)
 					goto invdata;
 				break;
 			case PIV_TAG_URI:
+				free(tk->pt_app_uri);
+				tk->pt_app_uri = NULL;
 				rv = tlv_read_string(tlv, &tk->pt_app_uri);
 				if (rv != NULL)
 					goto invdata;
@@ -2191,6 +2697,7 @@ piv_write_file(struct piv_token *pt, uint tag, const uint8_t *data, size_t len)
 
 	if (apdu->a_sw == SW_NO_ERROR) {
 		err = ERRF_OK;
+		pt->pt_absent = 0;
 	} else if (apdu->a_sw == SW_OUT_OF_MEMORY) {
 		err = errf("DeviceOutOfMemoryError", swerrf("INS_PUT_DATA(%x)",
 		    apdu->a_sw, tag), "Out of memory to store file object on "
@@ -2210,6 +2717,107 @@ piv_write_file(struct piv_token *pt, uint tag, const uint8_t *data, size_t len)
 	return (err);
 }
 
+/*
+ * Allocates an empty public key of the right type for a PIV algorithm, ready
+ * to be filled in by piv_read_pubkey_tags(). Returns NULL if the algorithm
+ * isn't an asymmetric one we support.
+ */
+static struct sshkey *
+piv_alg_new_pubkey(enum piv_alg alg)
+{
+	struct sshkey *k;
+
+	switch (alg) {
+	case PIV_ALG_RSA1024:
+	case PIV_ALG_RSA2048:
+		k = sshkey_new(KEY_RSA);
+		VERIFY(k != NULL);
+		return (k);
+	case PIV_ALG_ECCP256:
+	case PIV_ALG_ECCP384:
+		k = sshkey_new(KEY_ECDSA);
+		VERIFY(k != NULL);
+		k->ecdsa_nid = (alg == PIV_ALG_ECCP256) ?
+		    NID_X9_62_prime256v1 : NID_secp384r1;
+		k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
+		EC_KEY_set_asn1_flag(k->ecdsa, OPENSSL_EC_NAMED_CURVE);
+		return (k);
+	default:
+		return (NULL);
+	}
+}
+
+/*
+ * Parses the public key data objects (tags 0x81/0x82 for RSA, 0x86 for EC)
+ * found inside the 0x7F49 template returned by GENERATE ASYMMETRIC (and the
+ * YubicoPIV GET METADATA public key tag, which uses the same encoding).
+ * Reads until the end of the enclosing tag but doesn't end it.
+ */
+static errf_t *
+piv_read_pubkey_tags(struct tlv_state *tlv, enum piv_alg alg,
+    struct sshkey *k, const char *what)
+{
+	errf_t *err;
+	int rv;
+	uint tag;
+
+	while (!tlv_at_end(tlv)) {
+		if ((err = tlv_read_tag(tlv, &tag)))
+			return (err);
+		if (alg == PIV_ALG_RSA1024 || alg == PIV_ALG_RSA2048) {
+			if (tag == 0x81) {		/* Modulus */
+				VERIFY(BN_bin2bn(tlv_ptr(tlv),
+				    tlv_rem(tlv), k->rsa->n) != NULL);
+				tlv_skip(tlv);
+				continue;
+			} else if (tag == 0x82) {	/* Exponent */
+				VERIFY(BN_bin2bn(tlv_ptr(tlv),
+				    tlv_rem(tlv), k->rsa->e) != NULL);
+				tlv_skip(tlv);
+				continue;
+			}
+		} else if (alg == PIV_ALG_ECCP256 || alg == PIV_ALG_ECCP384) {
+			if (tag == 0x86) {
+				const EC_GROUP *g;
+				EC_POINT *point;
+
+				g = EC_KEY_get0_group(k->ecdsa);
+				VERIFY(g != NULL);
+				point = EC_POINT_new(g);
+				VERIFY(point != NULL);
+				rv = EC_POINT_oct2point(g, point,
+				    tlv_ptr(tlv), tlv_rem(tlv), NULL);
+				if (rv != 1) {
+					EC_POINT_free(point);
+					make_sslerrf(err, "EC_POINT_oct2point",
+					    "parsing pubkey");
+					return (err);
+				}
+
+				rv = sshkey_ec_validate_public(g, point);
+				if (rv) {
+					EC_POINT_free(point);
+					return (ssherrf(
+					    "sshkey_ec_validate_public", rv));
+				}
+				rv = EC_KEY_set_public_key(k->ecdsa, point);
+				EC_POINT_free(point);
+				if (rv != 1) {
+					make_sslerrf(err,
+					    "EC_KEY_set_public_key",
+					    "parsing pubkey");
+					return (err);
+				}
+
+				tlv_skip(tlv);
+				continue;
+			}
+		}
+		return (tagerrf("%s", tag, what));
+	}
+	return (ERRF_OK);
+}
+
 /*
  * see [piv] 800-73-4 part 2 section 3.3.2
  */
@@ -2219,7 +2827,6 @@ piv_generate_common(struct piv_token *pt, struct apdu *apdu,
     struct sshkey **pubkey)
 {
 	errf_t *err;
-	int rv;
 	uint tag;
 	struct sshkey *k = NULL;
 
@@ -2245,89 +2852,18 @@ piv_generate_common(struct piv_token *pt, struct apdu *apdu,
 			err = tagerrf("INS_GEN_ASYM", tag);
 			goto invdata;
 		}
-		if (alg == PIV_ALG_RSA1024 || alg == PIV_ALG_RSA2048) {
-			k = sshkey_new(KEY_RSA);
-			VERIFY(k != NULL);
-		} else if (alg == PIV_ALG_ECCP256) {
-			k = sshkey_new(KEY_ECDSA);
-			VERIFY(k != NULL);
-			k->ecdsa_nid = NID_X9_62_prime256v1;
-			k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
-			EC_KEY_set_asn1_flag(k->ecdsa, OPENSSL_EC_NAMED_CURVE);
-		} else if (alg == PIV_ALG_ECCP384) {
-			k = sshkey_new(KEY_ECDSA);
-			VERIFY(k != NULL);
-			k->ecdsa_nid = NID_secp384r1;
-			k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
-			EC_KEY_set_asn1_flag(k->ecdsa, OPENSSL_EC_NAMED_CURVE);
-		} else {
+		if ((k = piv_alg_new_pubkey(alg)) == NULL) {
 			err = argerrf("alg", "a supported algorithm", "%d", alg);
 			tlv_abort(tlv);
 			goto out;
 		}
-		while (!tlv_at_end(tlv)) {
-			if ((err = tlv_read_tag(tlv, &tag)))
-				goto invdata;
-			if (alg == PIV_ALG_RSA1024 || alg == PIV_ALG_RSA2048) {
-				if (tag == 0x81) {		/* Modulus */
-					VERIFY(BN_bin2bn(tlv_ptr(tlv),
-					    tlv_rem(tlv), k->rsa->n) != NULL);
-					tlv_skip(tlv);
-					continue;
-				} else if (tag == 0x82) {	/* Exponent */
-					VERIFY(BN_bin2bn(tlv_ptr(tlv),
-					    tlv_rem(tlv), k->rsa->e) != NULL);
-					tlv_skip(tlv);
-					continue;
-				}
-			} else if (alg == PIV_ALG_ECCP256 ||
-			    alg == PIV_ALG_ECCP384) {
-				if (tag == 0x86) {
-					const EC_GROUP *g;
-					EC_POINT *point;
-
-					g = EC_KEY_get0_group(k->ecdsa);
-					VERIFY(g != NULL);
-					point = EC_POINT_new(g);
-					VERIFY(point != NULL);
-					rv = EC_POINT_oct2point(g, point,
-					    tlv_ptr(tlv), tlv_rem(tlv), NULL);
-					if (rv != 1) {
-						make_sslerrf(err,
-						    "EC_POINT_oct2point",
-						    "parsing pubkey");
-						goto invdata;
-					}
-
-					rv = sshkey_ec_validate_public(g,
-					    point);
-					if (rv) {
-						err = ssherrf(
-						    "sshkey_ec_validate_public",
-						    rv);
-						goto invdata;
-					}
-					rv = EC_KEY_set_public_key(
-					    k->ecdsa, point);
-					if (rv != 1) {
-						make_sslerrf(err,
-						    "EC_KEY_set_public_key",
-						    "parsing pubkey");
-						goto invdata;
-					}
-					EC_POINT_free(point);
-
-					tlv_skip(tlv);
-					continue;
-				}
-			}
-			err = tagerrf("INS_GEN_ASYM", tag);
+		if ((err = piv_read_pubkey_tags(tlv, alg, k, "INS_GEN_ASYM")))
 			goto invdata;
-		}
 		if ((err = tlv_end(tlv)))
 			goto invdata;
 
 		*pubkey = k;
+		pt->pt_absent &= ~PIV_SLOT_BIT(slotid);
 
 		err = ERRF_OK;
 
@@ -2345,6 +2881,7 @@ out:
 	return (err);
 
 invdata:
+	sshkey_free(k);
 	err = invderrf(err, pt->pt_rdrname);
 	debug_dump(err, apdu);
 	tlv_abort(tlv);
@@ -2393,10 +2930,12 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 	enum ykpiv_pin_policy pinpol;
 	enum ykpiv_touch_policy touchpol;
 	uint8_t v;
+	struct sshkey *k = NULL;
 
 	VERIFY(pt->pt_intxn);
 
 	/* Reject if this isn't a YubicoPIV card. */
+	piv_fill_lazy(pt, PIV_LAZY_YKPIV);
 	if (!pt->pt_ykpiv)
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 	if (ykpiv_version_compare(pt, 5, 3, 0) == -1) {
@@ -2459,6 +2998,13 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 				if (pinpol == YKPIV_PIN_NEVER) {
 					slot->ps_auth &= ~PIV_SLOT_AUTH_PIN;
 				}
+				if (pinpol == YKPIV_PIN_ALWAYS) {
+					slot->ps_auth |=
+					    PIV_SLOT_AUTH_PIN_ALWAYS;
+				} else if (pinpol != YKPIV_PIN_DEFAULT) {
+					slot->ps_auth &=
+					    ~PIV_SLOT_AUTH_PIN_ALWAYS;
+				}
 				if (touchpol == YKPIV_TOUCH_ALWAYS ||
 				    touchpol == YKPIV_TOUCH_CACHED) {
 					slot->ps_auth |= PIV_SLOT_AUTH_TOUCH;
@@ -2467,12 +3013,42 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 					slot->ps_auth &= ~PIV_SLOT_AUTH_TOUCH;
 				}
 				break;
+			case 0x04:
+				/*
+				 * The public key, encoded the same way as in
+				 * a GENERATE ASYMMETRIC response. The alg tag
+				 * always comes first. We only fill it in if
+				 * the slot doesn't already have one (from its
+				 * certificate).
+				 */
+				k = piv_alg_new_pubkey(slot->ps_alg);
+				if (k == NULL) {
+					tlv_skip(tlv);
+					break;
+				}
+				err = piv_read_pubkey_tags(tlv, slot->ps_alg, k,
+				    "YK_INS_GET_METADATA");
+				if (err)
+					goto invdata;
+				if ((err = tlv_end(tlv)))
+					goto invdata;
+				if (slot->ps_pubkey == NULL)
+					slot->ps_pubkey = k;
+				else
+					sshkey_free(k);
+				k = NULL;
+				break;
 			default:
 				tlv_skip(tlv);
 			}
 		}
 		err = NULL;
 
+	} else if (apdu->a_sw == SW_FILE_NOT_FOUND) {
+		err = errf("NotFoundError", swerrf("YK_INS_GET_METADATA",
+		    apdu->a_sw), "No key present in slot %02x in device '%s'",
+		    (uint)slot->ps_slot, pt->pt_rdrname);
+
 	} else if (apdu->a_sw == SW_FUNC_NOT_SUPPORTED) {
 		err = notsuperrf(swerrf("YK_INS_GET_METADATA", apdu->a_sw),
 		    pt->pt_rdrname, "key slot 0x%02x", slot->ps_slot);
@@ -2490,6 +3066,7 @@ out:
 	return (err);
 
 invdata:
+	sshkey_free(k);
 	tlv_abort(tlv);
 	err = invderrf(err, pt->pt_rdrname);
 	debug_dump(err, apdu);
@@ -2565,6 +3142,10 @@ ykpiv_attest_metadata(struct piv_token *pt, struct piv_slot *slot)
 	if (pinpol == YKPIV_PIN_NEVER) {
 		slot->ps_auth &= ~PIV_SLOT_AUTH_PIN;
 	}
+	if (pinpol == YKPIV_PIN_ALWAYS)
+		slot->ps_auth |= PIV_SLOT_AUTH_PIN_ALWAYS;
+	else if (pinpol != YKPIV_PIN_DEFAULT)
+		slot->ps_auth &= ~PIV_SLOT_AUTH_PIN_ALWAYS;
 	if (touchpol == YKPIV_TOUCH_ALWAYS ||
 	    touchpol == YKPIV_TOUCH_CACHED) {
 		slot->ps_auth |= PIV_SLOT_AUTH_TOUCH;
@@ -2593,6 +3174,7 @@ ykpiv_generate(struct piv_token *pt, enum piv_slotid slotid,
 	VERIFY(pt->pt_intxn);
 
 	/* Reject if this isn't a YubicoPIV card. */
+	piv_fill_lazy(pt, PIV_LAZY_YKPIV);
 	if (!pt->pt_ykpiv)
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 	/* The TOUCH_CACHED option is only supported on versions >=4.3 */
@@ -2729,6 +3311,7 @@ ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
 
 	if (apdu->a_sw == SW_NO_ERROR) {
 		err = ERRF_OK;
+		pt->pt_absent &= ~PIV_SLOT_BIT(slotid);
 	} else if (apdu->a_sw == SW_OUT_OF_MEMORY) {
 		err = errf("DeviceOutOfMemoryError",
 		    swerrf("INS_IMPORT_ASYM(%x)", apdu->a_sw, slotid),
@@ -2792,6 +3375,7 @@ piv_write_keyhistory(struct piv_token *pt, uint oncard, uint offcard,
 	err = piv_write_file(pt, PIV_TAG_KEYHIST, tlv_buf(tlv), tlv_len(tlv));
 
 	if (err == ERRF_OK) {
+		pt->pt_lazy &= ~PIV_LAZY_KEYHIST;
 		pt->pt_hist_oncard = oncard;
 		pt->pt_hist_offcard = offcard;
 		free(pt->pt_hist_url);
@@ -2806,13 +3390,56 @@ piv_write_keyhistory(struct piv_token *pt, uint oncard, uint offcard,
 	return (err);
 }
 
-errf_t *
-piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
-    const uint8_t *data, size_t datalen, uint flags)
+/*
+ * Compresses a DER certificate for storage with PIV_COMP_GZIP, in the gzip
+ * format piv_read_cert() (and other PIV middleware) expects.
+ */
+static errf_t *
+piv_gzip_cert(const uint8_t *data, size_t datalen, uint8_t **pout,
+    size_t *poutlen)
 {
-	errf_t *err;
-	struct tlv_state *tlv;
-	uint tag;
+	z_stream strm;
+	uint8_t *buf;
+	size_t buflen;
+	int rv;
+
+	bzero(&strm, sizeof (strm));
+	VERIFY0(deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 9,
+	    Z_DEFAULT_STRATEGY));
+
+	buflen = deflateBound(&strm, datalen);
+	buf = malloc(buflen);
+	VERIFY(buf != NULL);
+
+	strm.avail_in = datalen;
+	strm.next_in = (uint8_t *)data;
+	strm.avail_out = buflen;
+	strm.next_out = buf;
+
+	rv = deflate(&strm, Z_FINISH);
+	if (rv != Z_STREAM_END) {
+		(void) deflateEnd(&strm);
+		free(buf);
+		return (errf("CompressionError", NULL, "Failed to compress "
+		    "certificate (zlib error %d)", rv));
+	}
+	*poutlen = buflen - strm.avail_out;
+	*pout = buf;
+
+	VERIFY0(deflateEnd(&strm));
+
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
+    const uint8_t *data, size_t datalen, uint flags)
+{
+	errf_t *err;
+	struct tlv_state *tlv;
+	uint tag;
+	uint8_t *zdata = NULL;
+	size_t zlen = 0;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
@@ -2839,6 +3466,23 @@ piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
 		    "%02x", slotid));
 	}
 
+	if ((flags & PIV_CI_COMPTYPE) == PIV_COMP_GZIP) {
+		err = piv_gzip_cert(data, datalen, &zdata, &zlen);
+		if (err)
+			return (err);
+		if (zlen < datalen) {
+			bunyan_log(BNY_DEBUG, "compressed cert",
+			    "uncompressed_len", BNY_UINT, (uint)datalen,
+			    "compressed_len", BNY_UINT, (uint)zlen, NULL);
+			data = zdata;
+			datalen = zlen;
+		} else {
+			/* Not worth it: the card will have to send more. */
+			flags &= ~PIV_CI_COMPTYPE;
+			flags |= PIV_COMP_NONE;
+		}
+	}
+
 	tlv = tlv_init_write();
 	tlv_pushl(tlv, 0x70, datalen + 3);
 	tlv_write(tlv, data, datalen);
@@ -2850,6 +3494,11 @@ piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
 	err = piv_write_file(pk, tag, tlv_buf(tlv), tlv_len(tlv));
 
 	tlv_free(tlv);
+	free(zdata);
+
+	/* Any cached copy of our slots is now out of date. */
+	if (err == ERRF_OK)
+		piv_cache_forget(pk);
 
 	return (err);
 }
@@ -2868,6 +3517,7 @@ ykpiv_attest(struct piv_token *pt, struct piv_slot *slot, uint8_t **data,
 	struct apdu *apdu;
 
 	VERIFY(pt->pt_intxn == B_TRUE);
+	piv_fill_lazy(pt, PIV_LAZY_YKPIV);
 	if (!pt->pt_ykpiv)
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
@@ -3013,6 +3663,117 @@ piv_file_data_free(uint8_t *data, size_t len)
 	freezero(data, len);
 }
 
+/*
+ * Adds (or replaces) the slot for slotid on a token, given the certificate
+ * which was found in it. Takes ownership of cert.
+ */
+static errf_t *
+piv_slot_set_cert(struct piv_token *pk, enum piv_slotid slotid, X509 *cert,
+    struct piv_slot **pslot)
+{
+	errf_t *err;
+	int rv;
+	struct piv_slot *pc;
+	EVP_PKEY *pkey;
+	struct sshkey *k = NULL;
+
+	for (pc = pk->pt_slots; pc != NULL; pc = pc->ps_next) {
+		if (pc->ps_slot == slotid)
+			break;
+	}
+	if (pc == NULL) {
+		pc = calloc(1, sizeof (struct piv_slot));
+		VERIFY(pc != NULL);
+		if (pk->pt_last_slot == NULL) {
+			pk->pt_slots = pc;
+		} else {
+			pk->pt_last_slot->ps_next = pc;
+		}
+		pk->pt_last_slot = pc;
+	} else {
+		OPENSSL_free((void *)pc->ps_subj);
+		X509_free(pc->ps_x509);
+	}
+	switch (pc->ps_slot) {
+	case PIV_SLOT_CARD_AUTH:
+	case PIV_SLOT_YK_ATTESTATION:
+		break;
+	default:
+		pc->ps_auth |= PIV_SLOT_AUTH_PIN;
+		break;
+	}
+	pc->ps_slot = slotid;
+	pc->ps_x509 = cert;
+	pc->ps_subj = X509_NAME_oneline(
+	    X509_get_subject_name(cert), NULL, 0);
+	pc->ps_certpending = B_FALSE;
+	pkey = X509_get_pubkey(cert);
+	VERIFY(pkey != NULL);
+	rv = sshkey_from_evp_pkey(pkey, KEY_UNSPEC, &k);
+	EVP_PKEY_free(pkey);
+	if (rv != 0) {
+		sshkey_free(pc->ps_pubkey);
+		pc->ps_pubkey = NULL;
+		return (invderrf(ssherrf("sshkey_from_evp_pkey", rv),
+		    pk->pt_rdrname));
+	}
+	/*
+	 * If we already had this key (e.g. from piv_read_all_keys()) keep the
+	 * existing sshkey, since callers may be holding on to it.
+	 */
+	if (pc->ps_pubkey != NULL && sshkey_equal_public(pc->ps_pubkey, k)) {
+		sshkey_free(k);
+	} else {
+		sshkey_free(pc->ps_pubkey);
+		pc->ps_pubkey = k;
+	}
+
+	err = NULL;
+
+	switch (pc->ps_pubkey->type) {
+	case KEY_ECDSA:
+		switch (sshkey_size(pc->ps_pubkey)) {
+		case 256:
+			pc->ps_alg = PIV_ALG_ECCP256;
+			break;
+		case 384:
+			pc->ps_alg = PIV_ALG_ECCP384;
+			break;
+		default:
+			err = invderrf(errf("BadAlgorithmError", NULL,
+			    "Cert subj is EC key of size %u, not "
+			    "supported by PIV",
+			    sshkey_size(pc->ps_pubkey)),
+			    pk->pt_rdrname);
+		}
+		break;
+	case KEY_RSA:
+		switch (sshkey_size(pc->ps_pubkey)) {
+		case 1024:
+			pc->ps_alg = PIV_ALG_RSA1024;
+			break;
+		case 2048:
+			pc->ps_alg = PIV_ALG_RSA2048;
+			break;
+		default:
+			err = invderrf(errf("BadAlgorithmError", NULL,
+			    "Cert subj is RSA key of size %u, not "
+			    "supported by PIV",
+			    sshkey_size(pc->ps_pubkey)),
+			    pk->pt_rdrname);
+		}
+		break;
+	default:
+		err = invderrf(errf("BadAlgorithmError", NULL,
+		    "Certificate subject key is of unsupported type: "
+		    "%s", sshkey_type(pc->ps_pubkey)), pk->pt_rdrname);
+	}
+
+
+	*pslot = pc;
+	return (err);
+}
+
 /*
  * The structure inside the certificate objects is documented in
  * [piv] 800-73-4 part 2 appendix A, in tables 15 and onwards
@@ -3024,7 +3785,6 @@ errf_t *
 piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 {
 	errf_t *err;
-	int rv;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
 	uint tag;
@@ -3032,7 +3792,6 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 	size_t len = 0;
 	X509 *cert;
 	struct piv_slot *pc;
-	EVP_PKEY *pkey;
 	uint8_t certinfo = 0;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
@@ -3187,88 +3946,11 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 		free(buf);
 		buf = NULL;
 
-		for (pc = pk->pt_slots; pc != NULL; pc = pc->ps_next) {
-			if (pc->ps_slot == slotid)
-				break;
-		}
-		if (pc == NULL) {
-			pc = calloc(1, sizeof (struct piv_slot));
-			VERIFY(pc != NULL);
-			if (pk->pt_last_slot == NULL) {
-				pk->pt_slots = pc;
-			} else {
-				pk->pt_last_slot->ps_next = pc;
-			}
-			pk->pt_last_slot = pc;
-		} else {
-			OPENSSL_free((void *)pc->ps_subj);
-			X509_free(pc->ps_x509);
-			sshkey_free(pc->ps_pubkey);
-		}
-		switch (pc->ps_slot) {
-		case PIV_SLOT_CARD_AUTH:
-		case PIV_SLOT_YK_ATTESTATION:
-			break;
-		default:
-			pc->ps_auth |= PIV_SLOT_AUTH_PIN;
-			break;
-		}
-		pc->ps_slot = slotid;
-		pc->ps_x509 = cert;
-		pc->ps_subj = X509_NAME_oneline(
-		    X509_get_subject_name(cert), NULL, 0);
-		pkey = X509_get_pubkey(cert);
-		VERIFY(pkey != NULL);
-		rv = sshkey_from_evp_pkey(pkey, KEY_UNSPEC,
-		    &pc->ps_pubkey);
-		EVP_PKEY_free(pkey);
-		if (rv != 0) {
-			err = ssherrf("sshkey_from_evp_pkey", rv);
-			goto invdata;
-		}
-
-		err = NULL;
-
-		switch (pc->ps_pubkey->type) {
-		case KEY_ECDSA:
-			switch (sshkey_size(pc->ps_pubkey)) {
-			case 256:
-				pc->ps_alg = PIV_ALG_ECCP256;
-				break;
-			case 384:
-				pc->ps_alg = PIV_ALG_ECCP384;
-				break;
-			default:
-				err = invderrf(errf("BadAlgorithmError", NULL,
-				    "Cert subj is EC key of size %u, not "
-				    "supported by PIV",
-				    sshkey_size(pc->ps_pubkey)),
-				    pk->pt_rdrname);
-			}
-			break;
-		case KEY_RSA:
-			switch (sshkey_size(pc->ps_pubkey)) {
-			case 1024:
-				pc->ps_alg = PIV_ALG_RSA1024;
-				break;
-			case 2048:
-				pc->ps_alg = PIV_ALG_RSA2048;
-				break;
-			default:
-				err = invderrf(errf("BadAlgorithmError", NULL,
-				    "Cert subj is RSA key of size %u, not "
-				    "supported by PIV",
-				    sshkey_size(pc->ps_pubkey)),
-				    pk->pt_rdrname);
-			}
-			break;
-		default:
-			err = invderrf(errf("BadAlgorithmError", NULL,
-			    "Certificate subject key is of unsupported type: "
-			    "%s", sshkey_type(pc->ps_pubkey)), pk->pt_rdrname);
-		}
+		err = piv_slot_set_cert(pk, slotid, cert, &pc);
+		pk->pt_absent &= ~PIV_SLOT_BIT(slotid);
 
-		if (err == NULL && pk->pt_ykpiv &&
+		piv_fill_lazy(pk, PIV_LAZY_YKPIV);
+		if (err == NULL && !pc->ps_got_metadata && pk->pt_ykpiv &&
 		    ykpiv_version_compare(pk, 5, 3, 0) >= 0) {
 			err = ykpiv_get_metadata(pk, pc);
 			if (err == ERRF_OK) {
@@ -3284,6 +3966,11 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 		err = errf("NotFoundError", swerrf("INS_GET_DATA", apdu->a_sw),
 		    "No certificate found for slot %02x in device '%s'",
 		    slotid, pk->pt_rdrname);
+		/* A key found by piv_read_all_keys() with no cert. */
+		if ((pc = piv_get_slot(pk, slotid)) != NULL)
+			pc->ps_certpending = B_FALSE;
+		else
+			pk->pt_absent |= PIV_SLOT_BIT(slotid);
 
 	} else if (apdu->a_sw == SW_SECURITY_STATUS_NOT_SATISFIED) {
 		err = permerrf(swerrf("INS_GET_DATA", apdu->a_sw), pk->pt_rdrname,
@@ -3293,6 +3980,7 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 	    apdu->a_sw == SW_WRONG_DATA) {
 		err = notsuperrf(swerrf("INS_GET_DATA", apdu->a_sw),
 		    pk->pt_rdrname, "Certificate slot %02x", slotid);
+		pk->pt_absent |= PIV_SLOT_BIT(slotid);
 
 	} else {
 		err = swerrf("INS_GET_DATA", apdu->a_sw);
@@ -3322,6 +4010,7 @@ piv_slot_get_auth(struct piv_token *pt, struct piv_slot *slot)
 	if (slot->ps_got_metadata)
 		return (slot->ps_auth);
 
+	piv_fill_lazy(pt, PIV_LAZY_YKPIV);
 	if (pt->pt_ykpiv && ykpiv_version_compare(pt, 5, 3, 0) >= 0) {
 		err = ykpiv_get_metadata(pt, slot);
 		if (err == ERRF_OK) {
@@ -3364,37 +4053,38 @@ read_all_aborts_on(errf_t *err)
 	    !errf_caused_by(err, "NotSupportedError"));
 }
 
+/* The standard key slots, in the order we read them. */
+static const enum piv_slotid piv_std_slots[] = {
+	PIV_SLOT_9E, PIV_SLOT_9A, PIV_SLOT_9C, PIV_SLOT_9D
+};
+#define	PIV_STD_SLOTS	(sizeof (piv_std_slots) / sizeof (piv_std_slots[0]))
+
 errf_t *
 piv_read_all_certs(struct piv_token *tk)
 {
 	errf_t *err;
+	enum piv_slotid slotid;
 	uint i;
 
 	VERIFY(tk->pt_intxn == B_TRUE);
 
-	err = piv_read_cert(tk, PIV_SLOT_9E);
-	if (read_all_aborts_on(err))
-		return (err);
-	else if (err)
-		errf_free(err);
-	err = piv_read_cert(tk, PIV_SLOT_9A);
-	if (read_all_aborts_on(err))
-		return (err);
-	else if (err)
-		errf_free(err);
-	err = piv_read_cert(tk, PIV_SLOT_9C);
-	if (read_all_aborts_on(err))
-		return (err);
-	else if (err)
-		errf_free(err);
-	err = piv_read_cert(tk, PIV_SLOT_9D);
-	if (read_all_aborts_on(err))
-		return (err);
-	else if (err)
-		errf_free(err);
+	for (i = 0; i < PIV_STD_SLOTS; ++i) {
+		slotid = piv_std_slots[i];
+		if (tk->pt_absent & PIV_SLOT_BIT(slotid))
+			continue;
+		err = piv_read_cert(tk, slotid);
+		if (read_all_aborts_on(err))
+			return (err);
+		else if (err)
+			errf_free(err);
+	}
 
+	piv_fill_lazy(tk, PIV_LAZY_KEYHIST);
 	for (i = 0; i < tk->pt_hist_oncard; ++i) {
-		err = piv_read_cert(tk, PIV_SLOT_RETIRED_1 + i);
+		slotid = PIV_SLOT_RETIRED_1 + i;
+		if (tk->pt_absent & PIV_SLOT_BIT(slotid))
+			continue;
+		err = piv_read_cert(tk, slotid);
 		if (read_all_aborts_on(err) && !errf_caused_by(err, "APDUError"))
 			return (err);
 		else if (err)
@@ -3406,6 +4096,477 @@ piv_read_all_certs(struct piv_token *tk)
 	return (ERRF_OK);
 }
 
+/*
+ * Fills in a slot from the YubicoPIV GET METADATA response for it, which
+ * includes the public key. Leaves the certificate to be read on demand
+ * unless the key is the same one we already had a certificate for.
+ */
+static errf_t *
+piv_read_key(struct piv_token *tk, enum piv_slotid slotid)
+{
+	struct piv_slot tmp, *pc;
+	errf_t *err;
+
+	bzero(&tmp, sizeof (tmp));
+	tmp.ps_slot = slotid;
+	if (slotid != PIV_SLOT_CARD_AUTH)
+		tmp.ps_auth = PIV_SLOT_AUTH_PIN;
+
+	if ((err = ykpiv_get_metadata(tk, &tmp))) {
+		if (errf_caused_by(err, "NotFoundError") &&
+		    piv_get_slot(tk, slotid) == NULL)
+			tk->pt_absent |= PIV_SLOT_BIT(slotid);
+		return (err);
+	}
+	if (tmp.ps_pubkey == NULL) {
+		return (errf("NotFoundError", NULL, "No public key in "
+		    "metadata for slot %02x in device '%s'", (uint)slotid,
+		    tk->pt_rdrname));
+	}
+
+	pc = piv_get_slot(tk, slotid);
+	if (pc != NULL && pc->ps_pubkey != NULL &&
+	    sshkey_equal_public(pc->ps_pubkey, tmp.ps_pubkey)) {
+		sshkey_free(tmp.ps_pubkey);
+	} else {
+		pc = piv_force_slot(tk, slotid, tmp.ps_alg);
+		OPENSSL_free((void *)pc->ps_subj);
+		X509_free(pc->ps_x509);
+		sshkey_free(pc->ps_pubkey);
+		pc->ps_subj = NULL;
+		pc->ps_x509 = NULL;
+		pc->ps_pubkey = tmp.ps_pubkey;
+		pc->ps_token = tk;
+		pc->ps_certpending = B_TRUE;
+	}
+	pc->ps_auth = tmp.ps_auth;
+	pc->ps_got_metadata = B_TRUE;
+
+	return (ERRF_OK);
+}
+
+/*
+ * Reads a slot for piv_read_all_keys(): the key from its metadata if we can,
+ * otherwise the cert. Returns NotFoundError if the slot is empty.
+ */
+static errf_t *
+piv_read_key_or_cert(struct piv_token *tk, enum piv_slotid slotid)
+{
+	errf_t *err;
+
+	err = piv_read_key(tk, slotid);
+	if (err == ERRF_OK || errf_caused_by(err, "NotFoundError"))
+		return (err);
+
+	/* Something odd about the metadata: try the cert instead. */
+	bunyan_log(BNY_DEBUG, "reading key metadata failed, using cert",
+	    "reader", BNY_STRING, tk->pt_rdrname,
+	    "slot", BNY_UINT, (uint)slotid,
+	    "error", BNY_ERF, err, NULL);
+	errf_free(err);
+	return (piv_read_cert(tk, slotid));
+}
+
+errf_t *
+piv_read_all_keys(struct piv_token *tk)
+{
+	errf_t *err;
+	enum piv_slotid slotid;
+	uint i;
+
+	VERIFY(tk->pt_intxn == B_TRUE);
+
+	piv_fill_lazy(tk, PIV_LAZY_YKPIV);
+	if (!tk->pt_ykpiv || ykpiv_version_compare(tk, 5, 3, 0) == -1)
+		return (piv_read_all_certs(tk));
+
+	for (i = 0; i < PIV_STD_SLOTS; ++i) {
+		slotid = piv_std_slots[i];
+		if (tk->pt_absent & PIV_SLOT_BIT(slotid))
+			continue;
+		err = piv_read_key_or_cert(tk, slotid);
+		if (read_all_aborts_on(err))
+			return (err);
+		else if (err)
+			errf_free(err);
+	}
+
+	piv_fill_lazy(tk, PIV_LAZY_KEYHIST);
+	for (i = 0; i < tk->pt_hist_oncard; ++i) {
+		slotid = PIV_SLOT_RETIRED_1 + i;
+		if (tk->pt_absent & PIV_SLOT_BIT(slotid))
+			continue;
+		err = piv_read_key_or_cert(tk, slotid);
+		if (read_all_aborts_on(err) && !errf_caused_by(err, "APDUError"))
+			return (err);
+		else if (err)
+			errf_free(err);
+	}
+
+	return (ERRF_OK);
+}
+
+/*
+ * Called by the cert accessors to read the certificate for a slot which was
+ * found by piv_read_all_keys(). Like piv_fill_lazy(), we open our own txn if
+ * we need to and can't return errors, so failures are just logged. If the
+ * card says there's no cert there, we don't ask again.
+ */
+static void
+piv_slot_fill_cert(struct piv_slot *slot)
+{
+	struct piv_token *pk = slot->ps_token;
+	boolean_t ourtxn = B_FALSE;
+	errf_t *err;
+
+	if (!slot->ps_certpending)
+		return;
+
+	if (!pk->pt_intxn) {
+		if ((err = piv_txn_begin(pk)))
+			goto out;
+		ourtxn = B_TRUE;
+		if ((err = piv_select(pk)))
+			goto out;
+	}
+	err = piv_read_cert(pk, slot->ps_slot);
+
+out:
+	if (ourtxn)
+		piv_txn_end(pk);
+	if (err) {
+		if (errf_caused_by(err, "NotFoundError") ||
+		    errf_caused_by(err, "PermissionError") ||
+		    errf_caused_by(err, "NotSupportedError") ||
+		    errf_caused_by(err, "InvalidDataError"))
+			slot->ps_certpending = B_FALSE;
+		bunyan_log(BNY_DEBUG, "failed to read slot cert on demand",
+		    "reader", BNY_STRING, pk->pt_rdrname,
+		    "slot", BNY_UINT, (uint)slot->ps_slot,
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+}
+
+/*
+ * Token slot cache.
+ *
+ * Reading every cert object off a token can take a couple of seconds (most
+ * of it spent in GET DATA over T=1), which hurts tools that start cold. When
+ * the user opts in (by setting PIVY_CACHE), we keep a copy of the slots we
+ * found in a file per token GUID, so that the next process can skip
+ * piv_read_all_certs() if nothing on the card appears to have changed.
+ *
+ * The check for "nothing has changed" is a digest over the CHUID, key
+ * history and YubiKey version/serial, all of which are read by
+ * piv_enumerate() and piv_find() anyway. It won't notice a new cert being
+ * written by some other tool, so long-lived users (like pivy-agent) should
+ * still re-read the certs once things are quiet and re-save the cache.
+ */
+
+#define	PIV_CACHE_MAGIC		"pivy-token-cache"
+#define	PIV_CACHE_VERSION	1
+
+char *
+piv_cache_dir(void)
+{
+	const char *env, *home;
+	char *path;
+
+	env = getenv("PIVY_CACHE");
+	if (env == NULL || *env == '\0')
+		return (NULL);
+	if (*env == '/')
+		return (strdup(env));
+
+	path = calloc(1, PATH_MAX);
+	VERIFY(path != NULL);
+	if ((home = getenv("XDG_CACHE_HOME")) != NULL && *home == '/') {
+		snprintf(path, PATH_MAX, "%s/pivy", home);
+	} else if ((home = getenv("HOME")) != NULL) {
+		snprintf(path, PATH_MAX, "%s/.cache/pivy", home);
+	} else {
+		free(path);
+		return (NULL);
+	}
+	return (path);
+}
+
+static void
+piv_cache_tag(const struct piv_token *pk, uint8_t *tag, size_t taglen)
+{
+	struct sshbuf *b;
+
+	b = sshbuf_new();
+	VERIFY(b != NULL);
+	VERIFY0(sshbuf_put(b, pk->pt_guid, sizeof (pk->pt_guid)));
+	VERIFY0(sshbuf_put_string(b, pk->pt_fascn, pk->pt_fascn_len));
+	VERIFY0(sshbuf_put(b, pk->pt_expiry, sizeof (pk->pt_expiry)));
+	VERIFY0(sshbuf_put_u8(b, pk->pt_haschuuid));
+	VERIFY0(sshbuf_put(b, pk->pt_chuuid, sizeof (pk->pt_chuuid)));
+	VERIFY0(sshbuf_put_u8(b, pk->pt_signedchuid));
+	VERIFY0(sshbuf_put_u8(b, pk->pt_hist_oncard));
+	VERIFY0(sshbuf_put_u8(b, pk->pt_hist_offcard));
+	VERIFY0(sshbuf_put_u8(b, pk->pt_ykpiv));
+	VERIFY0(sshbuf_put(b, pk->pt_ykver, sizeof (pk->pt_ykver)));
+	VERIFY0(sshbuf_put_u8(b, pk->pt_ykserial_valid));
+	VERIFY0(sshbuf_put_u32(b, pk->pt_ykserial));
+	VERIFY0(ssh_digest_memory(SSH_DIGEST_SHA256, sshbuf_ptr(b),
+	    sshbuf_len(b), tag, taglen));
+	sshbuf_free(b);
+}
+
+static char *
+piv_cache_path(const struct piv_token *pk, const char *dir)
+{
+	char *path;
+
+	path = calloc(1, PATH_MAX);
+	VERIFY(path != NULL);
+	snprintf(path, PATH_MAX, "%s/%s",
+	    dir, piv_token_guid_hex(pk));
+	return (path);
+}
+
+errf_t *
+piv_cache_load(struct piv_token *pk, const char *dir)
+{
+	errf_t *err = NULL;
+	struct sshbuf *b = NULL;
+	char *path = NULL, *magic = NULL;
+	FILE *f = NULL;
+	uint8_t buf[4096];
+	uint8_t tag[32];
+	const uint8_t *ctag, *cguid, *der;
+	size_t n, ctaglen, cguidlen, derlen;
+	uint8_t ver, slotid, alg, auth, gotmeta;
+	uint32_t nslots, i;
+	struct piv_slot *pc;
+	X509 *cert;
+	int rc;
+
+	if (pk->pt_nochuid) {
+		return (argerrf("tk", "a token with a CHUID",
+		    "a token without one"));
+	}
+
+	path = piv_cache_path(pk, dir);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		err = errf("NotFoundError", errfno("fopen", errno, "%s", path),
+		    "No cached data for token %s", piv_token_guid_hex(pk));
+		goto out;
+	}
+	b = sshbuf_new();
+	VERIFY(b != NULL);
+	while ((n = fread(buf, 1, sizeof (buf), f)) > 0) {
+		if ((rc = sshbuf_put(b, buf, n))) {
+			err = ssherrf("sshbuf_put", rc);
+			goto out;
+		}
+	}
+	if (ferror(f)) {
+		err = errfno("fread", errno, "%s", path);
+		goto out;
+	}
+
+	if ((rc = sshbuf_get_cstring(b, &magic, NULL)) ||
+	    (rc = sshbuf_get_u8(b, &ver)) ||
+	    (rc = sshbuf_get_string_direct(b, &cguid, &cguidlen)) ||
+	    (rc = sshbuf_get_string_direct(b, &ctag, &ctaglen)) ||
+	    (rc = sshbuf_get_u32(b, &nslots))) {
+		err = ssherrf("sshbuf_get", rc);
+		goto invdata;
+	}
+	if (strcmp(magic, PIV_CACHE_MAGIC) != 0 || ver != PIV_CACHE_VERSION) {
+		err = errf("CacheVersionError", NULL, "Unsupported cache "
+		    "file format");
+		goto invdata;
+	}
+
+	piv_cache_tag(pk, tag, sizeof (tag));
+	if (cguidlen != sizeof (pk->pt_guid) ||
+	    bcmp(cguid, pk->pt_guid, cguidlen) != 0 ||
+	    ctaglen != sizeof (tag) || bcmp(ctag, tag, ctaglen) != 0) {
+		err = errf("StaleCacheError", NULL, "Cached data for token "
+		    "%s no longer matches the card", piv_token_guid_hex(pk));
+		goto out;
+	}
+
+	for (i = 0; i < nslots; ++i) {
+		if ((rc = sshbuf_get_u8(b, &slotid)) ||
+		    (rc = sshbuf_get_u8(b, &alg)) ||
+		    (rc = sshbuf_get_u8(b, &auth)) ||
+		    (rc = sshbuf_get_u8(b, &gotmeta)) ||
+		    (rc = sshbuf_get_string_direct(b, &der, &derlen))) {
+			err = ssherrf("sshbuf_get", rc);
+			goto invdata;
+		}
+		cert = d2i_X509(NULL, &der, derlen);
+		if (cert == NULL) {
+			make_sslerrf(err, "d2i_X509", "parsing cached cert "
+			    "%02x", (uint)slotid);
+			goto invdata;
+		}
+		if ((err = piv_slot_set_cert(pk, slotid, cert, &pc)))
+			goto invdata;
+		pc->ps_alg = alg;
+		pc->ps_auth = auth;
+		pc->ps_got_metadata = (gotmeta != 0);
+	}
+	pk->pt_did_read_all = B_TRUE;
+
+	bunyan_log(BNY_DEBUG, "loaded token slots from cache",
+	    "guid", BNY_STRING, piv_token_guid_hex(pk),
+	    "path", BNY_STRING, path,
+	    "nslots", BNY_UINT, (uint)nslots, NULL);
+
+out:
+	if (f != NULL)
+		fclose(f);
+	sshbuf_free(b);
+	free(magic);
+	free(path);
+	return (err);
+
+invdata:
+	err = errf("InvalidDataError", err, "Cache file for token %s is "
+	    "corrupt", piv_token_guid_hex(pk));
+	goto out;
+}
+
+errf_t *
+piv_cache_save(struct piv_token *pk, const char *dir)
+{
+	errf_t *err = NULL;
+	struct sshbuf *b = NULL;
+	char *path = NULL, *tpath = NULL, *parent = NULL, *p;
+	uint8_t tag[32];
+	struct piv_slot *pc;
+	uint8_t *der = NULL;
+	int derlen, fd = -1;
+	uint32_t nslots = 0;
+	ssize_t done;
+	size_t off;
+
+	if (pk->pt_nochuid) {
+		return (argerrf("tk", "a token with a CHUID",
+		    "a token without one"));
+	}
+	if (!pk->pt_did_read_all) {
+		return (argerrf("tk", "a token with all certs read",
+		    "a token without"));
+	}
+
+	/* Make sure the directory (and e.g. ~/.cache above it) exists. */
+	parent = strdup(dir);
+	VERIFY(parent != NULL);
+	if ((p = strrchr(parent, '/')) != NULL && p != parent) {
+		*p = '\0';
+		(void) mkdir(parent, 0700);
+	}
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		err = errfno("mkdir", errno, "%s", dir);
+		goto out;
+	}
+
+	for (pc = pk->pt_slots; pc != NULL; pc = pc->ps_next) {
+		if (pc->ps_x509 != NULL && pc->ps_pubkey != NULL)
+			++nslots;
+	}
+
+	piv_cache_tag(pk, tag, sizeof (tag));
+	b = sshbuf_new();
+	VERIFY(b != NULL);
+	VERIFY0(sshbuf_put_cstring(b, PIV_CACHE_MAGIC));
+	VERIFY0(sshbuf_put_u8(b, PIV_CACHE_VERSION));
+	VERIFY0(sshbuf_put_string(b, pk->pt_guid, sizeof (pk->pt_guid)));
+	VERIFY0(sshbuf_put_string(b, tag, sizeof (tag)));
+	VERIFY0(sshbuf_put_u32(b, nslots));
+	for (pc = pk->pt_slots; pc != NULL; pc = pc->ps_next) {
+		if (pc->ps_x509 == NULL || pc->ps_pubkey == NULL)
+			continue;
+		der = NULL;
+		derlen = i2d_X509(pc->ps_x509, &der);
+		if (derlen < 0) {
+			make_sslerrf(err, "i2d_X509", "serialising cert %02x",
+			    (uint)pc->ps_slot);
+			goto out;
+		}
+		VERIFY0(sshbuf_put_u8(b, pc->ps_slot));
+		VERIFY0(sshbuf_put_u8(b, pc->ps_alg));
+		VERIFY0(sshbuf_put_u8(b, pc->ps_auth));
+		VERIFY0(sshbuf_put_u8(b, pc->ps_got_metadata));
+		VERIFY0(sshbuf_put_string(b, der, derlen));
+		OPENSSL_free(der);
+		der = NULL;
+	}
+
+	path = piv_cache_path(pk, dir);
+	tpath = calloc(1, PATH_MAX);
+	VERIFY(tpath != NULL);
+	snprintf(tpath, PATH_MAX, "%s.%d", path, (int)getpid());
+
+	fd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		err = errfno("open", errno, "%s", tpath);
+		goto out;
+	}
+	for (off = 0; off < sshbuf_len(b); off += done) {
+		done = write(fd, sshbuf_ptr(b) + off, sshbuf_len(b) - off);
+		if (done < 0 && errno == EINTR) {
+			done = 0;
+			continue;
+		}
+		if (done < 0) {
+			err = errfno("write", errno, "%s", tpath);
+			goto out;
+		}
+	}
+	if (close(fd) != 0) {
+		fd = -1;
+		err = errfno("close", errno, "%s", tpath);
+		goto out;
+	}
+	fd = -1;
+	if (rename(tpath, path) != 0) {
+		err = errfno("rename", errno, "%s", path);
+		goto out;
+	}
+
+	bunyan_log(BNY_DEBUG, "saved token slots to cache",
+	    "guid", BNY_STRING, piv_token_guid_hex(pk),
+	    "path", BNY_STRING, path,
+	    "nslots", BNY_UINT, (uint)nslots, NULL);
+
+out:
+	if (fd >= 0) {
+		close(fd);
+		(void) unlink(tpath);
+	} else if (err != NULL && tpath != NULL) {
+		(void) unlink(tpath);
+	}
+	OPENSSL_free(der);
+	sshbuf_free(b);
+	free(parent);
+	free(path);
+	free(tpath);
+	return (err);
+}
+
+void
+piv_cache_forget(struct piv_token *pk)
+{
+	char *dir, *path;
+
+	if (pk->pt_nochuid || (dir = piv_cache_dir()) == NULL)
+		return;
+	path = piv_cache_path(pk, dir);
+	(void) unlink(path);
+	free(path);
+	free(dir);
+}
+
 /*
  * see [piv] 800-83-4 part 2 section 3.2.2
  */
@@ -3568,6 +4729,7 @@ ykpiv_reset(struct piv_token *pt)
 	if (apdu->a_sw == SW_NO_ERROR) {
 		err = ERRF_OK;
 		pt->pt_reset = B_TRUE;
+		pt->pt_absent = 0;
 
 	} else if (apdu->a_sw == SW_SECURITY_STATUS_NOT_SATISFIED) {
 		err = permerrf(swerrf("INS_RESET", apdu->a_sw),
@@ -3897,44 +5059,45 @@ piv_verify_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
 	return (err);
 }
 
-errf_t *
-piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
-    size_t datalen, enum sshdigest_types *hashalgo, uint8_t **signature,
-    size_t *siglen)
+/*
+ * Works out the hash algorithm, digest length and input block length for a
+ * signature with the key in "slot". If the card can only do hash-on-card for
+ * this slot, "cardalg" is set to the algorithm ID to use instead (and the data
+ * goes to the card as-is), otherwise it's set to 0.
+ */
+static errf_t *
+piv_sign_params(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types *hashalgo, size_t *inplen, size_t *dglen,
+    enum piv_alg *cardalg)
 {
 	int i;
-	errf_t *err;
-	struct ssh_digest_ctx *hctx;
-	uint8_t *buf;
-	size_t nread, dglen, inplen;
 	boolean_t cardhash = B_FALSE, ch_sha256 = B_FALSE, ch_sha384 = B_FALSE;
-	enum piv_alg oldalg;
 
-	VERIFY(tk->pt_intxn);
+	*cardalg = 0;
 
 	switch (slot->ps_alg) {
 	case PIV_ALG_RSA1024:
-		inplen = 128;
+		*inplen = 128;
 		if (*hashalgo == SSH_DIGEST_SHA1) {
-			dglen = 20;
+			*dglen = 20;
 		} else {
 			*hashalgo = SSH_DIGEST_SHA256;
-			dglen = 32;
+			*dglen = 32;
 		}
 		break;
 	case PIV_ALG_RSA2048:
-		inplen = 256;
+		*inplen = 256;
 		if (*hashalgo == SSH_DIGEST_SHA1) {
-			dglen = 20;
+			*dglen = 20;
 		} else if (*hashalgo == SSH_DIGEST_SHA512) {
-			dglen = 64;
+			*dglen = 64;
 		} else {
 			*hashalgo = SSH_DIGEST_SHA256;
-			dglen = 32;
+			*dglen = 32;
 		}
 		break;
 	case PIV_ALG_ECCP256:
-		inplen = 32;
+		*inplen = 32;
 		/*
 		 * JC22x cards running PivApplet have proprietary algorithm IDs
 		 * for hash-on-card ECDSA since they can't sign a precomputed
@@ -3953,32 +5116,29 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 			}
 		}
 		if (*hashalgo == SSH_DIGEST_SHA1) {
-			dglen = 20;
+			*dglen = 20;
 			if (cardhash) {
 				/*
 				 * In sign_prehash we just send ps_alg as the
-				 * alg ID to the card. So stash the old one here
-				 * and replace it with the _SHA* variant.
+				 * alg ID to the card, so piv_sign() will swap
+				 * in this _SHA* variant while it signs.
 				 */
-				oldalg = slot->ps_alg;
-				slot->ps_alg = PIV_ALG_ECCP256_SHA1;
+				*cardalg = PIV_ALG_ECCP256_SHA1;
 			}
 		} else {
 			*hashalgo = SSH_DIGEST_SHA256;
-			dglen = 32;
+			*dglen = 32;
 			if (cardhash && ch_sha256) {
-				oldalg = slot->ps_alg;
-				slot->ps_alg = PIV_ALG_ECCP256_SHA256;
+				*cardalg = PIV_ALG_ECCP256_SHA256;
 			} else if (cardhash) {
 				*hashalgo = SSH_DIGEST_SHA1;
-				dglen = 20;
-				oldalg = slot->ps_alg;
-				slot->ps_alg = PIV_ALG_ECCP256_SHA1;
+				*dglen = 20;
+				*cardalg = PIV_ALG_ECCP256_SHA1;
 			}
 		}
 		break;
 	case PIV_ALG_ECCP384:
-		inplen = 48;
+		*inplen = 48;
 		/*
 		 * JC22x cards running PivApplet have proprietary algorithm IDs
 		 * for hash-on-card ECDSA since they can't sign a precomputed
@@ -4000,38 +5160,32 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 			}
 		}
 		if (*hashalgo == SSH_DIGEST_SHA1) {
-			dglen = 20;
+			*dglen = 20;
 			if (cardhash) {
-				oldalg = slot->ps_alg;
-				slot->ps_alg = PIV_ALG_ECCP384_SHA1;
+				*cardalg = PIV_ALG_ECCP384_SHA1;
 			}
 		} else if (*hashalgo == SSH_DIGEST_SHA256) {
-			dglen = 32;
+			*dglen = 32;
 			if (cardhash && ch_sha256) {
-				oldalg = slot->ps_alg;
-				slot->ps_alg = PIV_ALG_ECCP384_SHA256;
+				*cardalg = PIV_ALG_ECCP384_SHA256;
 			} else if (cardhash) {
 				*hashalgo = SSH_DIGEST_SHA1;
-				dglen = 20;
-				oldalg = slot->ps_alg;
-				slot->ps_alg = PIV_ALG_ECCP384_SHA1;
+				*dglen = 20;
+				*cardalg = PIV_ALG_ECCP384_SHA1;
 			}
 		} else {
 			*hashalgo = SSH_DIGEST_SHA384;
-			dglen = 48;
+			*dglen = 48;
 			if (cardhash && ch_sha384) {
-				oldalg = slot->ps_alg;
-				slot->ps_alg = PIV_ALG_ECCP384_SHA384;
+				*cardalg = PIV_ALG_ECCP384_SHA384;
 			} else if (cardhash && ch_sha256) {
 				*hashalgo = SSH_DIGEST_SHA256;
-				dglen = 32;
-				oldalg = slot->ps_alg;
-				slot->ps_alg = PIV_ALG_ECCP384_SHA256;
+				*dglen = 32;
+				*cardalg = PIV_ALG_ECCP384_SHA256;
 			} else if (cardhash) {
 				*hashalgo = SSH_DIGEST_SHA1;
-				dglen = 20;
-				oldalg = slot->ps_alg;
-				slot->ps_alg = PIV_ALG_ECCP384_SHA1;
+				*dglen = 20;
+				*cardalg = PIV_ALG_ECCP384_SHA1;
 			}
 		}
 		break;
@@ -4041,20 +5195,19 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 		    slot->ps_slot, slot->ps_alg, tk->pt_rdrname));
 	}
 
-	if (!cardhash) {
-		buf = calloc(1, inplen);
-		VERIFY(buf != NULL);
+	return (ERRF_OK);
+}
 
-		hctx = ssh_digest_start(*hashalgo);
-		VERIFY(hctx != NULL);
-		VERIFY0(ssh_digest_update(hctx, data, datalen));
-		VERIFY0(ssh_digest_final(hctx, buf, dglen));
-		ssh_digest_free(hctx);
-	} else {
-		bunyan_log(BNY_TRACE, "doing hash on card", NULL);
-		buf = (uint8_t *)data;
-		inplen = datalen;
-	}
+/*
+ * Takes the digest (in the first "dglen" bytes of the "inplen"-byte "buf")
+ * and turns it into the block for the card to sign, padding it out in PKCS#1
+ * style for RSA.
+ */
+static void
+piv_sign_pad(struct piv_slot *slot, enum sshdigest_types hashalgo,
+    uint8_t *buf, size_t inplen, size_t dglen)
+{
+	size_t nread;
 
 	/*
 	 * If it's an RSA signature, we have to generate the PKCS#1 style
@@ -4084,7 +5237,7 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 		 * XXX: I thought this should be sha256WithRSAEncryption (etc)
 		 *      rather than just NID_sha256 but that doesn't work
 		 */
-		switch (*hashalgo) {
+		switch (hashalgo) {
 		case SSH_DIGEST_SHA1:
 			nid = NID_sha1;
 			break;
@@ -4123,14 +5276,168 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 		free(tmp);
 		OPENSSL_free(out);
 	}
+}
 
-	err = piv_sign_prehash(tk, slot, buf, inplen, signature, siglen);
+/*
+ * Hashes the data on the host and builds the block for the card to sign.
+ */
+static uint8_t *
+piv_sign_block(struct piv_slot *slot, enum sshdigest_types hashalgo,
+    const uint8_t *data, size_t datalen, size_t inplen, size_t dglen)
+{
+	struct ssh_digest_ctx *hctx;
+	uint8_t *buf;
 
-	if (!cardhash)
-		free(buf);
+	buf = calloc(1, inplen);
+	VERIFY(buf != NULL);
+
+	hctx = ssh_digest_start(hashalgo);
+	VERIFY(hctx != NULL);
+	VERIFY0(ssh_digest_update(hctx, data, datalen));
+	VERIFY0(ssh_digest_final(hctx, buf, dglen));
+	ssh_digest_free(hctx);
+
+	piv_sign_pad(slot, hashalgo, buf, inplen, dglen);
+
+	return (buf);
+}
+
+errf_t *
+piv_sign_prepare(struct piv_token *tk, struct piv_slot *slot,
+    const uint8_t *data, size_t datalen, enum sshdigest_types *hashalgo,
+    uint8_t **block, size_t *blocklen)
+{
+	errf_t *err;
+	size_t inplen, dglen;
+	enum piv_alg cardalg;
 
-	if (cardhash)
+	err = piv_sign_params(tk, slot, hashalgo, &inplen, &dglen, &cardalg);
+	if (err)
+		return (err);
+	if (cardalg != 0) {
+		return (errf("NotSupportedError", NULL, "PIV device '%s' "
+		    "can only hash on-card for slot %02x", tk->pt_rdrname,
+		    slot->ps_slot));
+	}
+	*block = piv_sign_block(slot, *hashalgo, data, datalen, inplen, dglen);
+	*blocklen = inplen;
+	return (ERRF_OK);
+}
+
+struct piv_sign_ctx {
+	struct piv_token	*psc_tk;
+	struct piv_slot		*psc_slot;
+	enum sshdigest_types	 psc_hashalg;
+	size_t			 psc_inplen;
+	size_t			 psc_dglen;
+	struct ssh_digest_ctx	*psc_hctx;
+	uint8_t			*psc_block;
+};
+
+errf_t *
+piv_sign_init(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types *hashalgo, struct piv_sign_ctx **pctx)
+{
+	errf_t *err;
+	struct piv_sign_ctx *ctx;
+	size_t inplen, dglen;
+	enum piv_alg cardalg;
+
+	err = piv_sign_params(tk, slot, hashalgo, &inplen, &dglen, &cardalg);
+	if (err)
+		return (err);
+	if (cardalg != 0) {
+		return (errf("NotSupportedError", NULL, "PIV device '%s' "
+		    "can only hash on-card for slot %02x", tk->pt_rdrname,
+		    slot->ps_slot));
+	}
+
+	ctx = calloc(1, sizeof (struct piv_sign_ctx));
+	VERIFY(ctx != NULL);
+	ctx->psc_tk = tk;
+	ctx->psc_slot = slot;
+	ctx->psc_hashalg = *hashalgo;
+	ctx->psc_inplen = inplen;
+	ctx->psc_dglen = dglen;
+	ctx->psc_hctx = ssh_digest_start(*hashalgo);
+	VERIFY(ctx->psc_hctx != NULL);
+
+	*pctx = ctx;
+	return (ERRF_OK);
+}
+
+void
+piv_sign_update(struct piv_sign_ctx *ctx, const uint8_t *data, size_t len)
+{
+	VERIFY(ctx->psc_hctx != NULL);
+	VERIFY0(ssh_digest_update(ctx->psc_hctx, data, len));
+}
+
+errf_t *
+piv_sign_final(struct piv_sign_ctx *ctx, uint8_t **signature, size_t *siglen)
+{
+	VERIFY(ctx->psc_tk->pt_intxn);
+
+	/*
+	 * Keep the finished block around, so that if signing fails (e.g. with
+	 * PermissionError because we need a PIN) the caller can just call us
+	 * again without having to hash everything a second time.
+	 */
+	if (ctx->psc_block == NULL) {
+		VERIFY(ctx->psc_hctx != NULL);
+		ctx->psc_block = calloc(1, ctx->psc_inplen);
+		VERIFY(ctx->psc_block != NULL);
+		VERIFY0(ssh_digest_final(ctx->psc_hctx, ctx->psc_block,
+		    ctx->psc_dglen));
+		ssh_digest_free(ctx->psc_hctx);
+		ctx->psc_hctx = NULL;
+		piv_sign_pad(ctx->psc_slot, ctx->psc_hashalg, ctx->psc_block,
+		    ctx->psc_inplen, ctx->psc_dglen);
+	}
+
+	return (piv_sign_prehash(ctx->psc_tk, ctx->psc_slot, ctx->psc_block,
+	    ctx->psc_inplen, signature, siglen));
+}
+
+void
+piv_sign_ctx_free(struct piv_sign_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+	ssh_digest_free(ctx->psc_hctx);
+	free(ctx->psc_block);
+	free(ctx);
+}
+
+errf_t *
+piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
+    size_t datalen, enum sshdigest_types *hashalgo, uint8_t **signature,
+    size_t *siglen)
+{
+	errf_t *err;
+	uint8_t *buf;
+	size_t inplen, dglen;
+	enum piv_alg cardalg, oldalg;
+
+	VERIFY(tk->pt_intxn);
+
+	err = piv_sign_params(tk, slot, hashalgo, &inplen, &dglen, &cardalg);
+	if (err)
+		return (err);
+
+	if (cardalg != 0) {
+		bunyan_log(BNY_TRACE, "doing hash on card", NULL);
+		oldalg = slot->ps_alg;
+		slot->ps_alg = cardalg;
+		err = piv_sign_prehash(tk, slot, data, datalen, signature,
+		    siglen);
 		slot->ps_alg = oldalg;
+		return (err);
+	}
+
+	buf = piv_sign_block(slot, *hashalgo, data, datalen, inplen, dglen);
+	err = piv_sign_prehash(tk, slot, buf, inplen, signature, siglen);
+	free(buf);
 
 	return (err);
 }
@@ -215,7 +215,9 @@ enum ykpiv_touch_policy {
 enum piv_slot_auth {
 	PIV_SLOT_AUTH_UNKNOWN = 0,
 	PIV_SLOT_AUTH_PIN = 1<<0,
-	PIV_SLOT_AUTH_TOUCH = 1<<1
+	PIV_SLOT_AUTH_TOUCH = 1<<1,
+	/* The PIN must be verified again before every use (YubicoPIV only) */
+	PIV_SLOT_AUTH_PIN_ALWAYS = 1<<2
 };
 
 #define	GUID_LEN	16
@@ -223,6 +225,20 @@ enum piv_slot_auth {
 struct piv_slot;
 struct piv_token;
 
+/*
+ * PCSC context and reader-list calls for use by tools. These take the same
+ * arguments as SCardEstablishContext(SCARD_SCOPE_SYSTEM, ...),
+ * SCardReleaseContext(), SCardListReaders() and SCardGetStatusChange()
+ * respectively and return PCSC status codes, but go through the same
+ * transport as the rest of this library, so that they work without pcscd
+ * when a trace is being replayed or a soft token is in use.
+ */
+LONG piv_establish_context(SCARDCONTEXT *ctx);
+LONG piv_release_context(SCARDCONTEXT ctx);
+LONG piv_list_readers(SCARDCONTEXT ctx, char *readers, DWORD *readerslen);
+LONG piv_get_status_change(SCARDCONTEXT ctx, DWORD timeout,
+    SCARD_READERSTATE *states, DWORD nstates);
+
 /*
  * Enumerates all PIV tokens attached to the given SCARDCONTEXT.
  *
@@ -236,6 +252,21 @@ struct piv_token;
 MUST_CHECK
 errf_t *piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens);
 
+/*
+ * Like piv_enumerate(), but only reads the CHUID (for the GUID) from each
+ * token up front. The discovery object, key history object and YubicoPIV
+ * version and serial are read the first time something asks for them (e.g.
+ * piv_token_default_auth(), piv_token_is_ykpiv()), inside the caller's
+ * transaction if there is one, or a short one of their own if not.
+ *
+ * Use this when you're only going to look at the GUIDs of most of the tokens.
+ *
+ * Errors:
+ *  - PCSCError: a PCSC call failed in a way that is not retryable
+ */
+MUST_CHECK
+errf_t *piv_enumerate_lazy(SCARDCONTEXT ctx, struct piv_token **tokens);
+
 /*
  * Retrieves a PIV token on the system which matches a given GUID or GUID
  * prefix. If guidlen < GUID_LEN, then guid will be interpreted as a prefix
@@ -256,6 +287,15 @@ MUST_CHECK
 errf_t *piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
     struct piv_token **token);
 
+/*
+ * Sets how many readers piv_enumerate() and piv_find() will probe at once
+ * (each on its own thread, with its own SCARDCONTEXT). Setting this to 1
+ * probes them one at a time using the caller's context. If never called (or
+ * called with 0), PIVY_PROBE_THREADS from the environment is used, or a
+ * default of 8.
+ */
+void piv_set_probe_threads(uint n);
+
 /*
  * Returns the next token on a list of tokens such as that returned by
  * piv_enumerate().
@@ -365,7 +405,8 @@ uint32_t ykpiv_token_serial(const struct piv_token *token);
 
 /*
  * Gets a reference to a particular key/cert slot on the card. This must have
- * been enumerated using piv_read_cert, or else this will return NULL.
+ * been enumerated using piv_read_cert (or piv_read_all_keys), or else this
+ * will return NULL.
  */
 struct piv_slot *piv_get_slot(struct piv_token *tk, enum piv_slotid slotid);
 
@@ -393,12 +434,26 @@ enum piv_alg piv_slot_alg(const struct piv_slot *slot);
 /*
  * Returns the certificate stored for a given slot.
  *
+ * If the slot was found by piv_read_all_keys() the certificate may not have
+ * been read yet, in which case this reads it from the card first (opening a
+ * transaction if one isn't already open). Returns NULL if there is no
+ * certificate in the slot or it can't be read.
+ *
  * The memory referenced by the returned pointer should be treated as const
  * and not freed or modified (it will be freed with the piv_slot).
  */
 X509 *piv_slot_cert(const struct piv_slot *slot);
-/* Helper: retrieves the subject DN from the certificate for a slot. */
+/*
+ * Helper: retrieves the subject DN from the certificate for a slot. Reads the
+ * certificate on demand like piv_slot_cert().
+ */
 const char *piv_slot_subject(const struct piv_slot *slot);
+/*
+ * Returns B_TRUE if piv_slot_cert() and piv_slot_subject() can answer without
+ * talking to the card (the certificate has been read, or we know that there
+ * isn't one).
+ */
+boolean_t piv_slot_cert_loaded(const struct piv_slot *slot);
 
 /*
  * Returns the public key for a slot.
@@ -480,6 +535,67 @@ errf_t *piv_read_cert(struct piv_token *tk, enum piv_slotid slotid);
 MUST_CHECK
 errf_t *piv_read_all_certs(struct piv_token *tk);
 
+/*
+ * Finds the keys in all supported PIV slots on the card without reading the
+ * certificate objects, where the card allows it. On YubicoPIV >=5.3 this uses
+ * GET METADATA to fetch each public key (along with its PIN and touch
+ * policy), which is much quicker than reading and parsing the certs. The
+ * certs are then read on demand by piv_slot_cert() and piv_slot_subject().
+ * Slots which hold a key without any cert are included.
+ *
+ * On other cards this is the same as piv_read_all_certs().
+ *
+ * Errors:
+ *  - IOError: general card communication failure
+ *  - InvalidDataError: device returned an invalid payload or unparseable
+ *                      certificate
+ *  - APDUError: card rejected the request (e.g because applet not selected)
+ */
+MUST_CHECK
+errf_t *piv_read_all_keys(struct piv_token *tk);
+
+/*
+ * Returns the directory used for the on-disk token slot cache, or NULL if
+ * the user hasn't enabled it. The cache is enabled by setting PIVY_CACHE in
+ * the environment: either to an absolute path to use, or to any other
+ * non-empty value to use $XDG_CACHE_HOME/pivy (or ~/.cache/pivy).
+ *
+ * The returned string should be freed with free().
+ */
+char *piv_cache_dir(void);
+
+/*
+ * Populates the slots of a token from the cache in directory "dir" instead of
+ * reading them from the card (as if piv_read_all_certs() had been called).
+ * Does not talk to the card: the cache entry is only used if the CHUID, key
+ * history and YubiKey version and serial number read when the token was
+ * enumerated still match those it was saved with.
+ *
+ * Errors:
+ *  - ArgumentError: the token has no CHUID (and so no stable GUID)
+ *  - NotFoundError: no cache entry exists for this token
+ *  - StaleCacheError: the cache entry no longer matches the card
+ *  - InvalidDataError: the cache entry could not be parsed
+ */
+MUST_CHECK
+errf_t *piv_cache_load(struct piv_token *tk, const char *dir);
+
+/*
+ * Saves the slots of a token to the cache in directory "dir" (creating it if
+ * needed). piv_read_all_certs() must have been called on the token first.
+ *
+ * Errors:
+ *  - ArgumentError: the token has no CHUID, or its certs have not been read
+ *  - SystemError: creating or writing the cache file failed
+ */
+MUST_CHECK
+errf_t *piv_cache_save(struct piv_token *tk, const char *dir);
+
+/*
+ * Removes any cache entry for the token (if the cache is enabled).
+ */
+void piv_cache_forget(struct piv_token *tk);
+
 /*
  * Authenticates as the card administrator using a 3DES key.
  *
@@ -586,12 +702,16 @@ errf_t *ykpiv_import(struct piv_token *tk, enum piv_slotid slotid,
  * Loads a certificate for a given slot on the token.
  *
  * "flags" should include bits from enum piv_certinfo_flags (and piv_cert_comp).
+ * The certificate in "data" is always plain DER: if the flags ask for
+ * PIV_COMP_GZIP we compress it here (and fall back to writing it
+ * uncompressed if that doesn't make it any smaller).
  *
  * Errors:
  *  - IOError: general card communication failure
  *  - DeviceOutOfMemoryError: certificate is too large to fit on card
  *  - PermissionError: admin authentication required to write a cert
  *  - NotSupportedError: slot unsupported
+ *  - CompressionError: zlib failed to compress the certificate
  *  - APDUError: other card error
  */
 MUST_CHECK
@@ -819,6 +939,57 @@ MUST_CHECK
 errf_t *piv_sign_prehash(struct piv_token *tk, struct piv_slot *slot,
     const uint8_t *hash, size_t hashlen, uint8_t **signature, size_t *siglen);
 
+/*
+ * Does the host-side half of piv_sign() without talking to the card: hashes
+ * "data" and (for RSA) pads it out, producing a block which can then be
+ * signed with piv_sign_prehash(). Useful for getting this work out of the way
+ * before starting a transaction to sign a lot of payloads at once. Does not
+ * need to be in a transaction.
+ *
+ * "hashalgo" works as for piv_sign(). "block" will be written with a pointer
+ * to a buffer "blocklen" bytes long, which should be released with free().
+ *
+ * Errors:
+ *   - NotSupportedError: algorithm is not supported, or the card can only do
+ *                        hash-on-card for this slot (use piv_sign() instead)
+ */
+MUST_CHECK
+errf_t *piv_sign_prepare(struct piv_token *tk, struct piv_slot *slot,
+    const uint8_t *data, size_t datalen, enum sshdigest_types *hashalgo,
+    uint8_t **block, size_t *blocklen);
+
+/*
+ * Incremental version of piv_sign(), for payloads too big to want in memory
+ * all at once. piv_sign_init() sets up a context (without talking to the
+ * card), piv_sign_update() hashes each piece of the payload on the host, and
+ * piv_sign_final() sends the result to the card to be signed, so only
+ * piv_sign_final() has to be called in a transaction.
+ *
+ * "hashalgo" works as for piv_sign(). "signature" and "siglen" are as for
+ * piv_sign(). If piv_sign_final() fails (e.g. with PermissionError because
+ * a PIN is needed) it can be called again on the same context without
+ * re-hashing. The context should be released with piv_sign_ctx_free()
+ * afterwards, and piv_sign_update() can't be used on it again after
+ * piv_sign_final().
+ *
+ * Errors (piv_sign_init):
+ *   - NotSupportedError: algorithm is not supported, or the card can only do
+ *                        hash-on-card for this slot (use piv_sign() instead)
+ *
+ * Errors (piv_sign_final): as for piv_sign()
+ */
+struct piv_sign_ctx;
+
+MUST_CHECK
+errf_t *piv_sign_init(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types *hashalgo, struct piv_sign_ctx **ctx);
+void piv_sign_update(struct piv_sign_ctx *ctx, const uint8_t *data,
+    size_t len);
+MUST_CHECK
+errf_t *piv_sign_final(struct piv_sign_ctx *ctx, uint8_t **signature,
+    size_t *siglen);
+void piv_sign_ctx_free(struct piv_sign_ctx *ctx);
+
 /*
  * Performs an ECDH key derivation between the private key on the token and
  * the given EC public key.
@@ -995,6 +1166,10 @@ errf_t *piv_apdu_transceive(struct piv_token *pk, struct apdu *pdu);
  * Transceives a chain of APDUs, allowing both the command data and reply data
  * to span multiple APDUs. The struct apdu will be used and filled out as if
  * one single large APDU had been transceived.
+ *
+ * For cards which advertise support for extended-length APDUs in their ATR,
+ * GET DATA, PUT DATA, GENERAL AUTHENTICATE and key import commands are sent
+ * as a single extended APDU instead of a chain.
  */
 MUST_CHECK
 errf_t *piv_apdu_transceive_chain(struct piv_token *pk, struct apdu *apdu);
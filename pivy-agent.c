@@ -87,6 +87,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include "libssh/ssh2.h"
 #include "libssh/sshbuf.h"
@@ -114,6 +115,12 @@
 #include <procfs.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define	USE_EPOLL	1
+#endif
+
 #if defined(__APPLE__)
 #include <sys/proc_info.h>
 #include <sys/ucred.h>
@@ -124,6 +131,7 @@
 #include "libssh/cipher.h"
 #include "libssh/ssherr.h"
 
+#define	MAXIMUM(a,b) (((a) > (b)) ? (a) : (b))
 #define	MINIMUM(a,b) (((a) < (b)) ? (a) : (b))
 
 /*
@@ -161,15 +169,83 @@ typedef enum confirm_mode {
 	C_FORWARDED
 } confirm_mode_t;
 
-static struct piv_token *ks = NULL;
-static struct piv_token *selk = NULL;
-static boolean_t txnopen = B_FALSE;
-static uint64_t txntimeout = 0;
+/*
+ * One of these exists for every PIV token the agent is serving. They are
+ * either set up front by -g (in which case at_guid may be only a prefix of
+ * the real GUID), or added as we discover new tokens when no -g options were
+ * given at all.
+ *
+ * Each token has its own transaction, PIN and refresh state, so that e.g.
+ * pulling one token out only drops the PIN for that token.
+ *
+ * Everything in here belongs to the card thread, except for at_next and the
+ * PIN, which the main loop also uses (to lock the agent) and so are protected
+ * by token_lock.
+ */
+struct agent_token {
+	struct agent_token *at_next;
+	uint at_idx;
+
+	uint8_t at_guid[GUID_LEN];
+	size_t at_guid_len;
+	char *at_guidhex;
+
+	/* NULL when the token isn't currently present on the system */
+	struct piv_token *at_tk;
+	/* B_FALSE if the last discovery pass didn't see this token */
+	boolean_t at_seen;
+	/*
+	 * Slots came from the on-disk cache (or we only read the public keys)
+	 * and the certs should be re-read when idle
+	 */
+	boolean_t at_cache_refresh;
+
+	boolean_t at_txnopen;
+	/* We've verified the PIN since at_txnopen was set */
+	boolean_t at_txnpin;
+	uint64_t at_txntimeout;
+	uint64_t at_last_update;
+	uint64_t at_last_op;
+
+	/* Points into the guarded pinmem page, MAX_PIN_LEN bytes long */
+	char *at_pin;
+	size_t at_pin_len;
+
+	/*
+	 * This token's part of an SSH2_AGENT_IDENTITIES_ANSWER, already
+	 * encoded (key management keys separately, since they go last).
+	 * Only valid while at_idvalid is set.
+	 */
+	boolean_t at_idvalid;
+	boolean_t at_idlisted;
+	struct sshbuf *at_idkeys;
+	struct sshbuf *at_idmgmt;
+	uint at_idcount;
+
+	struct sshkey *at_cak;
+};
+
+static struct agent_token *tokens = NULL;
+static uint ntokens = 0;
+static pthread_mutex_t token_lock = PTHREAD_MUTEX_INITIALIZER;
+/* No -g was given: serve whichever PIV tokens we can find. */
+static boolean_t all_tokens = B_FALSE;
+static uint64_t last_discover = 0;
+/* Where to cache token slot contents (NULL if not enabled) */
+static char *cache_dir = NULL;
+
+/*
+ * The whole SSH2_AGENT_IDENTITIES_ANSWER we last sent (as a message body), so
+ * that the main loop can answer REQUEST_IDENTITIES without bothering the card
+ * thread. It's thrown away by the card thread whenever the contents of any
+ * token's slots might have changed, and expires after idcache_expiry so that
+ * we still go and re-read the certs every now and then.
+ */
+static pthread_mutex_t idcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sshbuf *idcache = NULL;
+static uint64_t idcache_expiry = 0;
+
 static SCARDCONTEXT ctx;
-static uint64_t last_update;
-static uint64_t last_op;
-static uint8_t *guid = NULL;
-static size_t guid_len = 0;
 static boolean_t sign_9d = B_FALSE;
 static boolean_t check_client_uid = B_TRUE;
 static confirm_mode_t confirm_mode = C_NEVER;
@@ -181,11 +257,7 @@ static uint64_t slot_ena_mask = 0x743ffffc;
 
 static char *pinmem = NULL;
 static char *pin = NULL;
-static size_t pin_len = 0;
-
-static struct sshkey *cak = NULL;
-
-static struct bunyan_frame *msg_log_frame;
+static size_t pin_slots = 0;
 
 /* Maximum accepted message length */
 #define AGENT_MAX_LEN	(256*1024)
@@ -215,33 +287,89 @@ typedef struct socket_entry {
 	struct sshbuf *se_request;
 	struct pid_entry *se_pid_ent;
 	uint se_pid_idx;
+	/* Log frame for the message currently being processed */
+	struct bunyan_frame *se_log_frame;
+	/* Request waiting on the card thread, if any */
+	struct card_job *se_job;
+	/* Whether we've asked epoll for EPOLLOUT on this one */
+	boolean_t se_pollout;
 } socket_entry_t;
 
 u_int sockets_alloc = 0;
 socket_entry_t *sockets = NULL;
 
+#if defined(USE_EPOLL)
+static int epoll_fd = -1;
+static int parent_timer_fd = -1;
+static int pid_timer_fd = -1;
+#endif
+
+static void check_parent_exists(void);
+static boolean_t is_slot_enabled(const struct piv_slot *);
+
+/*
+ * Identifies the executable a process is running, so we can tell when it has
+ * exec()d something else. All zero if the platform won't tell us.
+ */
+typedef struct pid_exe_id {
+	dev_t pei_dev;
+	ino_t pei_ino;
+	time_t pei_mtime;
+} pid_exe_id_t;
+
+/*
+ * What we know about a client process, kept across its connections. Entries
+ * live in a hash table keyed on (pid, start time, executable), so that a
+ * recycled pid or a process which has exec()d gets a fresh entry (with no
+ * cached auth), and are never moved once made (connections point at them,
+ * and hold a reference while they're open).
+ *
+ * The executable path and arguments are looked up the first time we see the
+ * process and then remembered, rather than going back to /proc on every
+ * accept. We still have to stat() the executable on each accept to find the
+ * entry, but that's much cheaper than reading the path and arguments.
+ *
+ * Every entry is also on the pid timer wheel: the main loop goes round it
+ * looking at entries which have been idle for a while, and throws them away
+ * once their process has gone.
+ */
 typedef struct pid_entry {
-	boolean_t pe_valid;
-	uint64_t pe_time;
+	struct pid_entry *pe_next;	/* hash chain */
+	struct pid_entry *pe_wnext;	/* timer wheel slot */
+	uint64_t pe_time;		/* last connection */
+	uint64_t pe_check;		/* when the wheel should next look */
 	pid_t pe_pid;
 	uint64_t pe_start_time;
+	pid_exe_id_t pe_exe_id;
+	uint pe_refs;
 	uint pe_conn_count;
 	uint64_t pe_last_auth;
+	boolean_t pe_have_exe;
+	char *pe_exepath;
+	char *pe_exeargs;
 } pid_entry_t;
 
-pid_entry_t *pids = NULL;
-uint pids_alloc = 0;
+enum {
+	PID_HASH_SIZE = 256,		/* must be a power of 2 */
+	PID_WHEEL_SLOTS = 64,
+	PID_WHEEL_TICK = 1000,		/* ms per wheel slot */
+	PID_IDLE_TIME = 30000,		/* ms before we check an entry */
+};
+
+static pid_entry_t *pid_hash[PID_HASH_SIZE];
+static pid_entry_t *pid_wheel[PID_WHEEL_SLOTS];
+/* Start of the next wheel slot due to run (0 = the wheel isn't going yet) */
+static uint64_t pid_wheel_time = 0;
 
 int max_fd = 0;
 
-const time_t card_probe_interval_nopin = 120;
-const time_t card_probe_interval_pin = 30;
-const uint card_probe_limit = 3;
+const time_t card_reread_interval_nopin = 120;
+const time_t card_reread_interval_pin = 30;
 
 const uint64_t pid_auth_cache_time = 15000;
 
-time_t card_probe_interval = 120; /* card_probe_interval_nopin */
-uint card_probe_fails = 0;
+/* How long a token must be idle before we re-read certs loaded from cache */
+const time_t cache_refresh_delay = 5;
 
 /* pid of shell == parent of agent */
 pid_t parent_pid = -1;
@@ -326,16 +454,18 @@ monotime(void)
 }
 
 static void
-agent_piv_close(boolean_t force)
+agent_piv_close(struct agent_token *at, boolean_t force)
 {
 	uint64_t now = monotime();
-	VERIFY(txnopen);
-	if (force || now >= txntimeout) {
+	VERIFY(at->at_txnopen);
+	if (force || now >= at->at_txntimeout) {
 		bunyan_log(BNY_TRACE, "closing txn",
+		    "guid", BNY_STRING, at->at_guidhex,
 		    "now", BNY_UINT64, now,
-		    "txntimeout", BNY_UINT64, txntimeout, NULL);
-		piv_txn_end(selk);
-		txnopen = B_FALSE;
+		    "txntimeout", BNY_UINT64, at->at_txntimeout, NULL);
+		piv_txn_end(at->at_tk);
+		at->at_txnopen = B_FALSE;
+		at->at_txnpin = B_FALSE;
 	}
 }
 
@@ -352,6 +482,50 @@ piv_token_shortid(struct piv_token *pk)
 	return (guid);
 }
 
+static struct agent_token *
+new_agent_token(const uint8_t *guid, size_t guid_len)
+{
+	struct agent_token *at, **pat;
+
+	VERIFY(guid_len <= GUID_LEN);
+
+	at = calloc(1, sizeof (struct agent_token));
+	VERIFY(at != NULL);
+	bcopy(guid, at->at_guid, guid_len);
+	at->at_guid_len = guid_len;
+	at->at_guidhex = buf_to_hex(guid, guid_len, B_FALSE);
+	at->at_seen = B_TRUE;
+
+	VERIFY0(pthread_mutex_lock(&token_lock));
+	at->at_idx = ntokens++;
+	if (pin != NULL) {
+		VERIFY(at->at_idx < pin_slots);
+		at->at_pin = pin + at->at_idx * MAX_PIN_LEN;
+	}
+
+	/* Keep them in the order they were given/discovered. */
+	for (pat = &tokens; *pat != NULL; pat = &(*pat)->at_next)
+		;
+	*pat = at;
+	VERIFY0(pthread_mutex_unlock(&token_lock));
+
+	return (at);
+}
+
+static struct agent_token *
+find_agent_token(const uint8_t *guid, size_t guid_len)
+{
+	struct agent_token *at;
+
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_guid_len > guid_len)
+			continue;
+		if (bcmp(at->at_guid, guid, at->at_guid_len) == 0)
+			return (at);
+	}
+	return (NULL);
+}
+
 static const char *
 pin_type_to_name(enum piv_pin type)
 {
@@ -388,28 +562,98 @@ valid_pin(const char *pin)
 }
 
 static void
-drop_pin(void)
+drop_pin_locked(struct agent_token *at)
 {
-	if (pin_len != 0) {
-		bunyan_log(BNY_INFO, "clearing PIN from memory", NULL);
-		explicit_bzero(pin, pin_len);
+	if (at->at_pin_len != 0) {
+		bunyan_log(BNY_INFO, "clearing PIN from memory",
+		    "guid", BNY_STRING, at->at_guidhex, NULL);
+		explicit_bzero(at->at_pin, at->at_pin_len);
 	}
-	pin_len = 0;
-	card_probe_interval = card_probe_interval_nopin;
+	at->at_pin_len = 0;
+}
+
+static void
+drop_pin(struct agent_token *at)
+{
+	VERIFY0(pthread_mutex_lock(&token_lock));
+	drop_pin_locked(at);
+	VERIFY0(pthread_mutex_unlock(&token_lock));
+}
+
+/* Called from the main loop as well as the card thread. */
+static void
+drop_all_pins(void)
+{
+	struct agent_token *at;
+	VERIFY0(pthread_mutex_lock(&token_lock));
+	for (at = tokens; at != NULL; at = at->at_next)
+		drop_pin_locked(at);
+	VERIFY0(pthread_mutex_unlock(&token_lock));
+}
+
+static void
+store_pin(struct agent_token *at, const char *newpin, size_t len)
+{
+	VERIFY(at->at_pin != NULL);
+	VERIFY(len < MAX_PIN_LEN);
+	VERIFY0(pthread_mutex_lock(&token_lock));
+	if (at->at_pin_len != 0)
+		explicit_bzero(at->at_pin, at->at_pin_len);
+	at->at_pin_len = len;
+	bcopy(newpin, at->at_pin, len);
+	at->at_pin[len] = '\0';
+	VERIFY0(pthread_mutex_unlock(&token_lock));
+	bunyan_log(BNY_INFO, "storing PIN in memory",
+	    "guid", BNY_STRING, at->at_guidhex, NULL);
+}
+
+/*
+ * Copies out the token's PIN (if we have one) into buf, which must be
+ * MAX_PIN_LEN bytes long. Returns the PIN length (0 if we have none).
+ */
+static size_t
+copy_pin(struct agent_token *at, char *buf)
+{
+	size_t len;
+	VERIFY0(pthread_mutex_lock(&token_lock));
+	len = at->at_pin_len;
+	if (len != 0)
+		bcopy(at->at_pin, buf, len + 1);
+	VERIFY0(pthread_mutex_unlock(&token_lock));
+	return (len);
+}
+
+static boolean_t
+token_has_pin(struct agent_token *at)
+{
+	boolean_t ret;
+	VERIFY0(pthread_mutex_lock(&token_lock));
+	ret = (at->at_pin_len != 0);
+	VERIFY0(pthread_mutex_unlock(&token_lock));
+	return (ret);
+}
+
+/* How often to re-read certs when listing identities */
+static time_t
+reread_interval(struct agent_token *at)
+{
+	if (token_has_pin(at))
+		return (card_reread_interval_pin);
+	return (card_reread_interval_nopin);
 }
 
 static errf_t *
-auth_cak(void)
+auth_cak(struct agent_token *at)
 {
 	struct piv_slot *slot;
 	errf_t *err;
-	slot = piv_get_slot(selk, PIV_SLOT_CARD_AUTH);
+	slot = piv_get_slot(at->at_tk, PIV_SLOT_CARD_AUTH);
 	if (slot == NULL) {
 		err = errf("CAKAuthError", NULL, "No key was found in the "
 		    "CARD_AUTH (CAK) slot");
 		return (err);
 	}
-	err = piv_auth_key(selk, slot, cak);
+	err = piv_auth_key(at->at_tk, slot, at->at_cak);
 	if (err) {
 		err = errf("CAKAuthError", err, "Key in CARD_AUTH slot (CAK) "
 		    "does not match the configured CAK: this card may be "
@@ -420,252 +664,788 @@ auth_cak(void)
 }
 
 static errf_t *
-agent_piv_open(void)
+reset_pcsc_context(void)
+{
+	int rv;
+
+	piv_release_context(ctx);
+	rv = piv_establish_context(&ctx);
+	if (rv != SCARD_S_SUCCESS)
+		return (pcscerrf("SCardEstablishContext", rv));
+	return (NULL);
+}
+
+static void
+idcache_invalidate(void)
+{
+	VERIFY0(pthread_mutex_lock(&idcache_lock));
+	sshbuf_free(idcache);
+	idcache = NULL;
+	VERIFY0(pthread_mutex_unlock(&idcache_lock));
+}
+
+static void
+idcache_set(const struct sshbuf *msg, uint64_t expiry)
+{
+	int r;
+
+	VERIFY0(pthread_mutex_lock(&idcache_lock));
+	sshbuf_free(idcache);
+	if ((idcache = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_putb(idcache, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	idcache_expiry = expiry;
+	VERIFY0(pthread_mutex_unlock(&idcache_lock));
+}
+
+/*
+ * Called by the main loop: answers a REQUEST_IDENTITIES from the cache if we
+ * can, returning B_FALSE if it has to go to the card thread instead.
+ */
+static boolean_t
+idcache_reply(socket_entry_t *e)
+{
+	boolean_t ret = B_FALSE;
+	int r;
+
+	VERIFY0(pthread_mutex_lock(&idcache_lock));
+	if (idcache != NULL && monotime() < idcache_expiry) {
+		if ((r = sshbuf_put_stringb(e->se_output, idcache)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		ret = B_TRUE;
+	}
+	VERIFY0(pthread_mutex_unlock(&idcache_lock));
+	return (ret);
+}
+
+/*
+ * Must be called whenever the token's slots might have changed (we've re-read
+ * them, or the token has come or gone).
+ */
+static void
+token_slots_changed(struct agent_token *at)
+{
+	at->at_idvalid = B_FALSE;
+	idcache_invalidate();
+}
+
+static void
+agent_save_cache(struct agent_token *at)
+{
+	errf_t *err;
+
+	if (cache_dir == NULL)
+		return;
+	if ((err = piv_cache_save(at->at_tk, cache_dir))) {
+		bunyan_log(BNY_WARN, "failed to save token cache",
+		    "guid", BNY_STRING, at->at_guidhex,
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+}
+
+/*
+ * After piv_read_all_keys(), read the certs for the slots we're going to
+ * list as identities (we want their subjects for the comments, and to leave
+ * out key-only slots as we do on cards without GET METADATA), while we're
+ * still in the txn. Then either schedule reading the rest of them for when
+ * we're idle, or (if that was all of them) save the cache.
+ */
+static void
+agent_keys_read(struct agent_token *at)
+{
+	struct piv_slot *slot = NULL;
+
+	while ((slot = piv_slot_next(at->at_tk, slot)) != NULL) {
+		if (is_slot_enabled(slot) && !piv_slot_cert_loaded(slot))
+			(void) piv_slot_cert(slot);
+	}
+	while ((slot = piv_slot_next(at->at_tk, slot)) != NULL) {
+		if (!piv_slot_cert_loaded(slot)) {
+			at->at_cache_refresh = B_TRUE;
+			return;
+		}
+	}
+	at->at_cache_refresh = B_FALSE;
+	agent_save_cache(at);
+}
+
+/*
+ * Populates the slots of a freshly found token, from the cache if we can.
+ * Otherwise, if the card lets us do that quickly, we read the public keys,
+ * plus only the certs of the slots we'll use. Either way we'll read all of
+ * the certs from the card properly later, once things are quiet. Must be
+ * called inside a txn.
+ */
+static errf_t *
+agent_read_certs(struct agent_token *at)
+{
+	errf_t *err;
+
+	if (cache_dir != NULL) {
+		err = piv_cache_load(at->at_tk, cache_dir);
+		if (err == ERRF_OK) {
+			at->at_cache_refresh = B_TRUE;
+			return (ERRF_OK);
+		}
+		bunyan_log(BNY_DEBUG, "not using token cache",
+		    "guid", BNY_STRING, at->at_guidhex,
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+
+	err = piv_read_all_keys(at->at_tk);
+	if (err && !errf_caused_by(err, "NotFoundError") &&
+	    !errf_caused_by(err, "NotSupportedError")) {
+		return (err);
+	}
+	errf_free(err);
+	agent_keys_read(at);
+	return (ERRF_OK);
+}
+
+static errf_t *
+agent_piv_open(struct agent_token *at)
 {
 	struct piv_slot *slot;
 	errf_t *err = NULL;
-	int rv;
 
-	if (txnopen) {
-		txntimeout = monotime() + 2000;
+	at->at_last_op = monotime();
+
+	if (at->at_txnopen) {
+		at->at_txntimeout = monotime() + 2000;
 		return (NULL);
 	}
 
-	if (selk == NULL || (err = piv_txn_begin(selk))) {
+	if (at->at_tk == NULL || (err = piv_txn_begin(at->at_tk))) {
 		errf_free(err);
 
-		selk = NULL;
-		if (ks != NULL)
-			piv_release(ks);
+		if (at->at_tk != NULL)
+			piv_release(at->at_tk);
+		at->at_tk = NULL;
+		token_slots_changed(at);
 
 findagain:
-		err = piv_find(ctx, guid, guid_len, &ks);
+		err = piv_find(ctx, at->at_guid, at->at_guid_len, &at->at_tk);
 		if (err && errf_caused_by(err, "PCSCContextError")) {
-			ks = NULL;
+			at->at_tk = NULL;
 			bunyan_log(BNY_TRACE, "got context error, re-initing",
 			    "error", BNY_ERF, err, NULL);
 			errf_free(err);
-			SCardReleaseContext(ctx);
-			rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL,
-			    NULL, &ctx);
-			if (rv != SCARD_S_SUCCESS) {
-				err = pcscerrf("SCardEstablishContext", rv);
+			if ((err = reset_pcsc_context()))
 				return (err);
-			}
 			goto findagain;
 		} else if (err) {
-			ks = NULL;
+			at->at_tk = NULL;
 			err = errf("EnumerationError", err, "Failed to "
 			    "find specified PIV token on the system");
 			return (err);
 		}
-		selk = ks;
 
-		if (selk == NULL) {
+		if (at->at_tk == NULL) {
 			err = errf("NotFoundError", NULL, "PIV card with "
 			    "given GUID is not present on the system");
-			if (monotime() - last_update > 5000)
-				drop_pin();
+			if (monotime() - at->at_last_update > 5000)
+				drop_pin(at);
 			return (err);
 		}
+		at->at_seen = B_TRUE;
 
-		if ((err = piv_txn_begin(selk))) {
+		if ((err = piv_txn_begin(at->at_tk))) {
 			return (err);
 		}
 
-		if ((err = piv_select(selk))) {
-			piv_txn_end(selk);
+		if ((err = piv_select(at->at_tk))) {
+			piv_txn_end(at->at_tk);
 			return (err);
 		}
 
-		err = piv_read_all_certs(selk);
-		if (err && !errf_caused_by(err, "NotFoundError") &&
-		    !errf_caused_by(err, "NotSupportedError")) {
-			piv_txn_end(selk);
+		if ((err = agent_read_certs(at))) {
+			piv_txn_end(at->at_tk);
 			return (err);
 		}
-		if (cak != NULL && (err = auth_cak())) {
-			piv_txn_end(selk);
-			drop_pin();
+		if (at->at_cak != NULL && (err = auth_cak(at))) {
+			piv_txn_end(at->at_tk);
+			drop_pin(at);
 			return (err);
 		}
-		last_update = monotime();
+		at->at_last_update = monotime();
 
 	} else {
-		if ((err = piv_select(selk))) {
-			piv_txn_end(selk);
+		if ((err = piv_select(at->at_tk))) {
+			piv_txn_end(at->at_tk);
 			return (err);
 		}
 	}
-	if (cak == NULL) {
-		slot = piv_get_slot(selk, PIV_SLOT_CARD_AUTH);
-		if (slot != NULL)
-			VERIFY0(sshkey_demote(piv_slot_pubkey(slot), &cak));
+	if (at->at_cak == NULL) {
+		slot = piv_get_slot(at->at_tk, PIV_SLOT_CARD_AUTH);
+		if (slot != NULL) {
+			VERIFY0(sshkey_demote(piv_slot_pubkey(slot),
+			    &at->at_cak));
+		}
 	}
-	bunyan_log(BNY_TRACE, "opened new txn", NULL);
-	txnopen = B_TRUE;
-	txntimeout = monotime() + 2000;
-	card_probe_fails = 0;
+	bunyan_log(BNY_TRACE, "opened new txn",
+	    "guid", BNY_STRING, at->at_guidhex, NULL);
+	at->at_txnopen = B_TRUE;
+	at->at_txnpin = B_FALSE;
+	at->at_txntimeout = monotime() + 2000;
 	return (NULL);
 }
 
+/*
+ * Re-reads the certs on a token whose slots were loaded from the cache (or
+ * where we only read the public keys), and updates the cache with what we
+ * find. Called from the card thread when
+ * we're idle.
+ */
 static void
-probe_card(void)
+refresh_cached_token(struct agent_token *at)
 {
 	errf_t *err;
-	if (card_probe_fails > card_probe_limit)
-		return;
-	bunyan_log(BNY_TRACE, "doing idle probe", NULL);
 
-	last_op = monotime();
-	if ((err = agent_piv_open())) {
-		bunyan_log(BNY_TRACE, "error opening for idle probe",
-		    "error", BNY_ERF, err, NULL);
+	if ((err = agent_piv_open(at))) {
 		errf_free(err);
-		/*
-		 * Allow one failure due to connectivity issues before we
-		 * drop the PIN (so that transient glitches aren't so
-		 * inconvenient).
-		 */
-		if (card_probe_fails++ > 0)
-			drop_pin();
-		selk = NULL;
+		at->at_cache_refresh = B_FALSE;
 		return;
 	}
-	if (cak != NULL && (err = auth_cak())) {
-		bunyan_log(BNY_WARN, "CAK authentication failed",
+	at->at_cache_refresh = B_FALSE;
+	err = piv_read_all_certs(at->at_tk);
+	if (err) {
+		bunyan_log(BNY_DEBUG, "failed to refresh cached token",
+		    "guid", BNY_STRING, at->at_guidhex,
 		    "error", BNY_ERF, err, NULL);
-		agent_piv_close(B_TRUE);
-		/* Always drop PIN on a CAK failure. */
-		drop_pin();
-		selk = NULL;
-		card_probe_fails++;
+		errf_free(err);
+		agent_piv_close(at, B_TRUE);
 		return;
 	}
-	agent_piv_close(B_FALSE);
-	card_probe_fails = 0;
-}
-
-static errf_t *
-wrap_pin_error(errf_t *err, int retries)
-{
-	if (errf_caused_by(err, "PermissionError")) {
-		if (retries == 0) {
-			err = errf("TokenLocked", err,
-			    "PIV token is locked due to too many "
-			    "invalid PIN code attempts");
-		} else {
-			err = errf("InvalidPIN", err,
-			    "Invalid PIN code supplied (%d attempts "
-			    "remaining)", retries);
-			drop_pin();
-		}
-	} else if (errf_caused_by(err, "MinRetriesError")) {
-		err = errf("TokenLocked", err,
-		    "Refusing to use up the last PIN code attempt: "
-		    "unlock the token with another tool to clear "
-		    "the counter");
-		drop_pin();
-	}
-	return (err);
+	agent_piv_close(at, B_TRUE);
+	at->at_last_update = monotime();
+	token_slots_changed(at);
+	agent_save_cache(at);
 }
 
-static const char *askpass = NULL;
-static const char *confirm = NULL;
-
+/*
+ * When we're running without any -g options, look for any PIV tokens with
+ * a CHUID which we haven't seen before and start serving them. Tokens which
+ * have gone away are left in the list (so their PIN state is kept if they
+ * come back quickly) but are skipped when listing identities.
+ */
 static void
-try_askpass(void)
+discover_tokens(void)
 {
-	int p[2], status;
-	pid_t kid, ret;
-	size_t len;
+	struct piv_token *list = NULL, *tk;
+	struct agent_token *at, *oat;
+	const uint8_t *tkguid;
 	errf_t *err;
-	uint retries = 1;
-	char prompt[64], buf[1024];
-	char *guid = piv_token_shortid(selk);
-	enum piv_pin auth = piv_token_default_auth(selk);
-	snprintf(prompt, 64, "Enter %s for token %s",
-	    pin_type_to_name(auth), guid);
 
-	if (askpass == NULL)
-		askpass = getenv("SSH_ASKPASS");
-	if (askpass == NULL)
+	if (!all_tokens)
 		return;
+	last_discover = monotime();
 
-	if (pipe(p) == -1)
-		return;
-	if ((kid = fork()) == -1)
+again:
+	err = piv_enumerate_lazy(ctx, &list);
+	if (err && errf_caused_by(err, "PCSCContextError")) {
+		errf_free(err);
+		if ((err = reset_pcsc_context()) == NULL)
+			goto again;
+	}
+	if (err) {
+		bunyan_log(BNY_WARN, "failed to enumerate PIV tokens",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
 		return;
-	if (kid == 0) {
-		close(p[0]);
-		if (dup2(p[1], STDOUT_FILENO) == -1)
-			exit(1);
-		execlp(askpass, askpass, prompt, (char *)NULL);
-		exit(1);
 	}
-	close(p[1]);
 
-	len = 0;
-	do {
-		ssize_t r = read(p[0], buf + len, sizeof(buf) - 1 - len);
+	for (at = tokens; at != NULL; at = at->at_next)
+		at->at_seen = B_FALSE;
 
-		if (r == -1 && errno == EINTR)
+	for (tk = list; tk != NULL; tk = piv_token_next(tk)) {
+		if (!piv_token_has_chuid(tk))
 			continue;
-		if (r <= 0)
-			break;
-		len += r;
-	} while (sizeof(buf) - 1 - len > 0);
-	buf[len] = '\0';
-
-	close(p[0]);
-	while ((ret = waitpid(kid, &status, 0)) == -1)
-		if (errno != EINTR)
-			break;
-	if (ret == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-		explicit_bzero(buf, sizeof(buf));
-		bunyan_log(BNY_WARN, "executing askpass failed",
-		    "exit_status", BNY_UINT, (uint)WEXITSTATUS(status),
-		    NULL);
-		return;
+		tkguid = piv_token_guid(tk);
+		at = find_agent_token(tkguid, GUID_LEN);
+		if (at == NULL) {
+			if (ntokens >= pin_slots) {
+				bunyan_log(BNY_WARN, "too many PIV tokens, "
+				    "ignoring new token",
+				    "guid", BNY_STRING, piv_token_guid_hex(tk),
+				    NULL);
+				continue;
+			}
+			at = new_agent_token(tkguid, GUID_LEN);
+			/* Comments change once there's more than one token */
+			for (oat = tokens; oat != NULL; oat = oat->at_next)
+				token_slots_changed(oat);
+			bunyan_log(BNY_INFO, "found new PIV token",
+			    "guid", BNY_STRING, at->at_guidhex,
+			    "reader", BNY_STRING, piv_token_rdrname(tk), NULL);
+		}
+		at->at_seen = B_TRUE;
 	}
 
-	buf[strcspn(buf, "\r\n")] = '\0';
-	if ((err = valid_pin(buf))) {
-		errf_free(err);
-		goto out;
-	}
-	if ((err = agent_piv_open())) {
-		errf_free(err);
-		goto out;
-	}
-	err = piv_verify_pin(selk, auth, buf, &retries, B_FALSE);
-	if (err != ERRF_OK) {
-		err = wrap_pin_error(err, retries);
-		bunyan_log(BNY_WARN, "failed to use PIN provided by askpass",
-		    "error", BNY_ERF, err, NULL);
-		errf_free(err);
-		goto out;
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_seen || at->at_txnopen || at->at_tk == NULL)
+			continue;
+		piv_release(at->at_tk);
+		at->at_tk = NULL;
+		token_slots_changed(at);
 	}
-	agent_piv_close(B_FALSE);
-	if (pin_len != 0)
-		explicit_bzero(pin, pin_len);
-	pin_len = strlen(buf);
-	bcopy(buf, pin, pin_len);
-	bunyan_log(BNY_INFO, "storing PIN in memory", NULL);
-	card_probe_interval = card_probe_interval_pin;
 
-out:
-	explicit_bzero(buf, sizeof(buf));
+	piv_release(list);
 }
 
-static void
-try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
-{
-	int status;
+static int set_nonblock(int);
+
+/*
+ * Card watcher.
+ *
+ * Rather than waking up every so often to probe our tokens (which generates
+ * card traffic and still leaves us with stale state for minutes after a card
+ * is pulled), we run a helper thread which sits in piv_get_status_change() on
+ * its own PCSC context. Whenever a card is inserted into or removed from a
+ * reader it writes a struct watch_msg down watch_pipe, which the card thread
+ * polls on alongside its queue of requests.
+ *
+ * The thread never touches any of the agent's state: it only knows about
+ * reader names.
+ */
+enum watch_event {
+	WATCH_CARD_IN = 1,
+	WATCH_CARD_OUT,
+	/* Card was removed and re-inserted before we noticed */
+	WATCH_CARD_SWAP
+};
+
+#define	WATCH_READER_MAX	256
+
+struct watch_msg {
+	enum watch_event wm_event;
+	/* This is the first report about this reader since we started. */
+	boolean_t wm_initial;
+	char wm_reader[WATCH_READER_MAX];
+};
+
+static int watch_pipe[2] = { -1, -1 };
+static pthread_t watch_thread;
+
+/* How often to re-list readers if PnP notification isn't supported */
+static const DWORD watch_relist_timeout = 5000;
+
+static const char *watch_pnp_reader = "\\\\?PnP?\\Notification";
+
+static void
+watch_send(enum watch_event ev, boolean_t initial, const char *reader)
+{
+	struct watch_msg wm;
+	ssize_t done;
+
+	bzero(&wm, sizeof (wm));
+	wm.wm_event = ev;
+	wm.wm_initial = initial;
+	strlcpy(wm.wm_reader, reader, sizeof (wm.wm_reader));
+	/* Writes of less than PIPE_BUF are atomic, so no partial messages */
+	do {
+		done = write(watch_pipe[1], &wm, sizeof (wm));
+	} while (done == -1 && errno == EINTR);
+}
+
+/*
+ * Rebuilds the array of reader states after the set of readers may have
+ * changed, carrying over what we knew about readers which are still there.
+ * Slot 0 is always the special PnP notification "reader", if we're using it.
+ */
+static void
+watch_relist(SCARDCONTEXT wctx, boolean_t pnp, SCARD_READERSTATE **prs,
+    DWORD *pnrs, char **prdrs)
+{
+	SCARD_READERSTATE *ors = *prs, *nrs;
+	DWORD onrs = *pnrs, nnrs, i, j;
+	char *rdrs = NULL, *thisrdr;
+	DWORD rdrslen = 0;
+	LONG rv;
+
+	rv = piv_list_readers(wctx, NULL, &rdrslen);
+	if (rv == SCARD_S_SUCCESS) {
+		rdrs = calloc(1, rdrslen);
+		VERIFY(rdrs != NULL);
+		rv = piv_list_readers(wctx, rdrs, &rdrslen);
+	}
+	if (rv != SCARD_S_SUCCESS) {
+		free(rdrs);
+		rdrs = NULL;
+		rdrslen = 0;
+	}
+
+	nnrs = pnp ? 1 : 0;
+	for (thisrdr = rdrs; rdrs != NULL && *thisrdr != '\0';
+	    thisrdr += strlen(thisrdr) + 1)
+		++nnrs;
+
+	nrs = calloc(nnrs == 0 ? 1 : nnrs, sizeof (SCARD_READERSTATE));
+	VERIFY(nrs != NULL);
+	i = 0;
+	if (pnp) {
+		nrs[0].szReader = watch_pnp_reader;
+		nrs[0].dwCurrentState = (onrs > 0) ?
+		    ors[0].dwCurrentState : SCARD_STATE_UNAWARE;
+		i = 1;
+	}
+	for (thisrdr = rdrs; rdrs != NULL && *thisrdr != '\0';
+	    thisrdr += strlen(thisrdr) + 1, ++i) {
+		nrs[i].szReader = thisrdr;
+		nrs[i].dwCurrentState = SCARD_STATE_UNAWARE;
+		/* Non-NULL user data means "not reported yet" */
+		nrs[i].pvUserData = nrs;
+		for (j = pnp ? 1 : 0; j < onrs; ++j) {
+			if (strcmp(ors[j].szReader, thisrdr) == 0) {
+				nrs[i].dwCurrentState = ors[j].dwCurrentState;
+				nrs[i].pvUserData = NULL;
+				ors[j].szReader = NULL;
+				break;
+			}
+		}
+	}
+
+	/* Anything left in the old list has gone away. */
+	for (j = pnp ? 1 : 0; j < onrs; ++j) {
+		if (ors[j].szReader == NULL)
+			continue;
+		if (ors[j].dwCurrentState & SCARD_STATE_PRESENT)
+			watch_send(WATCH_CARD_OUT, B_FALSE, ors[j].szReader);
+	}
+
+	free(ors);
+	free(*prdrs);
+	*prs = nrs;
+	*pnrs = nnrs;
+	*prdrs = rdrs;
+}
+
+/*ARGSUSED*/
+static void *
+watch_thread_main(void *arg)
+{
+	SCARDCONTEXT wctx;
+	SCARD_READERSTATE *rs = NULL;
+	DWORD nrs = 0, i, timeout;
+	DWORD ost, nst;
+	char *rdrs = NULL;
+	boolean_t havectx = B_FALSE, pnp = B_TRUE, relist = B_TRUE;
+	boolean_t was, is, first;
+	LONG rv;
+
+	for (;;) {
+		if (!havectx) {
+			rv = piv_establish_context(&wctx);
+			if (rv != SCARD_S_SUCCESS) {
+				sleep(5);
+				continue;
+			}
+			havectx = B_TRUE;
+			relist = B_TRUE;
+		}
+		if (relist) {
+			watch_relist(wctx, pnp, &rs, &nrs, &rdrs);
+			relist = B_FALSE;
+		}
+		if (nrs == 0) {
+			/* No readers and no PnP: just poll for readers. */
+			sleep(watch_relist_timeout / 1000);
+			relist = B_TRUE;
+			continue;
+		}
+
+		timeout = pnp ? SCARD_INFINITE : watch_relist_timeout;
+		rv = piv_get_status_change(wctx, timeout, rs, nrs);
+		if (rv == SCARD_E_TIMEOUT) {
+			relist = B_TRUE;
+			continue;
+		} else if (rv == SCARD_E_NO_SERVICE ||
+		    rv == SCARD_E_SERVICE_STOPPED ||
+		    rv == SCARD_E_INVALID_HANDLE) {
+			piv_release_context(wctx);
+			havectx = B_FALSE;
+			sleep(1);
+			continue;
+		} else if (rv != SCARD_S_SUCCESS) {
+			/* e.g. a reader went away while we were listing */
+			relist = B_TRUE;
+			sleep(1);
+			continue;
+		}
+
+		i = 0;
+		if (pnp) {
+			if (rs[0].dwEventState & SCARD_STATE_UNKNOWN) {
+				/* No PnP support here (e.g. macOS) */
+				pnp = B_FALSE;
+				relist = B_TRUE;
+				free(rs);
+				rs = NULL;
+				nrs = 0;
+				free(rdrs);
+				rdrs = NULL;
+				continue;
+			}
+			if (rs[0].dwEventState & SCARD_STATE_CHANGED)
+				relist = B_TRUE;
+			rs[0].dwCurrentState = rs[0].dwEventState &
+			    ~SCARD_STATE_CHANGED;
+			i = 1;
+		}
+		for (; i < nrs; ++i) {
+			if (!(rs[i].dwEventState & SCARD_STATE_CHANGED))
+				continue;
+			ost = rs[i].dwCurrentState;
+			nst = rs[i].dwEventState;
+			was = (ost & SCARD_STATE_PRESENT) != 0;
+			is = (nst & SCARD_STATE_PRESENT) != 0;
+			first = (rs[i].pvUserData != NULL);
+
+			if (first && is) {
+				watch_send(WATCH_CARD_IN, B_TRUE,
+				    rs[i].szReader);
+			} else if (was && !is) {
+				watch_send(WATCH_CARD_OUT, B_FALSE,
+				    rs[i].szReader);
+			} else if (!was && is) {
+				watch_send(WATCH_CARD_IN, B_FALSE,
+				    rs[i].szReader);
+			} else if (was && is && !first &&
+			    (ost >> 16) != (nst >> 16)) {
+				/*
+				 * The upper 16 bits are a count of card
+				 * events: if it changed while the card stayed
+				 * present, we missed a remove/insert pair.
+				 */
+				watch_send(WATCH_CARD_SWAP, B_FALSE,
+				    rs[i].szReader);
+			}
+			if (nst & SCARD_STATE_UNAVAILABLE)
+				relist = B_TRUE;
+
+			rs[i].dwCurrentState = nst & ~SCARD_STATE_CHANGED;
+			rs[i].pvUserData = NULL;
+		}
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+static void
+start_watcher(void)
+{
+	int rc;
+
+	if (pipe(watch_pipe) != 0)
+		fatal("pipe: %s", strerror(errno));
+	if (set_nonblock(watch_pipe[0]) != 0)
+		fatal("failed to set watch pipe non-blocking");
+	rc = pthread_create(&watch_thread, NULL, watch_thread_main, NULL);
+	if (rc != 0)
+		fatal("pthread_create: %s", strerror(rc));
+}
+
+/*
+ * Forget about a token which has been pulled out: drop the PIN and our card
+ * handle, so that whatever is inserted next has to be found (and
+ * authenticated with the CAK, if we have one) from scratch.
+ */
+static void
+token_removed(struct agent_token *at)
+{
+	bunyan_log(BNY_INFO, "PIV token removed",
+	    "guid", BNY_STRING, at->at_guidhex,
+	    "reader", BNY_STRING, piv_token_rdrname(at->at_tk), NULL);
+	if (at->at_txnopen)
+		agent_piv_close(at, B_TRUE);
+	drop_pin(at);
+	piv_release(at->at_tk);
+	at->at_tk = NULL;
+	token_slots_changed(at);
+}
+
+static void
+handle_watch_msg(const struct watch_msg *wm)
+{
+	struct agent_token *at;
+	errf_t *err;
+
+	bunyan_log(BNY_DEBUG, "card event",
+	    "event", BNY_UINT, (uint)wm->wm_event,
+	    "initial", BNY_UINT, (uint)wm->wm_initial,
+	    "reader", BNY_STRING, wm->wm_reader, NULL);
+
+	if (wm->wm_event == WATCH_CARD_OUT || wm->wm_event == WATCH_CARD_SWAP) {
+		for (at = tokens; at != NULL; at = at->at_next) {
+			if (at->at_tk == NULL)
+				continue;
+			if (strcmp(piv_token_rdrname(at->at_tk),
+			    wm->wm_reader) != 0)
+				continue;
+			token_removed(at);
+		}
+		if (wm->wm_event == WATCH_CARD_OUT)
+			return;
+	}
+
+	/*
+	 * A card has arrived: pick up any new tokens (if we're serving them
+	 * all) and then try to find the ones we're missing, so that they're
+	 * ready to use (and CAK-checked) before the next request.
+	 */
+	discover_tokens();
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_tk != NULL || !at->at_seen)
+			continue;
+		if ((err = agent_piv_open(at))) {
+			errf_free(err);
+			continue;
+		}
+		agent_piv_close(at, B_TRUE);
+		bunyan_log(BNY_INFO, "PIV token inserted",
+		    "guid", BNY_STRING, at->at_guidhex,
+		    "reader", BNY_STRING, piv_token_rdrname(at->at_tk), NULL);
+	}
+}
+
+static void
+handle_watch_read(void)
+{
+	struct watch_msg wm;
+	ssize_t done;
+
+	for (;;) {
+		done = read(watch_pipe[0], &wm, sizeof (wm));
+		if (done == -1 && errno == EINTR)
+			continue;
+		if (done == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (done != sizeof (wm))
+			fatal("%s: short read on watch pipe", __func__);
+		handle_watch_msg(&wm);
+	}
+}
+
+static errf_t *
+wrap_pin_error(struct agent_token *at, errf_t *err, int retries)
+{
+	if (errf_caused_by(err, "PermissionError")) {
+		if (retries == 0) {
+			err = errf("TokenLocked", err,
+			    "PIV token is locked due to too many "
+			    "invalid PIN code attempts");
+		} else {
+			err = errf("InvalidPIN", err,
+			    "Invalid PIN code supplied (%d attempts "
+			    "remaining)", retries);
+			drop_pin(at);
+		}
+	} else if (errf_caused_by(err, "MinRetriesError")) {
+		err = errf("TokenLocked", err,
+		    "Refusing to use up the last PIN code attempt: "
+		    "unlock the token with another tool to clear "
+		    "the counter");
+		drop_pin(at);
+	}
+	return (err);
+}
+
+static const char *askpass = NULL;
+static const char *confirm = NULL;
+
+static void
+try_askpass(struct agent_token *at)
+{
+	int p[2], status;
+	pid_t kid, ret;
+	size_t len;
+	errf_t *err;
+	uint retries = 1;
+	char prompt[64], buf[1024];
+	char *guid = piv_token_shortid(at->at_tk);
+	enum piv_pin auth = piv_token_default_auth(at->at_tk);
+	snprintf(prompt, 64, "Enter %s for token %s",
+	    pin_type_to_name(auth), guid);
+	free(guid);
+
+	if (askpass == NULL)
+		askpass = getenv("SSH_ASKPASS");
+	if (askpass == NULL)
+		return;
+
+	if (pipe(p) == -1)
+		return;
+	if ((kid = fork()) == -1)
+		return;
+	if (kid == 0) {
+		close(p[0]);
+		if (dup2(p[1], STDOUT_FILENO) == -1)
+			exit(1);
+		execlp(askpass, askpass, prompt, (char *)NULL);
+		exit(1);
+	}
+	close(p[1]);
+
+	len = 0;
+	do {
+		ssize_t r = read(p[0], buf + len, sizeof(buf) - 1 - len);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		len += r;
+	} while (sizeof(buf) - 1 - len > 0);
+	buf[len] = '\0';
+
+	close(p[0]);
+	while ((ret = waitpid(kid, &status, 0)) == -1)
+		if (errno != EINTR)
+			break;
+	if (ret == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		explicit_bzero(buf, sizeof(buf));
+		bunyan_log(BNY_WARN, "executing askpass failed",
+		    "exit_status", BNY_UINT, (uint)WEXITSTATUS(status),
+		    NULL);
+		return;
+	}
+
+	buf[strcspn(buf, "\r\n")] = '\0';
+	if ((err = valid_pin(buf))) {
+		errf_free(err);
+		goto out;
+	}
+	if ((err = agent_piv_open(at))) {
+		errf_free(err);
+		goto out;
+	}
+	err = piv_verify_pin(at->at_tk, auth, buf, &retries, B_FALSE);
+	if (err != ERRF_OK) {
+		err = wrap_pin_error(at, err, retries);
+		bunyan_log(BNY_WARN, "failed to use PIN provided by askpass",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		goto out;
+	}
+	agent_piv_close(at, B_FALSE);
+	store_pin(at, buf, strlen(buf));
+
+out:
+	explicit_bzero(buf, sizeof(buf));
+}
+
+static void
+try_confirm_client(socket_entry_t *e, struct agent_token *at,
+    enum piv_slotid slotid)
+{
+	int status;
 	pid_t kid, ret;
 	boolean_t add_zenity_args = B_FALSE;
 	char prompt[1024];
-	char *guid = piv_token_shortid(selk);
+	char *guid;
 
 	if (confirm_mode == C_NEVER) {
 		e->se_authz = AUTHZ_ALLOWED;
@@ -708,6 +1488,7 @@ try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 		free(tmp);
 	}
 
+	guid = piv_token_shortid(at->at_tk);
 	snprintf(prompt, sizeof (prompt),
 	    "%sA new client is trying to use PIV token %s\n\n"
 	    "Client PID: %d\nClient executable: %s\nClient cmd: %s\n"
@@ -717,6 +1498,7 @@ try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 	    (e->se_exepath == NULL) ? "(unknown)" : e->se_exepath,
 	    (e->se_exeargs == NULL) ? "(unknown)" : e->se_exeargs,
 	    (uint)slotid);
+	free(guid);
 
 	if ((kid = fork()) == -1)
 		return;
@@ -759,17 +1541,28 @@ try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 }
 
 static errf_t *
-agent_piv_try_pin(boolean_t canskip)
+agent_piv_try_pin(struct agent_token *at, boolean_t canskip)
 {
 	errf_t *err = NULL;
 	uint retries = 1;
-	if (pin_len == 0 && !canskip)
-		try_askpass();
-	if (pin_len != 0) {
-		err = piv_verify_pin(selk, piv_token_default_auth(selk),
-		    pin, &retries, canskip);
-		err = wrap_pin_error(err, retries);
-	}
+	char pinbuf[MAX_PIN_LEN];
+	/*
+	 * Nothing else can use the card while we hold the txn, so if we've
+	 * already verified the PIN in it there's no need to even ask the card
+	 * (this matters for batches).
+	 */
+	if (canskip && at->at_txnpin)
+		return (NULL);
+	if (!token_has_pin(at) && !canskip)
+		try_askpass(at);
+	if (copy_pin(at, pinbuf) != 0) {
+		err = piv_verify_pin(at->at_tk,
+		    piv_token_default_auth(at->at_tk), pinbuf, &retries,
+		    canskip);
+		err = wrap_pin_error(at, err, retries);
+		at->at_txnpin = (err == NULL);
+	}
+	explicit_bzero(pinbuf, sizeof (pinbuf));
 	return (err);
 }
 
@@ -852,88 +1645,250 @@ get_pid_start_time(pid_t pid)
 	return (val);
 }
 
+static void
+get_pid_exe_id(pid_t pid, pid_exe_id_t *id)
+{
+	struct stat st;
+#if defined(__APPLE__)
+	char fn[PROC_PIDPATHINFO_MAXSIZE];
+#else
+	char fn[128];
+#endif
+
+	bzero(id, sizeof (*id));
+#if defined(__sun)
+	snprintf(fn, sizeof (fn), "/proc/%d/object/a.out", (int)pid);
+#elif defined(__linux__)
+	snprintf(fn, sizeof (fn), "/proc/%d/exe", (int)pid);
+#elif defined(__APPLE__)
+	if (proc_pidpath(pid, fn, sizeof (fn)) <= 0)
+		return;
+#else
+	return;
+#endif
+	if (stat(fn, &st) != 0)
+		return;
+	id->pei_dev = st.st_dev;
+	id->pei_ino = st.st_ino;
+	id->pei_mtime = st.st_mtime;
+}
+
+static boolean_t
+pid_exe_id_eq(const pid_exe_id_t *a, const pid_exe_id_t *b)
+{
+	return (a->pei_dev == b->pei_dev && a->pei_ino == b->pei_ino &&
+	    a->pei_mtime == b->pei_mtime);
+}
+
+static void
+pid_wheel_add(pid_entry_t *pe)
+{
+	uint64_t when = pe->pe_check;
+	uint slot;
+
+	if (pid_wheel_time == 0)
+		pid_wheel_time = monotime();
+	if (when < pid_wheel_time)
+		when = pid_wheel_time;
+	slot = (when / PID_WHEEL_TICK) % PID_WHEEL_SLOTS;
+	pe->pe_wnext = pid_wheel[slot];
+	pid_wheel[slot] = pe;
+}
+
 static struct pid_entry *
-find_or_make_pid_entry(pid_t pid, uint64_t start_time)
+find_or_make_pid_entry(pid_t pid, uint64_t start_time,
+    const pid_exe_id_t *exe_id)
 {
-	uint i;
+	pid_entry_t *pe, **pep;
 	uint64_t now = monotime();
-	uint npids_alloc;
-
-	for (i = 0; i < pids_alloc; ++i) {
-		if (pids[i].pe_valid && pids[i].pe_pid == pid &&
-		    pids[i].pe_start_time == start_time) {
-			pids[i].pe_time = now;
-			return (&pids[i]);
-		}
-		if (pids[i].pe_valid && pids[i].pe_pid == pid) {
-			pids[i].pe_time = now;
-			pids[i].pe_start_time = start_time;
-			pids[i].pe_conn_count = 0;
-			pids[i].pe_last_auth = 0;
-			return (&pids[i]);
-		}
-		if (pids[i].pe_valid) {
-			uint64_t delta = now - pids[i].pe_time;
-			if (delta > 30000) {
-				uint64_t nstart;
-				nstart = get_pid_start_time(pids[i].pe_pid);
-				if (nstart == 0 ||
-				    nstart != pids[i].pe_start_time) {
-					pids[i].pe_valid = B_FALSE;
-				}
-			}
-		}
-	}
 
-	for (i = 0; i < pids_alloc; ++i) {
-		if (!pids[i].pe_valid)
-			goto newpid;
+	pep = &pid_hash[(uint)pid & (PID_HASH_SIZE - 1)];
+	for (pe = *pep; pe != NULL; pe = pe->pe_next) {
+		if (pe->pe_pid == pid && pe->pe_start_time == start_time &&
+		    pid_exe_id_eq(&pe->pe_exe_id, exe_id)) {
+			pe->pe_time = now;
+			return (pe);
+		}
 	}
 
-	npids_alloc = pids_alloc + 128;
-	pids = reallocarray(pids, npids_alloc, sizeof (pid_entry_t));
-	VERIFY(pids != NULL);
-	for (i = pids_alloc; i < npids_alloc; ++i)
-		pids[i].pe_valid = B_FALSE;
-	i = pids_alloc;
-	pids_alloc = npids_alloc;
-newpid:
-	pids[i].pe_valid = B_TRUE;
-	pids[i].pe_pid = pid;
-	pids[i].pe_start_time = start_time;
-	pids[i].pe_time = now;
-	pids[i].pe_conn_count = 0;
-	pids[i].pe_last_auth = 0;
-	return (&pids[i]);
+	pe = calloc(1, sizeof (pid_entry_t));
+	VERIFY(pe != NULL);
+	pe->pe_pid = pid;
+	pe->pe_start_time = start_time;
+	pe->pe_exe_id = *exe_id;
+	pe->pe_time = now;
+	pe->pe_check = now + PID_IDLE_TIME;
+	pe->pe_next = *pep;
+	*pep = pe;
+	pid_wheel_add(pe);
+	return (pe);
 }
 
 static void
-close_socket(socket_entry_t *e)
+free_pid_entry(pid_entry_t *pe)
 {
-	close(e->se_fd);
-	e->se_fd = -1;
-	e->se_type = AUTH_UNUSED;
-	e->se_authz = AUTHZ_NOT_YET;
-	e->se_pid_ent = NULL;
-	sshbuf_free(e->se_input);
-	sshbuf_free(e->se_output);
-	sshbuf_free(e->se_request);
-	free(e->se_exepath);
-	free(e->se_exeargs);;
+	pid_entry_t **pep;
+
+	VERIFY0(pe->pe_refs);
+	pep = &pid_hash[(uint)pe->pe_pid & (PID_HASH_SIZE - 1)];
+	while (*pep != pe)
+		pep = &(*pep)->pe_next;
+	*pep = pe->pe_next;
+	free(pe->pe_exepath);
+	free(pe->pe_exeargs);
+	free(pe);
 }
 
-static int
-set_nonblock(int fd)
+/*
+ * Runs any pid wheel slots which have come due. Entries which are still in
+ * use (or have been used recently) go back on the wheel; idle ones are kept
+ * only while their process is still around.
+ */
+static void
+expire_pids(void)
 {
-	int val;
+	pid_entry_t *list, *pe;
+	pid_exe_id_t nexe;
+	uint64_t now, nstart;
+	uint slot;
 
-	val = fcntl(fd, F_GETFL);
-	if (val < 0) {
-		error("fcntl(%d, F_GETFL): %s", fd, strerror(errno));
-		return (-1);
-	}
-	if (val & O_NONBLOCK) {
-		sdebug("fd %d is O_NONBLOCK", fd);
+	if (pid_wheel_time == 0)
+		return;
+	now = monotime();
+	/* If we've been asleep for ages, one lap of the wheel will do. */
+	if (now - pid_wheel_time > PID_WHEEL_SLOTS * PID_WHEEL_TICK)
+		pid_wheel_time = now - PID_WHEEL_SLOTS * PID_WHEEL_TICK;
+
+	while (pid_wheel_time <= now) {
+		slot = (pid_wheel_time / PID_WHEEL_TICK) % PID_WHEEL_SLOTS;
+		list = pid_wheel[slot];
+		pid_wheel[slot] = NULL;
+		pid_wheel_time += PID_WHEEL_TICK;
+
+		while ((pe = list) != NULL) {
+			list = pe->pe_wnext;
+			if (pe->pe_check >= pid_wheel_time) {
+				/* Not due yet, it's on a later lap. */
+				pid_wheel_add(pe);
+				continue;
+			}
+			if (pe->pe_refs > 0 ||
+			    now - pe->pe_time < PID_IDLE_TIME) {
+				pe->pe_check = MAXIMUM(now, pe->pe_time) +
+				    PID_IDLE_TIME;
+				pid_wheel_add(pe);
+				continue;
+			}
+			nstart = get_pid_start_time(pe->pe_pid);
+			if (nstart == 0 || nstart != pe->pe_start_time) {
+				free_pid_entry(pe);
+				continue;
+			}
+			/* It has exec()d: this entry will never match again. */
+			get_pid_exe_id(pe->pe_pid, &nexe);
+			if (!pid_exe_id_eq(&nexe, &pe->pe_exe_id)) {
+				free_pid_entry(pe);
+				continue;
+			}
+			pe->pe_check = now + PID_IDLE_TIME;
+			pid_wheel_add(pe);
+		}
+	}
+}
+
+/*
+ * Looks up the executable path and arguments of a client process, where
+ * the platform lets us.
+ */
+static void
+get_pid_exe(pid_t pid, char **exepath, char **exeargs)
+{
+#if defined(__sun)
+	struct psinfo *psinfo;
+	char fn[128];
+	FILE *f;
+
+	psinfo = calloc(1, sizeof (struct psinfo));
+	VERIFY(psinfo != NULL);
+	snprintf(fn, sizeof (fn), "/proc/%d/psinfo", (int)pid);
+	f = fopen(fn, "r");
+	if (f != NULL) {
+		if (fread(psinfo, sizeof (struct psinfo), 1, f) == 1) {
+			*exepath = strndup(psinfo->pr_fname,
+			    sizeof (psinfo->pr_fname));
+			*exeargs = strndup(psinfo->pr_psargs,
+			    sizeof (psinfo->pr_psargs));
+		}
+		fclose(f);
+	}
+	free(psinfo);
+#elif defined(__APPLE__)
+	char pathBuf[PROC_PIDPATHINFO_MAXSIZE];
+	int rc;
+
+	rc = proc_pidpath(pid, pathBuf, sizeof (pathBuf));
+	if (rc > 0)
+		*exepath = strdup(pathBuf);
+#elif defined(__linux__)
+	char fn[128], ln[1024];
+	ssize_t len;
+	size_t i;
+	FILE *f;
+
+	snprintf(fn, sizeof (fn), "/proc/%d/exe", (int)pid);
+	len = readlink(fn, ln, sizeof (ln));
+	if (len > 0 && len < sizeof (ln))
+		*exepath = strndup(ln, len);
+	snprintf(fn, sizeof (fn), "/proc/%d/cmdline", (int)pid);
+	f = fopen(fn, "r");
+	if (f != NULL) {
+		len = fread(ln, 1, sizeof (ln) - 1, f);
+		fclose(f);
+		for (i = 0; i < len; ++i) {
+			if (ln[i] == '\0')
+				ln[i] = ' ';
+		}
+		*exeargs = strndup(ln, len);
+	}
+#endif
+}
+
+static void
+close_socket(socket_entry_t *e)
+{
+#if defined(USE_EPOLL)
+	if (epoll_fd != -1)
+		(void) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, e->se_fd, NULL);
+#endif
+	close(e->se_fd);
+	e->se_fd = -1;
+	e->se_type = AUTH_UNUSED;
+	e->se_authz = AUTHZ_NOT_YET;
+	if (e->se_pid_ent != NULL)
+		--e->se_pid_ent->pe_refs;
+	e->se_pid_ent = NULL;
+	/* These belong to the pid entry. */
+	e->se_exepath = NULL;
+	e->se_exeargs = NULL;
+	/* If there's a card job in flight, its reply will be thrown away. */
+	e->se_job = NULL;
+	sshbuf_free(e->se_input);
+	sshbuf_free(e->se_output);
+	sshbuf_free(e->se_request);
+}
+
+static int
+set_nonblock(int fd)
+{
+	int val;
+
+	val = fcntl(fd, F_GETFL);
+	if (val < 0) {
+		error("fcntl(%d, F_GETFL): %s", fd, strerror(errno));
+		return (-1);
+	}
+	if (val & O_NONBLOCK) {
+		sdebug("fd %d is O_NONBLOCK", fd);
 		return (0);
 	}
 	sdebug("fd %d setting O_NONBLOCK", fd);
@@ -1056,77 +2011,184 @@ maskout:
 	return (ERRF_OK);
 }
 
+static int
+put_identity(struct sshbuf *msg, struct agent_token *at, struct piv_slot *slot)
+{
+	char comment[256];
+	const char *subj = NULL;
+	int r;
+
+	/*
+	 * agent_keys_read() has normally read the cert already, but if that
+	 * failed don't go back to the card just for the comment.
+	 */
+	if (piv_slot_cert_loaded(slot))
+		subj = piv_slot_subject(slot);
+	if (subj == NULL)
+		subj = "";
+
+	comment[0] = 0;
+	if (ntokens > 1) {
+		snprintf(comment, sizeof (comment), "PIV_slot_%02X@%s %s",
+		    piv_slot_id(slot), piv_token_guid_hex(at->at_tk), subj);
+	} else {
+		snprintf(comment, sizeof (comment), "PIV_slot_%02X %s",
+		    piv_slot_id(slot), subj);
+	}
+	if ((r = sshkey_puts(piv_slot_pubkey(slot), msg)) != 0 ||
+	    (r = sshbuf_put_cstring(msg, comment)) != 0)
+		return (r);
+	return (0);
+}
+
+/*
+ * Fill in the token's at_idkeys/at_idmgmt from its slots (which must already
+ * have been read). Doesn't touch the card.
+ */
+static void
+token_encode_ids(struct agent_token *at)
+{
+	struct piv_slot *slot = NULL;
+	int r;
+
+	if (at->at_idkeys == NULL && (at->at_idkeys = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if (at->at_idmgmt == NULL && (at->at_idmgmt = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	sshbuf_reset(at->at_idkeys);
+	sshbuf_reset(at->at_idmgmt);
+	at->at_idcount = 0;
+
+	while ((slot = piv_slot_next(at->at_tk, slot)) != NULL) {
+		if (!is_slot_enabled(slot))
+			continue;
+		/*
+		 * Slots where GET METADATA found a key but there's no cert
+		 * would never have been found at all on other cards, so leave
+		 * them out here too.
+		 */
+		if (piv_slot_cert_loaded(slot) && piv_slot_cert(slot) == NULL)
+			continue;
+		/*
+		 * Always put key mgmt last so that SSH clients not
+		 * aware of the fact that this slot is not used for
+		 * signing by default will be unlikely to try using
+		 * it.
+		 */
+		if (piv_slot_id(slot) == PIV_SLOT_KEY_MGMT)
+			r = put_identity(at->at_idmgmt, at, slot);
+		else
+			r = put_identity(at->at_idkeys, at, slot);
+		if (r != 0) {
+			fatal("%s: put key/comment: %s", __func__,
+			    ssh_err(r));
+		}
+		++at->at_idcount;
+	}
+	at->at_idvalid = B_TRUE;
+}
+
 /* send list of supported public keys to 'client' */
 static errf_t *
 process_request_identities(socket_entry_t *e)
 {
 	struct sshbuf *msg;
-	struct piv_slot *slot = NULL;
-	char comment[256];
-	uint64_t now;
-	int r, n;
-	errf_t *err = NULL;
+	struct agent_token *at;
+	uint64_t now, expiry;
+	int r, n = 0;
+	uint nopen = 0, nfail = 0;
+	errf_t *err = NULL, *firsterr = NULL;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
 
-	if ((err = agent_piv_open()))
-		goto out;
+	if (all_tokens && last_discover == 0)
+		discover_tokens();
 
-	now = monotime();
-	if ((now - last_update) >= card_probe_interval * 1000) {
-		last_update = now;
-		err = piv_read_all_certs(selk);
-		errf_free(err);
-		if (cak != NULL && (err = auth_cak())) {
-			agent_piv_close(B_TRUE);
-			drop_pin();
-			goto out;
+	expiry = monotime() + card_reread_interval_nopin * 1000;
+
+	for (at = tokens; at != NULL; at = at->at_next) {
+		at->at_idlisted = B_FALSE;
+		if (!at->at_seen)
+			continue;
+
+		if ((err = agent_piv_open(at))) {
+			bunyan_log(BNY_DEBUG, "failed to open token for "
+			    "listing identities",
+			    "guid", BNY_STRING, at->at_guidhex,
+			    "error", BNY_ERF, err, NULL);
+			if (firsterr == NULL)
+				firsterr = err;
+			else
+				errf_free(err);
+			++nfail;
+			continue;
+		}
+
+		now = monotime();
+		if ((now - at->at_last_update) >=
+		    reread_interval(at) * 1000) {
+			at->at_last_update = now;
+			err = piv_read_all_keys(at->at_tk);
+			if (err == ERRF_OK)
+				agent_keys_read(at);
+			errf_free(err);
+			token_slots_changed(at);
+			if (at->at_cak != NULL && (err = auth_cak(at))) {
+				agent_piv_close(at, B_TRUE);
+				drop_pin(at);
+				if (firsterr == NULL)
+					firsterr = err;
+				else
+					errf_free(err);
+				++nfail;
+				continue;
+			}
 		}
+		agent_piv_close(at, B_FALSE);
+		++nopen;
+
+		if (!at->at_idvalid)
+			token_encode_ids(at);
+		at->at_idlisted = B_TRUE;
+		n += at->at_idcount;
+		if (at->at_last_update + reread_interval(at) * 1000 < expiry)
+			expiry = at->at_last_update + reread_interval(at) * 1000;
 	}
-	agent_piv_close(B_FALSE);
 
-	n = 0;
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
-		if (!is_slot_enabled(slot))
-			continue;
-		++n;
+	/*
+	 * We only fail the request if we couldn't talk to any of our tokens:
+	 * otherwise a single missing token would hide the keys on all the
+	 * others.
+	 */
+	if (nopen == 0 && firsterr != NULL) {
+		err = firsterr;
+		goto out;
 	}
+	errf_free(firsterr);
+	err = NULL;
 
 	if ((r = sshbuf_put_u8(msg, SSH2_AGENT_IDENTITIES_ANSWER)) != 0 ||
 	    (r = sshbuf_put_u32(msg, n)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
-		if (piv_slot_id(slot) == PIV_SLOT_KEY_MGMT)
-			continue;
-		if (!is_slot_enabled(slot))
-			continue;
-		comment[0] = 0;
-		snprintf(comment, sizeof (comment), "PIV_slot_%02X %s",
-		    piv_slot_id(slot), piv_slot_subject(slot));
-		if ((r = sshkey_puts(piv_slot_pubkey(slot), msg)) != 0 ||
-		    (r = sshbuf_put_cstring(msg, comment)) != 0) {
-			fatal("%s: put key/comment: %s", __func__,
-			    ssh_err(r));
-		}
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_idlisted &&
+		    (r = sshbuf_putb(msg, at->at_idkeys)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_idlisted &&
+		    (r = sshbuf_putb(msg, at->at_idmgmt)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	}
+
 	/*
-	 * Always put key mgmt last so that SSH clients not aware of the fact
-	 * that this slot is not used for signing by default will be unlikely
-	 * to try using it.
+	 * Don't cache an answer with a token missing from it: we want the
+	 * next request to try that token again.
 	 */
-	if ((slot = piv_get_slot(selk, PIV_SLOT_KEY_MGMT)) != NULL &&
-	    is_slot_enabled(slot)) {
-		comment[0] = 0;
-		snprintf(comment, sizeof (comment), "PIV_slot_%02X %s",
-		    piv_slot_id(slot), piv_slot_subject(slot));
-		if ((r = sshkey_puts(piv_slot_pubkey(slot), msg)) != 0 ||
-		    (r = sshbuf_put_cstring(msg, comment)) != 0) {
-			fatal("%s: put key/comment: %s", __func__,
-			    ssh_err(r));
-		}
-	}
+	if (nfail == 0)
+		idcache_set(msg, expiry);
+
 	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
@@ -1135,6 +2197,94 @@ out:
 	return (err);
 }
 
+static struct piv_slot *
+token_key_slot(struct agent_token *at, const struct sshkey *key)
+{
+	struct piv_slot *slot = NULL;
+
+	if (at->at_tk == NULL)
+		return (NULL);
+	while ((slot = piv_slot_next(at->at_tk, slot)) != NULL) {
+		if (sshkey_equal(piv_slot_pubkey(slot), key) == 1)
+			return (slot);
+	}
+	return (NULL);
+}
+
+/*
+ * Finds the token and slot holding the given public key, and opens a txn on
+ * that token. Tokens whose contents we already know about are checked first,
+ * so that in the common case we only talk to the one token that matters.
+ */
+static errf_t *
+agent_find_key(const struct sshkey *key, struct agent_token **pat,
+    struct piv_slot **pslot)
+{
+	struct agent_token *at;
+	struct piv_slot *slot;
+	boolean_t rediscovered = B_FALSE;
+	errf_t *err;
+
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (token_key_slot(at, key) == NULL)
+			continue;
+		if ((err = agent_piv_open(at)))
+			return (err);
+		/* Opening may have re-read the token, so look again. */
+		if ((slot = token_key_slot(at, key)) != NULL)
+			goto found;
+		agent_piv_close(at, B_FALSE);
+	}
+
+again:
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_tk != NULL || !at->at_seen)
+			continue;
+		if ((err = agent_piv_open(at))) {
+			errf_free(err);
+			continue;
+		}
+		if ((slot = token_key_slot(at, key)) != NULL)
+			goto found;
+		agent_piv_close(at, B_FALSE);
+	}
+	if (all_tokens && !rediscovered) {
+		rediscovered = B_TRUE;
+		discover_tokens();
+		goto again;
+	}
+
+	return (errf("NotFoundError", NULL, "specified key not found"));
+
+found:
+	*pat = at;
+	*pslot = slot;
+	return (NULL);
+}
+
+/* Which hash algorithm the client wants us to sign with. */
+static enum sshdigest_types
+sign_hashalg(const struct sshkey *key, u_int flags)
+{
+	if (key->type == KEY_RSA) {
+		if (flags & SSH_AGENT_RSA_SHA2_256)
+			return (SSH_DIGEST_SHA256);
+		else if (flags & SSH_AGENT_RSA_SHA2_512)
+			return (SSH_DIGEST_SHA512);
+		return (SSH_DIGEST_SHA1);
+	} else if (key->type == KEY_ECDSA) {
+		switch (sshkey_curve_nid_to_bits(key->ecdsa_nid)) {
+		case 384:
+			return (SSH_DIGEST_SHA384);
+		case 521:
+			return (SSH_DIGEST_SHA512);
+		default:
+			return (SSH_DIGEST_SHA256);
+		}
+	}
+	return (SSH_DIGEST_SHA256);
+}
+
 /* ssh2 only */
 static errf_t *
 process_sign_request2(socket_entry_t *e)
@@ -1149,8 +2299,8 @@ process_sign_request2(socket_entry_t *e)
 	struct sshbuf *msg;
 	struct sshbuf *buf;
 	struct sshkey *key = NULL;
+	struct agent_token *at = NULL;
 	struct piv_slot *slot = NULL;
-	int found = 0;
 	enum sshdigest_types hashalg, ohashalg;
 	boolean_t canskip = B_TRUE;
 	enum piv_slot_auth rauth;
@@ -1164,24 +2314,17 @@ process_sign_request2(socket_entry_t *e)
 		goto out;
 	}
 
-	if ((err = agent_piv_open()))
+	if ((err = agent_find_key(key, &at, &slot)))
 		goto out;
-
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
-		if (sshkey_equal(piv_slot_pubkey(slot), key)) {
-			found = 1;
-			break;
-		}
-	}
-	if (!found || slot == NULL || !is_slot_enabled(slot)) {
-		agent_piv_close(B_FALSE);
+	if (!is_slot_enabled(slot)) {
+		agent_piv_close(at, B_FALSE);
 		err = errf("NotFoundError", NULL, "specified key not found");
 		goto out;
 	}
-	bunyan_add_vars(msg_log_frame,
+	bunyan_add_vars(e->se_log_frame,
 	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
 
-	try_confirm_client(e, piv_slot_id(slot));
+	try_confirm_client(e, at, piv_slot_id(slot));
 	if (e->se_authz == AUTHZ_DENIED) {
 		err = errf("AuthzError", NULL, "client blocked");
 		goto out;
@@ -1193,41 +2336,21 @@ process_sign_request2(socket_entry_t *e)
 		goto out;
 	}
 
-	rauth = piv_slot_get_auth(selk, slot);
+	rauth = piv_slot_get_auth(at->at_tk, slot);
 	if (rauth & PIV_SLOT_AUTH_PIN)
 		canskip = B_FALSE;
 
 pin_again:
-	if ((err = agent_piv_try_pin(canskip))) {
-		agent_piv_close(B_TRUE);
+	if ((err = agent_piv_try_pin(at, canskip))) {
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	if (key->type == KEY_RSA) {
-		hashalg = SSH_DIGEST_SHA1;
-		if (flags & SSH_AGENT_RSA_SHA2_256)
-			hashalg = SSH_DIGEST_SHA256;
-		else if (flags & SSH_AGENT_RSA_SHA2_512)
-			hashalg = SSH_DIGEST_SHA512;
-	} else if (key->type == KEY_ECDSA) {
-		switch (sshkey_curve_nid_to_bits(key->ecdsa_nid)) {
-		case 256:
-			hashalg = SSH_DIGEST_SHA256;
-			break;
-		case 384:
-			hashalg = SSH_DIGEST_SHA384;
-			break;
-		case 521:
-			hashalg = SSH_DIGEST_SHA512;
-			break;
-		default:
-			hashalg = SSH_DIGEST_SHA256;
-		}
-	}
+	hashalg = sign_hashalg(key, flags);
 	ohashalg = hashalg;
-	err = piv_sign(selk, slot, data, dlen, &hashalg, &rawsig, &rslen);
+	err = piv_sign(at->at_tk, slot, data, dlen, &hashalg, &rawsig, &rslen);
 
-	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
-	    piv_token_is_ykpiv(selk) && canskip) {
+	if (errf_caused_by(err, "PermissionError") && token_has_pin(at) &&
+	    piv_token_is_ykpiv(at->at_tk) && canskip) {
 		/*
 		 * On a Yubikey, slots other than 9C (SIGNATURE) can also be
 		 * set to "PIN Always" mode. We might have one, so try again
@@ -1236,19 +2359,19 @@ pin_again:
 		canskip = B_FALSE;
 		goto pin_again;
 	} else if (errf_caused_by(err, "PermissionError")) {
-		try_askpass();
-		if (pin_len != 0) {
+		try_askpass(at);
+		if (token_has_pin(at)) {
 			canskip = B_FALSE;
 			goto pin_again;
 		}
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		err = nopinerrf(err);
 		goto out;
 	} else if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	agent_piv_close(B_FALSE);
+	agent_piv_close(at, B_FALSE);
 
 	if (hashalg != ohashalg) {
 		err = errf("HashMismatch", NULL,
@@ -1287,7 +2410,7 @@ out:
 static errf_t *
 process_remove_all_identities(socket_entry_t *e)
 {
-	drop_pin();
+	drop_all_pins();
 	send_status(e, 1);
 	return (NULL);
 }
@@ -1295,102 +2418,339 @@ process_remove_all_identities(socket_entry_t *e)
 struct exthandler {
 	const char *eh_name;
 	errf_t *(*eh_handler)(socket_entry_t *, struct sshbuf *);
+	/* Talks to the card, so has to run on the card thread */
+	boolean_t eh_card;
 };
 struct exthandler exthandlers[];
 
+/* Most payloads we'll sign in one sign-batch@joyent.com request */
+#define	SIGN_BATCH_MAX		4096
+
+/*
+ * sign-batch@joyent.com: sign a list of payloads with the same key.
+ *
+ * Request:	string key, uint32 flags, uint32 count, count * string data
+ * Response:	byte SSH_AGENT_SUCCESS, uint32 count, count * string signature
+ *
+ * The flags are the same as for SSH2_AGENTC_SIGN_REQUEST. The whole batch is
+ * signed inside one transaction, with one PIN check (unless the slot demands
+ * the PIN for every signature). All the hashing and padding is done before we
+ * start on the card, and all the conversion of the signatures into SSH format
+ * after we're finished with it, so that the transaction only covers the work
+ * the card has to do.
+ */
 static errf_t *
-process_ext_ecdh(socket_entry_t *e, struct sshbuf *buf)
+process_ext_sign_batch(socket_entry_t *e, struct sshbuf *buf)
 {
 	int r;
-	errf_t *err;
-	struct sshbuf *msg;
+	errf_t *err = NULL;
+	struct sshbuf *msg = NULL, *sigbuf = NULL;
 	struct sshkey *key = NULL;
-	struct sshkey *partner = NULL;
+	struct agent_token *at = NULL;
 	struct piv_slot *slot = NULL;
-	uint8_t *secret;
-	size_t seclen;
-	uint flags;
-	int found = 0;
-	boolean_t canskip = B_TRUE;
+	u_int flags, count = 0, i;
+	const u_char **data = NULL;
+	size_t *dlen = NULL;
+	uint8_t **blocks = NULL, **rawsigs = NULL;
+	size_t *blocklen = NULL, *rawsiglen = NULL;
+	enum sshdigest_types hashalg, ohashalg;
+	boolean_t canskip = B_TRUE, prehash = B_TRUE, retried;
+	boolean_t pinalways = B_FALSE;
 	enum piv_slot_auth rauth;
 
-	if ((msg = sshbuf_new()) == NULL)
+	if ((msg = sshbuf_new()) == NULL || (sigbuf = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
-	if ((r = sshkey_froms(buf, &key)) ||
-	    (r = sshkey_froms(buf, &partner))) {
+	if ((r = sshkey_froms(buf, &key))) {
 		err = parserrf("sshkey_froms", r);
 		goto out;
 	}
-	if ((r = sshbuf_get_u32(buf, &flags))) {
-		err = parserrf("sshbuf_get_u32(flags)", r);
+	if ((r = sshbuf_get_u32(buf, &flags)) ||
+	    (r = sshbuf_get_u32(buf, &count))) {
+		err = parserrf("sshbuf_get_u32", r);
 		goto out;
 	}
-
-	if (flags != 0) {
-		err = flagserrf(flags);
+	if (count == 0 || count > SIGN_BATCH_MAX) {
+		err = errf("ArgumentError", NULL, "sign-batch request must "
+		    "contain between 1 and %u payloads (has %u)",
+		    SIGN_BATCH_MAX, count);
+		count = 0;
 		goto out;
 	}
 
-	if ((err = agent_piv_open()))
-		goto out;
+	data = calloc(count, sizeof (*data));
+	dlen = calloc(count, sizeof (*dlen));
+	blocks = calloc(count, sizeof (*blocks));
+	blocklen = calloc(count, sizeof (*blocklen));
+	rawsigs = calloc(count, sizeof (*rawsigs));
+	rawsiglen = calloc(count, sizeof (*rawsiglen));
+	VERIFY(data != NULL && dlen != NULL && blocks != NULL &&
+	    blocklen != NULL && rawsigs != NULL && rawsiglen != NULL);
 
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
-		if (sshkey_equal(piv_slot_pubkey(slot), key) == 1) {
-			found = 1;
-			break;
+	for (i = 0; i < count; ++i) {
+		if ((r = sshbuf_get_string_direct(buf, &data[i], &dlen[i]))) {
+			err = parserrf("sshbuf_get_string_direct", r);
+			goto out;
 		}
 	}
-	if (!found || !is_slot_enabled(slot)) {
-		agent_piv_close(B_FALSE);
-		err = errf("NotFoundError", NULL, "specified key not found");
+
+	if ((err = agent_find_key(key, &at, &slot)))
+		goto out;
+	if (!is_slot_enabled(slot)) {
+		agent_piv_close(at, B_FALSE);
+		err = errf("NotFoundError", NULL, "specified key not found");
 		goto out;
 	}
-	bunyan_add_vars(msg_log_frame,
-	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
+	bunyan_add_vars(e->se_log_frame,
+	    "slotid", BNY_UINT, (uint)piv_slot_id(slot),
+	    "count", BNY_UINT, count, NULL);
 
-	try_confirm_client(e, piv_slot_id(slot));
+	try_confirm_client(e, at, piv_slot_id(slot));
 	if (e->se_authz == AUTHZ_DENIED) {
+		agent_piv_close(at, B_FALSE);
 		err = errf("AuthzError", NULL, "client blocked");
 		goto out;
 	}
 
+	if (piv_slot_id(slot) == PIV_SLOT_KEY_MGMT && !sign_9d) {
+		agent_piv_close(at, B_FALSE);
+		err = errf("PermissionError", NULL, "key management key (9d) "
+		    "is not allowed to sign data without the -m option");
+		goto out;
+	}
+
+	ohashalg = sign_hashalg(key, flags);
+	for (i = 0; i < count && prehash; ++i) {
+		hashalg = ohashalg;
+		err = piv_sign_prepare(at->at_tk, slot, data[i], dlen[i],
+		    &hashalg, &blocks[i], &blocklen[i]);
+		if (errf_caused_by(err, "NotSupportedError")) {
+			/* Hash-on-card only: let piv_sign() do it all. */
+			errf_free(err);
+			err = ERRF_OK;
+			prehash = B_FALSE;
+		} else if (err) {
+			agent_piv_close(at, B_FALSE);
+			goto out;
+		} else if (hashalg != ohashalg) {
+			agent_piv_close(at, B_FALSE);
+			err = errf("HashMismatch", NULL,
+			    "PIV device cannot sign with the hash algorithm "
+			    "requested (wanted %d, got %d)",
+			    (int)ohashalg, (int)hashalg);
+			goto out;
+		}
+	}
+
+	rauth = piv_slot_get_auth(at->at_tk, slot);
+	if (rauth & PIV_SLOT_AUTH_PIN)
+		canskip = B_FALSE;
+	if (rauth & PIV_SLOT_AUTH_PIN_ALWAYS)
+		pinalways = B_TRUE;
+
+	if ((err = agent_piv_try_pin(at, canskip))) {
+		agent_piv_close(at, B_TRUE);
+		goto out;
+	}
+	for (i = 0; i < count; ++i) {
+		retried = B_FALSE;
+again:
+		hashalg = ohashalg;
+		if (prehash) {
+			err = piv_sign_prehash(at->at_tk, slot, blocks[i],
+			    blocklen[i], &rawsigs[i], &rawsiglen[i]);
+		} else {
+			err = piv_sign(at->at_tk, slot, data[i], dlen[i],
+			    &hashalg, &rawsigs[i], &rawsiglen[i]);
+		}
+		if (errf_caused_by(err, "PermissionError") && !retried) {
+			/*
+			 * Either this slot wants the PIN every time, or we
+			 * didn't have it yet: get it and have another go. If
+			 * we'd already verified it in this txn, it must be
+			 * the former, and we'll need it for every signature.
+			 */
+			errf_free(err);
+			retried = B_TRUE;
+			if (at->at_txnpin)
+				pinalways = B_TRUE;
+			canskip = B_FALSE;
+			if (!token_has_pin(at))
+				try_askpass(at);
+			if (!token_has_pin(at)) {
+				agent_piv_close(at, B_TRUE);
+				err = nopinerrf(NULL);
+				goto out;
+			}
+			if ((err = agent_piv_try_pin(at, canskip))) {
+				agent_piv_close(at, B_TRUE);
+				goto out;
+			}
+			goto again;
+		} else if (errf_caused_by(err, "PermissionError")) {
+			agent_piv_close(at, B_TRUE);
+			err = nopinerrf(err);
+			goto out;
+		} else if (err) {
+			agent_piv_close(at, B_TRUE);
+			goto out;
+		}
+		if (hashalg != ohashalg) {
+			agent_piv_close(at, B_FALSE);
+			err = errf("HashMismatch", NULL,
+			    "PIV device signed with a different hash "
+			    "algorithm to the one requested (wanted %d, "
+			    "got %d)", (int)ohashalg, (int)hashalg);
+			goto out;
+		}
+		/* A "PIN Always" slot needs it again for the next one. */
+		if (pinalways && i + 1 < count &&
+		    (err = agent_piv_try_pin(at, B_FALSE))) {
+			agent_piv_close(at, B_TRUE);
+			goto out;
+		}
+	}
+	agent_piv_close(at, B_FALSE);
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, count)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < count; ++i) {
+		sshbuf_reset(sigbuf);
+		VERIFY0(sshkey_sig_from_asn1(piv_slot_pubkey(slot), ohashalg,
+		    rawsigs[i], rawsiglen[i], sigbuf));
+		if ((r = sshbuf_put_stringb(msg, sigbuf)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+out:
+	for (i = 0; i < count; ++i) {
+		if (blocks != NULL)
+			freezero(blocks[i], blocklen[i]);
+		if (rawsigs != NULL)
+			freezero(rawsigs[i], rawsiglen[i]);
+	}
+	free(data);
+	free(dlen);
+	free(blocks);
+	free(blocklen);
+	free(rawsigs);
+	free(rawsiglen);
+	sshbuf_free(sigbuf);
+	sshbuf_free(msg);
+	sshkey_free(key);
+	return (err);
+}
+
+/*
+ * The card side of an ecdh@joyent.com request, also used for each item of an
+ * ecdh-batch@joyent.com. The txn is left to time out as usual rather than
+ * being closed, so that the rest of a batch can carry on using it (and the
+ * PIN we verified in it).
+ *
+ * In a batch we only ask the user to confirm the client once, rather than
+ * once per item.
+ */
+static errf_t *
+agent_ecdh(socket_entry_t *e, struct sshkey *key, struct sshkey *partner,
+    boolean_t batch, uint8_t **secret, size_t *seclen)
+{
+	errf_t *err;
+	struct agent_token *at = NULL;
+	struct piv_slot *slot = NULL;
+	boolean_t canskip = B_TRUE;
+	enum piv_slot_auth rauth;
+
+	if ((err = agent_find_key(key, &at, &slot)))
+		return (err);
+	if (!is_slot_enabled(slot)) {
+		agent_piv_close(at, B_FALSE);
+		return (errf("NotFoundError", NULL, "specified key not found"));
+	}
+	if (!batch) {
+		bunyan_add_vars(e->se_log_frame,
+		    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
+	}
+
+	if (!batch || e->se_authz == AUTHZ_NOT_YET)
+		try_confirm_client(e, at, piv_slot_id(slot));
+	if (e->se_authz == AUTHZ_DENIED) {
+		agent_piv_close(at, B_FALSE);
+		return (errf("AuthzError", NULL, "client blocked"));
+	}
+
 	if (key->type != KEY_ECDSA || partner->type != KEY_ECDSA) {
-		agent_piv_close(B_FALSE);
-		err = errf("InvalidKeysError", NULL,
+		agent_piv_close(at, B_FALSE);
+		return (errf("InvalidKeysError", NULL,
 		    "keys are not both EC keys (%s and %s)",
-		    sshkey_type(key), sshkey_type(partner));
-		goto out;
+		    sshkey_type(key), sshkey_type(partner)));
 	}
 
-	rauth = piv_slot_get_auth(selk, slot);
+	rauth = piv_slot_get_auth(at->at_tk, slot);
 	if (rauth & PIV_SLOT_AUTH_PIN)
 		canskip = B_FALSE;
 
 pin_again:
-	if ((err = agent_piv_try_pin(canskip))) {
-		agent_piv_close(B_TRUE);
-		goto out;
+	if ((err = agent_piv_try_pin(at, canskip))) {
+		agent_piv_close(at, B_TRUE);
+		return (err);
 	}
-	err = piv_ecdh(selk, slot, partner, &secret, &seclen);
-	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
-	    piv_token_is_ykpiv(selk) && canskip) {
+	err = piv_ecdh(at->at_tk, slot, partner, secret, seclen);
+	if (errf_caused_by(err, "PermissionError") && token_has_pin(at) &&
+	    piv_token_is_ykpiv(at->at_tk) && canskip) {
 		/* Yubikey can have slots other than 9C as "PIN Always" */
+		errf_free(err);
 		canskip = B_FALSE;
 		goto pin_again;
 	} else if (errf_caused_by(err, "PermissionError")) {
-		try_askpass();
-		if (pin_len != 0) {
+		try_askpass(at);
+		if (token_has_pin(at)) {
+			errf_free(err);
 			canskip = B_FALSE;
 			goto pin_again;
 		}
-		agent_piv_close(B_TRUE);
-		err = nopinerrf(err);
-		goto out;
+		agent_piv_close(at, B_TRUE);
+		return (nopinerrf(err));
 	} else if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
+		return (err);
+	}
+	agent_piv_close(at, B_FALSE);
+	return (ERRF_OK);
+}
+
+static errf_t *
+process_ext_ecdh(socket_entry_t *e, struct sshbuf *buf)
+{
+	int r;
+	errf_t *err;
+	struct sshbuf *msg;
+	struct sshkey *key = NULL;
+	struct sshkey *partner = NULL;
+	uint8_t *secret;
+	size_t seclen;
+	uint flags;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshkey_froms(buf, &key)) ||
+	    (r = sshkey_froms(buf, &partner))) {
+		err = parserrf("sshkey_froms", r);
+		goto out;
+	}
+	if ((r = sshbuf_get_u32(buf, &flags))) {
+		err = parserrf("sshbuf_get_u32(flags)", r);
 		goto out;
 	}
-	agent_piv_close(B_FALSE);
+
+	if (flags != 0) {
+		err = flagserrf(flags);
+		goto out;
+	}
+
+	if ((err = agent_ecdh(e, key, partner, B_FALSE, &secret, &seclen)))
+		goto out;
 
 	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
 	    (r = sshbuf_put_string(msg, secret, seclen)) != 0)
@@ -1408,6 +2768,105 @@ out:
 	return (err);
 }
 
+/*
+ * The card side of an ecdh-rebox@joyent.com request (and each item of an
+ * ecdh-rebox-batch@joyent.com): unlocks "box" and seals its contents up again
+ * in a new box for "partner", which is written out in binary form to "out".
+ * As with agent_ecdh(), the txn is left open for the rest of a batch.
+ */
+static errf_t *
+agent_rebox(socket_entry_t *e, struct piv_ecdh_box *box, struct sshbuf *guidb,
+    uint8_t slotid, struct sshkey *partner, boolean_t batch, uint8_t **out,
+    size_t *outlen)
+{
+	errf_t *err;
+	struct piv_ecdh_box *newbox = NULL;
+	struct agent_token *at;
+	struct piv_slot *slot;
+	uint8_t *secret = NULL;
+	size_t seclen;
+	boolean_t canskip = B_TRUE;
+	enum piv_slot_auth rauth;
+
+	err = agent_find_key(piv_box_pubkey(box), &at, &slot);
+	if (errf_caused_by(err, "NotFoundError")) {
+		return (errf("WrongTokenError", err, "box can only be "
+		    "unlocked by a different PIV device"));
+	} else if (err) {
+		return (err);
+	}
+	if (!is_slot_enabled(slot)) {
+		agent_piv_close(at, B_FALSE);
+		return (errf("KeyDisabledError", NULL, "box can only be "
+		    "unlocked by a disabled key slot"));
+	}
+
+	if (!batch || e->se_authz == AUTHZ_NOT_YET)
+		try_confirm_client(e, at, piv_slot_id(slot));
+	if (e->se_authz == AUTHZ_DENIED) {
+		agent_piv_close(at, B_FALSE);
+		return (errf("AuthzError", NULL, "client blocked"));
+	}
+
+	rauth = piv_slot_get_auth(at->at_tk, slot);
+	if (rauth & PIV_SLOT_AUTH_PIN)
+		canskip = B_FALSE;
+
+pin_again:
+	if ((err = agent_piv_try_pin(at, canskip))) {
+		agent_piv_close(at, B_TRUE);
+		return (err);
+	}
+	err = piv_box_open(at->at_tk, slot, box);
+	if (errf_caused_by(err, "PermissionError") && token_has_pin(at) &&
+	    piv_token_is_ykpiv(at->at_tk) && canskip) {
+		/*
+		 * On a Yubikey, slots other than 9C (SIGNATURE) can also be
+		 * set to "PIN Always" mode. We might have one, so try again
+		 * with forced PIN entry.
+		 */
+		errf_free(err);
+		canskip = B_FALSE;
+		goto pin_again;
+	} else if (errf_caused_by(err, "PermissionError")) {
+		try_askpass(at);
+		if (token_has_pin(at)) {
+			errf_free(err);
+			canskip = B_FALSE;
+			goto pin_again;
+		}
+		agent_piv_close(at, B_TRUE);
+		return (nopinerrf(err));
+	} else if (err) {
+		agent_piv_close(at, B_TRUE);
+		return (err);
+	}
+
+	VERIFY0(piv_box_take_data(box, &secret, &seclen));
+	agent_piv_close(at, B_FALSE);
+
+	newbox = piv_box_new();
+	VERIFY(newbox != NULL);
+
+	if (sshbuf_len(guidb) > 0) {
+		piv_box_set_guid(newbox, sshbuf_ptr(guidb), GUID_LEN);
+		piv_box_set_slot(newbox, slotid);
+	}
+	VERIFY0(piv_box_set_data(newbox, secret, seclen));
+	if ((err = piv_box_seal_offline(partner, newbox)))
+		goto out;
+
+	VERIFY0(piv_box_to_binary(newbox, out, outlen));
+
+out:
+	piv_box_free(newbox);
+	if (secret != NULL) {
+		explicit_bzero(secret, seclen);
+		free(secret);
+	}
+	return (err);
+}
+
 static errf_t *
 process_ext_rebox(socket_entry_t *e, struct sshbuf *buf)
 {
@@ -1415,15 +2874,11 @@ process_ext_rebox(socket_entry_t *e, struct sshbuf *buf)
 	errf_t *err;
 	struct sshbuf *msg, *boxbuf = NULL, *guidb = NULL;
 	struct sshkey *partner = NULL;
-	struct piv_ecdh_box *box = NULL, *newbox = NULL;
+	struct piv_ecdh_box *box = NULL;
 	uint8_t slotid;
 	uint flags;
-	struct piv_slot *slot;
-	struct piv_token *tk;
-	uint8_t *secret = NULL, *out = NULL;
-	size_t seclen, outlen;
-	boolean_t canskip = B_TRUE;
-	enum piv_slot_auth rauth;
+	uint8_t *out = NULL;
+	size_t outlen;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
@@ -1450,100 +2905,216 @@ process_ext_rebox(socket_entry_t *e, struct sshbuf *buf)
 		goto out;
 	}
 
-	try_confirm_client(e, PIV_SLOT_KEY_MGMT);
-	if (e->se_authz == AUTHZ_DENIED) {
-		err = errf("AuthzError", NULL, "client blocked");
-		goto out;
-	}
-
 	err = sshbuf_get_piv_box(boxbuf, &box);
 	if (err)
 		goto out;
 
-	err = piv_box_find_token(selk, box, &tk, &slot);
+	err = agent_rebox(e, box, guidb, slotid, partner, B_FALSE, &out,
+	    &outlen);
 	if (err)
 		goto out;
-	if (tk != selk) {
-		err = errf("WrongTokenError", NULL, "box can only be unlocked "
-		    "by a different PIV device");
-		goto out;
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_string(msg, out, outlen)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+out:
+	piv_box_free(box);
+	if (out != NULL) {
+		explicit_bzero(out, outlen);
+		free(out);
 	}
-	if (!is_slot_enabled(slot)) {
-		err = errf("KeyDisabledError", NULL, "box can only be unlocked "
-		    "by a disabled key slot");
-		goto out;
+	sshbuf_free(msg);
+	sshkey_free(partner);
+	sshbuf_free(boxbuf);
+	sshbuf_free(guidb);
+	return (err);
+}
+
+/* Most items we'll handle in one *-batch@joyent.com request */
+#define	ECDH_BATCH_MAX		4096
+
+/*
+ * Each item in an ecdh-batch or ecdh-rebox-batch response is a status byte
+ * followed by a string. If the status is SSH_AGENT_SUCCESS the string is the
+ * result, otherwise it's the name of the error we hit (and the rest of the
+ * batch carries on regardless).
+ */
+static void
+put_batch_item(struct sshbuf *msg, errf_t *err, const uint8_t *data,
+    size_t len)
+{
+	int r;
+
+	if (err != ERRF_OK) {
+		bunyan_log(BNY_WARN, "failed to process batch item",
+		    "error", BNY_ERF, err, NULL);
+		if ((r = sshbuf_put_u8(msg, SSH_AGENT_FAILURE)) != 0 ||
+		    (r = sshbuf_put_cstring(msg, errf_name(err))) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		return;
 	}
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_string(msg, data, len)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+}
 
-	rauth = piv_slot_get_auth(tk, slot);
-	if (rauth & PIV_SLOT_AUTH_PIN)
-		canskip = B_FALSE;
+static errf_t *
+get_batch_header(struct sshbuf *buf, uint *pcount)
+{
+	int r;
+	uint flags, count;
+
+	if ((r = sshbuf_get_u32(buf, &flags)) != 0 ||
+	    (r = sshbuf_get_u32(buf, &count)) != 0)
+		return (parserrf("sshbuf_get_u32", r));
+	if (flags != 0)
+		return (flagserrf(flags));
+	if (count == 0 || count > ECDH_BATCH_MAX) {
+		return (errf("ArgumentError", NULL, "batch request must "
+		    "contain between 1 and %u items (has %u)",
+		    ECDH_BATCH_MAX, count));
+	}
+	*pcount = count;
+	return (ERRF_OK);
+}
 
-	if ((err = agent_piv_open()))
-		goto out;
-pin_again:
-	if ((err = agent_piv_try_pin(canskip))) {
-		agent_piv_close(B_TRUE);
+/*
+ * ecdh-batch@joyent.com: many ecdh@joyent.com requests in one.
+ *
+ * Request:	uint32 flags, uint32 count,
+ *		count * (string key, string partner)
+ * Response:	byte SSH_AGENT_SUCCESS, uint32 count,
+ *		count * (byte status, string secret or error name)
+ *
+ * Items using the same token share one card transaction and PIN check.
+ */
+static errf_t *
+process_ext_ecdh_batch(socket_entry_t *e, struct sshbuf *buf)
+{
+	int r;
+	errf_t *err, *ierr;
+	struct sshbuf *msg;
+	struct sshkey *key = NULL, *partner = NULL;
+	uint8_t *secret;
+	size_t seclen;
+	uint count, i;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((err = get_batch_header(buf, &count)))
 		goto out;
-	}
-	err = piv_box_open(selk, slot, box);
-	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
-	    piv_token_is_ykpiv(selk) && canskip) {
-		/*
-		 * On a Yubikey, slots other than 9C (SIGNATURE) can also be
-		 * set to "PIN Always" mode. We might have one, so try again
-		 * with forced PIN entry.
-		 */
-		canskip = B_FALSE;
-		goto pin_again;
-	} else if (errf_caused_by(err, "PermissionError")) {
-		try_askpass();
-		if (pin_len != 0) {
-			canskip = B_FALSE;
-			goto pin_again;
+	bunyan_add_vars(e->se_log_frame, "count", BNY_UINT, count, NULL);
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, count)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	for (i = 0; i < count; ++i) {
+		if ((r = sshkey_froms(buf, &key)) ||
+		    (r = sshkey_froms(buf, &partner))) {
+			err = parserrf("sshkey_froms", r);
+			goto out;
 		}
-		agent_piv_close(B_TRUE);
-		err = nopinerrf(err);
-		goto out;
-	} else if (err) {
-		agent_piv_close(B_TRUE);
-		goto out;
+		secret = NULL;
+		seclen = 0;
+		ierr = agent_ecdh(e, key, partner, B_TRUE, &secret, &seclen);
+		put_batch_item(msg, ierr, secret, seclen);
+		errf_free(ierr);
+		freezero(secret, seclen);
+		sshkey_free(key);
+		sshkey_free(partner);
+		key = NULL;
+		partner = NULL;
 	}
 
-	VERIFY0(piv_box_take_data(box, &secret, &seclen));
-	agent_piv_close(B_FALSE);
-
+	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
-	newbox = piv_box_new();
-	VERIFY(newbox != NULL);
+out:
+	sshbuf_free(msg);
+	sshkey_free(key);
+	sshkey_free(partner);
+	return (err);
+}
 
-	if (sshbuf_len(guidb) > 0) {
-		piv_box_set_guid(newbox, sshbuf_ptr(guidb), GUID_LEN);
-		piv_box_set_slot(newbox, slotid);
-	}
-	VERIFY0(piv_box_set_data(newbox, secret, seclen));
-	if ((err = piv_box_seal_offline(partner, newbox)))
-		goto out;
+/*
+ * ecdh-rebox-batch@joyent.com: many ecdh-rebox@joyent.com requests in one.
+ *
+ * Request:	uint32 flags, uint32 count,
+ *		count * (string box, string guid, byte slotid, string partner)
+ * Response:	byte SSH_AGENT_SUCCESS, uint32 count,
+ *		count * (byte status, string new box or error name)
+ *
+ * Items using the same token share one card transaction and PIN check.
+ */
+static errf_t *
+process_ext_rebox_batch(socket_entry_t *e, struct sshbuf *buf)
+{
+	int r;
+	errf_t *err, *ierr;
+	struct sshbuf *msg, *boxbuf = NULL, *guidb = NULL;
+	struct sshkey *partner = NULL;
+	struct piv_ecdh_box *box = NULL;
+	uint8_t slotid;
+	uint8_t *out;
+	size_t outlen;
+	uint count, i;
 
-	VERIFY0(piv_box_to_binary(newbox, &out, &outlen));
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((err = get_batch_header(buf, &count)))
+		goto out;
+	bunyan_add_vars(e->se_log_frame, "count", BNY_UINT, count, NULL);
 
 	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
-	    (r = sshbuf_put_string(msg, out, outlen)) != 0)
+	    (r = sshbuf_put_u32(msg, count)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
+	for (i = 0; i < count; ++i) {
+		if ((r = sshbuf_froms(buf, &boxbuf)) != 0 ||
+		    (r = sshbuf_froms(buf, &guidb)) != 0) {
+			err = parserrf("sshbuf_froms", r);
+			goto out;
+		}
+		if ((r = sshbuf_get_u8(buf, &slotid)) != 0) {
+			err = parserrf("sshbuf_get_u8(slotid)", r);
+			goto out;
+		}
+		if ((r = sshkey_froms(buf, &partner)) != 0) {
+			err = parserrf("sshkey_froms(partner)", r);
+			goto out;
+		}
+
+		out = NULL;
+		outlen = 0;
+		ierr = sshbuf_get_piv_box(boxbuf, &box);
+		if (ierr == ERRF_OK) {
+			ierr = agent_rebox(e, box, guidb, slotid, partner,
+			    B_TRUE, &out, &outlen);
+		}
+		put_batch_item(msg, ierr, out, outlen);
+		errf_free(ierr);
+		freezero(out, outlen);
+
+		piv_box_free(box);
+		sshkey_free(partner);
+		sshbuf_free(boxbuf);
+		sshbuf_free(guidb);
+		box = NULL;
+		partner = NULL;
+		boxbuf = NULL;
+		guidb = NULL;
+	}
+
 	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
 out:
 	piv_box_free(box);
-	piv_box_free(newbox);
-	if (secret != NULL) {
-		explicit_bzero(secret, seclen);
-		free(secret);
-	}
-	if (out != NULL) {
-		explicit_bzero(out, outlen);
-		free(out);
-	}
 	sshbuf_free(msg);
 	sshkey_free(partner);
 	sshbuf_free(boxbuf);
@@ -1567,11 +3138,11 @@ process_ext_attest(socket_entry_t *e, struct sshbuf *buf)
 	errf_t *err;
 	struct sshbuf *msg;
 	struct sshkey *key = NULL;
+	struct agent_token *at = NULL;
 	struct piv_slot *slot = NULL;
 	uint8_t *cert = NULL, *chain = NULL, *ptr;
 	size_t certlen, chainlen = 0, len;
 	uint flags;
-	int found = 0;
 	uint tag;
 	struct tlv_state *tlv = NULL;
 
@@ -1588,34 +3159,27 @@ process_ext_attest(socket_entry_t *e, struct sshbuf *buf)
 		goto out;
 	}
 
-	if ((err = agent_piv_open()))
+	if ((err = agent_find_key(key, &at, &slot)))
 		goto out;
-
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
-		if (sshkey_equal(piv_slot_pubkey(slot), key)) {
-			found = 1;
-			break;
-		}
-	}
-	if (!found || !is_slot_enabled(slot)) {
-		agent_piv_close(B_FALSE);
+	if (!is_slot_enabled(slot)) {
+		agent_piv_close(at, B_FALSE);
 		err = errf("NotFoundError", NULL, "specified key not found");
 		goto out;
 	}
-	bunyan_add_vars(msg_log_frame,
+	bunyan_add_vars(e->se_log_frame,
 	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
 
-	err = ykpiv_attest(selk, slot, &cert, &certlen);
+	err = ykpiv_attest(at->at_tk, slot, &cert, &certlen);
 	if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	err = piv_read_file(selk, PIV_TAG_CERT_YK_ATTESTATION, &chain, &chainlen);
+	err = piv_read_file(at->at_tk, PIV_TAG_CERT_YK_ATTESTATION, &chain, &chainlen);
 	if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	agent_piv_close(B_FALSE);
+	agent_piv_close(at, B_FALSE);
 
 	tlv = tlv_init(chain, 0, chainlen);
 	if ((err = tlv_read_tag(tlv, &tag)))
@@ -1679,12 +3243,15 @@ process_ext_query(socket_entry_t *e, struct sshbuf *buf)
 }
 
 struct exthandler exthandlers[] = {
-	{ "query", process_ext_query },
-	{ "ecdh@joyent.com", process_ext_ecdh },
-	{ "ecdh-rebox@joyent.com", process_ext_rebox },
-	{ "x509-certs@joyent.com", process_ext_x509_certs },
-	{ "ykpiv-attest@joyent.com", process_ext_attest },
-	{ NULL, NULL }
+	{ "query", process_ext_query, B_FALSE },
+	{ "ecdh@joyent.com", process_ext_ecdh, B_TRUE },
+	{ "sign-batch@joyent.com", process_ext_sign_batch, B_TRUE },
+	{ "ecdh-rebox@joyent.com", process_ext_rebox, B_TRUE },
+	{ "ecdh-batch@joyent.com", process_ext_ecdh_batch, B_TRUE },
+	{ "ecdh-rebox-batch@joyent.com", process_ext_rebox_batch, B_TRUE },
+	{ "x509-certs@joyent.com", process_ext_x509_certs, B_TRUE },
+	{ "ykpiv-attest@joyent.com", process_ext_attest, B_TRUE },
+	{ NULL, NULL, B_FALSE }
 };
 
 static errf_t *
@@ -1719,7 +3286,7 @@ process_extension(socket_entry_t *e)
 		goto out;
 	}
 
-	bunyan_add_vars(msg_log_frame,
+	bunyan_add_vars(e->se_log_frame,
 	    "extension", BNY_STRING, h->eh_name, NULL);
 	err = hdlr->eh_handler(e, inner);
 
@@ -1741,13 +3308,71 @@ out:
 	return (err);
 }
 
+static boolean_t
+agent_token_matches(struct agent_token *at, const char *prefix)
+{
+	const char *hex = at->at_guidhex;
+
+	if (at->at_tk != NULL && piv_token_has_chuid(at->at_tk))
+		hex = piv_token_guid_hex(at->at_tk);
+	if (strlen(prefix) > strlen(hex))
+		return (B_FALSE);
+	return (strncasecmp(hex, prefix, strlen(prefix)) == 0);
+}
+
+/*
+ * Work out which token an unlock request (ssh-add -X) is meant for. The
+ * "password" given can either be just a PIN, or "guid:PIN" where guid is a
+ * (prefix of a) token GUID in hex. A bare PIN goes to the first token we're
+ * serving which doesn't have a PIN yet.
+ */
+static errf_t *
+unlock_target(char *passwd, struct agent_token **pat, char **ppin)
+{
+	struct agent_token *at;
+	char *p;
+
+	if ((p = strchr(passwd, ':')) != NULL) {
+		*p = '\0';
+		*ppin = p + 1;
+		for (at = tokens; at != NULL; at = at->at_next) {
+			if (agent_token_matches(at, passwd))
+				break;
+		}
+		if (at == NULL) {
+			return (errf("NotFoundError", NULL, "No PIV token "
+			    "matching GUID '%s' is being used by this agent",
+			    passwd));
+		}
+		*pat = at;
+		return (NULL);
+	}
+
+	*ppin = passwd;
+	if (ntokens == 1) {
+		*pat = tokens;
+		return (NULL);
+	}
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_seen && !token_has_pin(at))
+			break;
+	}
+	if (at == NULL) {
+		return (errf("NotFoundError", NULL, "All PIV tokens already "
+		    "have a PIN set (use 'guid:PIN' to choose one)"));
+	}
+	*pat = at;
+	return (NULL);
+}
+
 static errf_t *
 process_lock_agent(socket_entry_t *e, int lock)
 {
 	int r;
-	char *passwd;
+	char *passwd, *newpin;
 	size_t pwlen;
 	uint retries = 1;
+	struct agent_token *at;
 	errf_t *err = NULL;
 
 	/*
@@ -1760,32 +3385,31 @@ process_lock_agent(socket_entry_t *e, int lock)
 	VERIFY(passwd != NULL);
 
 	if (lock) {
-		drop_pin();
+		drop_all_pins();
 		send_status(e, 1);
 	} else {
-		if ((err = valid_pin(passwd)))
+		if ((err = unlock_target(passwd, &at, &newpin)))
 			goto out;
 
-		if ((err = agent_piv_open()))
+		if ((err = valid_pin(newpin)))
 			goto out;
 
-		err = piv_verify_pin(selk, piv_token_default_auth(selk),
-		    passwd, &retries, B_FALSE);
+		if ((err = agent_piv_open(at)))
+			goto out;
+
+		err = piv_verify_pin(at->at_tk,
+		    piv_token_default_auth(at->at_tk), newpin, &retries,
+		    B_FALSE);
 
 		if (err == ERRF_OK) {
-			agent_piv_close(B_FALSE);
-			if (pin_len != 0)
-				explicit_bzero(pin, pin_len);
-			pin_len = pwlen;
-			bcopy(passwd, pin, pwlen + 1);
+			agent_piv_close(at, B_FALSE);
+			store_pin(at, newpin, strlen(newpin));
 			send_status(e, 1);
-			bunyan_log(BNY_INFO, "storing PIN in memory", NULL);
-			card_probe_interval = card_probe_interval_pin;
 			goto out;
 		}
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 
-		err = wrap_pin_error(err, retries);
+		err = wrap_pin_error(at, err, retries);
 	}
 out:
 	explicit_bzero(passwd, pwlen);
@@ -1822,104 +3446,557 @@ msg_type_to_name(int msg)
 	}
 }
 
-/* dispatch incoming messages */
+/*
+ * Works out whether a message has to go to the card thread, or whether we can
+ * answer it straight away in the main loop.
+ */
+static boolean_t
+message_needs_card(socket_entry_t *e, u_char type)
+{
+	struct sshbuf *req;
+	struct exthandler *h;
+	char *extname = NULL;
+	boolean_t card = B_FALSE;
+
+	switch (type) {
+	case SSH_AGENTC_UNLOCK:
+	case SSH2_AGENTC_SIGN_REQUEST:
+	case SSH2_AGENTC_REQUEST_IDENTITIES:
+		return (B_TRUE);
+	case SSH2_AGENTC_EXTENSION:
+		/* Peek at the extension name without consuming it. */
+		if ((req = sshbuf_fromb(e->se_request)) == NULL)
+			fatal("%s: sshbuf_fromb failed", __func__);
+		if (sshbuf_get_cstring(req, &extname, NULL) == 0) {
+			for (h = exthandlers; h->eh_name != NULL; ++h) {
+				if (strcmp(h->eh_name, extname) == 0) {
+					card = h->eh_card;
+					break;
+				}
+			}
+		}
+		free(extname);
+		sshbuf_free(req);
+		return (card);
+	default:
+		return (B_FALSE);
+	}
+}
+
+/*
+ * Runs the handler for a message in e->se_request, leaving the reply in
+ * e->se_output. Called either from the main loop or on the card thread (with
+ * the card job's private copy of the connection).
+ */
+static void
+dispatch_message(socket_entry_t *e, u_char type)
+{
+	errf_t *err;
+
+	e->se_log_frame = bunyan_push(
+	    "fd", BNY_INT, e->se_fd,
+	    "msg_type", BNY_INT, (int)type,
+	    "msg_type_name", BNY_STRING, msg_type_to_name(type),
+	    "remote_pid", BNY_INT, (int)e->se_pid,
+	    "remote_cmd", BNY_STRING,
+	    (e->se_exepath == NULL) ? "???" : e->se_exepath,
+	    NULL);
+	bunyan_log(BNY_DEBUG, "received ssh-agent message", NULL);
+
+	switch (type) {
+	case SSH_AGENTC_LOCK:
+	case SSH_AGENTC_UNLOCK:
+		err = process_lock_agent(e, type == SSH_AGENTC_LOCK);
+		break;
+	/* ssh2 */
+	case SSH2_AGENTC_SIGN_REQUEST:
+		err = process_sign_request2(e);
+		break;
+	case SSH2_AGENTC_REQUEST_IDENTITIES:
+		err = process_request_identities(e);
+		break;
+	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		err = process_remove_all_identities(e);
+		break;
+	case SSH2_AGENTC_EXTENSION:
+		err = process_extension(e);
+		break;
+	default:
+		/* Unknown message.  Respond with failure. */
+		err = errf("UnknownMessageError", NULL,
+		    "unknown/unsupported agent protocol message %d", type);
+		break;
+	}
+
+	if (err) {
+		bunyan_log(BNY_WARN, "failed to process command",
+		    "error", BNY_ERF, err, NULL);
+		if (errf_caused_by(err, "NoPINError") &&
+		    bunyan_get_level() > BNY_WARN) {
+			warnfx(err, "denied command due to lack of PIN");
+		}
+		sshbuf_reset(e->se_request);
+		send_status(e, 0);
+		errf_free(err);
+	} else {
+		bunyan_log(BNY_INFO, "processed ssh-agent message", NULL);
+	}
+
+	bunyan_pop(e->se_log_frame);
+	e->se_log_frame = NULL;
+}
+
+static void queue_card_job(u_int, u_char);
+static void update_sock_events(u_int);
+
+/*
+ * The REQUEST_IDENTITIES job currently queued or running on the card thread,
+ * if any. When lots of clients start up at once, any more REQUEST_IDENTITIES
+ * which arrive while it's in flight don't get a job of their own: they just
+ * wait for this one (their se_job points at it) and get a copy of its answer.
+ *
+ * The counters are only touched by the main loop.
+ */
+static struct card_job *idjob = NULL;
+static uint64_t idreq_executed = 0;
+static uint64_t idreq_coalesced = 0;
+static uint64_t idreq_cached = 0;
+
+/*
+ * Takes one message off the connection's input buffer and either answers it
+ * or hands it to the card thread. Returns 1 if a message was taken, 0 if
+ * there isn't a complete one buffered yet.
+ */
+static int
+process_message(u_int socknum)
+{
+	u_int msg_len;
+	u_char type;
+	const u_char *cp;
+	int r;
+	socket_entry_t *e;
+
+	if (socknum >= sockets_alloc) {
+		fatal("%s: socket number %u >= allocated %u",
+		    __func__, socknum, sockets_alloc);
+	}
+	e = &sockets[socknum];
+
+	if (sshbuf_len(e->se_input) < 5)
+		return 0;		/* Incomplete message header. */
+	cp = sshbuf_ptr(e->se_input);
+	msg_len = PEEK_U32(cp);
+	if (msg_len > AGENT_MAX_LEN) {
+		sdebug("%s: socket %u (fd=%d) message too long %u > %u",
+		    __func__, socknum, e->se_fd, msg_len, AGENT_MAX_LEN);
+		return -1;
+	}
+	if (sshbuf_len(e->se_input) < msg_len + 4)
+		return 0;		/* Incomplete message body. */
+
+	/* move the current input to e->request */
+	sshbuf_reset(e->se_request);
+	if ((r = sshbuf_get_stringb(e->se_input, e->se_request)) != 0 ||
+	    (r = sshbuf_get_u8(e->se_request, &type)) != 0) {
+		if (r == SSH_ERR_MESSAGE_INCOMPLETE ||
+		    r == SSH_ERR_STRING_TOO_LARGE) {
+			sdebug("%s: buffer error: %s", __func__, ssh_err(r));
+			return -1;
+		}
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+
+	if (type == SSH2_AGENTC_REQUEST_IDENTITIES && idcache_reply(e)) {
+		++idreq_cached;
+		bunyan_log(BNY_TRACE, "answered identities from cache",
+		    "fd", BNY_INT, e->se_fd, NULL);
+	} else if (type == SSH2_AGENTC_REQUEST_IDENTITIES && idjob != NULL) {
+		++idreq_coalesced;
+		sshbuf_reset(e->se_request);
+		e->se_job = idjob;
+		bunyan_log(BNY_TRACE, "waiting on in-flight identities request",
+		    "fd", BNY_INT, e->se_fd, NULL);
+	} else if (message_needs_card(e, type)) {
+		queue_card_job(socknum, type);
+		if (type == SSH2_AGENTC_REQUEST_IDENTITIES) {
+			++idreq_executed;
+			idjob = e->se_job;
+		}
+	} else {
+		dispatch_message(e, type);
+	}
+	return 1;
+}
+
+/*
+ * Deals with as many of the buffered messages on a connection as we can,
+ * stopping when one has to wait for the card.
+ */
+static void
+process_input(u_int socknum)
+{
+	while (sockets[socknum].se_type == AUTH_CONNECTION &&
+	    sockets[socknum].se_job == NULL) {
+		if (process_message(socknum) != 1)
+			break;
+	}
+	update_sock_events(socknum);
+}
+
+/*
+ * Card thread.
+ *
+ * Talking to a card is slow (an RSA-2048 signature takes hundreds of ms), so
+ * none of it happens in the main loop. Messages which need a card are copied
+ * into a struct card_job and queued for the card thread by writing a pointer
+ * to the job down card_pipe. The card thread owns the PCSC context and all
+ * of the agent_token state (apart from the PINs, see token_lock), and is also
+ * the one which handles the card watcher's events. When a job is done it is
+ * written back down done_pipe, and the main loop sends the reply.
+ *
+ * Meanwhile the main loop carries on answering anything that doesn't need a
+ * card (e.g. "query" or locking the agent) straight away. Each connection
+ * only ever has one job in flight, so a client's replies still come back in
+ * the order it sent its requests.
+ */
+struct card_job {
+	u_int cj_socknum;
+	u_char cj_type;
+	/*
+	 * Private copies of the connection and its pid entry for the handlers
+	 * to use, since the sockets array can be reallocated (and the
+	 * connection closed, and its pid entry expired) while the job is
+	 * running.
+	 */
+	socket_entry_t cj_conn;
+	pid_entry_t cj_pid;
+};
+
+static int card_pipe[2] = { -1, -1 };
+static int done_pipe[2] = { -1, -1 };
+static pthread_t card_thread;
+
+static void
+send_job(int fd, struct card_job *job)
+{
+	ssize_t done;
+
+	/* Writes of less than PIPE_BUF are atomic, so no partial pointers */
+	do {
+		done = write(fd, &job, sizeof (job));
+	} while (done == -1 && errno == EINTR);
+	if (done != sizeof (job))
+		fatal("%s: write failed: %s", __func__, strerror(errno));
+}
+
+/* Returns NULL once there's nothing left to read on the pipe. */
+static struct card_job *
+recv_job(int fd)
+{
+	struct card_job *job;
+	ssize_t done;
+
+	do {
+		done = read(fd, &job, sizeof (job));
+	} while (done == -1 && errno == EINTR);
+	if (done == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return (NULL);
+	if (done != sizeof (job))
+		fatal("%s: short read on job pipe", __func__);
+	return (job);
+}
+
+static void
+free_card_job(struct card_job *job)
+{
+	sshbuf_free(job->cj_conn.se_request);
+	sshbuf_free(job->cj_conn.se_output);
+	free(job->cj_conn.se_exepath);
+	free(job->cj_conn.se_exeargs);
+	free(job);
+}
+
+static void
+queue_card_job(u_int socknum, u_char type)
+{
+	socket_entry_t *e = &sockets[socknum];
+	socket_entry_t *je;
+	struct card_job *job;
+	int r;
+
+	VERIFY(e->se_job == NULL);
+
+	job = calloc(1, sizeof (struct card_job));
+	VERIFY(job != NULL);
+	job->cj_socknum = socknum;
+	job->cj_type = type;
+
+	je = &job->cj_conn;
+	je->se_fd = e->se_fd;
+	je->se_type = e->se_type;
+	je->se_pid = e->se_pid;
+	je->se_gid = e->se_gid;
+	je->se_authz = e->se_authz;
+	je->se_pid_idx = e->se_pid_idx;
+	if (e->se_exepath != NULL)
+		VERIFY((je->se_exepath = strdup(e->se_exepath)) != NULL);
+	if (e->se_exeargs != NULL)
+		VERIFY((je->se_exeargs = strdup(e->se_exeargs)) != NULL);
+	if (e->se_pid_ent != NULL)
+		bcopy(e->se_pid_ent, &job->cj_pid, sizeof (pid_entry_t));
+	je->se_pid_ent = &job->cj_pid;
+	if ((je->se_request = sshbuf_new()) == NULL ||
+	    (je->se_output = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_putb(je->se_request, e->se_request)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_reset(e->se_request);
+
+	bunyan_log(BNY_TRACE, "queueing message for card thread",
+	    "fd", BNY_INT, e->se_fd,
+	    "msg_type_name", BNY_STRING, msg_type_to_name(type), NULL);
+
+	e->se_job = job;
+	send_job(card_pipe[1], job);
+}
+
+/*
+ * Hands the answer to a REQUEST_IDENTITIES job out to all the other
+ * connections which were waiting on it.
+ */
+static void
+finish_coalesced(struct card_job *job)
+{
+	socket_entry_t *e;
+	u_int i;
+	int r;
+
+	for (i = 0; i < sockets_alloc; ++i) {
+		e = &sockets[i];
+		if (e->se_job != job)
+			continue;
+		if ((r = sshbuf_putb(e->se_output,
+		    job->cj_conn.se_output)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		e->se_job = NULL;
+		process_input(i);
+	}
+	bunyan_log(BNY_DEBUG, "finished identities request",
+	    "executed", BNY_UINT64, idreq_executed,
+	    "coalesced", BNY_UINT64, idreq_coalesced,
+	    "cached", BNY_UINT64, idreq_cached, NULL);
+}
+
+/* Called in the main loop when the card thread hands back a job. */
+static void
+finish_card_job(struct card_job *job)
+{
+	u_int socknum = job->cj_socknum;
+	socket_entry_t *e;
+	int r;
+
+	if (job == idjob)
+		idjob = NULL;
+
+	if (socknum < sockets_alloc && sockets[socknum].se_job == job) {
+		e = &sockets[socknum];
+		if ((r = sshbuf_putb(e->se_output,
+		    job->cj_conn.se_output)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		e->se_authz = job->cj_conn.se_authz;
+		if (e->se_pid_ent != NULL)
+			e->se_pid_ent->pe_last_auth = job->cj_pid.pe_last_auth;
+		e->se_job = NULL;
+
+		/* Carry on with anything else the client sent meanwhile. */
+		process_input(socknum);
+	}
+	/* Otherwise the client went away while we were working on it. */
+
+	if (job->cj_type == SSH2_AGENTC_REQUEST_IDENTITIES)
+		finish_coalesced(job);
+	free_card_job(job);
+}
+
+static void
+handle_done_read(void)
+{
+	struct card_job *job;
+
+	while ((job = recv_job(done_pipe[0])) != NULL)
+		finish_card_job(job);
+}
+
+/* How long the card thread can sleep for before it has something to do. */
 static int
-process_message(u_int socknum)
+card_timeout(void)
 {
-	u_int msg_len;
-	u_char type;
-	const u_char *cp;
-	int r;
-	errf_t *err;
-	socket_entry_t *e;
+	struct agent_token *at;
+	uint64_t now, deadline = 0, next;
 
-	if (socknum >= sockets_alloc) {
-		fatal("%s: socket number %u >= allocated %u",
-		    __func__, socknum, sockets_alloc);
+	now = monotime();
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_txnopen) {
+			next = (at->at_txntimeout > now) ?
+			    (at->at_txntimeout - now) : 1;
+			deadline = (deadline == 0) ? next :
+			    MINIMUM(deadline, next);
+		}
+		if (at->at_cache_refresh) {
+			next = at->at_last_op + cache_refresh_delay * 1000;
+			next = (next > now) ? (next - now) : 1;
+			deadline = (deadline == 0) ? next :
+			    MINIMUM(deadline, next);
+		}
 	}
-	e = &sockets[socknum];
+	if (deadline == 0)
+		return (-1); /* INFTIM */
+	if (deadline > INT_MAX)
+		return (INT_MAX);
+	return (deadline);
+}
 
-	if (sshbuf_len(e->se_input) < 5)
-		return 0;		/* Incomplete message header. */
-	cp = sshbuf_ptr(e->se_input);
-	msg_len = PEEK_U32(cp);
-	if (msg_len > AGENT_MAX_LEN) {
-		sdebug("%s: socket %u (fd=%d) message too long %u > %u",
-		    __func__, socknum, e->se_fd, msg_len, AGENT_MAX_LEN);
-		return -1;
-	}
-	if (sshbuf_len(e->se_input) < msg_len + 4)
-		return 0;		/* Incomplete message body. */
+/*ARGSUSED*/
+static void *
+card_thread_main(void *arg)
+{
+	struct pollfd pfd[2];
+	struct agent_token *at;
+	struct card_job *job;
+	uint64_t now;
+	errf_t *err;
+	int rc;
 
-	/* move the current input to e->request */
-	sshbuf_reset(e->se_request);
-	if ((r = sshbuf_get_stringb(e->se_input, e->se_request)) != 0 ||
-	    (r = sshbuf_get_u8(e->se_request, &type)) != 0) {
-		if (r == SSH_ERR_MESSAGE_INCOMPLETE ||
-		    r == SSH_ERR_STRING_TOO_LARGE) {
-			sdebug("%s: buffer error: %s", __func__, ssh_err(r));
-			return -1;
+	discover_tokens();
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if ((err = agent_piv_open(at))) {
+			errf_free(err);
+			continue;
 		}
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		agent_piv_close(at, B_TRUE);
 	}
 
-	msg_log_frame = bunyan_push(
-	    "fd", BNY_INT, e->se_fd,
-	    "msg_type", BNY_INT, (int)type,
-	    "msg_type_name", BNY_STRING, msg_type_to_name(type),
-	    "remote_pid", BNY_INT, (int)e->se_pid,
-	    "remote_cmd", BNY_STRING,
-	    (e->se_exepath == NULL) ? "???" : e->se_exepath,
-	    NULL);
-	bunyan_log(BNY_DEBUG, "received ssh-agent message", NULL);
+	for (;;) {
+		pfd[0].fd = card_pipe[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = watch_pipe[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
 
-	last_op = monotime();
+		rc = poll(pfd, 2, card_timeout());
+		if (rc < 0 && errno != EINTR)
+			fatal("%s: poll: %s", __func__, strerror(errno));
 
-	switch (type) {
-	case SSH_AGENTC_LOCK:
-	case SSH_AGENTC_UNLOCK:
-		err = process_lock_agent(e, type == SSH_AGENTC_LOCK);
-		break;
-	/* ssh2 */
-	case SSH2_AGENTC_SIGN_REQUEST:
-		err = process_sign_request2(e);
-		break;
-	case SSH2_AGENTC_REQUEST_IDENTITIES:
-		err = process_request_identities(e);
-		break;
-	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
-		err = process_remove_all_identities(e);
-		break;
-	case SSH2_AGENTC_EXTENSION:
-		err = process_extension(e);
-		break;
-	default:
-		/* Unknown message.  Respond with failure. */
-		err = errf("UnknownMessageError", NULL,
-		    "unknown/unsupported agent protocol message %d", type);
-		break;
-	}
+		now = monotime();
+		for (at = tokens; at != NULL; at = at->at_next) {
+			if (at->at_txnopen && now >= at->at_txntimeout)
+				agent_piv_close(at, B_TRUE);
+		}
 
-	if (err) {
-		bunyan_log(BNY_WARN, "failed to process command",
-		    "error", BNY_ERF, err, NULL);
-		if (errf_caused_by(err, "NoPINError") &&
-		    bunyan_get_level() > BNY_WARN) {
-			warnfx(err, "denied command due to lack of PIN");
+		if (rc > 0 && pfd[1].revents != 0)
+			handle_watch_read();
+		if (rc > 0 && pfd[0].revents != 0) {
+			while ((job = recv_job(card_pipe[0])) != NULL) {
+				dispatch_message(&job->cj_conn, job->cj_type);
+				send_job(done_pipe[1], job);
+			}
+		}
+
+		/*
+		 * If nothing is happening, re-read any token we loaded from
+		 * the cache to make sure it's still accurate.
+		 */
+		now = monotime();
+		for (at = tokens; at != NULL; at = at->at_next) {
+			if (at->at_cache_refresh && !at->at_txnopen &&
+			    (now - at->at_last_op) >=
+			    cache_refresh_delay * 1000)
+				refresh_cached_token(at);
 		}
-		sshbuf_reset(e->se_request);
-		send_status(e, 0);
-		errf_free(err);
-	} else {
-		bunyan_log(BNY_INFO, "processed ssh-agent message", NULL);
 	}
 
-	bunyan_pop(msg_log_frame);
-	return 0;
+	/* NOTREACHED */
+	return (NULL);
+}
+
+static void
+start_card_thread(void)
+{
+	int rc;
+
+	if (pipe(card_pipe) != 0 || pipe(done_pipe) != 0)
+		fatal("pipe: %s", strerror(errno));
+	if (set_nonblock(card_pipe[0]) != 0 ||
+	    set_nonblock(done_pipe[0]) != 0)
+		fatal("failed to set job pipes non-blocking");
+	rc = pthread_create(&card_thread, NULL, card_thread_main, NULL);
+	if (rc != 0)
+		fatal("pthread_create: %s", strerror(rc));
+}
+
+/*
+ * Both the main loop and the card thread log (and push frames), so give
+ * bunyan a lock and a frame stack for each thread.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_stack_key;
+
+static void
+log_lock_enter(void)
+{
+	VERIFY0(pthread_mutex_lock(&log_lock));
+}
+
+static void
+log_lock_exit(void)
+{
+	VERIFY0(pthread_mutex_unlock(&log_lock));
+}
+
+static struct bunyan_stack **
+log_thread_stack(void)
+{
+	struct bunyan_stack **stk;
+
+	stk = pthread_getspecific(log_stack_key);
+	if (stk == NULL) {
+		stk = calloc(1, sizeof (struct bunyan_stack *));
+		VERIFY(stk != NULL);
+		VERIFY0(pthread_setspecific(log_stack_key, stk));
+	}
+	return (stk);
+}
+
+static const struct bunyan_thread_ops log_thread_ops = {
+	.bto_lock = log_lock_enter,
+	.bto_unlock = log_lock_exit,
+	.bto_stack = log_thread_stack
+};
+
+static void
+setup_log_threads(void)
+{
+	VERIFY0(pthread_key_create(&log_stack_key, free));
+	bunyan_set_thread_ops(&log_thread_ops);
 }
 
 extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
 
+#if defined(USE_EPOLL)
+static void
+epoll_add(int fd, uint32_t id)
+{
+	struct epoll_event ev;
+
+	bzero(&ev, sizeof (ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = id;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		fatal("%s: epoll_ctl: %s", __func__, strerror(errno));
+}
+#endif
+
 static socket_entry_t *
 new_socket(sock_type_t type, int fd)
 {
@@ -1931,17 +4008,8 @@ new_socket(sock_type_t type, int fd)
 		max_fd = fd;
 
 	for (i = 0; i < sockets_alloc; i++)
-		if (sockets[i].se_type == AUTH_UNUSED) {
-			sockets[i].se_fd = fd;
-			if ((sockets[i].se_input = sshbuf_new()) == NULL)
-				fatal("%s: sshbuf_new failed", __func__);
-			if ((sockets[i].se_output = sshbuf_new()) == NULL)
-				fatal("%s: sshbuf_new failed", __func__);
-			if ((sockets[i].se_request = sshbuf_new()) == NULL)
-				fatal("%s: sshbuf_new failed", __func__);
-			sockets[i].se_type = type;
-			return (&sockets[i]);
-		}
+		if (sockets[i].se_type == AUTH_UNUSED)
+			goto found;
 	old_alloc = sockets_alloc;
 	new_alloc = sockets_alloc + 10;
 	sockets = reallocarray(sockets, new_alloc, sizeof(socket_entry_t));
@@ -1949,15 +4017,49 @@ new_socket(sock_type_t type, int fd)
 	for (i = old_alloc; i < new_alloc; i++)
 		sockets[i].se_type = AUTH_UNUSED;
 	sockets_alloc = new_alloc;
-	sockets[old_alloc].se_fd = fd;
-	if ((sockets[old_alloc].se_input = sshbuf_new()) == NULL)
+	i = old_alloc;
+found:
+	sockets[i].se_fd = fd;
+	if ((sockets[i].se_input = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
-	if ((sockets[old_alloc].se_output = sshbuf_new()) == NULL)
+	if ((sockets[i].se_output = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
-	if ((sockets[old_alloc].se_request = sshbuf_new()) == NULL)
+	if ((sockets[i].se_request = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
-	sockets[old_alloc].se_type = type;
-	return (&sockets[old_alloc]);
+	sockets[i].se_type = type;
+	sockets[i].se_pollout = B_FALSE;
+#if defined(USE_EPOLL)
+	if (epoll_fd != -1)
+		epoll_add(fd, i);
+#endif
+	return (&sockets[i]);
+}
+
+/*
+ * Called whenever a connection's output buffer may have gone from empty to
+ * non-empty or back, to keep its write interest up to date. With poll()
+ * there's nothing to do, prepare_poll() looks at every socket anyway.
+ */
+static void
+update_sock_events(u_int socknum)
+{
+#if defined(USE_EPOLL)
+	socket_entry_t *e = &sockets[socknum];
+	struct epoll_event ev;
+	boolean_t want;
+
+	if (epoll_fd == -1 || e->se_type != AUTH_CONNECTION)
+		return;
+	want = (sshbuf_len(e->se_output) > 0);
+	if (want == e->se_pollout)
+		return;
+	bzero(&ev, sizeof (ev));
+	ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+	ev.data.u32 = socknum;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, e->se_fd, &ev) != 0)
+		fatal("%s: epoll_ctl: %s", __func__, strerror(errno));
+	e->se_pollout = want;
+#endif
 }
 
 static int
@@ -1969,31 +4071,22 @@ handle_socket_read(u_int socknum)
 	gid_t egid;
 	int fd;
 	pid_t pid = 0;
-#if defined(__sun) || defined(SO_PEERCRED)
-	uint i;
-	FILE *f;
-#endif
-	char *exepath = NULL;
-	char *exeargs = NULL;
 	socket_entry_t *ent;
+	pid_entry_t *pe;
 	uint64_t start_time;
+	pid_exe_id_t exe_id;
 #if defined(__sun)
 	ucred_t *peer = NULL;
-	struct psinfo *psinfo;
 	zoneid_t zid;
-	char fn[128];
 #elif defined(__OpenBSD__)
 	struct sockpeercred *peer;
 	socklen_t len;
 #elif defined(__APPLE__)
 	struct xucred *peer;
 	socklen_t len;
-	char pathBuf[PROC_PIDPATHINFO_MAXSIZE];
-	int rc;
 #elif defined(SO_PEERCRED)
 	struct ucred *peer;
 	socklen_t len;
-	char fn[128], ln[1024];
 #endif
 	slen = sizeof(sunaddr);
 	fd = accept(sockets[socknum].se_fd, (struct sockaddr *)&sunaddr, &slen);
@@ -2012,19 +4105,6 @@ handle_socket_read(u_int socknum)
 	pid = ucred_getpid(peer);
 	zid = ucred_getzoneid(peer);
 	ucred_free(peer);
-	psinfo = calloc(1, sizeof (struct psinfo));
-	snprintf(fn, sizeof (fn), "/proc/%d/psinfo", (int)pid);
-	f = fopen(fn, "r");
-	if (f != NULL) {
-		if (fread(psinfo, sizeof (struct psinfo), 1, f) == 1) {
-			exepath = strndup(psinfo->pr_fname,
-			    sizeof (psinfo->pr_fname));
-			exeargs = strndup(psinfo->pr_psargs,
-			    sizeof (psinfo->pr_psargs));
-		}
-		fclose(f);
-	}
-	free(psinfo);
 	if (check_client_zoneid && zid != getzoneid()) {
 		error("zoneid mismatch: peer zoneid %u != zoneid %u",
 		    (u_int) zid, (u_int) getzoneid());
@@ -2058,12 +4138,8 @@ handle_socket_read(u_int socknum)
 		egid = peer->cr_groups[0];
 	free(peer);
 	len = sizeof (pid);
-	if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, &pid, &len) == 0) {
-		rc = proc_pidpath(pid, pathBuf, sizeof (pathBuf));
-		if (rc > 0) {
-			exepath = strdup(pathBuf);
-		}
-	}
+	if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, &pid, &len) != 0)
+		pid = 0;
 #elif defined(SO_PEERCRED)
 	peer = calloc(1, sizeof (struct ucred));
 	len = sizeof (struct ucred);
@@ -2077,20 +4153,6 @@ handle_socket_read(u_int socknum)
 	egid = peer->gid;
 	pid = peer->pid;
 	free(peer);
-	snprintf(fn, sizeof (fn), "/proc/%d/exe", (int)pid);
-	len = readlink(fn, ln, sizeof (ln));
-	if (len > 0 && len < sizeof (ln)) {
-		exepath = strndup(ln, len);
-	}
-	snprintf(fn, sizeof (fn), "/proc/%d/cmdline", (int)pid);
-	f = fopen(fn, "r");
-	len = fread(ln, 1, sizeof (ln) - 1, f);
-	fclose(f);
-	for (i = 0; i < len; ++i) {
-		if (ln[i] == '\0')
-			ln[i] = ' ';
-	}
-	exeargs = strndup(ln, len);
 #else
 	if (getpeereid(fd, &euid, &egid) < 0) {
 		error("getpeereid %d failed: %s", fd, strerror(errno));
@@ -2104,14 +4166,22 @@ handle_socket_read(u_int socknum)
 		close(fd);
 		return -1;
 	}
+	start_time = get_pid_start_time(pid);
+	get_pid_exe_id(pid, &exe_id);
+	pe = find_or_make_pid_entry(pid, start_time, &exe_id);
+	if (!pe->pe_have_exe && pid != 0) {
+		get_pid_exe(pid, &pe->pe_exepath, &pe->pe_exeargs);
+		pe->pe_have_exe = B_TRUE;
+	}
+
 	ent = new_socket(AUTH_CONNECTION, fd);
 	ent->se_pid = pid;
 	ent->se_gid = egid;
-	ent->se_exepath = exepath;
-	ent->se_exeargs = exeargs;
-	start_time = get_pid_start_time(pid);
-	ent->se_pid_ent = find_or_make_pid_entry(pid, start_time);
-	ent->se_pid_idx = ent->se_pid_ent->pe_conn_count++;
+	ent->se_exepath = pe->pe_exepath;
+	ent->se_exeargs = pe->pe_exeargs;
+	ent->se_pid_ent = pe;
+	++pe->pe_refs;
+	ent->se_pid_idx = pe->pe_conn_count++;
 	return 0;
 }
 
@@ -2135,7 +4205,7 @@ handle_conn_read(u_int socknum)
 	if ((r = sshbuf_put(sockets[socknum].se_input, buf, len)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	explicit_bzero(buf, sizeof(buf));
-	process_message(socknum);
+	process_input(socknum);
 	return 0;
 }
 
@@ -2161,9 +4231,34 @@ handle_conn_write(u_int socknum)
 	}
 	if ((r = sshbuf_consume(sockets[socknum].se_output, len)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	update_sock_events(socknum);
 	return 0;
 }
 
+static void
+handle_sock_events(u_int socknum, boolean_t readable, boolean_t writable)
+{
+	if (socknum >= sockets_alloc)
+		return;
+	switch (sockets[socknum].se_type) {
+	case AUTH_SOCKET:
+		if (readable && handle_socket_read(socknum) != 0)
+			close_socket(&sockets[socknum]);
+		break;
+	case AUTH_CONNECTION:
+		if (readable && handle_conn_read(socknum) != 0) {
+			close_socket(&sockets[socknum]);
+			break;
+		}
+		if (writable && handle_conn_write(socknum) != 0)
+			close_socket(&sockets[socknum]);
+		break;
+	default:
+		/* Closed by an earlier event in the same batch. */
+		break;
+	}
+}
+
 static void
 after_poll(struct pollfd *pfd, size_t npfd)
 {
@@ -2173,6 +4268,10 @@ after_poll(struct pollfd *pfd, size_t npfd)
 	for (i = 0; i < npfd; i++) {
 		if (pfd[i].revents == 0)
 			continue;
+		if (pfd[i].fd == done_pipe[0]) {
+			handle_done_read();
+			continue;
+		}
 		/* Find sockets entry */
 		for (socknum = 0; socknum < sockets_alloc; socknum++) {
 			if (sockets[socknum].se_type != AUTH_SOCKET &&
@@ -2185,35 +4284,113 @@ after_poll(struct pollfd *pfd, size_t npfd)
 			error("%s: no socket for fd %d", __func__, pfd[i].fd);
 			continue;
 		}
-		/* Process events */
-		switch (sockets[socknum].se_type) {
-		case AUTH_SOCKET:
-			if ((pfd[i].revents & (POLLIN|POLLERR)) != 0 &&
-			    handle_socket_read(socknum) != 0)
-				close_socket(&sockets[socknum]);
+		handle_sock_events(socknum,
+		    (pfd[i].revents & (POLLIN|POLLERR)) != 0,
+		    (pfd[i].revents & (POLLOUT|POLLHUP)) != 0);
+	}
+}
+
+#if defined(USE_EPOLL)
+/*
+ * On Linux we use epoll rather than poll(), so that we don't have to walk
+ * every socket on every wakeup when lots of (mostly idle) forwarded agent
+ * connections are parked on us. Sockets are registered once, in new_socket(),
+ * and EPOLLOUT is only turned on while there's output waiting to go.
+ *
+ * Each registration carries the socket's index in sockets[] (which doesn't
+ * change when the array is grown), or one of these for our other fds.
+ */
+#define	EV_DONE_PIPE		UINT32_MAX
+#define	EV_PARENT_TIMER		(UINT32_MAX - 1)
+#define	EV_PID_TIMER		(UINT32_MAX - 2)
+
+static void
+setup_epoll(void)
+{
+	struct itimerspec its;
+	u_int i;
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		fatal("%s: epoll_create1: %s", __func__, strerror(errno));
+	for (i = 0; i < sockets_alloc; ++i) {
+		if (sockets[i].se_type == AUTH_UNUSED)
+			continue;
+		epoll_add(sockets[i].se_fd, i);
+		sockets[i].se_pollout = B_FALSE;
+	}
+	epoll_add(done_pipe[0], EV_DONE_PIPE);
+
+	if (parent_alive_interval != 0) {
+		parent_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+		    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (parent_timer_fd == -1) {
+			fatal("%s: timerfd_create: %s", __func__,
+			    strerror(errno));
+		}
+		bzero(&its, sizeof (its));
+		its.it_value.tv_sec = parent_alive_interval;
+		its.it_interval.tv_sec = parent_alive_interval;
+		if (timerfd_settime(parent_timer_fd, 0, &its, NULL) != 0) {
+			fatal("%s: timerfd_settime: %s", __func__,
+			    strerror(errno));
+		}
+		epoll_add(parent_timer_fd, EV_PARENT_TIMER);
+	}
+
+	/*
+	 * The pid wheel has to keep turning while we're idle, or entries
+	 * for processes which have gone away would never be freed.
+	 */
+	pid_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_NONBLOCK | TFD_CLOEXEC);
+	if (pid_timer_fd == -1)
+		fatal("%s: timerfd_create: %s", __func__, strerror(errno));
+	bzero(&its, sizeof (its));
+	its.it_value.tv_sec = PID_WHEEL_TICK / 1000;
+	its.it_value.tv_nsec = (PID_WHEEL_TICK % 1000) * 1000000L;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(pid_timer_fd, 0, &its, NULL) != 0)
+		fatal("%s: timerfd_settime: %s", __func__, strerror(errno));
+	epoll_add(pid_timer_fd, EV_PID_TIMER);
+}
+
+static void
+after_epoll(struct epoll_event *evs, int nevs)
+{
+	uint64_t expirations;
+	int i;
+
+	for (i = 0; i < nevs; ++i) {
+		switch (evs[i].data.u32) {
+		case EV_DONE_PIPE:
+			handle_done_read();
 			break;
-		case AUTH_CONNECTION:
-			if ((pfd[i].revents & (POLLIN|POLLERR)) != 0 &&
-			    handle_conn_read(socknum) != 0) {
-				close_socket(&sockets[socknum]);
-				break;
-			}
-			if ((pfd[i].revents & (POLLOUT|POLLHUP)) != 0 &&
-			    handle_conn_write(socknum) != 0)
-				close_socket(&sockets[socknum]);
+		case EV_PARENT_TIMER:
+			(void) read(parent_timer_fd, &expirations,
+			    sizeof (expirations));
+			check_parent_exists();
+			break;
+		case EV_PID_TIMER:
+			(void) read(pid_timer_fd, &expirations,
+			    sizeof (expirations));
+			expire_pids();
 			break;
 		default:
+			handle_sock_events(evs[i].data.u32,
+			    (evs[i].events & (EPOLLIN|EPOLLERR)) != 0,
+			    (evs[i].events & (EPOLLOUT|EPOLLHUP)) != 0);
 			break;
 		}
 	}
 }
+#endif /* USE_EPOLL */
 
 static int
 prepare_poll(struct pollfd **pfdp, size_t *npfdp, int *timeoutp)
 {
 	struct pollfd *pfd = *pfdp;
 	size_t i, j, npfd = 0;
-	uint64_t now, deadline;
+	uint64_t deadline;
 
 	/* Count active sockets */
 	for (i = 0; i < sockets_alloc; i++) {
@@ -2229,6 +4406,8 @@ prepare_poll(struct pollfd **pfdp, size_t *npfdp, int *timeoutp)
 			break;
 		}
 	}
+	if (done_pipe[0] != -1)
+		npfd++;
 	if (npfd != *npfdp &&
 	    (pfd = recallocarray(pfd, *npfdp, npfd, sizeof(struct pollfd))) == NULL)
 		fatal("%s: recallocarray failed", __func__);
@@ -2251,14 +4430,19 @@ prepare_poll(struct pollfd **pfdp, size_t *npfdp, int *timeoutp)
 			break;
 		}
 	}
-	now = monotime();
-	deadline = txnopen ? (txntimeout - now) : 0;
+	if (done_pipe[0] != -1) {
+		pfd[j].fd = done_pipe[0];
+		pfd[j].revents = 0;
+		pfd[j].events = POLLIN;
+		j++;
+	}
+	deadline = 0;
 	if (parent_alive_interval != 0)
-		deadline = (deadline == 0) ? parent_alive_interval * 1000 :
-		    MINIMUM(deadline, parent_alive_interval * 1000);
-	if (card_probe_interval != 0)
-		deadline = (deadline == 0) ? card_probe_interval * 1000 :
-		    MINIMUM(deadline, card_probe_interval * 1000);
+		deadline = parent_alive_interval * 1000;
+	/* Wake up for the next pid wheel slot, too. */
+	if (pid_wheel_time != 0 &&
+	    (deadline == 0 || deadline > PID_WHEEL_TICK))
+		deadline = PID_WHEEL_TICK;
 	if (deadline == 0) {
 		*timeoutp = -1; /* INFTIM */
 	} else {
@@ -2293,11 +4477,17 @@ cleanup_exit(int i)
 static void
 cleanup_handler(int sig)
 {
+	struct agent_token *at;
+
 	cleanup_socket();
-	if (selk != NULL && piv_token_in_txn(selk))
-		piv_txn_end(selk);
-	piv_release(ks);
-	SCardReleaseContext(ctx);
+	for (at = tokens; at != NULL; at = at->at_next) {
+		if (at->at_tk == NULL)
+			continue;
+		if (piv_token_in_txn(at->at_tk))
+			piv_txn_end(at->at_tk);
+		piv_release(at->at_tk);
+	}
+	piv_release_context(ctx);
 	_exit(2);
 }
 
@@ -2321,7 +4511,7 @@ usage(void)
 {
 	fprintf(stderr,
 	    "usage: pivy-agent [-c | -s] [-Ddim] [-a bind_address] [-E fingerprint_hash]\n"
-	    "                  [-K cak] -g guid [command [arg ...]]\n"
+	    "                  [-K cak] [-g guid [-K cak] ...] [command [arg ...]]\n"
 	    "       pivy-agent [-c | -s] -k\n"
 	    "\n"
 	    "An ssh-agent work-alike which always contains the keys stored on\n"
@@ -2341,7 +4531,11 @@ usage(void)
 	    "  -m                    Allow signing with 9D (KEY_MGMT) key\n"
 	    "  -E fp_hash            Set hash algo for fingerprints\n"
 	    "  -g guid               GUID or GUID prefix of PIV token to use\n"
-	    "  -K cak                9E (card auth) key to authenticate PIV token\n"
+	    "                        (may be given more than once; if not given\n"
+	    "                        at all, every PIV token found is used)\n"
+	    "  -K cak                9E (card auth) key to authenticate the PIV\n"
+	    "                        token given by the preceding -g (or the\n"
+	    "                        first -g, if it comes before any)\n"
 	    "  -k                    Kill an already-running agent\n"
 	    "  -U                    Don't check client UID (allow any uid to connect)\n"
 #if defined(__sun)
@@ -2359,6 +4553,9 @@ usage(void)
 	    "  SSH_CONFIRM           Path to a program to run to confirm that\n"
 	    "                        a new client should be allowed to use the\n"
 	    "                        keys in the agent. Can be 'zenity'.\n"
+	    "  PIVY_CACHE            Set to cache token certs on disk (in\n"
+	    "                        ~/.cache/pivy, or the path given) to\n"
+	    "                        speed up start-up\n"
 	    );
 	exit(1);
 }
@@ -2527,13 +4724,19 @@ main(int ac, char **av)
 	char pidstrbuf[1 + 3 * sizeof pid];
 	uint len = 0;
 	mode_t prev_mask;
+#if defined(USE_EPOLL)
+	struct epoll_event evs[64];
+#else
 	int timeout = -1; /* INFTIM */
 	struct pollfd *pfd = NULL;
 	size_t npfd = 0;
-	uint64_t now;
+#endif
 	char *ptr;
 	int r;
 	errf_t *err;
+	uint8_t *guid;
+	struct agent_token *lastat = NULL;
+	struct sshkey *cak, *firstcak = NULL;
 
 #if !defined(__APPLE__)
 	int fd;
@@ -2557,12 +4760,13 @@ main(int ac, char **av)
 		switch (ch) {
 		case 'g':
 			guid = parse_hex(optarg, &len);
-			guid_len = len;
-			if (len > 16) {
+			if (len > GUID_LEN) {
 				fprintf(stderr, "error: GUID must be <=16 bytes"
 				    " in length (you gave %u)\n", len);
 				exit(3);
 			}
+			lastat = new_agent_token(guid, len);
+			free(guid);
 			break;
 		case 'U':
 			check_client_uid = B_FALSE;
@@ -2579,6 +4783,21 @@ main(int ac, char **av)
 			r = sshkey_read(cak, &ptr);
 			if (r != 0)
 				fatal("Invalid CAK key given: %ld", r);
+			/*
+			 * Usually -K follows the -g it applies to, but we
+			 * also accept "-K cak -g guid" (the only way to write
+			 * it when there could only be one -g).
+			 */
+			if ((lastat == NULL && firstcak != NULL) ||
+			    (lastat != NULL && lastat->at_cak != NULL)) {
+				fprintf(stderr, "error: more than one -K given "
+				    "for the same -g\n");
+				exit(3);
+			}
+			if (lastat == NULL)
+				firstcak = cak;
+			else
+				lastat->at_cak = cak;
 			break;
 		case 'S':
 			err = parse_slot_spec(optarg);
@@ -2638,6 +4857,20 @@ main(int ac, char **av)
 	ac -= optind;
 	av += optind;
 
+	if (firstcak != NULL) {
+		if (tokens == NULL) {
+			fprintf(stderr, "error: -K can only be used along "
+			    "with -g\n");
+			exit(3);
+		}
+		if (tokens->at_cak != NULL) {
+			fprintf(stderr, "error: more than one -K given for "
+			    "the same -g\n");
+			exit(3);
+		}
+		tokens->at_cak = firstcak;
+	}
+
 	if (ac > 0 && (c_flag || k_flag || s_flag || d_flag || D_flag))
 		usage();
 
@@ -2647,8 +4880,8 @@ main(int ac, char **av)
 		    strncmp(shell + len - 3, "csh", 3) == 0)
 			c_flag = 1;
 	}
-	if (guid == NULL)
-		usage();
+	if (tokens == NULL)
+		all_tokens = B_TRUE;
 	if (k_flag) {
 		const char *errstr = NULL;
 
@@ -2820,7 +5053,12 @@ skip:
 	VERIFY0(mprotect(pinmem, pgsz, PROT_NONE));
 	VERIFY0(mprotect(pinmem + 2*pgsz, pgsz, PROT_NONE));
 	pin = pinmem + pgsz;
-	explicit_bzero(pin, MAX_PIN_LEN);
+	explicit_bzero(pin, pgsz);
+	pin_slots = pgsz / MAX_PIN_LEN;
+	if (ntokens > pin_slots)
+		fatal("Too many PIV tokens given with -g (max %zu)", pin_slots);
+	for (lastat = tokens; lastat != NULL; lastat = lastat->at_next)
+		lastat->at_pin = pin + lastat->at_idx * MAX_PIN_LEN;
 
 	cleanup_pid = getpid();
 
@@ -2836,7 +5074,7 @@ skip:
 	signal(SIGHUP, cleanup_handler);
 	signal(SIGTERM, cleanup_handler);
 
-	r = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
+	r = piv_establish_context(&ctx);
 	if (r != SCARD_S_SUCCESS) {
 		err = pcscerrf("SCardEstablishContext", r);
 		bunyan_log(BNY_ERROR, "error setting up PCSC lib context",
@@ -2844,27 +5082,32 @@ skip:
 		return (1);
 	}
 
-	err = agent_piv_open();
-	if (err) {
-		errf_free(err);
-	} else {
-		agent_piv_close(B_TRUE);
-	}
-	last_op = monotime();
+	cache_dir = piv_cache_dir();
+	setup_log_threads();
+	start_watcher();
+	start_card_thread();
 
+#if defined(USE_EPOLL)
+	setup_epoll();
+	while (1) {
+		result = epoll_wait(epoll_fd, evs, sizeof (evs) / sizeof (evs[0]),
+		    -1);
+		saved_errno = errno;
+		if (result < 0) {
+			if (saved_errno == EINTR)
+				continue;
+			fatal("epoll_wait: %s", strerror(saved_errno));
+		}
+		after_epoll(evs, result);
+		expire_pids();
+	}
+#else
 	while (1) {
 		prepare_poll(&pfd, &npfd, &timeout);
 		result = poll(pfd, npfd, timeout);
 		saved_errno = errno;
 		if (parent_alive_interval != 0)
 			check_parent_exists();
-		now = monotime();
-		if (card_probe_interval != 0 &&
-		    (now - last_op) >= card_probe_interval * 1000) {
-			probe_card();
-		}
-		if (txnopen && now >= txntimeout)
-			agent_piv_close(B_TRUE);
 		/*(void) reaper();*/	/* remove expired keys */
 		if (result < 0) {
 			if (saved_errno == EINTR)
@@ -2872,6 +5115,8 @@ skip:
 			fatal("poll: %s", strerror(saved_errno));
 		} else if (result > 0)
 			after_poll(pfd, npfd);
+		expire_pids();
 	}
+#endif
 	/* NOTREACHED */
 }
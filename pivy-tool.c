@@ -86,6 +86,7 @@ static const uint8_t *admin_key = DEFAULT_ADMIN_KEY;
 
 static enum ykpiv_pin_policy pinpolicy = YKPIV_PIN_DEFAULT;
 static enum ykpiv_touch_policy touchpolicy = YKPIV_TOUCH_DEFAULT;
+static enum piv_cert_comp cert_comp = PIV_COMP_GZIP;
 
 static struct piv_token *ks = NULL;
 static struct piv_token *selk = NULL;
@@ -190,6 +191,7 @@ parse_hex(const char *str, uint *outlen)
 }
 
 #define	MAX_KEYFILE_LEN		(1024)
+#define	SIGN_READ_CHUNK		(1024 * 1024)
 
 static uint8_t *
 read_key_file(const char *fname, uint *outlen)
@@ -421,6 +423,37 @@ enum_all_retired_slots(struct piv_token *pk)
 	return (ERRF_OK);
 }
 
+/*
+ * Like piv_read_all_certs(), but uses the on-disk token cache if the user
+ * has enabled it (see piv_cache_dir()).
+ */
+static errf_t *
+read_all_certs_cached(struct piv_token *pk)
+{
+	errf_t *err;
+	char *dir;
+
+	if ((dir = piv_cache_dir()) == NULL)
+		return (piv_read_all_certs(pk));
+
+	err = piv_cache_load(pk, dir);
+	if (err == ERRF_OK)
+		goto out;
+	errf_free(err);
+
+	if ((err = piv_read_all_certs(pk)))
+		goto out;
+	if ((err = piv_cache_save(pk, dir))) {
+		warnfx(err, "failed to save token cache");
+		errf_free(err);
+		err = ERRF_OK;
+	}
+
+out:
+	free(dir);
+	return (err);
+}
+
 static errf_t *
 cmd_list(void)
 {
@@ -443,7 +476,7 @@ cmd_list(void)
 		if ((err = piv_txn_begin(pk)))
 			return (err);
 		assert_select(pk);
-		if ((err = piv_read_all_certs(pk))) {
+		if ((err = read_all_certs_cached(pk))) {
 			piv_txn_end(pk);
 			return (err);
 		}
@@ -740,6 +773,75 @@ admin_again:
 	return (ERRF_OK);
 }
 
+/*
+ * Re-writes every certificate on the card with the compression chosen by -Z
+ * (gzip by default), e.g. to shrink certs written by older tools.
+ */
+static errf_t *
+cmd_recompress(void)
+{
+	struct piv_slot *slot;
+	errf_t *err;
+	uint8_t *cdata;
+	int rv;
+	uint n = 0;
+
+	if ((err = piv_txn_begin(selk)))
+		return (err);
+	assert_select(selk);
+	if ((err = piv_read_all_certs(selk))) {
+		piv_txn_end(selk);
+		return (err);
+	}
+	if (enum_all_retired && (err = enum_all_retired_slots(selk))) {
+		piv_txn_end(selk);
+		return (err);
+	}
+
+admin_again:
+	err = piv_auth_admin(selk, admin_key, 24);
+	if (err && errf_caused_by(err, "PermissionError") &&
+	    admin_key == DEFAULT_ADMIN_KEY) {
+		errf_free(err);
+		err = try_pinfo_admin_key(selk);
+		if (err == ERRF_OK)
+			goto admin_again;
+	}
+
+	slot = NULL;
+	while (err == ERRF_OK &&
+	    (slot = piv_slot_next(selk, slot)) != NULL) {
+		if (piv_slot_cert(slot) == NULL)
+			continue;
+		cdata = NULL;
+		rv = i2d_X509(piv_slot_cert(slot), &cdata);
+		if (cdata == NULL || rv <= 0) {
+			make_sslerrf(err, "i2d_X509", "encoding cert %02X",
+			    (uint)piv_slot_id(slot));
+			break;
+		}
+		err = piv_write_cert(selk, piv_slot_id(slot), cdata, rv,
+		    cert_comp);
+		OPENSSL_free(cdata);
+		if (err) {
+			err = funcerrf(err, "failed to write cert in slot "
+			    "%02X", (uint)piv_slot_id(slot));
+			break;
+		}
+		++n;
+	}
+	piv_txn_end(selk);
+
+	if (err)
+		return (err);
+
+	fprintf(stderr, "Re-wrote %u certificate%s %s compression\n", n,
+	    (n == 1) ? "" : "s",
+	    (cert_comp == PIV_COMP_NONE) ? "without" : "with");
+
+	return (ERRF_OK);
+}
+
 static errf_t *
 cmd_init(void)
 {
@@ -1355,7 +1457,7 @@ signagain:
 	}
 	cdlen = (size_t)rv;
 
-	flags = PIV_COMP_NONE;
+	flags = cert_comp;
 	err = piv_write_cert(selk, slotid, cdata, cdlen, flags);
 
 	if (err == ERRF_OK && slotid >= 0x82 && slotid <= 0x95 &&
@@ -1681,13 +1783,55 @@ cmd_cert(uint slotid)
 	return (ERRF_OK);
 }
 
+/*
+ * For cards which can only hash on-card: the whole payload has to go to the
+ * card in one command, so it has to be small.
+ */
 static errf_t *
-cmd_sign(uint slotid)
+cmd_sign_oncard(struct piv_slot *cert)
 {
-	struct piv_slot *cert;
 	uint8_t *buf, *sig;
 	enum sshdigest_types hashalg;
 	size_t inplen, siglen;
+	errf_t *err;
+
+	buf = read_stdin(16384, &inplen);
+	assert(buf != NULL);
+
+	if ((err = piv_txn_begin(selk))) {
+		free(buf);
+		return (err);
+	}
+	assert_select(selk);
+	assert_pin(selk, cert, B_FALSE);
+again:
+	hashalg = 0;
+	err = piv_sign(selk, cert, buf, inplen, &hashalg, &sig, &siglen);
+	if (errf_caused_by(err, "PermissionError")) {
+		assert_pin(selk, cert, B_TRUE);
+		goto again;
+	}
+	piv_txn_end(selk);
+	free(buf);
+	if (err) {
+		err = funcerrf(err, "failed to sign data");
+		return (err);
+	}
+
+	fwrite(sig, 1, siglen, stdout);
+	free(sig);
+
+	return (ERRF_OK);
+}
+
+static errf_t *
+cmd_sign(uint slotid, const char *path)
+{
+	struct piv_slot *cert;
+	struct piv_sign_ctx *ctx = NULL;
+	uint8_t *buf = NULL, *sig;
+	enum sshdigest_types hashalg;
+	size_t n, siglen;
 	errf_t *err = ERRF_OK;
 
 	assert_slotid(slotid);
@@ -1710,31 +1854,62 @@ cmd_sign(uint slotid)
 		return (err);
 	}
 
-	buf = read_stdin(16384, &inplen);
-	assert(buf != NULL);
+	if (path != NULL && freopen(path, "r", stdin) == NULL) {
+		err = funcerrf(errfno("freopen", errno, "%s", path),
+		    "failed to open input file");
+		return (err);
+	}
 
-	if ((err = piv_txn_begin(selk)))
+	hashalg = 0;
+	err = piv_sign_init(selk, cert, &hashalg, &ctx);
+	if (errf_caused_by(err, "NotSupportedError")) {
+		errf_free(err);
+		return (cmd_sign_oncard(cert));
+	} else if (err) {
+		err = funcerrf(err, "failed to sign data");
 		return (err);
+	}
+
+	/*
+	 * Stream the input through the hash in big reads: we don't need to
+	 * talk to the card until we're done, and this way signing a huge file
+	 * doesn't need it all in memory.
+	 */
+	(void) setvbuf(stdin, NULL, _IONBF, 0);
+	buf = malloc(SIGN_READ_CHUNK);
+	VERIFY(buf != NULL);
+	while ((n = fread(buf, 1, SIGN_READ_CHUNK, stdin)) > 0)
+		piv_sign_update(ctx, buf, n);
+	if (ferror(stdin)) {
+		err = funcerrf(errfno("fread", errno, "%s",
+		    (path == NULL) ? "stdin" : path), "failed to read input");
+		goto out;
+	}
+
+	if ((err = piv_txn_begin(selk)))
+		goto out;
 	assert_select(selk);
 	assert_pin(selk, cert, B_FALSE);
 again:
-	hashalg = 0;
-	err = piv_sign(selk, cert, buf, inplen, &hashalg, &sig, &siglen);
+	err = piv_sign_final(ctx, &sig, &siglen);
 	if (errf_caused_by(err, "PermissionError")) {
+		errf_free(err);
 		assert_pin(selk, cert, B_TRUE);
 		goto again;
 	}
 	piv_txn_end(selk);
 	if (err) {
 		err = funcerrf(err, "failed to sign data");
-		return (err);
+		goto out;
 	}
 
 	fwrite(sig, 1, siglen, stdout);
 	free(sig);
-	free(buf);
 
-	return (ERRF_OK);
+out:
+	piv_sign_ctx_free(ctx);
+	free(buf);
+	return (err);
 }
 
 static errf_t *
@@ -2426,8 +2601,10 @@ usage(void)
 	    "  set-admin <hex|@file>  Sets the admin 3DES key\n"
 	    "  update-keyhist         Scan all retired key slots and then\n"
 	    "                         re-generate the PIV Key History object\n"
+	    "  recompress             Re-write all certificates on the card\n"
+	    "                         compressed (or uncompressed with -Z)\n"
 	    "\n"
-	    "  sign <slot>            Signs data on stdin\n"
+	    "  sign <slot> [file]     Signs data on stdin (or in file)\n"
 	    "  ecdh <slot>            Do ECDH with pubkey on stdin\n"
 	    "  auth <slot>            Does a round-trip signature test to\n"
 	    "                         verify that the pubkey on stdin\n"
@@ -2455,6 +2632,9 @@ usage(void)
 	    "                         (use twice to include APDU trace)\n"
 	    "  -X                     Always enumerate all retired key slots\n"
 	    "                         (ignore the PIV Key History object)\n"
+	    "  -Z                     Don't compress certificates written to\n"
+	    "                         the card (e.g. for middleware which\n"
+	    "                         can't read compressed certs)\n"
 	    "\n"
 	    "Options for 'list':\n"
 	    "  -p                     Generate parseable output\n"
@@ -2493,7 +2673,7 @@ usage(void)
     "f(force)"
     "K:(admin-key)"
     "k:(key)";*/
-const char *optstring = "dpg:P:a:fK:k:n:t:i:u:RX";
+const char *optstring = "dpg:P:a:fK:k:n:t:i:u:RXZ";
 
 int
 main(int argc, char *argv[])
@@ -2526,6 +2706,9 @@ main(int argc, char *argv[])
 		case 'X':
 			enum_all_retired = B_TRUE;
 			break;
+		case 'Z':
+			cert_comp = PIV_COMP_NONE;
+			break;
 		case 'K':
 			if (strcmp(optarg, "default") == 0) {
 				admin_key = DEFAULT_ADMIN_KEY;
@@ -2624,7 +2807,7 @@ main(int argc, char *argv[])
 
 	const char *op = argv[optind++];
 
-	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
+	rv = piv_establish_context(&ctx);
 	if (rv != SCARD_S_SUCCESS) {
 		errfx(EXIT_IO_ERROR, pcscerrf("SCardEstablishContext", rv),
 		    "failed to initialise libpcsc");
@@ -2731,14 +2914,25 @@ main(int argc, char *argv[])
 		check_select_key();
 		err = cmd_update_keyhist();
 
+	} else if (strcmp(op, "recompress") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		check_select_key();
+		err = cmd_recompress();
+
 	} else if (strcmp(op, "sign") == 0) {
 		uint slotid;
+		const char *path = NULL;
 
 		if (optind >= argc) {
 			warnx("not enough arguments for %s", op);
 			usage();
 		}
 		slotid = strtol(argv[optind++], NULL, 16);
+		if (optind < argc)
+			path = argv[optind++];
 
 		if (optind < argc) {
 			warnx("too many arguments for %s", op);
@@ -2748,7 +2942,7 @@ main(int argc, char *argv[])
 		check_select_key();
 		if (hasover)
 			override = piv_force_slot(selk, slotid, overalg);
-		err = cmd_sign(slotid);
+		err = cmd_sign(slotid, path);
 
 	} else if (strcmp(op, "bench") == 0) {
 		uint slotid;